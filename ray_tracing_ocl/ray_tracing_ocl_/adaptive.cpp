@@ -0,0 +1,122 @@
+#include <math.h>
+#include <stdio.h>
+#include <fstream>
+#include <algorithm>
+
+#include "adaptive.h"
+
+namespace RAYTRACING
+{
+
+float PixelError(const float* sum, float luminanceSq)
+{
+	float n = sum[3];
+	if (n < 2.0f)
+		return INFINITY;
+
+	float mean = (0.2126f * sum[0] + 0.7152f * sum[1] + 0.0722f * sum[2]) / n;
+	float variance = std::max(0.0f, (luminanceSq - n * mean * mean) / (n - 1.0f));
+
+	return sqrtf(variance / n) / std::max(mean, ADAPTIVE_MIN_LUMINANCE);
+}
+
+unsigned int SelectActivePixels(const float* accum, const float* accumSq, unsigned int pixelCount,
+	const unsigned int* order, float threshold, std::vector<unsigned int>* active)
+{
+	active->clear();
+	for (unsigned int i = 0; i < pixelCount; i++)
+	{
+		unsigned int p = order ? order[i] : i;
+		if (PixelError(&accum[4 * p], accumSq[p]) > threshold)
+			active->push_back(p);
+	}
+	return (unsigned int)active->size();
+}
+
+void SelectAllPixels(unsigned int pixelCount, std::vector<unsigned int>* active)
+{
+	active->resize(pixelCount);
+	for (unsigned int p = 0; p < pixelCount; p++)
+	{
+		(*active)[p] = p;
+	}
+}
+
+// Every other bit of code, i.e. one coordinate of a Morton code
+static unsigned int MortonCoordinate(unsigned int code)
+{
+	code &= 0x55555555;
+	code = (code | (code >> 1)) & 0x33333333;
+	code = (code | (code >> 2)) & 0x0F0F0F0F;
+	code = (code | (code >> 4)) & 0x00FF00FF;
+	code = (code | (code >> 8)) & 0x0000FFFF;
+	return code;
+}
+
+void SelectTiledPixels(unsigned int width, unsigned int height, unsigned int tileWidth, unsigned int tileHeight,
+	std::vector<unsigned int>* active)
+{
+	active->clear();
+	active->reserve((size_t)width * height);
+
+	// Z-order over the smallest power-of-two square of tiles that covers the image,
+	// skipping the codes of tiles outside it
+	unsigned int tilesX = (width + tileWidth - 1) / tileWidth;
+	unsigned int tilesY = (height + tileHeight - 1) / tileHeight;
+	unsigned int side = 1;
+	while (side < tilesX || side < tilesY)
+		side *= 2;
+
+	for (unsigned int code = 0; code < side * side; code++)
+	{
+		unsigned int tileX = MortonCoordinate(code);
+		unsigned int tileY = MortonCoordinate(code >> 1);
+		if (tileX >= tilesX || tileY >= tilesY)
+			continue;
+
+		unsigned int x0 = tileX * tileWidth, x1 = std::min(x0 + tileWidth, width);
+		unsigned int y0 = tileY * tileHeight, y1 = std::min(y0 + tileHeight, height);
+		for (unsigned int y = y0; y < y1; y++)
+		{
+			for (unsigned int x = x0; x < x1; x++)
+				active->push_back(y * width + x);
+		}
+	}
+}
+
+double AverageSamples(const float* accum, unsigned int pixelCount)
+{
+	double total = 0.0;
+	for (unsigned int p = 0; p < pixelCount; p++)
+	{
+		total += accum[4 * p + 3];
+	}
+	return pixelCount ? total / pixelCount : 0.0;
+}
+
+bool WriteSampleMap(const char* fileName, const float* accum, unsigned int width, unsigned int height)
+{
+	float maxSamples = 1.0f;
+	for (unsigned int p = 0; p < width * height; p++)
+	{
+		maxSamples = std::max(maxSamples, accum[4 * p + 3]);
+	}
+
+	std::ofstream fileStream(fileName, std::ios::out | std::ios::binary);
+	if (!fileStream)
+	{
+		printf("Error: Couldn't open sample map file '%s'.\n", fileName);
+		return false;
+	}
+
+	fileStream << "P5\n" << width << ' ' << height << "\n255\n";
+	for (unsigned int p = 0; p < width * height; p++)
+	{
+		unsigned char value = (unsigned char)(accum[4 * p + 3] / maxSamples * 255.0f + 0.5f);
+		fileStream.put((char)value);
+	}
+
+	return (bool)fileStream;
+}
+
+}
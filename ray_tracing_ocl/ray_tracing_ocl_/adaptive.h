@@ -0,0 +1,55 @@
+// Adaptive sampling: pick the pixels that still need samples from their running statistics
+//
+#ifndef __ADAPTIVE_H__
+#define __ADAPTIVE_H__
+
+#include <vector>
+
+namespace RAYTRACING
+{
+
+// Pixels darker than this are judged by their absolute error instead of the relative one
+#define ADAPTIVE_MIN_LUMINANCE	0.1f
+
+// Default samples per pixel of one adaptive pass
+#define ADAPTIVE_PASS_SAMPLES	16
+
+/*
+* Estimated relative error of a pixel mean.
+* sum holds the rgb sum and the sample count (4 floats, as in the Accum buffer),
+* luminanceSq the sum of the squared luminance of the samples.
+* Returns the standard error of the mean luminance divided by max(mean, ADAPTIVE_MIN_LUMINANCE).
+*/
+float PixelError(const float* sum, float luminanceSq);
+
+/*
+* Collect into active the pixels whose PixelError is above threshold, in the order of order
+* (pixelCount entries, e.g. from SelectTiledPixels), or in row-major order if it is NULL.
+* Returns the number of active pixels.
+*/
+unsigned int SelectActivePixels(const float* accum, const float* accumSq, unsigned int pixelCount,
+	const unsigned int* order, float threshold, std::vector<unsigned int>* active);
+
+// Fill active with every pixel of the image
+void SelectAllPixels(unsigned int pixelCount, std::vector<unsigned int>* active);
+
+/*
+* Fill active with every pixel of the image, tile by tile: tiles of tileWidth x tileHeight
+* pixels in Morton (Z) order, the pixels of a tile row by row. Tiles at the right and bottom
+* edges are cut to the image.
+*/
+void SelectTiledPixels(unsigned int width, unsigned int height, unsigned int tileWidth, unsigned int tileHeight,
+	std::vector<unsigned int>* active);
+
+// Mean samples per pixel over the image
+double AverageSamples(const float* accum, unsigned int pixelCount);
+
+/*
+* Write the sample count of every pixel as a binary PGM, scaled so that the most sampled
+* pixel is white
+*/
+bool WriteSampleMap(const char* fileName, const float* accum, unsigned int width, unsigned int height);
+
+}
+
+#endif
@@ -0,0 +1,352 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+#include "benchmark.h"
+#include "portable.h"
+
+namespace RAYTRACING
+{
+
+const std::vector<BenchmarkCase>& BenchmarkCases()
+{
+	// name, description, width, height, spp, sphere grid, mesh rings, light grid
+	static const std::vector<BenchmarkCase> cases = {
+		{ "default", "built-in scene", 512, 512, 16, 0, 0, 0 },
+		{ "default-spp64", "built-in scene, more samples on fewer pixels", 256, 256, 64, 0, 0, 0 },
+		{ "shapes", "256 spheres and boxes", 512, 512, 16, 16, 0, 0 },
+		{ "mesh", "tessellated sphere of 32k triangles", 512, 512, 16, 0, 128, 0 },
+		{ "lights", "64 lights", 512, 512, 16, 0, 0, 8 },
+		{ "large", "shapes, mesh and lights at 1024x1024", 1024, 1024, 8, 16, 64, 4 } };
+	return cases;
+}
+
+// A UV sphere; the rings next to the poles have one triangle per segment
+static void AddSphereMesh(MeshData* meshes, const Point& center, float radius, unsigned int rings, const Color& color)
+{
+	const float pi = 3.14159265f;
+	const unsigned int segments = rings;
+	unsigned int vertexBase = (unsigned int)meshes->vertices.size();
+	unsigned int meshIndex = (unsigned int)meshes->colors.size();
+
+	for (unsigned int r = 0; r <= rings; r++)
+	{
+		float theta = pi * r / rings;
+		for (unsigned int s = 0; s <= segments; s++)
+		{
+			float phi = 2.0f * pi * s / segments;
+			Point p = { center.x + radius * sinf(theta) * cosf(phi), center.y + radius * cosf(theta),
+				center.z + radius * sinf(theta) * sinf(phi) };
+			meshes->vertices.push_back(p);
+		}
+	}
+
+	for (unsigned int r = 0; r < rings; r++)
+	{
+		for (unsigned int s = 0; s < segments; s++)
+		{
+			unsigned int v00 = vertexBase + r * (segments + 1) + s;
+			unsigned int v01 = v00 + 1;
+			unsigned int v10 = v00 + segments + 1;
+			unsigned int v11 = v10 + 1;
+			if (r > 0)
+			{
+				Triangle upper = { v00, v01, v11, meshIndex };
+				meshes->triangles.push_back(upper);
+			}
+			if (r + 1 < rings)
+			{
+				Triangle lower = { v00, v11, v10, meshIndex };
+				meshes->triangles.push_back(lower);
+			}
+		}
+	}
+	meshes->colors.push_back(color);
+}
+
+void BuildBenchmarkScene(const BenchmarkCase& benchmark, std::vector<RectangleLight>* lights,
+	AnalyticPrimitives* shapes, MeshData* meshes)
+{
+	// Shapes stand on the floor (y = -2) of the default scene, in front of the camera
+	if (benchmark.sphereGrid > 0)
+	{
+		Color red = { 0.8f, 0.3f, 0.3f };
+		Color blue = { 0.3f, 0.4f, 0.8f };
+		unsigned int sphereMaterial = AddMaterial(shapes, red);
+		unsigned int boxMaterial = AddMaterial(shapes, blue);
+		const float spacing = 12.0f / benchmark.sphereGrid;
+		const float size = spacing * 0.35f;
+		for (unsigned int z = 0; z < benchmark.sphereGrid; z++)
+		{
+			for (unsigned int x = 0; x < benchmark.sphereGrid; x++)
+			{
+				Point center = { -6.0f + (x + 0.5f) * spacing, -2.0f + size, -6.0f + (z + 0.5f) * spacing };
+				if ((x + z) % 2 == 0)
+				{
+					AddSphere(shapes, center, size, sphereMaterial);
+				}
+				else
+				{
+					Point boxMin = { center.x - size, -2.0f, center.z - size };
+					Point boxMax = { center.x + size, -2.0f + 2.0f * size, center.z + size };
+					AddBox(shapes, boxMin, boxMax, boxMaterial);
+				}
+			}
+		}
+	}
+
+	if (benchmark.meshRings > 0)
+	{
+		Point center = { 0.0f, 0.0f, 2.0f };
+		Color color = { 0.8f, 0.6f, 0.4f };
+		AddSphereMesh(meshes, center, 1.5f, benchmark.meshRings, color);
+	}
+
+	// Small lights facing down, as the default ones, spread over the scene
+	for (unsigned int z = 0; z < benchmark.lightGrid; z++)
+	{
+		for (unsigned int x = 0; x < benchmark.lightGrid; x++)
+		{
+			const float spacing = 12.0f / benchmark.lightGrid;
+			RectangleLight light = { { -6.0f + (x + 0.4f) * spacing, 4.0f, -6.0f + (z + 0.4f) * spacing },
+				{ 0.2f * spacing, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.2f * spacing },
+				{ 1.0f, 0.9f + 0.1f * (x % 2), 0.8f + 0.2f * (z % 2) }, 4.0f };
+			lights->push_back(light);
+		}
+	}
+}
+
+static double Median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+	size_t middle = values.size() / 2;
+	return (values.size() % 2) ? values[middle] : 0.5 * (values[middle - 1] + values[middle]);
+}
+
+BenchmarkResult SummarizeBenchmark(const BenchmarkCase& benchmark, const char* backend,
+	const std::vector<RenderStats>& runs)
+{
+	BenchmarkResult result;
+	result.caseName = benchmark.name;
+	result.backend = backend;
+	result.device = runs.empty() ? std::string() : runs[0].device;
+	result.width = benchmark.width;
+	result.height = benchmark.height;
+	result.samplesPerPixel = runs.empty() ? 0 : runs[0].samplesPerPixel;
+	result.repetitions = (unsigned int)runs.size();
+
+	std::vector<double> startup, render, closest, shadow;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		startup.push_back(runs[i].startupSeconds);
+		render.push_back(runs[i].renderSeconds);
+		closest.push_back((double)runs[i].rays[RAY_COUNT_CLOSEST]);
+		shadow.push_back((double)runs[i].rays[RAY_COUNT_SHADOW]);
+	}
+	if (runs.empty())
+	{
+		result.startupSeconds = result.renderSeconds = result.minRenderSeconds = result.maxRenderSeconds = 0.0;
+		result.secondsPerSample = result.primaryMraysPerSecond = result.closestMraysPerSecond = result.shadowMraysPerSecond = 0.0;
+		return result;
+	}
+
+	// Ray counts are medians too: schedules that hand pixels out at run time give them other seeds
+	result.startupSeconds = Median(startup);
+	result.renderSeconds = Median(render);
+	result.minRenderSeconds = *std::min_element(render.begin(), render.end());
+	result.maxRenderSeconds = *std::max_element(render.begin(), render.end());
+	result.secondsPerSample = result.renderSeconds / std::max(result.samplesPerPixel, 1u);
+
+	double seconds = std::max(result.renderSeconds, 1e-9);
+	double cameraRays = (double)result.width * result.height * result.samplesPerPixel;
+	result.primaryMraysPerSecond = cameraRays / seconds * 1e-6;
+	result.closestMraysPerSecond = Median(closest) / seconds * 1e-6;
+	result.shadowMraysPerSecond = Median(shadow) / seconds * 1e-6;
+	return result;
+}
+
+void PrintBenchmarkResult(const BenchmarkResult& result)
+{
+	printf("Benchmark %-14s %-3s %ux%u %u spp: startup %.3lfs, render %.3lfs (%.3lf-%.3lf), %.2lfms per sample,\n",
+		result.caseName.c_str(), result.backend.c_str(), result.width, result.height, result.samplesPerPixel,
+		result.startupSeconds, result.renderSeconds, result.minRenderSeconds, result.maxRenderSeconds,
+		result.secondsPerSample * 1e3);
+	printf("          %.2lf Mrays/s primary, %.2lf closest-hit, %.2lf shadow on %s\n",
+		result.primaryMraysPerSecond, result.closestMraysPerSecond, result.shadowMraysPerSecond, result.device.c_str());
+}
+
+static FILE* OpenResults(const char* fileName)
+{
+	FILE* file = NULL;
+	if (0 != fopen_s(&file, fileName, "w") || file == NULL)
+	{
+		printf("Error: Couldn't open benchmark file '%s'.\n", fileName);
+		return NULL;
+	}
+	return file;
+}
+
+static bool CloseResults(FILE* file, const char* fileName)
+{
+	bool written = !ferror(file);
+	written = (fclose(file) == 0) && written;
+	if (!written)
+	{
+		printf("Error: Couldn't write benchmark file '%s'.\n", fileName);
+	}
+	return written;
+}
+
+// Device names are the driver's; keep quotes and control characters out of the files
+static std::string CleanName(const std::string& text)
+{
+	std::string clean;
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		unsigned char c = (unsigned char)text[i];
+		clean += (c < 0x20 || c == '"' || c == '\\') ? ' ' : (char)c;
+	}
+	return clean;
+}
+
+bool WriteBenchmarkJSON(const char* fileName, const std::vector<BenchmarkResult>& results)
+{
+	FILE* file = OpenResults(fileName);
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n  \"results\": [");
+	const char* separator = "\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& result = results[i];
+		fprintf(file, "%s    { \"case\": \"%s\", \"backend\": \"%s\", \"device\": \"%s\", \"width\": %u, \"height\": %u, \"spp\": %u,"
+			" \"repetitions\": %u,\n      \"startupSeconds\": %.6f, \"renderSeconds\": %.6f, \"minRenderSeconds\": %.6f,"
+			" \"maxRenderSeconds\": %.6f, \"secondsPerSample\": %.6f,\n      \"primaryMraysPerSecond\": %.3f,"
+			" \"closestMraysPerSecond\": %.3f, \"shadowMraysPerSecond\": %.3f }",
+			separator, result.caseName.c_str(), result.backend.c_str(), CleanName(result.device).c_str(),
+			result.width, result.height, result.samplesPerPixel, result.repetitions,
+			result.startupSeconds, result.renderSeconds, result.minRenderSeconds, result.maxRenderSeconds,
+			result.secondsPerSample, result.primaryMraysPerSecond, result.closestMraysPerSecond, result.shadowMraysPerSecond);
+		separator = ",\n";
+	}
+	fprintf(file, "\n  ]\n}\n");
+
+	return CloseResults(file, fileName);
+}
+
+static const char* const kColumns =
+	"case,backend,device,width,height,spp,repetitions,startup_s,render_s,min_render_s,max_render_s,"
+	"s_per_sample,primary_mrays_s,closest_mrays_s,shadow_mrays_s";
+
+bool WriteBenchmarkCSV(const char* fileName, const std::vector<BenchmarkResult>& results)
+{
+	FILE* file = OpenResults(fileName);
+	if (!file)
+		return false;
+
+	fprintf(file, "%s\n", kColumns);
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& result = results[i];
+		fprintf(file, "%s,%s,\"%s\",%u,%u,%u,%u,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f,%.3f\n",
+			result.caseName.c_str(), result.backend.c_str(), CleanName(result.device).c_str(),
+			result.width, result.height, result.samplesPerPixel, result.repetitions,
+			result.startupSeconds, result.renderSeconds, result.minRenderSeconds, result.maxRenderSeconds,
+			result.secondsPerSample, result.primaryMraysPerSecond, result.closestMraysPerSecond, result.shadowMraysPerSecond);
+	}
+
+	return CloseResults(file, fileName);
+}
+
+// Fields of a CSV line; a field may be quoted (device names can hold commas)
+static std::vector<std::string> SplitCSV(const std::string& line)
+{
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+	for (size_t i = 0; i < line.size(); i++)
+	{
+		char c = line[i];
+		if (c == '"')
+			quoted = !quoted;
+		else if (c == ',' && !quoted)
+			fields.push_back(std::string());
+		else if (c != '\r')
+			fields.back() += c;
+	}
+	return fields;
+}
+
+bool CompareBenchmarkBaseline(const char* fileName, const std::vector<BenchmarkResult>& results, double tolerance)
+{
+	std::ifstream file(fileName);
+	std::string line;
+	if (!file || !std::getline(file, line))
+	{
+		printf("Error: Couldn't read benchmark baseline '%s'.\n", fileName);
+		return false;
+	}
+
+	// Columns by name, so baselines of other versions still compare as long as these are there
+	std::vector<std::string> header = SplitCSV(line);
+	std::map<std::string, size_t> column;
+	for (size_t i = 0; i < header.size(); i++)
+		column[header[i]] = i;
+	const char* const needed[] = { "case", "backend", "device", "s_per_sample", "closest_mrays_s", "shadow_mrays_s" };
+	for (int n = 0; n < 6; n++)
+	{
+		if (column.find(needed[n]) == column.end())
+		{
+			printf("Error: Benchmark baseline '%s' has no '%s' column.\n", fileName, needed[n]);
+			return false;
+		}
+	}
+
+	std::map<std::string, std::vector<std::string> > baseline;
+	while (std::getline(file, line))
+	{
+		std::vector<std::string> fields = SplitCSV(line);
+		if (fields.size() != header.size())
+			continue;
+		baseline[fields[column["case"]] + "/" + fields[column["backend"]] + "/" + fields[column["device"]]] = fields;
+	}
+
+	bool passed = true;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& result = results[i];
+		std::map<std::string, std::vector<std::string> >::const_iterator entry =
+			baseline.find(result.caseName + "/" + result.backend + "/" + CleanName(result.device));
+		if (entry == baseline.end())
+		{
+			printf("Baseline %-14s %-3s: no entry\n", result.caseName.c_str(), result.backend.c_str());
+			continue;
+		}
+
+		const std::vector<std::string>& fields = entry->second;
+		double sampleTime = atof(fields[column["s_per_sample"]].c_str());
+		double closest = atof(fields[column["closest_mrays_s"]].c_str());
+		double shadow = atof(fields[column["shadow_mrays_s"]].c_str());
+
+		// Time per sample may grow and ray throughput may drop by the tolerance at most
+		bool slower = result.secondsPerSample > sampleTime * (1.0 + tolerance) ||
+			result.closestMraysPerSecond < closest * (1.0 - tolerance) ||
+			result.shadowMraysPerSecond < shadow * (1.0 - tolerance);
+		double change = (sampleTime > 0.0) ? (result.secondsPerSample / sampleTime - 1.0) * 100.0 : 0.0;
+		printf("Baseline %-14s %-3s: %.2lfms per sample against %.2lfms (%+.1lf%%), %.2lf closest-hit Mrays/s against %.2lf%s\n",
+			result.caseName.c_str(), result.backend.c_str(), result.secondsPerSample * 1e3, sampleTime * 1e3, change,
+			result.closestMraysPerSecond, closest, slower ? " REGRESSION" : "");
+		passed = passed && !slower;
+	}
+
+	if (!passed)
+	{
+		printf("Error: Benchmark regressed by more than %.0lf%% against '%s'.\n", tolerance * 100.0, fileName);
+	}
+	return passed;
+}
+
+}
@@ -0,0 +1,93 @@
+// Benchmark suite: fixed scenes, sizes and sample counts, timed over repetitions and compared to a baseline
+//
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include <string>
+#include <vector>
+
+#include "raytracing.h"
+#include "define.h"
+#include "primitives.h"
+#include "mesh_loader.h"
+
+namespace RAYTRACING
+{
+
+/*
+* What one render measured. Startup is everything before the first pass (scene, light selection,
+* device, buffers, program and kernels), render the passes themselves, without the read back.
+*/
+struct RenderStats
+{
+	std::string        device;
+	double             startupSeconds;
+	double             renderSeconds;
+	unsigned int       samplesPerPixel;
+	unsigned long long rays[RAY_COUNT_KINDS];  // closest-hit and shadow rays traced
+};
+
+/*
+* A render of the suite: the default scene plus generated lights, shapes or meshes
+*/
+struct BenchmarkCase
+{
+	const char*  name;
+	const char*  description;
+	unsigned int width;
+	unsigned int height;
+	unsigned int sampleCount;
+	unsigned int sphereGrid;    // spheres and boxes on a grid of sphereGrid x sphereGrid
+	unsigned int meshRings;     // rings of a tessellated sphere mesh (2 * rings * rings triangles)
+	unsigned int lightGrid;     // small lights on a grid of lightGrid x lightGrid
+};
+
+// The fixed cases, the same on every run and every machine
+const std::vector<BenchmarkCase>& BenchmarkCases();
+
+// Add the generated part of a case to what the command line would give
+void BuildBenchmarkScene(const BenchmarkCase& benchmark, std::vector<RectangleLight>* lights,
+	AnalyticPrimitives* shapes, MeshData* meshes);
+
+/*
+* The repetitions of a case on one backend and device. Times are the median of the
+* repetitions; throughput is taken from the median render time.
+*/
+struct BenchmarkResult
+{
+	std::string  caseName;
+	std::string  backend;
+	std::string  device;
+	unsigned int width;
+	unsigned int height;
+	unsigned int samplesPerPixel;
+	unsigned int repetitions;
+	double       startupSeconds;
+	double       renderSeconds;
+	double       minRenderSeconds;
+	double       maxRenderSeconds;
+	double       secondsPerSample;      // render time of one sample per pixel over the image
+	double       primaryMraysPerSecond; // camera rays
+	double       closestMraysPerSecond; // every closest-hit ray, camera rays and bounces
+	double       shadowMraysPerSecond;
+};
+
+BenchmarkResult SummarizeBenchmark(const BenchmarkCase& benchmark, const char* backend,
+	const std::vector<RenderStats>& runs);
+
+void PrintBenchmarkResult(const BenchmarkResult& result);
+
+bool WriteBenchmarkJSON(const char* fileName, const std::vector<BenchmarkResult>& results);
+bool WriteBenchmarkCSV(const char* fileName, const std::vector<BenchmarkResult>& results);
+
+/*
+* Compare results to a CSV written by WriteBenchmarkCSV, matched by case, backend and device.
+* A result whose time per sample is more than tolerance (0.1 = 10%) above the baseline, or
+* whose ray throughput is that much below it, is a regression. Returns false on any regression
+* or if the baseline can't be read; results without a baseline entry are only listed.
+*/
+bool CompareBenchmarkBaseline(const char* fileName, const std::vector<BenchmarkResult>& results, double tolerance);
+
+}
+
+#endif
@@ -0,0 +1,391 @@
+#include <float.h>
+#include <stddef.h>
+#include <math.h>
+#include <algorithm>
+
+#include "bvh.h"
+#include "primitives.h"
+
+namespace RAYTRACING
+{
+
+// Relative costs of the SAH model
+#define BVH_TRAVERSAL_COST	1.0f
+#define BVH_INTERSECT_COST	2.0f
+
+struct BVHBuildContext
+{
+	const std::vector<BVHPrimitive>* primitives;
+	std::vector<unsigned int> order;
+	SceneBVH* bvh;
+};
+
+struct BVHBin
+{
+	float boundsMin[3];
+	float boundsMax[3];
+	unsigned int count;
+};
+
+static void ResetBounds(float* boundsMin, float* boundsMax)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		boundsMin[a] = FLT_MAX;
+		boundsMax[a] = -FLT_MAX;
+	}
+}
+
+static void GrowBounds(float* boundsMin, float* boundsMax, const float* otherMin, const float* otherMax)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		boundsMin[a] = std::min(boundsMin[a], otherMin[a]);
+		boundsMax[a] = std::max(boundsMax[a], otherMax[a]);
+	}
+}
+
+static float SurfaceArea(const float* boundsMin, const float* boundsMax)
+{
+	float dx = boundsMax[0] - boundsMin[0];
+	float dy = boundsMax[1] - boundsMin[1];
+	float dz = boundsMax[2] - boundsMin[2];
+	if (dx < 0.0f || dy < 0.0f || dz < 0.0f)
+		return 0.0f;
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static int MakeLeaf(BVHBuildContext* ctx, int nodeIndex, unsigned int first, unsigned int count)
+{
+	SceneBVH* bvh = ctx->bvh;
+	bvh->nodes[nodeIndex].m_offset = (int)bvh->primRefs.size();
+	bvh->nodes[nodeIndex].m_primCount = (int)count;
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		bvh->primRefs.push_back((*ctx->primitives)[ctx->order[i]].m_ref);
+	}
+	return nodeIndex;
+}
+
+static int BuildRecursive(BVHBuildContext* ctx, unsigned int first, unsigned int count, unsigned int depth)
+{
+	const std::vector<BVHPrimitive>& primitives = *ctx->primitives;
+	SceneBVH* bvh = ctx->bvh;
+
+	int nodeIndex = (int)bvh->nodes.size();
+	BVHNode node;
+	ResetBounds(node.m_boundsMin, node.m_boundsMax);
+	node.m_offset = 0;
+	node.m_primCount = 0;
+
+	float centroidMin[3], centroidMax[3];
+	ResetBounds(centroidMin, centroidMax);
+
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		const BVHPrimitive& prim = primitives[ctx->order[i]];
+		GrowBounds(node.m_boundsMin, node.m_boundsMax, prim.m_boundsMin, prim.m_boundsMax);
+		GrowBounds(centroidMin, centroidMax, prim.m_centroid, prim.m_centroid);
+	}
+	bvh->nodes.push_back(node);
+	bvh->depth = std::max(bvh->depth, depth + 1);
+
+	if (count <= 1 || depth >= BVH_MAX_DEPTH)
+	{
+		return MakeLeaf(ctx, nodeIndex, first, count);
+	}
+
+	// Binned SAH: evaluate BVH_SAH_BINS - 1 split planes on every axis of the centroid bounds
+	float parentArea = SurfaceArea(node.m_boundsMin, node.m_boundsMax);
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestSplit = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidMax[axis] - centroidMin[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		BVHBin bins[BVH_SAH_BINS];
+		for (int b = 0; b < BVH_SAH_BINS; b++)
+		{
+			ResetBounds(bins[b].boundsMin, bins[b].boundsMax);
+			bins[b].count = 0;
+		}
+
+		float scale = BVH_SAH_BINS / extent;
+		for (unsigned int i = first; i < first + count; i++)
+		{
+			const BVHPrimitive& prim = primitives[ctx->order[i]];
+			int b = std::min(BVH_SAH_BINS - 1, (int)((prim.m_centroid[axis] - centroidMin[axis]) * scale));
+			bins[b].count++;
+			GrowBounds(bins[b].boundsMin, bins[b].boundsMax, prim.m_boundsMin, prim.m_boundsMax);
+		}
+
+		// Sweep from the right to get the cost of every right side, then from the left
+		float rightArea[BVH_SAH_BINS];
+		unsigned int rightCount[BVH_SAH_BINS];
+		float boundsMin[3], boundsMax[3];
+		ResetBounds(boundsMin, boundsMax);
+		unsigned int accumulated = 0;
+		for (int b = BVH_SAH_BINS - 1; b > 0; b--)
+		{
+			GrowBounds(boundsMin, boundsMax, bins[b].boundsMin, bins[b].boundsMax);
+			accumulated += bins[b].count;
+			rightArea[b] = SurfaceArea(boundsMin, boundsMax);
+			rightCount[b] = accumulated;
+		}
+
+		ResetBounds(boundsMin, boundsMax);
+		accumulated = 0;
+		for (int b = 0; b < BVH_SAH_BINS - 1; b++)
+		{
+			GrowBounds(boundsMin, boundsMax, bins[b].boundsMin, bins[b].boundsMax);
+			accumulated += bins[b].count;
+			if (accumulated == 0 || rightCount[b + 1] == 0)
+				continue;
+
+			float cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST *
+				(SurfaceArea(boundsMin, boundsMax) * accumulated + rightArea[b + 1] * rightCount[b + 1]) / parentArea;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+			}
+		}
+	}
+
+	float leafCost = BVH_INTERSECT_COST * count;
+	unsigned int leftCount = 0;
+
+	if (bestAxis < 0)
+	{
+		// All centroids coincide: split by count, unless a leaf is small enough
+		if (count <= BVH_MAX_LEAF_SIZE)
+			return MakeLeaf(ctx, nodeIndex, first, count);
+		leftCount = count / 2;
+	}
+	else
+	{
+		if (count <= BVH_MAX_LEAF_SIZE && leafCost <= bestCost)
+			return MakeLeaf(ctx, nodeIndex, first, count);
+
+		float extent = centroidMax[bestAxis] - centroidMin[bestAxis];
+		float scale = BVH_SAH_BINS / extent;
+		float minCentroid = centroidMin[bestAxis];
+		std::vector<unsigned int>::iterator middle = std::partition(
+			ctx->order.begin() + first, ctx->order.begin() + first + count,
+			[&](unsigned int index)
+			{
+				int b = std::min(BVH_SAH_BINS - 1, (int)((primitives[index].m_centroid[bestAxis] - minCentroid) * scale));
+				return b <= bestSplit;
+			});
+		leftCount = (unsigned int)(middle - (ctx->order.begin() + first));
+
+		if (leftCount == 0 || leftCount == count)
+			leftCount = count / 2;
+	}
+
+	// The first child directly follows its parent, the second one is linked through m_offset
+	BuildRecursive(ctx, first, leftCount, depth + 1);
+	bvh->nodes[nodeIndex].m_offset = (int)bvh->nodes.size();
+	BuildRecursive(ctx, first + leftCount, count - leftCount, depth + 1);
+
+	return nodeIndex;
+}
+
+static void SetBVHViews(SceneBVH* bvh)
+{
+	bvh->nodeData = bvh->nodes.empty() ? NULL : &bvh->nodes[0];
+	bvh->nodeCount = (unsigned int)bvh->nodes.size();
+	bvh->primRefData = bvh->primRefs.empty() ? NULL : &bvh->primRefs[0];
+	bvh->primRefCount = (unsigned int)bvh->primRefs.size();
+}
+
+void BuildBVH(const std::vector<BVHPrimitive>& primitives, SceneBVH* bvh)
+{
+	bvh->nodes.clear();
+	bvh->primRefs.clear();
+	bvh->depth = 0;
+
+	if (primitives.empty())
+	{
+		SetBVHViews(bvh);
+		return;
+	}
+
+	BVHBuildContext ctx;
+	ctx.primitives = &primitives;
+	ctx.bvh = bvh;
+	ctx.order.resize(primitives.size());
+	for (size_t i = 0; i < primitives.size(); i++)
+	{
+		ctx.order[i] = (unsigned int)i;
+	}
+
+	bvh->nodes.reserve(primitives.size() * 2);
+	bvh->primRefs.reserve(primitives.size());
+
+	BuildRecursive(&ctx, 0, (unsigned int)primitives.size(), 0);
+	SetBVHViews(bvh);
+}
+
+/*
+* Flat primitives get a tiny thickness so that the slab test never sees an empty box
+*/
+static void PadBounds(BVHPrimitive* prim)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		float pad = 1.0e-4f * std::max(1.0f, std::max(fabsf(prim->m_boundsMin[a]), fabsf(prim->m_boundsMax[a])));
+		prim->m_boundsMin[a] -= pad;
+		prim->m_boundsMax[a] += pad;
+	}
+}
+
+static void RectangleLightBounds(const RectangleLight& light, BVHPrimitive* prim)
+{
+	const Point& p = light.m_pos;
+	const Vector& s1 = light.m_side1;
+	const Vector& s2 = light.m_side2;
+	float corners[4][3] = {
+		{ p.x, p.y, p.z },
+		{ p.x + s1.x, p.y + s1.y, p.z + s1.z },
+		{ p.x + s2.x, p.y + s2.y, p.z + s2.z },
+		{ p.x + s1.x + s2.x, p.y + s1.y + s2.y, p.z + s1.z + s2.z }
+	};
+
+	ResetBounds(prim->m_boundsMin, prim->m_boundsMax);
+	for (int c = 0; c < 4; c++)
+	{
+		GrowBounds(prim->m_boundsMin, prim->m_boundsMax, corners[c], corners[c]);
+	}
+	PadBounds(prim);
+}
+
+static void TriangleBounds(const SphereSet* scene, const Triangle& triangle, BVHPrimitive* prim)
+{
+	const Point* corners[3] = { &scene->m_vertices[triangle.m_v0], &scene->m_vertices[triangle.m_v1], &scene->m_vertices[triangle.m_v2] };
+
+	ResetBounds(prim->m_boundsMin, prim->m_boundsMax);
+	for (int c = 0; c < 3; c++)
+	{
+		float corner[3] = { corners[c]->x, corners[c]->y, corners[c]->z };
+		GrowBounds(prim->m_boundsMin, prim->m_boundsMax, corner, corner);
+	}
+	PadBounds(prim);
+}
+
+static void SphereBounds(const SphereSet* scene, unsigned int index, BVHPrimitive* prim)
+{
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Point center = PrimitivePoint(scene->m_primData, layout.m_sphereCenter, layout.m_sphereCount, index);
+	float radius = scene->m_primData[layout.m_sphereRadius + index];
+	float c[3] = { center.x, center.y, center.z };
+
+	for (int a = 0; a < 3; a++)
+	{
+		prim->m_boundsMin[a] = c[a] - radius;
+		prim->m_boundsMax[a] = c[a] + radius;
+	}
+	PadBounds(prim);
+}
+
+/*
+* A disc of radius r around normal n reaches r * sqrt(1 - n[a]^2) along axis a
+*/
+static void DiscBounds(const SphereSet* scene, unsigned int index, BVHPrimitive* prim)
+{
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Point center = PrimitivePoint(scene->m_primData, layout.m_discCenter, layout.m_discCount, index);
+	Vector normal = PrimitivePoint(scene->m_primData, layout.m_discNormal, layout.m_discCount, index);
+	float radius = scene->m_primData[layout.m_discRadius + index];
+	float c[3] = { center.x, center.y, center.z };
+	float n[3] = { normal.x, normal.y, normal.z };
+
+	for (int a = 0; a < 3; a++)
+	{
+		float extent = radius * sqrtf(std::max(0.0f, 1.0f - n[a] * n[a]));
+		prim->m_boundsMin[a] = c[a] - extent;
+		prim->m_boundsMax[a] = c[a] + extent;
+	}
+	PadBounds(prim);
+}
+
+static void AxisBoxBounds(const SphereSet* scene, unsigned int index, BVHPrimitive* prim)
+{
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Point boxMin = PrimitivePoint(scene->m_primData, layout.m_boxMin, layout.m_boxCount, index);
+	Point boxMax = PrimitivePoint(scene->m_primData, layout.m_boxMax, layout.m_boxCount, index);
+	float lo[3] = { boxMin.x, boxMin.y, boxMin.z };
+	float hi[3] = { boxMax.x, boxMax.y, boxMax.z };
+
+	ResetBounds(prim->m_boundsMin, prim->m_boundsMax);
+	GrowBounds(prim->m_boundsMin, prim->m_boundsMax, lo, hi);
+	PadBounds(prim);
+}
+
+/*
+* Every bounded primitive type goes through here; the index of a reference
+* is the position of the primitive inside the list of its type
+*/
+static void AddPrimitive(std::vector<BVHPrimitive>* primitives, BVHPrimitive* prim, unsigned int type, unsigned int index)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		prim->m_centroid[a] = 0.5f * (prim->m_boundsMin[a] + prim->m_boundsMax[a]);
+	}
+	prim->m_ref = MakePrimRef(type, index);
+	primitives->push_back(*prim);
+}
+
+void CollectScenePrimitives(const SphereSet* scene, std::vector<BVHPrimitive>* primitives)
+{
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	BVHPrimitive prim;
+
+	primitives->clear();
+	primitives->reserve(scene->LightCount + scene->TriangleCount +
+		layout.m_sphereCount + layout.m_discCount + layout.m_boxCount);
+
+	for (int i = 0; i < scene->LightCount; i++)
+	{
+		RectangleLightBounds(scene->m_rectLight[i], &prim);
+		AddPrimitive(primitives, &prim, PRIM_RECT_LIGHT, (unsigned int)i);
+	}
+
+	for (int i = 0; i < scene->TriangleCount; i++)
+	{
+		TriangleBounds(scene, scene->m_triangle[i], &prim);
+		AddPrimitive(primitives, &prim, PRIM_TRIANGLE, (unsigned int)i);
+	}
+
+	for (unsigned int i = 0; i < layout.m_sphereCount; i++)
+	{
+		SphereBounds(scene, i, &prim);
+		AddPrimitive(primitives, &prim, PRIM_SPHERE, i);
+	}
+
+	for (unsigned int i = 0; i < layout.m_discCount; i++)
+	{
+		DiscBounds(scene, i, &prim);
+		AddPrimitive(primitives, &prim, PRIM_DISC, i);
+	}
+
+	for (unsigned int i = 0; i < layout.m_boxCount; i++)
+	{
+		AxisBoxBounds(scene, i, &prim);
+		AddPrimitive(primitives, &prim, PRIM_BOX, i);
+	}
+}
+
+void BuildSceneBVH(const SphereSet* scene, SceneBVH* bvh)
+{
+	std::vector<BVHPrimitive> primitives;
+	CollectScenePrimitives(scene, &primitives);
+	BuildBVH(primitives, bvh);
+}
+
+}
@@ -0,0 +1,60 @@
+// Bounding volume hierarchy over the bounded primitives of a scene
+//
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+
+#include "raytracing.h"
+#include "define.h"
+
+namespace RAYTRACING
+{
+
+#define BVH_SAH_BINS		16
+#define BVH_MAX_LEAF_SIZE	4
+
+// Input of the builder: one entry per bounded primitive
+typedef struct BVHPrimitive{
+	float m_boundsMin[3];
+	float m_boundsMax[3];
+	float m_centroid[3];
+	unsigned int m_ref;	// (type << PRIM_TYPE_SHIFT) | index
+}BVHPrimitive;
+
+/*
+* Flattened hierarchy as uploaded to the device. The renderers read it through nodeData and
+* primRefData: BuildBVH points them at the vectors, a binary scene file (see scene_file.h)
+* points them into its mapping and leaves the vectors empty.
+*/
+struct SceneBVH
+{
+	std::vector<BVHNode> nodes;
+	std::vector<unsigned int> primRefs;
+	unsigned int depth;
+
+	const BVHNode* nodeData;         // NULL for an empty hierarchy
+	unsigned int nodeCount;
+	const unsigned int* primRefData;
+	unsigned int primRefCount;
+};
+
+static inline unsigned int MakePrimRef(unsigned int type, unsigned int index)
+{
+	return (type << PRIM_TYPE_SHIFT) | (index & PRIM_INDEX_MASK);
+}
+
+/*
+* Build a binned SAH BVH over the primitives and flatten it depth-first.
+* An empty primitive list yields an empty hierarchy.
+*/
+void BuildBVH(const std::vector<BVHPrimitive>& primitives, SceneBVH* bvh);
+
+// Collect the bounded primitives of the scene (everything except the infinite planes)
+void CollectScenePrimitives(const SphereSet* scene, std::vector<BVHPrimitive>* primitives);
+
+void BuildSceneBVH(const SphereSet* scene, SceneBVH* bvh);
+
+}
+
+#endif
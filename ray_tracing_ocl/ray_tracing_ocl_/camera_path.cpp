@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "camera_path.h"
+#include "scene_file.h"
+
+namespace RAYTRACING
+{
+
+bool LoadCameraPath(const char* fileName, CameraPath* path)
+{
+	std::ifstream file(fileName);
+	if (!file)
+	{
+		printf("Error: Couldn't open camera path '%s'.\n", fileName);
+		return false;
+	}
+
+	path->keys.clear();
+	path->interpolation = CAMERA_LINEAR;
+
+	std::string line;
+	for (int lineNumber = 1; std::getline(file, line); lineNumber++)
+	{
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword) || keyword[0] == '#')
+			continue;
+
+		std::string value;
+		std::getline(fields >> std::ws, value);
+		value.erase(value.find_last_not_of(" \t\r") + 1);
+
+		if (keyword == "interpolation")
+		{
+			// Only the first word, a comment may follow
+			std::string mode = value.substr(0, value.find_first_of(" \t#"));
+			if (mode != "linear" && mode != "smooth")
+			{
+				printf("Error: %s, line %d: interpolation is linear or smooth, got '%s'.\n", fileName, lineNumber, value.c_str());
+				return false;
+			}
+			path->interpolation = (mode == "smooth") ? CAMERA_SMOOTH : CAMERA_LINEAR;
+		}
+		else if (keyword == "key")
+		{
+			float v[11];
+			if (!ParseSceneValues(value, v, 11))
+			{
+				printf("Error: %s, line %d: key expects 11 comma-separated numbers, got '%s'.\n", fileName, lineNumber, value.c_str());
+				return false;
+			}
+			if (!path->keys.empty() && v[0] <= path->keys.back().time)
+			{
+				printf("Error: %s, line %d: key times have to increase.\n", fileName, lineNumber);
+				return false;
+			}
+
+			CameraKey key = { v[0], { v[10], { v[1], v[2], v[3] }, { v[4], v[5], v[6] }, { v[7], v[8], v[9] }, 1.0f } };
+			path->keys.push_back(key);
+		}
+		else
+		{
+			printf("Error: %s, line %d: Unknown keyword '%s'.\n", fileName, lineNumber, keyword.c_str());
+			return false;
+		}
+	}
+
+	if (path->keys.empty())
+	{
+		printf("Error: %s has no camera keys.\n", fileName);
+		return false;
+	}
+	return true;
+}
+
+// Catmull-Rom segment from b to c at t in [0, 1]; a and d are the keys around it
+static float Spline(float a, float b, float c, float d, float t)
+{
+	return 0.5f * (2.0f * b + (c - a) * t + (2.0f * a - 5.0f * b + 4.0f * c - d) * t * t +
+		(3.0f * b - a - 3.0f * c + d) * t * t * t);
+}
+
+static Vector SplineVector(const Vector& a, const Vector& b, const Vector& c, const Vector& d, float t)
+{
+	Vector v = { Spline(a.x, b.x, c.x, d.x, t), Spline(a.y, b.y, c.y, d.y, t), Spline(a.z, b.z, c.z, d.z, t) };
+	return v;
+}
+
+static float Lerp(float b, float c, float t)
+{
+	return b + (c - b) * t;
+}
+
+static Vector LerpVector(const Vector& b, const Vector& c, float t)
+{
+	Vector v = { Lerp(b.x, c.x, t), Lerp(b.y, c.y, t), Lerp(b.z, c.z, t) };
+	return v;
+}
+
+Camera CameraAt(const CameraPath& path, float time)
+{
+	const std::vector<CameraKey>& keys = path.keys;
+	if (time <= keys.front().time)
+		return keys.front().camera;
+	if (time >= keys.back().time)
+		return keys.back().camera;
+
+	size_t k = 1;
+	while (keys[k].time < time)
+		k++;
+
+	const Camera& b = keys[k - 1].camera;
+	const Camera& c = keys[k].camera;
+	float t = (time - keys[k - 1].time) / (keys[k].time - keys[k - 1].time);
+
+	Camera cam = b;
+	if (path.interpolation == CAMERA_LINEAR)
+	{
+		cam.fieldOfViewInDegrees = Lerp(b.fieldOfViewInDegrees, c.fieldOfViewInDegrees, t);
+		cam.origin = LerpVector(b.origin, c.origin, t);
+		cam.target = LerpVector(b.target, c.target, t);
+		cam.targetUpDirection = LerpVector(b.targetUpDirection, c.targetUpDirection, t);
+		return cam;
+	}
+
+	// The first and the last segment repeat their end key in place of the missing neighbour
+	const Camera& a = (k >= 2) ? keys[k - 2].camera : b;
+	const Camera& d = (k + 1 < keys.size()) ? keys[k + 1].camera : c;
+	cam.fieldOfViewInDegrees = Spline(a.fieldOfViewInDegrees, b.fieldOfViewInDegrees, c.fieldOfViewInDegrees, d.fieldOfViewInDegrees, t);
+	cam.origin = SplineVector(a.origin, b.origin, c.origin, d.origin, t);
+	cam.target = SplineVector(a.target, b.target, c.target, d.target, t);
+	cam.targetUpDirection = SplineVector(a.targetUpDirection, b.targetUpDirection, c.targetUpDirection, d.targetUpDirection, t);
+	return cam;
+}
+
+float FrameTime(const CameraPath& path, unsigned int frame, unsigned int frameCount)
+{
+	float begin = path.keys.front().time;
+	float end = path.keys.back().time;
+	return (frameCount > 1) ? begin + (end - begin) * (float)frame / (float)(frameCount - 1) : begin;
+}
+
+std::string FrameFileName(const char* outputFile, unsigned int frame)
+{
+	std::string name(outputFile);
+	size_t dot = name.find_last_of('.');
+	size_t slash = name.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = name.size();
+
+	char number[16];
+	snprintf(number, sizeof(number), "_%04u", frame);
+	return name.substr(0, dot) + number + name.substr(dot);
+}
+
+}
@@ -0,0 +1,51 @@
+// Camera paths: keyframes of the camera that an animation is rendered along
+//
+#ifndef __CAMERA_PATH_H__
+#define __CAMERA_PATH_H__
+
+#include <string>
+#include <vector>
+
+#include "raytracing.h"
+
+namespace RAYTRACING
+{
+
+// The camera at a point in time; aspectRatio is left to the render
+struct CameraKey
+{
+	float  time;
+	Camera camera;
+};
+
+enum CameraInterpolation
+{
+	CAMERA_LINEAR,      // straight from key to key
+	CAMERA_SMOOTH       // Catmull-Rom spline through the keys, no kinks at them
+};
+
+// Keys in increasing time order, at least one
+struct CameraPath
+{
+	std::vector<CameraKey> keys;
+	CameraInterpolation    interpolation;
+};
+
+/*
+* Parse a camera path file (see README.md): "key t,x,y,z,tx,ty,tz,ux,uy,uz,fov" lines, the time
+* followed by the values of a scene file's camera line, and "interpolation linear|smooth".
+*/
+bool LoadCameraPath(const char* fileName, CameraPath* path);
+
+// The camera at time; before the first key and after the last it stays at them
+Camera CameraAt(const CameraPath& path, float time);
+
+// Time of frame out of frameCount, spread evenly from the first key to the last
+float FrameTime(const CameraPath& path, unsigned int frame, unsigned int frameCount);
+
+// outputFile with the frame number before its extension: out.ppm -> out_0007.ppm
+std::string FrameFileName(const char* outputFile, unsigned int frame);
+
+}
+
+#endif
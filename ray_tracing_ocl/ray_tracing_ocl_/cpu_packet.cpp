@@ -0,0 +1,109 @@
+#include <stddef.h>
+
+#include "cpu_packet.h"
+
+#if defined(PACKET_SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace RAYTRACING
+{
+
+#ifdef PACKET_SIMD_X86
+
+#ifdef _MSC_VER
+// CPUID feature bits, and for AVX the register state the OS saves (XCR0)
+static bool CpuSupports(PacketIsa isa)
+{
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool ymmState = (xcr0 & 0x06) == 0x06;
+	bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+	int leaf7 = 0;
+	if (maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		leaf7 = info[1];
+	}
+
+	switch (isa)
+	{
+	case PACKET_ISA_SSE:
+		return sse41;
+	case PACKET_ISA_AVX2:
+		return avx && ymmState && (leaf7 & (1 << 5)) != 0;
+	case PACKET_ISA_AVX512:
+		return ymmState && zmmState && (leaf7 & (1 << 16)) != 0;
+	default:
+		return false;
+	}
+}
+#else
+static bool CpuSupports(PacketIsa isa)
+{
+	__builtin_cpu_init();
+
+	switch (isa)
+	{
+	case PACKET_ISA_SSE:
+		return __builtin_cpu_supports("sse4.1") != 0;
+	case PACKET_ISA_AVX2:
+		return __builtin_cpu_supports("avx2") != 0;
+	case PACKET_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f") != 0;
+	default:
+		return false;
+	}
+}
+#endif
+
+#else
+static bool CpuSupports(PacketIsa)
+{
+	return false;
+}
+#endif
+
+PacketIsa DetectPacketIsa()
+{
+	const PacketIsa widestFirst[] = { PACKET_ISA_AVX512, PACKET_ISA_AVX2, PACKET_ISA_SSE };
+
+	for (size_t i = 0; i < sizeof(widestFirst) / sizeof(widestFirst[0]); i++)
+	{
+		if (CpuSupports(widestFirst[i]))
+			return widestFirst[i];
+	}
+	return PACKET_ISA_OFF;
+}
+
+const PacketKernels* SelectPacketKernels(PacketIsa isa)
+{
+	if (isa == PACKET_ISA_AUTO)
+		isa = DetectPacketIsa();
+
+	if (isa == PACKET_ISA_OFF || !CpuSupports(isa))
+		return NULL;
+
+	switch (isa)
+	{
+	case PACKET_ISA_SSE:
+		return GetPacketKernelsSSE();
+	case PACKET_ISA_AVX2:
+		return GetPacketKernelsAVX2();
+	case PACKET_ISA_AVX512:
+		return GetPacketKernelsAVX512();
+	default:
+		return NULL;
+	}
+}
+
+}
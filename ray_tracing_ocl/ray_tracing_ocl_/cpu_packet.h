@@ -0,0 +1,105 @@
+// SIMD ray packets for the CPU path: closest-hit and any-hit queries for 4, 8 or 16 rays at once
+//
+#ifndef __CPU_PACKET_H__
+#define __CPU_PACKET_H__
+
+#include "raytracing.h"
+#include "define.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PACKET_SIMD_X86
+#endif
+
+namespace RAYTRACING
+{
+
+#define PACKET_MAX_WIDTH	16
+
+// Hit references of planes, which aren't in the BVH: this type above the PRIM_* ones and the plane index
+#define PACKET_HIT_PLANE	15
+
+enum PacketIsa
+{
+	PACKET_ISA_AUTO,        // the widest one the CPU supports
+	PACKET_ISA_OFF,         // scalar tracing only
+	PACKET_ISA_SSE,         // SSE4.1, 4 rays
+	PACKET_ISA_AVX2,        // AVX2, 8 rays
+	PACKET_ISA_AVX512       // AVX-512F, 16 rays
+};
+
+/*
+* The scene as the packet kernels read it. Plain arrays only, so that the units compiled
+* for an instruction set don't instantiate any library code the rest of the program shares.
+*/
+struct PacketScene
+{
+	const CompiledLight*  lights;
+	const CompiledPlane*  planes;
+	unsigned int          planeCount;
+	const BVHNode*        nodes;
+	unsigned int          nodeCount;
+	const unsigned int*   primRefs;
+	const Point*          vertices;
+	const Triangle*       triangles;
+	const float*          primData;
+	PrimitiveLayout       primLayout;
+};
+
+/*
+* Rays of one packet in structure-of-arrays form. Lanes whose bit in active is clear are
+* left out, but still loaded, so keep them initialized. ignoreLight is only read by
+* occlusion queries (-1: every light blocks).
+*/
+struct PacketRays
+{
+	float         originX[PACKET_MAX_WIDTH];
+	float         originY[PACKET_MAX_WIDTH];
+	float         originZ[PACKET_MAX_WIDTH];
+	float         directionX[PACKET_MAX_WIDTH];
+	float         directionY[PACKET_MAX_WIDTH];
+	float         directionZ[PACKET_MAX_WIDTH];
+	float         tMax[PACKET_MAX_WIDTH];
+	int           ignoreLight[PACKET_MAX_WIDTH];
+	unsigned int  active;
+};
+
+/*
+* Closest hit of each lane whose bit is set in hit: its distance and primitive reference,
+* (type << PRIM_TYPE_SHIFT) | index as in the BVH, with type PACKET_HIT_PLANE for planes
+*/
+struct PacketHits
+{
+	float         t[PACKET_MAX_WIDTH];
+	unsigned int  ref[PACKET_MAX_WIDTH];
+	unsigned int  hit;
+};
+
+struct PacketKernels
+{
+	PacketIsa     isa;
+	const char*   name;
+	unsigned int  width;        // rays per packet
+
+	void (*intersect)(const PacketScene* scene, const PacketRays* rays, PacketHits* hits);
+
+	// Returns the active lanes with anything but their ignoreLight closer than tMax
+	unsigned int (*occluded)(const PacketScene* scene, const PacketRays* rays);
+};
+
+// The widest instruction set of this CPU there are packet kernels for, PACKET_ISA_OFF if none
+PacketIsa DetectPacketIsa();
+
+/*
+* Packet kernels for isa; PACKET_ISA_AUTO picks DetectPacketIsa().
+* NULL for PACKET_ISA_OFF and for instruction sets the CPU doesn't have.
+*/
+const PacketKernels* SelectPacketKernels(PacketIsa isa);
+
+// The kernels of each instruction set, defined in cpu_packet_sse.cpp, cpu_packet_avx2.cpp and cpu_packet_avx512.cpp
+const PacketKernels* GetPacketKernelsSSE();
+const PacketKernels* GetPacketKernelsAVX2();
+const PacketKernels* GetPacketKernelsAVX512();
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+// Packet kernels for AVX2: 8 rays per packet
+//
+#include <math.h>
+#include <string.h>
+
+#include "cpu_packet.h"
+
+#ifdef PACKET_SIMD_X86
+
+#include <immintrin.h>
+
+// Only this unit is built for AVX2; the rest of the program runs on any CPU
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+#include "cpu_packet_impl.h"
+
+namespace RAYTRACING
+{
+namespace
+{
+
+struct SimdAVX2
+{
+	enum { Width = 8 };
+	typedef __m256 Float;
+	typedef __m256 Mask;
+
+	static Float Set1(float v) { return _mm256_set1_ps(v); }
+	static Float Bitcast(unsigned int v) { return _mm256_castsi256_ps(_mm256_set1_epi32((int)v)); }
+	static Float Load(const float* p) { return _mm256_loadu_ps(p); }
+	static void Store(float* p, Float v) { _mm256_storeu_ps(p, v); }
+
+	static Float Add(Float a, Float b) { return _mm256_add_ps(a, b); }
+	static Float Sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+	static Float Mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+	static Float Div(Float a, Float b) { return _mm256_div_ps(a, b); }
+	static Float Min(Float a, Float b) { return _mm256_min_ps(a, b); }
+	static Float Max(Float a, Float b) { return _mm256_max_ps(a, b); }
+	static Float Sqrt(Float a) { return _mm256_sqrt_ps(a); }
+
+	static Mask Lt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static Mask Le(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static Mask Gt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static Mask Ge(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	static Mask Eq(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	static Mask Neq(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+
+	static Mask And(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+	static Mask Or(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+	static Mask AndNot(Mask a, Mask b) { return _mm256_andnot_ps(b, a); }
+	static unsigned int Bits(Mask m) { return (unsigned int)_mm256_movemask_ps(m); }
+	static Mask FromBits(unsigned int bits)
+	{
+		__m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int)bits), lanes), lanes));
+	}
+	static Float Select(Mask m, Float a, Float b) { return _mm256_blendv_ps(b, a, m); }
+};
+
+template struct PacketTracer<SimdAVX2>;
+
+}
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif
+
+namespace RAYTRACING
+{
+
+const PacketKernels* GetPacketKernelsAVX2()
+{
+#ifdef PACKET_SIMD_X86
+	static const PacketKernels kernels = { PACKET_ISA_AVX2, "AVX2", SimdAVX2::Width,
+		PacketTracer<SimdAVX2>::Intersect, PacketTracer<SimdAVX2>::Occluded };
+	return &kernels;
+#else
+	return NULL;
+#endif
+}
+
+}
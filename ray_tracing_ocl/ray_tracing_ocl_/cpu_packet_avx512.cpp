@@ -0,0 +1,89 @@
+// Packet kernels for AVX-512F: 16 rays per packet
+//
+#include <math.h>
+#include <string.h>
+
+#include "cpu_packet.h"
+
+#ifdef PACKET_SIMD_X86
+
+#include <immintrin.h>
+
+// Only this unit is built for AVX-512F; the rest of the program runs on any CPU
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+
+#include "cpu_packet_impl.h"
+
+namespace RAYTRACING
+{
+namespace
+{
+
+struct SimdAVX512
+{
+	enum { Width = 16 };
+	typedef __m512 Float;
+	typedef __mmask16 Mask;
+
+	static Float Set1(float v) { return _mm512_set1_ps(v); }
+	static Float Bitcast(unsigned int v) { return _mm512_castsi512_ps(_mm512_set1_epi32((int)v)); }
+	static Float Load(const float* p) { return _mm512_loadu_ps(p); }
+	static void Store(float* p, Float v) { _mm512_storeu_ps(p, v); }
+
+	static Float Add(Float a, Float b) { return _mm512_add_ps(a, b); }
+	static Float Sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+	static Float Mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+	static Float Div(Float a, Float b) { return _mm512_div_ps(a, b); }
+	static Float Min(Float a, Float b) { return _mm512_min_ps(a, b); }
+	static Float Max(Float a, Float b) { return _mm512_max_ps(a, b); }
+	static Float Sqrt(Float a) { return _mm512_sqrt_ps(a); }
+
+	static Mask Lt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	static Mask Le(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+	static Mask Gt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+	static Mask Ge(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+	static Mask Eq(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+	static Mask Neq(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+
+	// Masks are one bit per lane already
+	static Mask And(Mask a, Mask b) { return (Mask)(a & b); }
+	static Mask Or(Mask a, Mask b) { return (Mask)(a | b); }
+	static Mask AndNot(Mask a, Mask b) { return (Mask)(a & ~b); }
+	static unsigned int Bits(Mask m) { return (unsigned int)m; }
+	static Mask FromBits(unsigned int bits) { return (Mask)bits; }
+	static Float Select(Mask m, Float a, Float b) { return _mm512_mask_blend_ps(m, b, a); }
+};
+
+template struct PacketTracer<SimdAVX512>;
+
+}
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif
+
+namespace RAYTRACING
+{
+
+const PacketKernels* GetPacketKernelsAVX512()
+{
+#ifdef PACKET_SIMD_X86
+	static const PacketKernels kernels = { PACKET_ISA_AVX512, "AVX-512", SimdAVX512::Width,
+		PacketTracer<SimdAVX512>::Intersect, PacketTracer<SimdAVX512>::Occluded };
+	return &kernels;
+#else
+	return NULL;
+#endif
+}
+
+}
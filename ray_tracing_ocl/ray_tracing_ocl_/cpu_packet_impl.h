@@ -0,0 +1,557 @@
+// Packet tracing shared by the instruction set units cpu_packet_sse.cpp, cpu_packet_avx2.cpp
+// and cpu_packet_avx512.cpp. Each of them defines a SIMD wrapper S and includes this file
+// where its instruction set is enabled, so everything here is in an anonymous namespace:
+// no compiled function may be shared with a unit built for another instruction set.
+//
+// S has
+//   Width, Float, Mask
+//   Set1, Bitcast (an unsigned int in every lane), Load, Store (unaligned)
+//   Add, Sub, Mul, Div, Min, Max, Sqrt
+//   Lt, Le, Gt, Ge, Eq, Neq (true for NaN, like !=), giving a Mask
+//   And, Or, AndNot(a, b) = a & ~b, Bits (one bit per lane), FromBits
+//   Select(mask, a, b) = mask ? a : b, bit for bit
+//
+#ifndef __CPU_PACKET_IMPL_H__
+#define __CPU_PACKET_IMPL_H__
+
+#include "cpu_packet.h"
+
+#define RAYMAX  1.0e30f
+#define EPSILON 0.00001f
+
+namespace RAYTRACING
+{
+namespace
+{
+
+template <class S>
+struct PacketTracer
+{
+	typedef typename S::Float Float;
+	typedef typename S::Mask Mask;
+
+	/*
+	* Per-packet constants: the rays, their inverse directions for the node boxes and the
+	* per-lane axes and shear of the watertight triangle test. Inactive lanes get tMax 0,
+	* so that no primitive test can hit for them.
+	*/
+	struct Setup
+	{
+		Float ox, oy, oz;
+		Float dx, dy, dz;
+		Float invX, invY, invZ;
+		Float shearX, shearY, shearZ;
+		Mask kx0, kx1, ky0, ky1, kz0, kz1;	// kx == 0, kx == 1, ...
+		Float tMax;
+		Float ignoreLight;
+		Mask active;
+	};
+
+	static Float Abs(const Float& v)
+	{
+		return S::Max(v, S::Sub(S::Set1(0.0f), v));
+	}
+
+	// 1 / d with d kept away from 0, as SafeInverse of the scalar path
+	static Float SafeInverse(const Float& d)
+	{
+		Float tiny = S::Select(S::Lt(d, S::Set1(0.0f)), S::Set1(-1.0e-20f), S::Set1(1.0e-20f));
+		return S::Div(S::Set1(1.0f), S::Select(S::Gt(Abs(d), S::Set1(1.0e-20f)), d, tiny));
+	}
+
+	static void Prepare(const PacketRays* rays, Setup* setup)
+	{
+		Float zero = S::Set1(0.0f);
+		Mask active = S::FromBits(rays->active & ((1u << S::Width) - 1));
+
+		// Inactive lanes look along +z with tMax 0
+		setup->active = active;
+		setup->ox = S::Select(active, S::Load(rays->originX), zero);
+		setup->oy = S::Select(active, S::Load(rays->originY), zero);
+		setup->oz = S::Select(active, S::Load(rays->originZ), zero);
+		setup->dx = S::Select(active, S::Load(rays->directionX), zero);
+		setup->dy = S::Select(active, S::Load(rays->directionY), zero);
+		setup->dz = S::Select(active, S::Load(rays->directionZ), S::Set1(1.0f));
+		setup->tMax = S::Select(active, S::Load(rays->tMax), zero);
+
+		float ignore[PACKET_MAX_WIDTH];
+		for (unsigned int lane = 0; lane < S::Width; lane++)
+		{
+			ignore[lane] = (float)rays->ignoreLight[lane];
+		}
+		setup->ignoreLight = S::Load(ignore);
+
+		setup->invX = SafeInverse(setup->dx);
+		setup->invY = SafeInverse(setup->dy);
+		setup->invZ = SafeInverse(setup->dz);
+
+		// Same axes as PrepareRayShear of the scalar path: kz is the dominant axis,
+		// kx and ky follow it and swap places when the direction along kz is negative
+		Float ax = Abs(setup->dx), ay = Abs(setup->dy), az = Abs(setup->dz);
+		Mask xOverY = S::Gt(ax, ay);
+		Mask kz0 = S::And(xOverY, S::Gt(ax, az));
+		Mask kz1 = S::AndNot(S::Gt(ay, az), xOverY);
+		Mask kz2 = S::AndNot(S::AndNot(S::FromBits((1u << S::Width) - 1), kz0), kz1);
+		Float dkz = Pick(setup->dx, setup->dy, setup->dz, kz0, kz1);
+		Mask swap = S::Lt(dkz, zero);
+
+		// Unswapped kx = (kz + 1) % 3 and ky = (kz + 2) % 3
+		setup->kx0 = S::Or(S::And(swap, kz1), S::AndNot(kz2, swap));
+		setup->kx1 = S::Or(S::And(swap, kz2), S::AndNot(kz0, swap));
+		setup->ky0 = S::Or(S::And(swap, kz2), S::AndNot(kz1, swap));
+		setup->ky1 = S::Or(S::And(swap, kz0), S::AndNot(kz2, swap));
+		setup->kz0 = kz0;
+		setup->kz1 = kz1;
+
+		setup->shearX = S::Div(Pick(setup->dx, setup->dy, setup->dz, setup->kx0, setup->kx1), dkz);
+		setup->shearY = S::Div(Pick(setup->dx, setup->dy, setup->dz, setup->ky0, setup->ky1), dkz);
+		setup->shearZ = S::Div(S::Set1(1.0f), dkz);
+	}
+
+	// Component k of (x, y, z) per lane, k given by the masks k == 0 and k == 1
+	static Float Pick(const Float& x, const Float& y, const Float& z, const Mask& is0, const Mask& is1)
+	{
+		return S::Select(is0, x, S::Select(is1, y, z));
+	}
+
+	static Float Dot(const Float& ax, const Float& ay, const Float& az, const Float& bx, const Float& by, const Float& bz)
+	{
+		return S::Add(S::Add(S::Mul(ax, bx), S::Mul(ay, by)), S::Mul(az, bz));
+	}
+
+	// Hit distances t within [EPSILON, tMax)
+	static Mask InRange(const Float& t, const Float& tMax)
+	{
+		return S::And(S::Lt(t, tMax), S::Ge(t, S::Set1(EPSILON)));
+	}
+
+	static Point StreamPoint(const float* data, unsigned int stream, unsigned int count, unsigned int index)
+	{
+		Point p = { data[stream + index], data[stream + count + index], data[stream + 2 * count + index] };
+		return p;
+	}
+
+	static Mask RectangleLightTest(const Setup& r, const CompiledLight& light, const Float& tMax, Float* tHit)
+	{
+		Float nx = S::Set1(light.m_normal.x), ny = S::Set1(light.m_normal.y), nz = S::Set1(light.m_normal.z);
+		Float nDotD = Dot(nx, ny, nz, r.dx, r.dy, r.dz);
+		Float t = S::Div(S::Sub(S::Set1(light.m_planeDistance), Dot(r.ox, r.oy, r.oz, nx, ny, nz)), nDotD);
+
+		// Position across the light in units of its sides
+		Float px = S::Sub(S::Add(S::Mul(t, r.dx), r.ox), S::Set1(light.m_pos.x));
+		Float py = S::Sub(S::Add(S::Mul(t, r.dy), r.oy), S::Set1(light.m_pos.y));
+		Float pz = S::Sub(S::Add(S::Mul(t, r.dz), r.oz), S::Set1(light.m_pos.z));
+		Float u = Dot(px, py, pz, S::Set1(light.m_side1Inv.x), S::Set1(light.m_side1Inv.y), S::Set1(light.m_side1Inv.z));
+		Float v = Dot(px, py, pz, S::Set1(light.m_side2Inv.x), S::Set1(light.m_side2Inv.y), S::Set1(light.m_side2Inv.z));
+
+		Float zero = S::Set1(0.0f), one = S::Set1(1.0f);
+		Mask inside = S::And(S::And(S::Ge(u, zero), S::Le(u, one)), S::And(S::Ge(v, zero), S::Le(v, one)));
+		*tHit = t;
+		return S::And(S::And(S::Neq(nDotD, zero), InRange(t, tMax)), inside);
+	}
+
+	static Mask PlaneTest(const Setup& r, const CompiledPlane& plane, const Float& tMax, Float* tHit)
+	{
+		Float nx = S::Set1(plane.m_normal.x), ny = S::Set1(plane.m_normal.y), nz = S::Set1(plane.m_normal.z);
+		Float nDotD = Dot(nx, ny, nz, r.dx, r.dy, r.dz);
+		Float t = S::Div(S::Sub(S::Set1(plane.m_distance), Dot(r.ox, r.oy, r.oz, nx, ny, nz)), nDotD);
+		*tHit = t;
+		return S::And(S::Lt(nDotD, S::Set1(0.0f)), InRange(t, tMax));
+	}
+
+	// Watertight test of the scalar path, with the axis permutation of each lane done by selects
+	static Mask TriangleTest(const Setup& r, const PacketScene* scene, unsigned int index, const Float& tMax, Float* tHit)
+	{
+		const Triangle& triangle = scene->triangles[index];
+		const Point& p0 = scene->vertices[triangle.m_v0];
+		const Point& p1 = scene->vertices[triangle.m_v1];
+		const Point& p2 = scene->vertices[triangle.m_v2];
+
+		Float A[3] = { S::Sub(S::Set1(p0.x), r.ox), S::Sub(S::Set1(p0.y), r.oy), S::Sub(S::Set1(p0.z), r.oz) };
+		Float B[3] = { S::Sub(S::Set1(p1.x), r.ox), S::Sub(S::Set1(p1.y), r.oy), S::Sub(S::Set1(p1.z), r.oz) };
+		Float C[3] = { S::Sub(S::Set1(p2.x), r.ox), S::Sub(S::Set1(p2.y), r.oy), S::Sub(S::Set1(p2.z), r.oz) };
+
+		Float Akz = Pick(A[0], A[1], A[2], r.kz0, r.kz1);
+		Float Bkz = Pick(B[0], B[1], B[2], r.kz0, r.kz1);
+		Float Ckz = Pick(C[0], C[1], C[2], r.kz0, r.kz1);
+		Float Ax = S::Sub(Pick(A[0], A[1], A[2], r.kx0, r.kx1), S::Mul(r.shearX, Akz));
+		Float Ay = S::Sub(Pick(A[0], A[1], A[2], r.ky0, r.ky1), S::Mul(r.shearY, Akz));
+		Float Bx = S::Sub(Pick(B[0], B[1], B[2], r.kx0, r.kx1), S::Mul(r.shearX, Bkz));
+		Float By = S::Sub(Pick(B[0], B[1], B[2], r.ky0, r.ky1), S::Mul(r.shearY, Bkz));
+		Float Cx = S::Sub(Pick(C[0], C[1], C[2], r.kx0, r.kx1), S::Mul(r.shearX, Ckz));
+		Float Cy = S::Sub(Pick(C[0], C[1], C[2], r.ky0, r.ky1), S::Mul(r.shearY, Ckz));
+
+		Float U = S::Sub(S::Mul(Cx, By), S::Mul(Cy, Bx));
+		Float V = S::Sub(S::Mul(Ax, Cy), S::Mul(Ay, Cx));
+		Float W = S::Sub(S::Mul(Bx, Ay), S::Mul(By, Ax));
+
+		Float zero = S::Set1(0.0f);
+		Mask anyNegative = S::Or(S::Or(S::Lt(U, zero), S::Lt(V, zero)), S::Lt(W, zero));
+		Mask anyPositive = S::Or(S::Or(S::Gt(U, zero), S::Gt(V, zero)), S::Gt(W, zero));
+		Float det = S::Add(S::Add(U, V), W);
+
+		Float T = S::Add(S::Add(S::Mul(S::Mul(U, r.shearZ), Akz), S::Mul(S::Mul(V, r.shearZ), Bkz)),
+			S::Mul(S::Mul(W, r.shearZ), Ckz));
+		Float t = S::Div(T, det);
+		*tHit = t;
+		return S::And(S::AndNot(S::Neq(det, zero), S::And(anyNegative, anyPositive)), InRange(t, tMax));
+	}
+
+	static Mask SphereTest(const Setup& r, const PacketScene* scene, unsigned int index, const Float& tMax, Float* tHit)
+	{
+		const PrimitiveLayout& layout = scene->primLayout;
+		Point center = StreamPoint(scene->primData, layout.m_sphereCenter, layout.m_sphereCount, index);
+		float radius = scene->primData[layout.m_sphereRadius + index];
+
+		Float ocx = S::Sub(r.ox, S::Set1(center.x));
+		Float ocy = S::Sub(r.oy, S::Set1(center.y));
+		Float ocz = S::Sub(r.oz, S::Set1(center.z));
+		Float b = Dot(ocx, ocy, ocz, r.dx, r.dy, r.dz);
+		Float c = S::Sub(Dot(ocx, ocy, ocz, ocx, ocy, ocz), S::Set1(radius * radius));
+		Float discriminant = S::Sub(S::Mul(b, b), c);
+
+		Float zero = S::Set1(0.0f);
+		Float root = S::Sqrt(S::Max(discriminant, zero));
+		Float minusB = S::Sub(zero, b);
+		Float nearT = S::Sub(minusB, root);
+		Float t = S::Select(S::Lt(nearT, S::Set1(EPSILON)), S::Add(minusB, root), nearT);
+		*tHit = t;
+		return S::And(S::Ge(discriminant, zero), InRange(t, tMax));
+	}
+
+	static Mask DiscTest(const Setup& r, const PacketScene* scene, unsigned int index, const Float& tMax, Float* tHit)
+	{
+		const PrimitiveLayout& layout = scene->primLayout;
+		Point center = StreamPoint(scene->primData, layout.m_discCenter, layout.m_discCount, index);
+		Vector normal = StreamPoint(scene->primData, layout.m_discNormal, layout.m_discCount, index);
+		float radius = scene->primData[layout.m_discRadius + index];
+
+		Float nx = S::Set1(normal.x), ny = S::Set1(normal.y), nz = S::Set1(normal.z);
+		Float cx = S::Set1(center.x), cy = S::Set1(center.y), cz = S::Set1(center.z);
+		Float nDotD = Dot(nx, ny, nz, r.dx, r.dy, r.dz);
+		Float t = S::Div(Dot(S::Sub(cx, r.ox), S::Sub(cy, r.oy), S::Sub(cz, r.oz), nx, ny, nz), nDotD);
+
+		Float px = S::Sub(S::Add(S::Mul(t, r.dx), r.ox), cx);
+		Float py = S::Sub(S::Add(S::Mul(t, r.dy), r.oy), cy);
+		Float pz = S::Sub(S::Add(S::Mul(t, r.dz), r.oz), cz);
+		Mask onDisc = S::Le(Dot(px, py, pz, px, py, pz), S::Set1(radius * radius));
+		*tHit = t;
+		return S::And(S::And(S::Neq(nDotD, S::Set1(0.0f)), InRange(t, tMax)), onDisc);
+	}
+
+	static Mask AxisBoxTest(const Setup& r, const PacketScene* scene, unsigned int index, const Float& tMax, Float* tHit)
+	{
+		const PrimitiveLayout& layout = scene->primLayout;
+		Point boxMin = StreamPoint(scene->primData, layout.m_boxMin, layout.m_boxCount, index);
+		Point boxMax = StreamPoint(scene->primData, layout.m_boxMax, layout.m_boxCount, index);
+
+		const Float o[3] = { r.ox, r.oy, r.oz };
+		const Float d[3] = { r.dx, r.dy, r.dz };
+		const float lo[3] = { boxMin.x, boxMin.y, boxMin.z };
+		const float hi[3] = { boxMax.x, boxMax.y, boxMax.z };
+
+		// Slab test; lanes parallel to a slab miss if they start outside of it
+		Float zero = S::Set1(0.0f);
+		Float tNear = S::Set1(-RAYMAX), tFar = S::Set1(RAYMAX);
+		Mask outside = S::FromBits(0);
+		for (int a = 0; a < 3; a++)
+		{
+			Float low = S::Set1(lo[a]), high = S::Set1(hi[a]);
+			Mask parallel = S::Eq(d[a], zero);
+			outside = S::Or(outside, S::And(parallel, S::Or(S::Lt(o[a], low), S::Gt(o[a], high))));
+
+			Float t0 = S::Div(S::Sub(low, o[a]), d[a]);
+			Float t1 = S::Div(S::Sub(high, o[a]), d[a]);
+			tNear = S::Select(parallel, tNear, S::Max(tNear, S::Min(t0, t1)));
+			tFar = S::Select(parallel, tFar, S::Min(tFar, S::Max(t0, t1)));
+		}
+
+		// Rays starting inside the box hit its far side
+		Float t = S::Select(S::Lt(tNear, S::Set1(EPSILON)), tFar, tNear);
+		*tHit = t;
+		return S::And(S::AndNot(S::Le(tNear, tFar), outside), InRange(t, tMax));
+	}
+
+	static Mask PrimitiveTest(const Setup& r, const PacketScene* scene, unsigned int ref, const Float& tMax, Float* tHit)
+	{
+		unsigned int index = ref & PRIM_INDEX_MASK;
+
+		switch (ref >> PRIM_TYPE_SHIFT)
+		{
+		case PRIM_RECT_LIGHT:
+			return RectangleLightTest(r, scene->lights[index], tMax, tHit);
+		case PRIM_TRIANGLE:
+			return TriangleTest(r, scene, index, tMax, tHit);
+		case PRIM_SPHERE:
+			return SphereTest(r, scene, index, tMax, tHit);
+		case PRIM_DISC:
+			return DiscTest(r, scene, index, tMax, tHit);
+		case PRIM_BOX:
+			return AxisBoxTest(r, scene, index, tMax, tHit);
+		default:
+			return S::FromBits(0);
+		}
+	}
+
+	// Slab test of a node box for the lanes in active; tEntry receives where each lane enters it
+	static Mask NodeTest(const Setup& r, const BVHNode& node, const Float& tMax, const Mask& active, Float* tEntry)
+	{
+		Float t0 = S::Mul(S::Sub(S::Set1(node.m_boundsMin[0]), r.ox), r.invX);
+		Float t1 = S::Mul(S::Sub(S::Set1(node.m_boundsMax[0]), r.ox), r.invX);
+		Float tNear = S::Min(t0, t1), tFar = S::Max(t0, t1);
+
+		t0 = S::Mul(S::Sub(S::Set1(node.m_boundsMin[1]), r.oy), r.invY);
+		t1 = S::Mul(S::Sub(S::Set1(node.m_boundsMax[1]), r.oy), r.invY);
+		tNear = S::Max(tNear, S::Min(t0, t1)); tFar = S::Min(tFar, S::Max(t0, t1));
+
+		t0 = S::Mul(S::Sub(S::Set1(node.m_boundsMin[2]), r.oz), r.invZ);
+		t1 = S::Mul(S::Sub(S::Set1(node.m_boundsMax[2]), r.oz), r.invZ);
+		tNear = S::Max(tNear, S::Min(t0, t1)); tFar = S::Min(tFar, S::Max(t0, t1));
+
+		*tEntry = tNear;
+		Mask hit = S::And(S::Le(tNear, tFar), S::And(S::Ge(tFar, S::Set1(0.0f)), S::Lt(tNear, tMax)));
+		return S::And(hit, active);
+	}
+
+	// Smallest value of the lanes in bits
+	static float MinLane(const Float& v, unsigned int bits)
+	{
+		float lanes[PACKET_MAX_WIDTH];
+		S::Store(lanes, v);
+		float result = RAYMAX;
+		for (unsigned int lane = 0; lane < S::Width; lane++)
+		{
+			if (((bits >> lane) & 1) && lanes[lane] < result)
+				result = lanes[lane];
+		}
+		return result;
+	}
+
+	static float MaxLane(const Float& v)
+	{
+		float lanes[PACKET_MAX_WIDTH];
+		S::Store(lanes, v);
+		float result = lanes[0];
+		for (unsigned int lane = 1; lane < S::Width; lane++)
+		{
+			if (lanes[lane] > result)
+				result = lanes[lane];
+		}
+		return result;
+	}
+
+	/*
+	* Closest hit of every active lane. The packet goes down the BVH together: a node is
+	* entered if any lane's ray hits its box, the child entered first by the nearest lane first.
+	*/
+	static void Intersect(const PacketScene* scene, const PacketRays* rays, PacketHits* hits)
+	{
+		Setup r;
+		Prepare(rays, &r);
+
+		Float tHit = r.tMax;
+		Float ref = S::Bitcast(0);
+		Mask hitAny = S::FromBits(0);
+		Float t;
+
+		// Planes are unbounded and stay out of the BVH
+		for (unsigned int i = 0; i < scene->planeCount; i++)
+		{
+			Mask hit = PlaneTest(r, scene->planes[i], tHit, &t);
+			tHit = S::Select(hit, t, tHit);
+			ref = S::Select(hit, S::Bitcast(((unsigned int)PACKET_HIT_PLANE << PRIM_TYPE_SHIFT) | i), ref);
+			hitAny = S::Or(hitAny, hit);
+		}
+
+		if (scene->nodeCount > 0)
+		{
+			const BVHNode* nodes = scene->nodes;
+			int stack[BVH_STACK_SIZE];
+			float stackEntry[BVH_STACK_SIZE];
+			int stackSize = 0;
+			int nodeIndex = 0;
+			Float tEntry;
+
+			if (S::Bits(NodeTest(r, nodes[0], tHit, r.active, &tEntry)) == 0)
+			{
+				nodeIndex = -1;
+			}
+
+			while (nodeIndex >= 0)
+			{
+				const BVHNode& node = nodes[nodeIndex];
+
+				if (node.m_primCount > 0)
+				{
+					for (int k = 0; k < node.m_primCount; k++)
+					{
+						unsigned int primRef = scene->primRefs[node.m_offset + k];
+						Mask hit = PrimitiveTest(r, scene, primRef, tHit, &t);
+						if (S::Bits(hit))
+						{
+							tHit = S::Select(hit, t, tHit);
+							ref = S::Select(hit, S::Bitcast(primRef), ref);
+							hitAny = S::Or(hitAny, hit);
+						}
+					}
+				}
+				else
+				{
+					int left = nodeIndex + 1;
+					int right = node.m_offset;
+					Float tLeft, tRight;
+					unsigned int hitLeft = S::Bits(NodeTest(r, nodes[left], tHit, r.active, &tLeft));
+					unsigned int hitRight = S::Bits(NodeTest(r, nodes[right], tHit, r.active, &tRight));
+
+					if (hitLeft && hitRight)
+					{
+						float entryLeft = MinLane(tLeft, hitLeft);
+						float entryRight = MinLane(tRight, hitRight);
+						if (entryRight < entryLeft)
+						{
+							int tmpIndex = left; left = right; right = tmpIndex;
+							entryRight = entryLeft;
+						}
+						stack[stackSize] = right;
+						stackEntry[stackSize] = entryRight;
+						stackSize++;
+						nodeIndex = left;
+						continue;
+					}
+					if (hitLeft || hitRight)
+					{
+						nodeIndex = hitLeft ? left : right;
+						continue;
+					}
+				}
+
+				// Pop the next node that can still hold a closer hit for some lane
+				float farthest = MaxLane(tHit);
+				nodeIndex = -1;
+				while (stackSize > 0)
+				{
+					stackSize--;
+					if (stackEntry[stackSize] < farthest)
+					{
+						nodeIndex = stack[stackSize];
+						break;
+					}
+				}
+			}
+		}
+
+		float refLanes[PACKET_MAX_WIDTH];
+		S::Store(hits->t, tHit);
+		S::Store(refLanes, ref);
+		for (unsigned int lane = 0; lane < S::Width; lane++)
+		{
+			unsigned int bits;
+			memcpy(&bits, &refLanes[lane], sizeof(bits));
+			hits->ref[lane] = bits;
+		}
+		hits->hit = S::Bits(hitAny);
+	}
+
+	/*
+	* Any-hit query of every active lane. A lane drops out of the packet at its first blocker,
+	* the query ends when every lane is blocked or the BVH is done.
+	*/
+	static unsigned int Occluded(const PacketScene* scene, const PacketRays* rays)
+	{
+		Setup r;
+		Prepare(rays, &r);
+
+		Float tMax = r.tMax;
+		Float zero = S::Set1(0.0f);
+		Mask open = r.active;
+		unsigned int blocked = 0;
+		Float t;
+
+		for (unsigned int i = 0; i < scene->planeCount; i++)
+		{
+			Mask hit = PlaneTest(r, scene->planes[i], tMax, &t);
+			tMax = S::Select(hit, zero, tMax);
+			open = S::AndNot(open, hit);
+			blocked |= S::Bits(hit);
+		}
+
+		if (scene->nodeCount == 0 || S::Bits(open) == 0)
+		{
+			return blocked;
+		}
+
+		const BVHNode* nodes = scene->nodes;
+		int stack[BVH_STACK_SIZE];
+		int stackSize = 0;
+		int nodeIndex = 0;
+		Float tEntry;
+
+		if (S::Bits(NodeTest(r, nodes[0], tMax, open, &tEntry)) == 0)
+		{
+			return blocked;
+		}
+
+		for (;;)
+		{
+			const BVHNode& node = nodes[nodeIndex];
+
+			if (node.m_primCount > 0)
+			{
+				for (int k = 0; k < node.m_primCount; k++)
+				{
+					unsigned int primRef = scene->primRefs[node.m_offset + k];
+					Mask hit = PrimitiveTest(r, scene, primRef, tMax, &t);
+					if ((primRef >> PRIM_TYPE_SHIFT) == PRIM_RECT_LIGHT)
+					{
+						hit = S::AndNot(hit, S::Eq(r.ignoreLight, S::Set1((float)(primRef & PRIM_INDEX_MASK))));
+					}
+					if (S::Bits(hit))
+					{
+						tMax = S::Select(hit, zero, tMax);
+						open = S::AndNot(open, hit);
+						blocked |= S::Bits(hit);
+						if (S::Bits(open) == 0)
+						{
+							return blocked;
+						}
+					}
+				}
+			}
+			else
+			{
+				int left = nodeIndex + 1;
+				int right = node.m_offset;
+				Float tLeft, tRight;
+				unsigned int hitLeft = S::Bits(NodeTest(r, nodes[left], tMax, open, &tLeft));
+				unsigned int hitRight = S::Bits(NodeTest(r, nodes[right], tMax, open, &tRight));
+
+				if (hitLeft && hitRight)
+				{
+					if (MinLane(tRight, hitRight) < MinLane(tLeft, hitLeft))
+					{
+						int tmpIndex = left; left = right; right = tmpIndex;
+					}
+					stack[stackSize++] = right;
+					nodeIndex = left;
+					continue;
+				}
+				if (hitLeft || hitRight)
+				{
+					nodeIndex = hitLeft ? left : right;
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+			{
+				return blocked;
+			}
+			nodeIndex = stack[--stackSize];
+		}
+	}
+};
+
+}
+}
+
+#endif
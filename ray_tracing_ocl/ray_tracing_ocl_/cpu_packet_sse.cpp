@@ -0,0 +1,92 @@
+// Packet kernels for SSE4.1: 4 rays per packet
+//
+#include <math.h>
+#include <string.h>
+
+#include "cpu_packet.h"
+
+#ifdef PACKET_SIMD_X86
+
+#include <smmintrin.h>
+
+// Only this unit is built for SSE4.1; the rest of the program runs on any CPU
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse4.1"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#endif
+
+#include "cpu_packet_impl.h"
+
+namespace RAYTRACING
+{
+namespace
+{
+
+struct SimdSSE
+{
+	enum { Width = 4 };
+	typedef __m128 Float;
+	typedef __m128 Mask;
+
+	static Float Set1(float v) { return _mm_set1_ps(v); }
+	static Float Bitcast(unsigned int v) { return _mm_castsi128_ps(_mm_set1_epi32((int)v)); }
+	static Float Load(const float* p) { return _mm_loadu_ps(p); }
+	static void Store(float* p, Float v) { _mm_storeu_ps(p, v); }
+
+	static Float Add(Float a, Float b) { return _mm_add_ps(a, b); }
+	static Float Sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+	static Float Mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+	static Float Div(Float a, Float b) { return _mm_div_ps(a, b); }
+	static Float Min(Float a, Float b) { return _mm_min_ps(a, b); }
+	static Float Max(Float a, Float b) { return _mm_max_ps(a, b); }
+	static Float Sqrt(Float a) { return _mm_sqrt_ps(a); }
+
+	static Mask Lt(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+	static Mask Le(Float a, Float b) { return _mm_cmple_ps(a, b); }
+	static Mask Gt(Float a, Float b) { return _mm_cmpgt_ps(a, b); }
+	static Mask Ge(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+	static Mask Eq(Float a, Float b) { return _mm_cmpeq_ps(a, b); }
+	static Mask Neq(Float a, Float b) { return _mm_cmpneq_ps(a, b); }
+
+	static Mask And(Mask a, Mask b) { return _mm_and_ps(a, b); }
+	static Mask Or(Mask a, Mask b) { return _mm_or_ps(a, b); }
+	static Mask AndNot(Mask a, Mask b) { return _mm_andnot_ps(b, a); }
+	static unsigned int Bits(Mask m) { return (unsigned int)_mm_movemask_ps(m); }
+	static Mask FromBits(unsigned int bits)
+	{
+		__m128i lanes = _mm_setr_epi32(1, 2, 4, 8);
+		return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)bits), lanes), lanes));
+	}
+	static Float Select(Mask m, Float a, Float b) { return _mm_blendv_ps(b, a, m); }
+};
+
+template struct PacketTracer<SimdSSE>;
+
+}
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif
+
+namespace RAYTRACING
+{
+
+const PacketKernels* GetPacketKernelsSSE()
+{
+#ifdef PACKET_SIMD_X86
+	static const PacketKernels kernels = { PACKET_ISA_SSE, "SSE4.1", SimdSSE::Width,
+		PacketTracer<SimdSSE>::Intersect, PacketTracer<SimdSSE>::Occluded };
+	return &kernels;
+#else
+	return NULL;
+#endif
+}
+
+}
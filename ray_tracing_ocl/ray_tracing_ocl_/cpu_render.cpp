@@ -0,0 +1,1347 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+#include "cpu_render.h"
+#include "primitives.h"
+
+#define RAYMAX  1.0e30f
+#define EPSILON 0.00001f
+#define INV_PI  0.318309886f
+#define TWO_PI  6.283185307f
+#define RAY_OFFSET 0.0001f
+
+#ifndef M_PI
+  // For some reason, MSVC doesn't define this when <cmath> is included
+  #define M_PI 3.14159265358979
+#endif
+
+// Same helpers as in ray_algorithm.cl so both paths read alike
+#define vinit(v, a, b, c) { (v).x = a; (v).y = b; (v).z = c; }
+#define vassign(a, b) vinit(a, (b).x, (b).y, (b).z)
+#define vclr(v) vinit(v, 0.f, 0.f, 0.f)
+#define vadd(v, a, b) vinit(v, (a).x + (b).x, (a).y + (b).y, (a).z + (b).z)
+#define vsub(v, a, b) vinit(v, (a).x - (b).x, (a).y - (b).y, (a).z - (b).z)
+#define vmul(v, a, b) vinit(v, (a).x * (b).x, (a).y * (b).y, (a).z * (b).z)
+#define vsmul(v, a, b) { float k = (a); vinit(v, k * (b).x, k * (b).y, k * (b).z) }
+#define vsdiv(v, a, b) { float k = (a); vinit(v, (b).x / k, (b).y / k, (b).z / k) }
+#define vdot(a, b) ((a).x * (b).x + (a).y * (b).y + (a).z * (b).z)
+#define vfilter(v) ((v).x > (v).y && (v).x > (v).z ? (v).x : (v).y > (v).z ? (v).y : (v).z)
+#define vnorm(v) { float l = 1.f / sqrtf(vdot(v, v)); vsmul(v, l, v); }
+#define vxcross(v, a, b) vinit(v, (a).y * (b).z - (a).z * (b).y, (a).z * (b).x - (a).x * (b).z, (a).x * (b).y - (a).y * (b).x)
+#define pcal(v, a, b, c) { vsmul(v, a, c); vadd(v, v, b);}
+#define vluminance(v) (0.2126f * (v).x + 0.7152f * (v).y + 0.0722f * (v).z)
+
+namespace RAYTRACING
+{
+
+// Everything the intersection routines read, like SceneData in the kernel.
+// packets is NULL when every ray is traced on its own.
+struct SceneData
+{
+	const SphereSet* scene;
+	const CompiledScene* compiled;
+	const SceneBVH* bvh;
+	const PacketKernels* packets;
+	PacketScene packetScene;
+};
+
+typedef struct Intersection{
+	Ray m_ray;
+	Color m_color;
+	Color m_emitted;
+	Vector m_normal;
+	float m_t;
+	int lastindex;
+}Intersection;
+
+static inline float clampUnit(float v)
+{
+	return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+}
+
+static inline float GetRandom(unsigned int *seed0, unsigned int *seed1)
+{
+	*seed0 = 36969 * ((*seed0) & 65535) + ((*seed0) >> 16);
+	*seed1 = 18000 * ((*seed1) & 65535) + ((*seed1) >> 16);
+
+	return ((*seed0 << 16) + *seed1) * 2.328306e-10f;
+}
+
+static Ray makeCameraRay(const CompiledCamera& cam, float xScreenPosTo1, float yScreenPosTo1)
+{
+	Vector right, up;
+	Ray ray;
+
+	vsmul(right, (xScreenPosTo1 - 0.5f), cam.m_right);
+	vsmul(up, (yScreenPosTo1 - 0.5f), cam.m_up);
+
+	ray.m_origin = cam.m_origin;
+	vadd(ray.m_direction, cam.m_forward, right);
+	vadd(ray.m_direction, ray.m_direction, up);
+	vnorm(ray.m_direction);
+	ray.m_tMax = RAYMAX;
+	return ray;
+}
+
+/*
+* As in the kernel, the *Distance tests find where ray hits a primitive, if that is in
+* [EPSILON, tMax), and write no hit record; the *Intersect tests fill the Intersection.
+*/
+static bool RectangleLightDistance(const CompiledLight& light, const Ray& ray, float tMax, float* tHit)
+{
+	float nDotD = vdot(light.m_normal, ray.m_direction);
+	if (nDotD == 0.0f)
+	{
+		return false;
+	}
+
+	float t = (light.m_planeDistance - vdot(ray.m_origin, light.m_normal)) / nDotD;
+
+	if (t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	Vector worldPoint, worldRelativePoint;
+	pcal(worldPoint, t, ray.m_origin, ray.m_direction);
+
+	vsub(worldRelativePoint, worldPoint, light.m_pos);
+
+	// Position across the light in units of its sides
+	float u = vdot(worldRelativePoint, light.m_side1Inv);
+	float v = vdot(worldRelativePoint, light.m_side2Inv);
+
+	if ((u < 0.0f) || (u > 1.0f) || (v < 0.0f) || (v > 1.0f))
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool RectangleLightIntersect(const CompiledLight& light, int index, Intersection* tmpIntersection)
+{
+	float t;
+	if (!RectangleLightDistance(light, tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	tmpIntersection->m_t = t;
+	tmpIntersection->lastindex = index;
+	tmpIntersection->m_normal = light.m_normal;
+	vclr(tmpIntersection->m_color);
+	tmpIntersection->m_emitted = light.m_emitted;
+
+	if (vdot(light.m_normal, tmpIntersection->m_ray.m_direction) > 0.0f)
+	{
+		vsmul(tmpIntersection->m_normal, -1.0f, tmpIntersection->m_normal);
+	}
+
+	return true;
+}
+
+static bool PlaneDistance(const CompiledPlane& plane, const Ray& ray, float tMax, float* tHit)
+{
+	float nDotD = vdot(plane.m_normal, ray.m_direction);
+	if (nDotD >= 0.0f)
+	{
+		return false;
+	}
+
+	float t = (plane.m_distance - vdot(ray.m_origin, plane.m_normal)) / nDotD;
+
+	if (t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool PlaneIntersect(const CompiledPlane& plane, Intersection* tmpIntersection)
+{
+	float t;
+	if (!PlaneDistance(plane, tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	tmpIntersection->m_t = t;
+	tmpIntersection->m_normal = plane.m_normal;
+	vclr(tmpIntersection->m_emitted);
+	tmpIntersection->m_color = plane.m_color;
+
+	return true;
+}
+
+/*
+* Record a hit on a non-emitting surface; the normal is turned to face the ray
+*/
+static inline void SetDiffuseHit(Intersection* tmpIntersection, float t, Vector normal, const Color& color)
+{
+	if (vdot(normal, tmpIntersection->m_ray.m_direction) > 0.0f)
+	{
+		vsmul(normal, -1.0f, normal);
+	}
+
+	tmpIntersection->m_t = t;
+	tmpIntersection->lastindex = -1;
+	tmpIntersection->m_normal = normal;
+	tmpIntersection->m_color = color;
+	vclr(tmpIntersection->m_emitted);
+}
+
+// Per-ray constants of the watertight ray/triangle test
+// (Woop, Benthin, Wald: "Watertight Ray/Triangle Intersection", JCGT 2013)
+typedef struct RayShear{
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+}RayShear;
+
+static void PrepareRayShear(const Vector& direction, RayShear* shear)
+{
+	float dir[3] = { direction.x, direction.y, direction.z };
+	float ax = fabsf(dir[0]), ay = fabsf(dir[1]), az = fabsf(dir[2]);
+
+	// kz is the dominant axis of the direction; swapping kx/ky keeps the winding
+	shear->kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	shear->kx = (shear->kz + 1) % 3;
+	shear->ky = (shear->kx + 1) % 3;
+	if (dir[shear->kz] < 0.0f)
+	{
+		std::swap(shear->kx, shear->ky);
+	}
+
+	shear->Sx = dir[shear->kx] / dir[shear->kz];
+	shear->Sy = dir[shear->ky] / dir[shear->kz];
+	shear->Sz = 1.0f / dir[shear->kz];
+}
+
+static bool TriangleDistance(const SphereSet* scene, unsigned int index, const RayShear* shear,
+	const Ray& ray, float tMax, float* tHit)
+{
+	const Triangle& triangle = scene->m_triangle[index];
+	const Point& p0 = scene->m_vertices[triangle.m_v0];
+	const Point& p1 = scene->m_vertices[triangle.m_v1];
+	const Point& p2 = scene->m_vertices[triangle.m_v2];
+	const Point& origin = ray.m_origin;
+
+	// Vertices relative to the ray origin, sheared so that the ray runs along +z
+	float A[3] = { p0.x - origin.x, p0.y - origin.y, p0.z - origin.z };
+	float B[3] = { p1.x - origin.x, p1.y - origin.y, p1.z - origin.z };
+	float C[3] = { p2.x - origin.x, p2.y - origin.y, p2.z - origin.z };
+
+	float Ax = A[shear->kx] - shear->Sx * A[shear->kz];
+	float Ay = A[shear->ky] - shear->Sy * A[shear->kz];
+	float Bx = B[shear->kx] - shear->Sx * B[shear->kz];
+	float By = B[shear->ky] - shear->Sy * B[shear->kz];
+	float Cx = C[shear->kx] - shear->Sx * C[shear->kz];
+	float Cy = C[shear->ky] - shear->Sy * C[shear->kz];
+
+	// Scaled barycentrics; edges shared by two triangles give the same value with opposite sign
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+
+	if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+	{
+		return false;
+	}
+
+	float det = U + V + W;
+	if (det == 0.0f)
+	{
+		return false;
+	}
+
+	float T = U * shear->Sz * A[shear->kz] + V * shear->Sz * B[shear->kz] + W * shear->Sz * C[shear->kz];
+	float t = T / det;
+
+	if (t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool TriangleIntersect(const SphereSet* scene, unsigned int index, const RayShear* shear, Intersection* tmpIntersection)
+{
+	float t;
+	if (!TriangleDistance(scene, index, shear, tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	const Triangle& triangle = scene->m_triangle[index];
+	const Point& p0 = scene->m_vertices[triangle.m_v0];
+	const Point& p1 = scene->m_vertices[triangle.m_v1];
+	const Point& p2 = scene->m_vertices[triangle.m_v2];
+	Vector edge1, edge2, normal;
+	vsub(edge1, p1, p0);
+	vsub(edge2, p2, p0);
+	vxcross(normal, edge1, edge2); vnorm(normal);
+
+	SetDiffuseHit(tmpIntersection, t, normal, scene->m_meshColor[triangle.m_mesh]);
+	return true;
+}
+
+static bool SphereDistance(const SphereSet* scene, unsigned int index, const Ray& ray, float tMax, float* tHit)
+{
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Point center = PrimitivePoint(scene->m_primData, layout.m_sphereCenter, layout.m_sphereCount, index);
+	float radius = scene->m_primData[layout.m_sphereRadius + index];
+
+	// |o + t*d - c|^2 = r^2 with |d| = 1
+	Vector oc;
+	vsub(oc, ray.m_origin, center);
+	float b = vdot(oc, ray.m_direction);
+	float c = vdot(oc, oc) - radius * radius;
+	float discriminant = b * b - c;
+	if (discriminant < 0.0f)
+	{
+		return false;
+	}
+
+	float root = sqrtf(discriminant);
+	float t = -b - root;
+	if (t < EPSILON)
+	{
+		t = -b + root;
+	}
+	if (t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool SphereIntersect(const SphereSet* scene, unsigned int index, Intersection* tmpIntersection)
+{
+	float t;
+	if (!SphereDistance(scene, index, tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Point center = PrimitivePoint(scene->m_primData, layout.m_sphereCenter, layout.m_sphereCount, index);
+	Vector hitPoint, normal;
+	pcal(hitPoint, t, tmpIntersection->m_ray.m_origin, tmpIntersection->m_ray.m_direction);
+	vsub(normal, hitPoint, center); vnorm(normal);
+
+	SetDiffuseHit(tmpIntersection, t, normal,
+		scene->m_material[PrimitiveMaterial(scene->m_primData, layout.m_sphereMaterial, index)]);
+	return true;
+}
+
+static bool DiscDistance(const SphereSet* scene, unsigned int index, const Ray& ray, float tMax, float* tHit)
+{
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Point center = PrimitivePoint(scene->m_primData, layout.m_discCenter, layout.m_discCount, index);
+	Vector normal = PrimitivePoint(scene->m_primData, layout.m_discNormal, layout.m_discCount, index);
+	float radius = scene->m_primData[layout.m_discRadius + index];
+
+	float nDotD = vdot(normal, ray.m_direction);
+	if (nDotD == 0.0f)
+	{
+		return false;
+	}
+
+	Vector toCenter;
+	vsub(toCenter, center, ray.m_origin);
+	float t = vdot(toCenter, normal) / nDotD;
+	if (t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	Vector hitPoint, offset;
+	pcal(hitPoint, t, ray.m_origin, ray.m_direction);
+	vsub(offset, hitPoint, center);
+	if (vdot(offset, offset) > radius * radius)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool DiscIntersect(const SphereSet* scene, unsigned int index, Intersection* tmpIntersection)
+{
+	float t;
+	if (!DiscDistance(scene, index, tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Vector normal = PrimitivePoint(scene->m_primData, layout.m_discNormal, layout.m_discCount, index);
+
+	SetDiffuseHit(tmpIntersection, t, normal,
+		scene->m_material[PrimitiveMaterial(scene->m_primData, layout.m_discMaterial, index)]);
+	return true;
+}
+
+// hitAxis receives the axis of the box face that is hit
+static bool AxisBoxDistance(const SphereSet* scene, unsigned int index, const Ray& ray, float tMax,
+	float* tHit, int* hitAxis)
+{
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Point boxMin = PrimitivePoint(scene->m_primData, layout.m_boxMin, layout.m_boxCount, index);
+	Point boxMax = PrimitivePoint(scene->m_primData, layout.m_boxMax, layout.m_boxCount, index);
+	const Point& origin = ray.m_origin;
+	const Vector& direction = ray.m_direction;
+
+	float lo[3] = { boxMin.x, boxMin.y, boxMin.z };
+	float hi[3] = { boxMax.x, boxMax.y, boxMax.z };
+	float o[3] = { origin.x, origin.y, origin.z };
+	float d[3] = { direction.x, direction.y, direction.z };
+
+	// Slab test that remembers which axis bounds the entry and the exit
+	float tNear = -RAYMAX, tFar = RAYMAX;
+	int nearAxis = 0, farAxis = 0;
+	for (int a = 0; a < 3; a++)
+	{
+		if (d[a] == 0.0f)
+		{
+			if (o[a] < lo[a] || o[a] > hi[a])
+				return false;
+			continue;
+		}
+		float t0 = (lo[a] - o[a]) / d[a];
+		float t1 = (hi[a] - o[a]) / d[a];
+		if (t0 > t1)
+			std::swap(t0, t1);
+		if (t0 > tNear)
+		{
+			tNear = t0;
+			nearAxis = a;
+		}
+		if (t1 < tFar)
+		{
+			tFar = t1;
+			farAxis = a;
+		}
+	}
+	if (tNear > tFar)
+	{
+		return false;
+	}
+
+	// Rays starting inside the box hit its far side
+	float t = tNear;
+	int axis = nearAxis;
+	if (t < EPSILON)
+	{
+		t = tFar;
+		axis = farAxis;
+	}
+	if (t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	*hitAxis = axis;
+	return true;
+}
+
+static bool AxisBoxIntersect(const SphereSet* scene, unsigned int index, Intersection* tmpIntersection)
+{
+	float t;
+	int axis;
+	if (!AxisBoxDistance(scene, index, tmpIntersection->m_ray, tmpIntersection->m_t, &t, &axis))
+	{
+		return false;
+	}
+
+	const PrimitiveLayout& layout = scene->m_primLayout;
+	Vector normal;
+	vclr(normal);
+	if (axis == 0) normal.x = 1.0f;
+	else if (axis == 1) normal.y = 1.0f;
+	else normal.z = 1.0f;
+
+	SetDiffuseHit(tmpIntersection, t, normal,
+		scene->m_material[PrimitiveMaterial(scene->m_primData, layout.m_boxMaterial, index)]);
+	return true;
+}
+
+static bool intersectPrimitive(unsigned int ref, Intersection* tmpIntersection, const SceneData* data, const RayShear* shear)
+{
+	const SphereSet* scene = data->scene;
+	unsigned int index = ref & PRIM_INDEX_MASK;
+
+	switch (ref >> PRIM_TYPE_SHIFT)
+	{
+	case PRIM_RECT_LIGHT:
+		return RectangleLightIntersect(data->compiled->lights[index], (int)index, tmpIntersection);
+	case PRIM_TRIANGLE:
+		return TriangleIntersect(scene, index, shear, tmpIntersection);
+	case PRIM_SPHERE:
+		return SphereIntersect(scene, index, tmpIntersection);
+	case PRIM_DISC:
+		return DiscIntersect(scene, index, tmpIntersection);
+	case PRIM_BOX:
+		return AxisBoxIntersect(scene, index, tmpIntersection);
+	default:
+		return false;
+	}
+}
+
+/*
+* Slab test against a node box; tEntry receives the distance where the ray enters the box
+*/
+static inline bool BoxIntersect(const BVHNode& node, const Point& origin, const Vector& invDir, float tMax, float* tEntry)
+{
+	float t0 = (node.m_boundsMin[0] - origin.x) * invDir.x;
+	float t1 = (node.m_boundsMax[0] - origin.x) * invDir.x;
+	float tNear = std::min(t0, t1), tFar = std::max(t0, t1);
+
+	t0 = (node.m_boundsMin[1] - origin.y) * invDir.y;
+	t1 = (node.m_boundsMax[1] - origin.y) * invDir.y;
+	tNear = std::max(tNear, std::min(t0, t1)); tFar = std::min(tFar, std::max(t0, t1));
+
+	t0 = (node.m_boundsMin[2] - origin.z) * invDir.z;
+	t1 = (node.m_boundsMax[2] - origin.z) * invDir.z;
+	tNear = std::max(tNear, std::min(t0, t1)); tFar = std::min(tFar, std::max(t0, t1));
+
+	*tEntry = tNear;
+	return tNear <= tFar && tFar >= 0.0f && tNear < tMax;
+}
+
+static inline float SafeInverse(float d)
+{
+	return 1.0f / (fabsf(d) > 1.0e-20f ? d : (d < 0.0f ? -1.0e-20f : 1.0e-20f));
+}
+
+/*
+* Closest-hit traversal of the BVH, nearer child first.
+* Primitive tests only accept hits closer than m_t, so the result is the same as testing everything.
+*/
+static bool intersectBVH(Intersection* tmpIntersection, const SceneData* data)
+{
+	const SceneBVH* bvh = data->bvh;
+	if (bvh->nodeCount == 0)
+		return false;
+
+	const BVHNode* nodes = bvh->nodeData;
+	const unsigned int* primRefs = bvh->primRefData;
+	const Point origin = tmpIntersection->m_ray.m_origin;
+	Vector invDir;
+	vinit(invDir, SafeInverse(tmpIntersection->m_ray.m_direction.x),
+		SafeInverse(tmpIntersection->m_ray.m_direction.y),
+		SafeInverse(tmpIntersection->m_ray.m_direction.z));
+	RayShear shear;
+	PrepareRayShear(tmpIntersection->m_ray.m_direction, &shear);
+
+	int stack[BVH_STACK_SIZE];
+	float stackEntry[BVH_STACK_SIZE];
+	int stackSize = 0;
+	bool intersectedAny = false;
+
+	float tEntry;
+	if (!BoxIntersect(nodes[0], origin, invDir, tmpIntersection->m_t, &tEntry))
+		return false;
+
+	int nodeIndex = 0;
+	for (;;)
+	{
+		const BVHNode& node = nodes[nodeIndex];
+
+		if (node.m_primCount > 0)
+		{
+			for (int k = 0; k < node.m_primCount; k++)
+			{
+				if (intersectPrimitive(primRefs[node.m_offset + k], tmpIntersection, data, &shear))
+				{
+					intersectedAny = true;
+				}
+			}
+		}
+		else
+		{
+			int left = nodeIndex + 1;
+			int right = node.m_offset;
+			float tLeft, tRight;
+			bool hitLeft = BoxIntersect(nodes[left], origin, invDir, tmpIntersection->m_t, &tLeft);
+			bool hitRight = BoxIntersect(nodes[right], origin, invDir, tmpIntersection->m_t, &tRight);
+
+			if (hitLeft && hitRight)
+			{
+				if (tRight < tLeft)
+				{
+					std::swap(left, right);
+					std::swap(tLeft, tRight);
+				}
+				stack[stackSize] = right;
+				stackEntry[stackSize] = tRight;
+				stackSize++;
+				nodeIndex = left;
+				continue;
+			}
+			if (hitLeft || hitRight)
+			{
+				nodeIndex = hitLeft ? left : right;
+				continue;
+			}
+		}
+
+		// Pop the next node that can still hold a closer hit
+		do
+		{
+			if (stackSize == 0)
+				return intersectedAny;
+			stackSize--;
+			nodeIndex = stack[stackSize];
+		} while (stackEntry[stackSize] >= tmpIntersection->m_t);
+	}
+}
+
+static bool intersect(Intersection* tmpIntersection, const SceneData* data)
+{
+	const std::vector<CompiledPlane>& planes = data->compiled->planes;
+	bool intersectedAny = false;
+
+	// Planes are unbounded and stay out of the BVH
+	for (size_t i = 0; i < planes.size(); i++)
+	{
+		if (PlaneIntersect(planes[i], tmpIntersection))
+		{
+			intersectedAny = true;
+		}
+	}
+
+	if (intersectBVH(tmpIntersection, data))
+	{
+		intersectedAny = true;
+	}
+
+	return intersectedAny;
+}
+
+// Any-hit counterpart of intersectPrimitive; light ignoreLight doesn't block the ray
+static bool occludedPrimitive(unsigned int ref, const Ray& ray, float tMax, int ignoreLight,
+	const SceneData* data, const RayShear* shear)
+{
+	const SphereSet* scene = data->scene;
+	unsigned int index = ref & PRIM_INDEX_MASK;
+	float t;
+	int axis;
+
+	switch (ref >> PRIM_TYPE_SHIFT)
+	{
+	case PRIM_RECT_LIGHT:
+		return (int)index != ignoreLight && RectangleLightDistance(data->compiled->lights[index], ray, tMax, &t);
+	case PRIM_TRIANGLE:
+		return TriangleDistance(scene, index, shear, ray, tMax, &t);
+	case PRIM_SPHERE:
+		return SphereDistance(scene, index, ray, tMax, &t);
+	case PRIM_DISC:
+		return DiscDistance(scene, index, ray, tMax, &t);
+	case PRIM_BOX:
+		return AxisBoxDistance(scene, index, ray, tMax, &t, &axis);
+	default:
+		return false;
+	}
+}
+
+/*
+* Any-hit traversal of the BVH, nearer child first; done at the first primitive closer than tMax
+*/
+static bool occludedBVH(const SceneData* data, const Ray& ray, float tMax, int ignoreLight)
+{
+	const SceneBVH* bvh = data->bvh;
+	if (bvh->nodeCount == 0)
+		return false;
+
+	const BVHNode* nodes = bvh->nodeData;
+	const unsigned int* primRefs = bvh->primRefData;
+	Vector invDir;
+	vinit(invDir, SafeInverse(ray.m_direction.x), SafeInverse(ray.m_direction.y), SafeInverse(ray.m_direction.z));
+	RayShear shear;
+	PrepareRayShear(ray.m_direction, &shear);
+
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	float tEntry;
+	if (!BoxIntersect(nodes[0], ray.m_origin, invDir, tMax, &tEntry))
+		return false;
+
+	int nodeIndex = 0;
+	for (;;)
+	{
+		const BVHNode& node = nodes[nodeIndex];
+
+		if (node.m_primCount > 0)
+		{
+			for (int k = 0; k < node.m_primCount; k++)
+			{
+				if (occludedPrimitive(primRefs[node.m_offset + k], ray, tMax, ignoreLight, data, &shear))
+					return true;
+			}
+		}
+		else
+		{
+			int left = nodeIndex + 1;
+			int right = node.m_offset;
+			float tLeft, tRight;
+			bool hitLeft = BoxIntersect(nodes[left], ray.m_origin, invDir, tMax, &tLeft);
+			bool hitRight = BoxIntersect(nodes[right], ray.m_origin, invDir, tMax, &tRight);
+
+			if (hitLeft && hitRight)
+			{
+				if (tRight < tLeft)
+					std::swap(left, right);
+				stack[stackSize++] = right;
+				nodeIndex = left;
+				continue;
+			}
+			if (hitLeft || hitRight)
+			{
+				nodeIndex = hitLeft ? left : right;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			return false;
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+/*
+* Any-hit query for shadow rays, see occluded in the kernel: whether anything but light
+* ignoreLight (-1 for none) lies on ray closer than tMax
+*/
+static bool occluded(const SceneData* data, const Ray& ray, float tMax, int ignoreLight)
+{
+	const std::vector<CompiledPlane>& planes = data->compiled->planes;
+	float t;
+
+	for (size_t i = 0; i < planes.size(); i++)
+	{
+		if (PlaneDistance(planes[i], ray, tMax, &t))
+			return true;
+	}
+
+	return occludedBVH(data, ray, tMax, ignoreLight);
+}
+
+static void sampleSurface(const CompiledLight& light, float u1, float u2,
+	const Point* referencePosition, Point* outPosition, Vector* outNormal)
+{
+	Point tmp;
+	*outNormal = light.m_normal;
+
+	vsmul(tmp, u1, light.m_side1); vadd(*outPosition, light.m_pos, tmp);
+
+	vsmul(tmp, u2, light.m_side2); vadd(*outPosition, *outPosition, tmp);
+
+	vsub(tmp, *outPosition, *referencePosition);
+
+	if (vdot(*outNormal, tmp) > 0.0f)
+	{
+		vsmul(*outNormal, -1.0f, *outNormal);
+	}
+}
+
+static void InitIntersection(Intersection* tmpIntersection, const Ray& ray)
+{
+	tmpIntersection->m_ray = ray;
+	tmpIntersection->m_t = ray.m_tMax;
+	vclr(tmpIntersection->m_color);
+	vclr(tmpIntersection->m_emitted);
+	vclr(tmpIntersection->m_normal);
+	tmpIntersection->lastindex = -1;
+}
+
+// Orthonormal basis around the unit vector n, as makeBasis in the kernel
+static void makeBasis(const Vector& n, Vector* tangent, Vector* bitangent)
+{
+	float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+	float a = -1.0f / (sign + n.z);
+	float b = n.x * n.y * a;
+	vinit(*tangent, 1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+	vinit(*bitangent, b, sign + n.y * n.y * a, -n.y);
+}
+
+// Cosine-weighted direction around the normal; its density is dot(normal, direction) / pi
+static Vector sampleCosineHemisphere(const Vector& normal, float u1, float u2)
+{
+	Vector tangent, bitangent, direction, tmp;
+	makeBasis(normal, &tangent, &bitangent);
+
+	float r = sqrtf(u1);
+	float phi = TWO_PI * u2;
+	vsmul(direction, sqrtf(std::max(0.0f, 1.0f - u1)), normal);
+	vsmul(tmp, r * cosf(phi), tangent); vadd(direction, direction, tmp);
+	vsmul(tmp, r * sinf(phi), bitangent); vadd(direction, direction, tmp);
+	return direction;
+}
+
+// Power heuristic (beta = 2) weight of the strategy with density pdf against the other one
+static inline float powerHeuristic(float pdf, float otherPdf)
+{
+	float a = pdf * pdf;
+	float b = otherPdf * otherPdf;
+	return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+// Solid angle density of sampling a point on light, 0 if it can't be sampled
+static inline float lightPdf(const CompiledLight& light, float distance, float cosLight)
+{
+	if (cosLight <= 0.0f || light.m_area <= 0.0f)
+		return 0.0f;
+	return distance * distance / (cosLight * light.m_area);
+}
+
+/*
+* Next-event estimation toward light, see sampleLight in the kernel: selectPdf is the chance of
+* sampling light times the light samples per hit. Fills shadowRay and the MIS-weighted
+* contribution that counts if the light is visible
+*/
+static bool sampleLight(const CompiledLight& light, float u1, float u2, float selectPdf, const Point& position,
+	const Vector& normal, const Color& albedo, Ray* shadowRay, Color* contribution)
+{
+	Point lightPoint;
+	Vector lightNormal;
+	sampleSurface(light, u1, u2, &position, &lightPoint, &lightNormal);
+
+	Vector toLight; vsub(toLight, lightPoint, position);
+	float lightDistance = sqrtf(vdot(toLight, toLight));
+	if (lightDistance <= 0.0f)
+		return false;
+	vsdiv(toLight, lightDistance, toLight);
+
+	float cosSurface = vdot(normal, toLight);
+	float pdf = selectPdf * lightPdf(light, lightDistance, -vdot(lightNormal, toLight));
+	if (cosSurface <= 0.0f || pdf <= 0.0f)
+		return false;
+
+	float weight = powerHeuristic(pdf, cosSurface * INV_PI);
+	vmul(*contribution, albedo, light.m_emitted);
+	vsmul(*contribution, weight * cosSurface * INV_PI / pdf, *contribution);
+
+	shadowRay->m_origin = position;
+	shadowRay->m_direction = toLight;
+	shadowRay->m_tMax = lightDistance;
+	return true;
+}
+
+/*
+* MIS weight of light j found at distance t by a cosine-sampled bounce that left the hit with
+* normal at ray's origin; camera rays (bsdfPdf 0) take it all
+*/
+static inline float emissionWeight(const SceneData* data, int j, const Ray& ray, float t,
+	const Vector& normal, float bsdfPdf)
+{
+	if (bsdfPdf <= 0.0f)
+		return 1.0f;
+	const LightSelection& selection = data->compiled->lightSelection;
+	const CompiledLight& light = data->compiled->lights[j];
+	float selectPdf = selection.samples * LightSelectPdf(selection, ray.m_origin, normal, (unsigned int)j);
+	return powerHeuristic(bsdfPdf, selectPdf * lightPdf(light, t, fabsf(vdot(light.m_normal, ray.m_direction))));
+}
+
+// Russian roulette from bounce PATH_RR_DEPTH on, as in the kernel
+static bool russianRoulette(unsigned int depth, Color* throughput, unsigned int* seed0, unsigned int* seed1)
+{
+	if (depth + 1 < PATH_RR_DEPTH)
+		return true;
+
+	float survive = std::min((float)vfilter(*throughput), 0.95f);
+	if (survive <= 0.0f || GetRandom(seed0, seed1) >= survive)
+		return false;
+	vsdiv(*throughput, survive, *throughput);
+	return true;
+}
+
+// State of one path between its bounces
+struct PathState
+{
+	Ray ray;
+	Color radiance;
+	Color throughput;
+	float bsdfPdf;
+	Vector lastNormal;
+};
+
+static void InitPath(PathState* path, const Ray& ray)
+{
+	path->ray = ray;
+	vclr(path->radiance);
+	vinit(path->throughput, 1.0f, 1.0f, 1.0f);
+	path->bsdfPdf = 0.0f;
+	vclr(path->lastNormal);
+}
+
+/*
+* Add the emission of a light hit. Returns whether the path goes on from the hit,
+* with position set to the hit point moved off the surface
+*/
+static bool ShadeHit(const SceneData* data, PathState* path, const Intersection& intersection,
+	unsigned int depth, unsigned int maxDepth, Point* position)
+{
+	// Lights don't reflect, so a path ends on them
+	if (intersection.lastindex >= 0)
+	{
+		Color tmp;
+		vmul(tmp, path->throughput, intersection.m_emitted);
+		vsmul(tmp, emissionWeight(data, intersection.lastindex, path->ray, intersection.m_t, path->lastNormal,
+			path->bsdfPdf), tmp);
+		vadd(path->radiance, path->radiance, tmp);
+		return false;
+	}
+
+	if (depth >= maxDepth)
+		return false;
+
+	pcal(*position, intersection.m_t, intersection.m_ray.m_origin, intersection.m_ray.m_direction);
+	Vector offset;
+	vsmul(offset, RAY_OFFSET, intersection.m_normal);
+	vadd(*position, *position, offset);
+	return true;
+}
+
+/*
+* One light sample of next-event estimation at position. Fills the shadow ray, the light it
+* goes to and the contribution to the path if nothing blocks it; false if it adds nothing anyway
+*/
+static bool SampleShadow(const SceneData* data, const PathState& path, const Intersection& intersection,
+	const Point& position, unsigned int* seed0, unsigned int* seed1, Ray* shadowRay, Color* contribution, int* light)
+{
+	const LightSelection& selection = data->compiled->lightSelection;
+	float pmf;
+	int j = SelectLight(selection, position, intersection.m_normal, GetRandom(seed0, seed1), &pmf);
+	float u1 = GetRandom(seed0, seed1);
+	float u2 = GetRandom(seed0, seed1);
+	if (j < 0 || !sampleLight(data->compiled->lights[j], u1, u2, pmf * selection.samples, position,
+		intersection.m_normal, intersection.m_color, shadowRay, contribution))
+	{
+		return false;
+	}
+
+	vmul(*contribution, *contribution, path.throughput);
+	*light = j;
+	return true;
+}
+
+// Russian roulette and the cosine-sampled bounce from position; false when the path ends
+static bool ScatterPath(PathState* path, const Intersection& intersection, const Point& position,
+	unsigned int depth, unsigned int* seed0, unsigned int* seed1)
+{
+	if (!russianRoulette(depth, &path->throughput, seed0, seed1))
+		return false;
+
+	float u1 = GetRandom(seed0, seed1);
+	float u2 = GetRandom(seed0, seed1);
+	path->ray.m_origin = position;
+	path->ray.m_direction = sampleCosineHemisphere(intersection.m_normal, u1, u2);
+	path->ray.m_tMax = RAYMAX;
+	path->bsdfPdf = vdot(intersection.m_normal, path->ray.m_direction) * INV_PI;
+	path->lastNormal = intersection.m_normal;
+	vmul(path->throughput, path->throughput, intersection.m_color);
+	return path->bsdfPdf > 0.0f;
+}
+
+// Trace path from its bounce depth on, ray by ray; the rays traced are added to rayCount
+static void ContinuePath(const SceneData* data, PathState* path, unsigned int depth, unsigned int maxDepth,
+	unsigned int* seed0, unsigned int* seed1, unsigned int* rayCount)
+{
+	const LightSelection& selection = data->compiled->lightSelection;
+
+	for (; ; depth++)
+	{
+		Intersection intersection;
+		InitIntersection(&intersection, path->ray);
+		rayCount[RAY_COUNT_CLOSEST]++;
+		if (!intersect(&intersection, data))
+			break;
+
+		Point position;
+		if (!ShadeHit(data, path, intersection, depth, maxDepth, &position))
+			break;
+
+		for (unsigned int s = 0; s < selection.samples; s++)
+		{
+			Ray shadowRay;
+			Color contribution;
+			int j;
+			if (!SampleShadow(data, *path, intersection, position, seed0, seed1, &shadowRay, &contribution, &j))
+				continue;
+
+			rayCount[RAY_COUNT_SHADOW]++;
+			if (!occluded(data, shadowRay, shadowRay.m_tMax, j))
+			{
+				vadd(path->radiance, path->radiance, contribution);
+			}
+		}
+
+		if (!ScatterPath(path, intersection, position, depth, seed0, seed1))
+			break;
+	}
+}
+
+/*
+* CPU counterpart of tracePath in the kernel: one sample of the camera ray with up to
+* maxDepth diffuse bounces, next-event estimation toward the selected lights and MIS
+*/
+static Color TracePath(const SceneData* data, const Ray& ray, unsigned int maxDepth,
+	unsigned int* seed0, unsigned int* seed1, unsigned int* rayCount)
+{
+	PathState path;
+	InitPath(&path, ray);
+	ContinuePath(data, &path, 0, maxDepth, seed0, seed1, rayCount);
+	return path.radiance;
+}
+
+/*
+* CPU counterpart of one ray_cal work item; returns the sum of the samples
+* and the sum of their squared luminance in luminanceSq
+*/
+static Color RenderPixel(const SceneData* data, unsigned int sampleCount, unsigned int maxDepth,
+	unsigned int width, unsigned int height, unsigned int x, unsigned int y,
+	unsigned int* seed0, unsigned int* seed1, float* luminanceSq, unsigned int* rayCount)
+{
+	Color pixelColor;
+	vclr(pixelColor);
+	*luminanceSq = 0.0f;
+
+	for (unsigned int i = 0; i < sampleCount; i++)
+	{
+		float yu = 1.0f - ((y + GetRandom(seed0, seed1)) / (height - 1));
+		float xu = (x + GetRandom(seed0, seed1)) / (width - 1);
+
+		Color sampleColor = TracePath(data, makeCameraRay(data->compiled->camera, xu, yu), maxDepth, seed0, seed1, rayCount);
+
+		vadd(pixelColor, pixelColor, sampleColor);
+		float luminance = vluminance(sampleColor);
+		*luminanceSq += luminance * luminance;
+	}
+
+	return pixelColor;
+}
+
+void InitCPUFrame(CPUFrame* frame, unsigned int width, unsigned int height,
+	const unsigned int* seeds, unsigned int seedCount)
+{
+	frame->width = width;
+	frame->height = height;
+	frame->accum.assign((size_t)width * height * 4, 0.0f);
+	frame->accumSq.assign((size_t)width * height, 0.0f);
+	frame->seeds.resize((size_t)width * height * 2);
+
+	for (unsigned int p = 0; p < width * height; p++)
+	{
+		// Pixel p takes the seed pair of work item (p % seedCount) like the OpenCL path,
+		// offset by its stage so that the stages don't repeat each other
+		unsigned int offset = p % seedCount;
+		unsigned int stage = p / seedCount;
+		unsigned int seed0 = seeds[2 * offset] + stage * 7919;
+		unsigned int seed1 = seeds[2 * offset + 1] + stage * 104729;
+		frame->seeds[2 * p] = seed0 < 2 ? 2 : seed0;
+		frame->seeds[2 * p + 1] = seed1 < 2 ? 2 : seed1;
+	}
+}
+
+// Add a pass of sampleCount samples of pixel p to the running sums of frame and show the mean so far
+static void AccumulatePixel(CPUFrame* frame, unsigned int p, const Color& color, float luminanceSq,
+	unsigned int sampleCount, unsigned int* pixels)
+{
+	float* sum = &frame->accum[4 * p];
+	sum[0] += color.x;
+	sum[1] += color.y;
+	sum[2] += color.z;
+	sum[3] += (float)sampleCount;
+	frame->accumSq[p] += luminanceSq;
+
+	unsigned char r, g, b;
+	r = (unsigned char)(clampUnit(sum[0] / sum[3]) * 255.0f);
+	g = (unsigned char)(clampUnit(sum[1] / sum[3]) * 255.0f);
+	b = (unsigned char)(clampUnit(sum[2] / sum[3]) * 255.0f);
+	pixels[p] = (r << 16) + (g << 8) + b;
+}
+
+/*
+* Render pixel p of frame and update its sums and its entry of pixels
+*/
+static void RenderFramePixel(const SceneData* data, unsigned int sampleCount, unsigned int maxDepth,
+	CPUFrame* frame, unsigned int p, unsigned int* pixels, unsigned int* rayCount)
+{
+	unsigned int width = frame->width;
+	float luminanceSq;
+	Color color = RenderPixel(data, sampleCount, maxDepth, width, frame->height, p % width, p / width,
+		&frame->seeds[2 * p], &frame->seeds[2 * p + 1], &luminanceSq, rayCount);
+
+	AccumulatePixel(frame, p, color, luminanceSq, sampleCount, pixels);
+}
+
+static inline void SetPacketRay(PacketRays* rays, unsigned int lane, const Ray& ray, int ignoreLight)
+{
+	rays->originX[lane] = ray.m_origin.x;
+	rays->originY[lane] = ray.m_origin.y;
+	rays->originZ[lane] = ray.m_origin.z;
+	rays->directionX[lane] = ray.m_direction.x;
+	rays->directionY[lane] = ray.m_direction.y;
+	rays->directionZ[lane] = ray.m_direction.z;
+	rays->tMax[lane] = ray.m_tMax;
+	rays->ignoreLight[lane] = ignoreLight;
+}
+
+/*
+* Hit record of a packet lane whose closest hit is ref: the scalar test of that primitive finds
+* the same hit. Falls back to the whole scene should its rounding disagree with the packet's.
+*/
+static bool PacketHitRecord(const SceneData* data, unsigned int ref, Intersection* intersection)
+{
+	bool found;
+	if ((ref >> PRIM_TYPE_SHIFT) == PACKET_HIT_PLANE)
+	{
+		found = PlaneIntersect(data->compiled->planes[ref & PRIM_INDEX_MASK], intersection);
+	}
+	else
+	{
+		RayShear shear;
+		PrepareRayShear(intersection->m_ray.m_direction, &shear);
+		found = intersectPrimitive(ref, intersection, data, &shear);
+	}
+
+	if (found)
+		return true;
+	InitIntersection(intersection, intersection->m_ray);
+	return intersect(intersection, data);
+}
+
+/*
+* RenderFramePixel for the count pixels in group, count at most the packet width. The camera
+* rays of each sample go through the scene as one packet, and so do their shadow rays;
+* the later bounces are incoherent and traced ray by ray. Every pixel draws the same random
+* numbers in the same order as with RenderFramePixel.
+*/
+static void RenderFramePacket(const SceneData* data, unsigned int sampleCount, unsigned int maxDepth,
+	CPUFrame* frame, const unsigned int* group, unsigned int count, unsigned int* pixels, unsigned int* rayCount)
+{
+	const PacketKernels* packets = data->packets;
+	const LightSelection& selection = data->compiled->lightSelection;
+	unsigned int width = frame->width;
+	unsigned int height = frame->height;
+
+	PacketRays rays;
+	PacketHits hits;
+	PathState paths[PACKET_MAX_WIDTH];
+	Intersection intersections[PACKET_MAX_WIDTH];
+	Point positions[PACKET_MAX_WIDTH];
+	Color contributions[PACKET_MAX_WIDTH];
+	Color pixelColor[PACKET_MAX_WIDTH];
+	float luminanceSq[PACKET_MAX_WIDTH];
+
+	memset(&rays, 0, sizeof(rays));
+	for (unsigned int lane = 0; lane < count; lane++)
+	{
+		vclr(pixelColor[lane]);
+		luminanceSq[lane] = 0.0f;
+	}
+
+	for (unsigned int i = 0; i < sampleCount; i++)
+	{
+		for (unsigned int lane = 0; lane < count; lane++)
+		{
+			unsigned int p = group[lane];
+			unsigned int* seed0 = &frame->seeds[2 * p];
+			unsigned int* seed1 = &frame->seeds[2 * p + 1];
+			float yu = 1.0f - ((p / width + GetRandom(seed0, seed1)) / (height - 1));
+			float xu = (p % width + GetRandom(seed0, seed1)) / (width - 1);
+
+			InitPath(&paths[lane], makeCameraRay(data->compiled->camera, xu, yu));
+			SetPacketRay(&rays, lane, paths[lane].ray, -1);
+		}
+		rays.active = (1u << count) - 1;
+		packets->intersect(&data->packetScene, &rays, &hits);
+		rayCount[RAY_COUNT_CLOSEST] += count;
+
+		unsigned int shading = 0;
+		for (unsigned int lane = 0; lane < count; lane++)
+		{
+			InitIntersection(&intersections[lane], paths[lane].ray);
+			if (((hits.hit >> lane) & 1) && PacketHitRecord(data, hits.ref[lane], &intersections[lane])
+				&& ShadeHit(data, &paths[lane], intersections[lane], 0, maxDepth, &positions[lane]))
+			{
+				shading |= 1u << lane;
+			}
+		}
+
+		// Light sample s of every lane still going makes one packet of shadow rays
+		for (unsigned int s = 0; s < selection.samples && shading; s++)
+		{
+			rays.active = 0;
+			for (unsigned int lane = 0; lane < count; lane++)
+			{
+				unsigned int p = group[lane];
+				Ray shadowRay;
+				int j;
+				if (((shading >> lane) & 1) && SampleShadow(data, paths[lane], intersections[lane], positions[lane],
+					&frame->seeds[2 * p], &frame->seeds[2 * p + 1], &shadowRay, &contributions[lane], &j))
+				{
+					SetPacketRay(&rays, lane, shadowRay, j);
+					rays.active |= 1u << lane;
+				}
+			}
+			if (rays.active == 0)
+				continue;
+
+			for (unsigned int active = rays.active; active; active &= active - 1)
+				rayCount[RAY_COUNT_SHADOW]++;
+			unsigned int visible = rays.active & ~packets->occluded(&data->packetScene, &rays);
+			for (unsigned int lane = 0; lane < count; lane++)
+			{
+				if ((visible >> lane) & 1)
+					vadd(paths[lane].radiance, paths[lane].radiance, contributions[lane]);
+			}
+		}
+
+		for (unsigned int lane = 0; lane < count; lane++)
+		{
+			unsigned int p = group[lane];
+			unsigned int* seed0 = &frame->seeds[2 * p];
+			unsigned int* seed1 = &frame->seeds[2 * p + 1];
+			if (((shading >> lane) & 1) && ScatterPath(&paths[lane], intersections[lane], positions[lane], 0, seed0, seed1))
+			{
+				ContinuePath(data, &paths[lane], 1, maxDepth, seed0, seed1, rayCount);
+			}
+
+			vadd(pixelColor[lane], pixelColor[lane], paths[lane].radiance);
+			float luminance = vluminance(paths[lane].radiance);
+			luminanceSq[lane] += luminance * luminance;
+		}
+	}
+
+	for (unsigned int lane = 0; lane < count; lane++)
+	{
+		AccumulatePixel(frame, group[lane], pixelColor[lane], luminanceSq[lane], sampleCount, pixels);
+	}
+}
+
+static void InitPacketScene(const SphereSet* scene, const CompiledScene* compiled, const SceneBVH* bvh,
+	PacketScene* packetScene)
+{
+	packetScene->lights = compiled->lights.empty() ? NULL : &compiled->lights[0];
+	packetScene->planes = compiled->planes.empty() ? NULL : &compiled->planes[0];
+	packetScene->planeCount = (unsigned int)compiled->planes.size();
+	packetScene->nodes = bvh->nodeData;
+	packetScene->nodeCount = bvh->nodeCount;
+	packetScene->primRefs = bvh->primRefData;
+	packetScene->vertices = scene->m_vertices;
+	packetScene->triangles = scene->m_triangle;
+	packetScene->primData = scene->m_primData;
+	packetScene->primLayout = scene->m_primLayout;
+}
+
+int RenderCPU(WorkStealingPool* pool, const SphereSet* scene, const CompiledScene* compiled, const SceneBVH* bvh,
+	unsigned int sampleCount, unsigned int maxDepth, CPUFrame* frame, const unsigned int* pixelList,
+	unsigned int pixelCount, const PacketKernels* packets, unsigned int* pixels, unsigned long long* rayCounts)
+{
+	unsigned int width = frame->width;
+	unsigned int height = frame->height;
+	if (sampleCount == 0 || width < 2 || height < 2)
+		return -1;
+
+	SceneData data;
+	data.scene = scene;
+	data.compiled = compiled;
+	data.bvh = bvh;
+	data.packets = packets;
+	InitPacketScene(scene, compiled, bvh, &data.packetScene);
+
+	// Every task counts its rays on its own and adds them here once
+	std::atomic<unsigned long long> counted[RAY_COUNT_KINDS];
+	for (int k = 0; k < RAY_COUNT_KINDS; k++)
+		counted[k] = 0;
+
+	if (pixelList)
+	{
+		const unsigned int runLength = CPU_TILE_SIZE * CPU_TILE_SIZE;
+		unsigned int runs = (pixelCount + runLength - 1) / runLength;
+
+		pool->Run(runs, [&](unsigned int run, unsigned int)
+		{
+			unsigned int rayCount[RAY_COUNT_KINDS] = { 0, 0 };
+			unsigned int end = std::min((run + 1) * runLength, pixelCount);
+			for (unsigned int i = run * runLength; i < end; )
+			{
+				if (packets)
+				{
+					unsigned int count = std::min(packets->width, end - i);
+					RenderFramePacket(&data, sampleCount, maxDepth, frame, &pixelList[i], count, pixels, rayCount);
+					i += count;
+				}
+				else
+				{
+					RenderFramePixel(&data, sampleCount, maxDepth, frame, pixelList[i], pixels, rayCount);
+					i++;
+				}
+			}
+			for (int k = 0; k < RAY_COUNT_KINDS; k++)
+				counted[k] += rayCount[k];
+		});
+
+		for (int k = 0; k < RAY_COUNT_KINDS; k++)
+			rayCounts[k] += counted[k];
+		return 0;
+	}
+
+	unsigned int tilesX = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	unsigned int tilesY = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+
+	pool->Run(tilesX * tilesY, [&](unsigned int tile, unsigned int)
+	{
+		unsigned int rayCount[RAY_COUNT_KINDS] = { 0, 0 };
+		unsigned int x0 = (tile % tilesX) * CPU_TILE_SIZE;
+		unsigned int y0 = (tile / tilesX) * CPU_TILE_SIZE;
+		unsigned int x1 = std::min(x0 + CPU_TILE_SIZE, width);
+		unsigned int y1 = std::min(y0 + CPU_TILE_SIZE, height);
+
+		for (unsigned int y = y0; y < y1; y++)
+		{
+			if (!packets)
+			{
+				for (unsigned int x = x0; x < x1; x++)
+				{
+					RenderFramePixel(&data, sampleCount, maxDepth, frame, y * width + x, pixels, rayCount);
+				}
+				continue;
+			}
+
+			// Packets run along the tile rows
+			for (unsigned int x = x0; x < x1; x += packets->width)
+			{
+				unsigned int group[PACKET_MAX_WIDTH];
+				unsigned int count = std::min(packets->width, x1 - x);
+				for (unsigned int k = 0; k < count; k++)
+				{
+					group[k] = y * width + x + k;
+				}
+				RenderFramePacket(&data, sampleCount, maxDepth, frame, group, count, pixels, rayCount);
+			}
+		}
+		for (int k = 0; k < RAY_COUNT_KINDS; k++)
+			counted[k] += rayCount[k];
+	});
+
+	for (int k = 0; k < RAY_COUNT_KINDS; k++)
+		rayCounts[k] += counted[k];
+	return 0;
+}
+
+}
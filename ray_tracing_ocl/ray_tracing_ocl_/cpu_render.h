@@ -0,0 +1,59 @@
+// Native CPU render path
+// Does the same work as the ray_cal kernel in ray_algorithm.cl, on host threads
+//
+#ifndef __CPU_RENDER_H__
+#define __CPU_RENDER_H__
+
+#include <vector>
+
+#include "raytracing.h"
+#include "thread_pool.h"
+#include "bvh.h"
+#include "scene_compile.h"
+#include "cpu_packet.h"
+
+namespace RAYTRACING
+{
+
+#define CPU_TILE_SIZE	16
+
+/*
+* Per-pixel state of the CPU path that is carried from one pass to the next
+*/
+struct CPUFrame
+{
+	unsigned int width;
+	unsigned int height;
+	std::vector<float> accum;			// 4 floats per pixel: rgb sum and sample count, like the Accum buffer
+	std::vector<float> accumSq;			// sum of the squared sample luminance per pixel, like AccumSq
+	std::vector<unsigned int> seeds;	// 2 per pixel
+};
+
+/*
+* Clear the sums and derive the pixel seeds from seeds, which holds seedCount pairs used
+* the same way as the Seeds buffer of the OpenCL path: pixel p starts from pair (p % seedCount).
+*/
+void InitCPUFrame(CPUFrame* frame, unsigned int width, unsigned int height,
+	const unsigned int* seeds, unsigned int seedCount);
+
+/*
+* Add sampleCount samples per pixel, each a path of up to maxDepth bounces, to frame and write the mean so far to pixels
+* (packed 0x00RRGGBB, row-major, width * height entries).
+* With a pixelList only its pixelCount pixels are rendered (see SelectActivePixels), else all of them.
+*
+* Lights, planes and the camera are read from compiled (see CompileScene), the other
+* primitives from scene. Bounded primitives are found through bvh (see BuildSceneBVH),
+* planes are tested directly.
+* The image is cut into CPU_TILE_SIZE x CPU_TILE_SIZE tiles which are handed to the pool,
+* a pixel list into runs of as many pixels.
+* With packets the camera rays and their shadow rays are traced packets->width at a time
+* (see SelectPacketKernels), NULL traces every ray on its own.
+* The rays traced are added to rayCounts (RAY_COUNT_KINDS entries), as the kernel counts them.
+*/
+int RenderCPU(WorkStealingPool* pool, const SphereSet* scene, const CompiledScene* compiled, const SceneBVH* bvh,
+	unsigned int sampleCount, unsigned int maxDepth, CPUFrame* frame, const unsigned int* pixelList,
+	unsigned int pixelCount, const PacketKernels* packets, unsigned int* pixels, unsigned long long* rayCounts);
+
+}
+
+#endif
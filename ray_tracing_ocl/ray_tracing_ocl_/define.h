@@ -1,9 +1,46 @@
 #ifndef __DEFINE_H__
 #define __DEFINE_H__
 
+// Defaults of -size and -spp; the kernel gets the actual values as arguments or SPEC_* defines
 #define WIDTH_SIZE	512
 #define HEIGHT_SIZE	512
 #define NUM_SAMPLE	128
 #define WORK_AMOUNT	4096
 
-#endif
\ No newline at end of file
+// 32-bit values per pixel of the largest per-pixel buffer (Accum, a float4); the kernels index
+// these with unsigned ints, so -size is limited to 2^32 / PIXEL_MAX_VALUES pixels
+#define PIXEL_MAX_VALUES	4
+
+// Lights and planes up to this many are baked into a specialized program (-specialize on)
+#define SPEC_MAX_COUNT	16
+
+// Work-groups per compute unit of the persistent-threads launch
+#define PERSISTENT_GROUPS_PER_UNIT	8
+
+// Wavefront mode: paths in flight per wave and work-group size of its kernels
+#define WAVEFRONT_MAX_PATHS	(1 << 18)
+#define WAVEFRONT_GROUP_SIZE	64
+
+// Path tracing: default bounce limit (-max-depth) and the bounce from which Russian roulette may end a path
+#define PATH_MAX_DEPTH	5
+#define PATH_RR_DEPTH	3
+
+// BVH traversal stack depth; the builder never goes deeper than BVH_MAX_DEPTH
+#define BVH_STACK_SIZE	64
+#define BVH_MAX_DEPTH	(BVH_STACK_SIZE - 2)
+
+// Rays traced, counted per pass: closest-hit rays (camera rays and bounces) and shadow rays
+#define RAY_COUNT_CLOSEST	0
+#define RAY_COUNT_SHADOW	1
+#define RAY_COUNT_KINDS	2
+
+// A primitive reference packs the primitive type in the top bits and its index in the rest
+#define PRIM_TYPE_SHIFT	28
+#define PRIM_INDEX_MASK	0x0FFFFFFF
+#define PRIM_RECT_LIGHT	0
+#define PRIM_TRIANGLE	1
+#define PRIM_SPHERE	2
+#define PRIM_DISC	3
+#define PRIM_BOX	4
+
+#endif
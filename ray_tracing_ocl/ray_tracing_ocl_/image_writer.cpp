@@ -0,0 +1,430 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "image_writer.h"
+#include "portable.h"
+#include "profiler.h"
+
+// SSE2 is part of every x86-64 CPU, so it needs no dispatch like the packet kernels
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace RAYTRACING
+{
+
+static bool HasExtension(const char* fileName, const char* extension)
+{
+	size_t length = strlen(fileName), extensionLength = strlen(extension);
+	if (length < extensionLength)
+		return false;
+
+	for (size_t i = 0; i < extensionLength; i++)
+	{
+		if (tolower((unsigned char)fileName[length - extensionLength + i]) != extension[i])
+			return false;
+	}
+	return true;
+}
+
+bool ImageFormatFromName(const char* fileName, ImageFormat* format)
+{
+	static const char* const extensions[] = { ".ppm", ".png", ".pfm", ".exr" };
+	for (int f = 0; f < 4; f++)
+	{
+		if (HasExtension(fileName, extensions[f]))
+		{
+			*format = (ImageFormat)f;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool IsFloatFormat(ImageFormat format)
+{
+	return format == IMAGE_PFM || format == IMAGE_EXR;
+}
+
+// The encoders append to the file image; every multi-byte field is written in host order (little-endian)
+// unless the format says otherwise
+
+static void Append(std::vector<unsigned char>* file, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	file->insert(file->end(), bytes, bytes + size);
+}
+
+static void AppendText(std::vector<unsigned char>* file, const char* text)
+{
+	Append(file, text, strlen(text));
+}
+
+static void AppendInt(std::vector<unsigned char>* file, int value)
+{
+	Append(file, &value, sizeof(value));
+}
+
+static void AppendBigEndian(std::vector<unsigned char>* file, unsigned int value)
+{
+	unsigned char bytes[4] = { (unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value };
+	Append(file, bytes, 4);
+}
+
+// 0x00RRGGBB to r, g, b bytes, one row at a time into rgb
+static void UnpackRow(const unsigned int* pixels, unsigned int width, unsigned char* rgb)
+{
+	unsigned int x = 0;
+#ifdef IMAGE_SSE2
+	// 4 pixels to 12 bytes per step. The 16-byte store runs 4 bytes into the next 2 pixels,
+	// which are written after it, so it stops 2 pixels short of the end of the row.
+	const __m128i byte0 = _mm_set1_epi32(0x000000FF);
+	const __m128i byte1 = _mm_set1_epi32(0x0000FF00);
+	const __m128i firstPixel = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+	const __m128i secondPixel = _mm_set_epi32(0x0000FFFF, (int)0xFF000000, 0x0000FFFF, (int)0xFF000000);
+	const __m128i lowBytes = _mm_set_epi32(0, 0, 0x0000FFFF, (int)0xFFFFFFFF);
+	const __m128i highBytes = _mm_set_epi32(0, (int)0xFFFFFFFF, (int)0xFFFF0000, 0);
+	for (; x + 6 <= width; x += 4)
+	{
+		__m128i pixel = _mm_loadu_si128((const __m128i*)(pixels + x));
+
+		// b, g, r, 0 in memory to r, g, b, 0
+		__m128i swapped = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(pixel, 16), byte0),
+			_mm_and_si128(pixel, byte1)), _mm_slli_epi32(_mm_and_si128(pixel, byte0), 16));
+
+		// Close the gaps: 6 bytes in each half, then the upper half right behind the lower one
+		__m128i halves = _mm_or_si128(_mm_and_si128(swapped, firstPixel),
+			_mm_and_si128(_mm_srli_epi64(swapped, 8), secondPixel));
+		__m128i packed = _mm_or_si128(_mm_and_si128(halves, lowBytes),
+			_mm_and_si128(_mm_srli_si128(halves, 2), highBytes));
+		_mm_storeu_si128((__m128i*)(rgb + 3 * x), packed);
+	}
+#endif
+	for (; x < width; x++)
+	{
+		unsigned int pixel = pixels[x];
+		rgb[3 * x] = (unsigned char)(pixel >> 16);
+		rgb[3 * x + 1] = (unsigned char)(pixel >> 8);
+		rgb[3 * x + 2] = (unsigned char)pixel;
+	}
+}
+
+static void EncodePPM(unsigned int width, unsigned int height, const unsigned int* pixels, std::vector<unsigned char>* file)
+{
+	char header[64];
+	snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+	AppendText(file, header);
+
+	size_t start = file->size();
+	file->resize(start + (size_t)width * height * 3);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		UnpackRow(pixels + (size_t)y * width, width, &(*file)[start + (size_t)y * width * 3]);
+	}
+}
+
+struct Crc32Table
+{
+	Crc32Table()
+	{
+		for (unsigned int n = 0; n < 256; n++)
+		{
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			entries[n] = c;
+		}
+	}
+
+	unsigned int entries[256];
+};
+
+static unsigned int Crc32(const unsigned char* data, size_t size, unsigned int crc)
+{
+	// Built once, by the first caller; the others wait for it
+	static const Crc32Table table;
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void AppendChunk(std::vector<unsigned char>* file, const char* type, const std::vector<unsigned char>& data)
+{
+	AppendBigEndian(file, (unsigned int)data.size());
+	size_t start = file->size();
+	Append(file, type, 4);
+	if (!data.empty())
+		Append(file, &data[0], data.size());
+	AppendBigEndian(file, Crc32(&(*file)[start], file->size() - start, 0));
+}
+
+/*
+* PNG with the image data in stored (uncompressed) deflate blocks: no compression library
+* is needed and encoding runs at copy speed, at the size of a PPM
+*/
+static void EncodePNG(unsigned int width, unsigned int height, const unsigned int* pixels, std::vector<unsigned char>* file)
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	Append(file, signature, 8);
+
+	std::vector<unsigned char> header;
+	AppendBigEndian(&header, width);
+	AppendBigEndian(&header, height);
+	unsigned char format[5] = { 8, 2, 0, 0, 0 };   // 8 bits per channel, RGB, deflate, no filter, no interlace
+	Append(&header, format, 5);
+	AppendChunk(file, "IHDR", header);
+
+	// Rows with filter type 0 in front
+	const size_t rowSize = (size_t)width * 3 + 1;
+	std::vector<unsigned char> raw(rowSize * height);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		raw[y * rowSize] = 0;
+		UnpackRow(pixels + (size_t)y * width, width, &raw[y * rowSize + 1]);
+	}
+
+	std::vector<unsigned char> zlib;
+	zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+	for (size_t at = 0, size; at < raw.size(); at += size)
+	{
+		size = std::min(raw.size() - at, (size_t)65535);
+		unsigned char block[5] = { (unsigned char)(at + size == raw.size() ? 1 : 0),
+			(unsigned char)size, (unsigned char)(size >> 8), (unsigned char)~size, (unsigned char)(~size >> 8) };
+		Append(&zlib, block, 5);
+		Append(&zlib, &raw[at], size);
+	}
+
+	// Adler-32, reduced every 5552 bytes, the most that can't overflow 32 bits
+	unsigned int adlerA = 1, adlerB = 0;
+	for (size_t at = 0; at < raw.size(); at += 5552)
+	{
+		size_t end = std::min(raw.size(), at + 5552);
+		for (size_t i = at; i < end; i++)
+		{
+			adlerA += raw[i];
+			adlerB += adlerA;
+		}
+		adlerA %= 65521;
+		adlerB %= 65521;
+	}
+	AppendBigEndian(&zlib, (adlerB << 16) | adlerA);
+	AppendChunk(file, "IDAT", zlib);
+	AppendChunk(file, "IEND", std::vector<unsigned char>());
+}
+
+// Portable float map: rows from the bottom up, a negative scale marks little-endian floats
+static void EncodePFM(unsigned int width, unsigned int height, const float* color, std::vector<unsigned char>* file)
+{
+	char header[64];
+	snprintf(header, sizeof(header), "PF\n%u %u\n-1.0\n", width, height);
+	AppendText(file, header);
+
+	for (unsigned int y = height; y-- > 0; )
+	{
+		Append(file, color + (size_t)y * width * 3, sizeof(float) * width * 3);
+	}
+}
+
+static void AppendAttribute(std::vector<unsigned char>* file, const char* name, const char* type, const void* value, int size)
+{
+	Append(file, name, strlen(name) + 1);
+	Append(file, type, strlen(type) + 1);
+	AppendInt(file, size);
+	Append(file, value, size);
+}
+
+/*
+* Single-part scanline OpenEXR with B, G, R float channels and no compression: the header
+* attributes every reader requires, the offset of each scanline, then the scanlines
+*/
+static void EncodeEXR(unsigned int width, unsigned int height, const float* color, std::vector<unsigned char>* file)
+{
+	static const unsigned char magic[8] = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+	Append(file, magic, 8);
+
+	// Channels in alphabetical order: name, pixel type 2 (float), pLinear and reserved, x/y sampling
+	std::vector<unsigned char> channels;
+	const char* names[3] = { "B", "G", "R" };
+	for (int c = 0; c < 3; c++)
+	{
+		Append(&channels, names[c], 2);
+		int fields[4] = { 2, 0, 1, 1 };
+		Append(&channels, fields, sizeof(fields));
+	}
+	channels.push_back(0);
+	AppendAttribute(file, "channels", "chlist", &channels[0], (int)channels.size());
+
+	unsigned char none = 0;
+	int window[4] = { 0, 0, (int)width - 1, (int)height - 1 };
+	float one = 1.0f;
+	float center[2] = { 0.0f, 0.0f };
+	AppendAttribute(file, "compression", "compression", &none, 1);
+	AppendAttribute(file, "dataWindow", "box2i", window, sizeof(window));
+	AppendAttribute(file, "displayWindow", "box2i", window, sizeof(window));
+	AppendAttribute(file, "lineOrder", "lineOrder", &none, 1);
+	AppendAttribute(file, "pixelAspectRatio", "float", &one, sizeof(one));
+	AppendAttribute(file, "screenWindowCenter", "v2f", center, sizeof(center));
+	AppendAttribute(file, "screenWindowWidth", "float", &one, sizeof(one));
+	file->push_back(0);
+
+	const int lineSize = (int)(width * 3 * sizeof(float));
+	unsigned long long offset = file->size() + (unsigned long long)height * 8;
+	for (unsigned int y = 0; y < height; y++)
+	{
+		Append(file, &offset, sizeof(offset));
+		offset += 8 + lineSize;
+	}
+
+	std::vector<float> line(width);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		AppendInt(file, (int)y);
+		AppendInt(file, lineSize);
+		const float* row = color + (size_t)y * width * 3;
+		for (int c = 2; c >= 0; c--)
+		{
+			for (unsigned int x = 0; x < width; x++)
+				line[x] = row[3 * x + c];
+			Append(file, &line[0], sizeof(float) * width);
+		}
+	}
+}
+
+static bool WriteWholeFile(const std::string& fileName, const std::vector<unsigned char>& data)
+{
+	FILE* file = NULL;
+	if (0 != fopen_s(&file, fileName.c_str(), "wb") || file == NULL)
+	{
+		printf("Error: Couldn't open output file '%s'.\n", fileName.c_str());
+		return false;
+	}
+
+	bool written = fwrite(&data[0], 1, data.size(), file) == data.size();
+	written = (fclose(file) == 0) && written;
+	if (!written)
+	{
+		printf("Error: Couldn't write output file '%s'.\n", fileName.c_str());
+	}
+	return written;
+}
+
+ImageWriter::ImageWriter(Profiler* profiler) :
+		m_profiler(profiler),
+		m_busy(false),
+		m_failed(false),
+		m_stop(false)
+{
+	m_thread = std::thread(&ImageWriter::WriterLoop, this);
+}
+
+ImageWriter::~ImageWriter()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+}
+
+void ImageWriter::Write(const char* fileName, const unsigned int* pixels, const float* accum,
+	unsigned int width, unsigned int height)
+{
+	Job job;
+	job.fileName = fileName;
+	job.width = width;
+	job.height = height;
+	if (!ImageFormatFromName(fileName, &job.format))
+	{
+		printf("Error: Unknown image format '%s' (expected .ppm, .png, .pfm or .exr).\n", fileName);
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_failed = true;
+		return;
+	}
+
+	// Take the copy here, so the caller can unmap or overwrite its buffer right away
+	const size_t pixelCount = (size_t)width * height;
+	if (IsFloatFormat(job.format))
+	{
+		job.color.resize(pixelCount * 3);
+		float* color = &job.color[0];
+		for (size_t p = 0; p < pixelCount; p++)
+		{
+			float scale = accum[4 * p + 3] > 0.0f ? 1.0f / accum[4 * p + 3] : 0.0f;
+			color[3 * p] = accum[4 * p] * scale;
+			color[3 * p + 1] = accum[4 * p + 1] * scale;
+			color[3 * p + 2] = accum[4 * p + 2] * scale;
+		}
+	}
+	else
+	{
+		job.pixels.assign(pixels, pixels + pixelCount);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		std::deque<Job>::iterator queued = m_jobs.begin();
+		while (queued != m_jobs.end() && queued->fileName != job.fileName)
+			++queued;
+		if (queued != m_jobs.end())
+			*queued = std::move(job);
+		else
+			m_jobs.push_back(std::move(job));
+	}
+	m_wake.notify_one();
+}
+
+bool ImageWriter::Finish()
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	m_done.wait(guard, [this] { return m_jobs.empty() && !m_busy; });
+	bool succeeded = !m_failed;
+	m_failed = false;
+	return succeeded;
+}
+
+void ImageWriter::WriterLoop()
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	for (;;)
+	{
+		m_wake.wait(guard, [this] { return m_stop || !m_jobs.empty(); });
+		if (m_jobs.empty())
+			break;
+
+		Job job = std::move(m_jobs.front());
+		m_jobs.pop_front();
+		m_busy = true;
+		guard.unlock();
+
+		double begin = ProfileNow(m_profiler);
+		std::vector<unsigned char> file;
+		if (job.format == IMAGE_PPM)
+			EncodePPM(job.width, job.height, &job.pixels[0], &file);
+		else if (job.format == IMAGE_PNG)
+			EncodePNG(job.width, job.height, &job.pixels[0], &file);
+		else if (job.format == IMAGE_PFM)
+			EncodePFM(job.width, job.height, &job.color[0], &file);
+		else
+			EncodeEXR(job.width, job.height, &job.color[0], &file);
+		double encoded = ProfileNow(m_profiler);
+		bool written = WriteWholeFile(job.fileName, file);
+		AddPhase(m_profiler, "encode image", job.fileName.c_str(), PROFILE_WRITER, begin, encoded);
+		AddPhase(m_profiler, "write image", job.fileName.c_str(), PROFILE_WRITER, encoded, ProfileNow(m_profiler));
+
+		guard.lock();
+		m_busy = false;
+		m_failed = m_failed || !written;
+		if (m_jobs.empty())
+			m_done.notify_all();
+	}
+}
+
+}
@@ -0,0 +1,83 @@
+// Image output: PPM, PNG, PFM and OpenEXR files encoded and written on a background thread
+//
+#ifndef __IMAGE_WRITER_H__
+#define __IMAGE_WRITER_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Profiler;
+
+namespace RAYTRACING
+{
+
+enum ImageFormat
+{
+	IMAGE_PPM,      // binary 8-bit RGB
+	IMAGE_PNG,      // 8-bit RGB
+	IMAGE_PFM,      // 32-bit float RGB
+	IMAGE_EXR       // 32-bit float RGB, scanlines without compression
+};
+
+// Format from the extension of fileName (.ppm, .png, .pfm, .exr); false for anything else
+bool ImageFormatFromName(const char* fileName, ImageFormat* format);
+
+// Float formats store the mean radiance of each pixel, the others the packed 8-bit color
+bool IsFloatFormat(ImageFormat format);
+
+/*
+* Queue of images that a writer thread encodes and writes while rendering goes on.
+* Every file is built in memory and written with a single write.
+*/
+class ImageWriter
+{
+public:
+	explicit ImageWriter(Profiler* profiler = NULL);    // profiler gets the encode and write times
+	~ImageWriter();             // writes what is still queued
+
+	/*
+	* Queue an image in the format of fileName's extension. 8-bit formats take the packed
+	* 0x00RRGGBB pixels, float formats the float4 sums of accum (r, g, b, sample count).
+	* Only the array the format takes is read (the other may be NULL), and it is copied
+	* before this returns. A queued image of the same file that hasn't started yet is replaced.
+	*/
+	void Write(const char* fileName, const unsigned int* pixels, const float* accum,
+		unsigned int width, unsigned int height);
+
+	// Wait until every queued image is written; false if any failed since the last call
+	bool Finish();
+
+private:
+	ImageWriter(const ImageWriter&);
+	ImageWriter& operator=(const ImageWriter&);
+
+	struct Job
+	{
+		std::string fileName;
+		ImageFormat format;
+		unsigned int width;
+		unsigned int height;
+		std::vector<unsigned int> pixels;
+		std::vector<float> color;   // mean r, g, b per pixel, for the float formats
+	};
+
+	void WriterLoop();
+
+	Profiler* m_profiler;
+	std::thread m_thread;
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	std::deque<Job> m_jobs;
+	bool m_busy;
+	bool m_failed;
+	bool m_stop;
+};
+
+}
+
+#endif
@@ -0,0 +1,438 @@
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+
+#include "light_select.h"
+
+#ifndef M_PI
+  #define M_PI 3.14159265358979
+#endif
+
+namespace RAYTRACING
+{
+
+static inline float Dot(const Vector& a, const Vector& b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline Vector Cross(const Vector& a, const Vector& b)
+{
+	Vector v = { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+	return v;
+}
+
+static inline Vector Scale(const Vector& a, float k)
+{
+	Vector v = { a.x * k, a.y * k, a.z * k };
+	return v;
+}
+
+static inline Vector Add(const Vector& a, const Vector& b)
+{
+	Vector v = { a.x + b.x, a.y + b.y, a.z + b.z };
+	return v;
+}
+
+static inline Vector Normalize(const Vector& a)
+{
+	float length = sqrtf(Dot(a, a));
+	return length > 0.0f ? Scale(a, 1.0f / length) : a;
+}
+
+float LightFlux(const CompiledLight& light)
+{
+	return (0.2126f * light.m_emitted.x + 0.7152f * light.m_emitted.y + 0.0722f * light.m_emitted.z) * light.m_area;
+}
+
+// Vose's method: entries below the mean weight are topped up by one above it
+void BuildLightAlias(const std::vector<CompiledLight>& lights, std::vector<LightAlias>* alias)
+{
+	unsigned int count = (unsigned int)lights.size();
+	alias->resize(count);
+	if (count == 0)
+		return;
+
+	std::vector<double> weights(count);
+	double total = 0.0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		weights[i] = std::max(0.0f, LightFlux(lights[i]));
+		total += weights[i];
+	}
+	if (total <= 0.0)
+	{
+		std::fill(weights.begin(), weights.end(), 1.0);
+		total = count;
+	}
+
+	std::vector<double> scaled(count);
+	std::vector<unsigned int> small, large;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		(*alias)[i].m_pdf = (float)(weights[i] / total);
+		scaled[i] = weights[i] / total * count;
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		unsigned int s = small.back(); small.pop_back();
+		unsigned int l = large.back(); large.pop_back();
+		(*alias)[s].m_threshold = (float)scaled[s];
+		(*alias)[s].m_alias = l;
+
+		scaled[l] -= 1.0 - scaled[s];
+		(scaled[l] < 1.0 ? small : large).push_back(l);
+	}
+
+	// What is left is 1 up to rounding
+	for (size_t i = 0; i < small.size(); i++)
+	{
+		(*alias)[small[i]].m_threshold = 1.0f;
+		(*alias)[small[i]].m_alias = small[i];
+	}
+	for (size_t i = 0; i < large.size(); i++)
+	{
+		(*alias)[large[i]].m_threshold = 1.0f;
+		(*alias)[large[i]].m_alias = large[i];
+	}
+}
+
+struct LightBuildEntry
+{
+	float boundsMin[3];
+	float boundsMax[3];
+	float centroid[3];
+	unsigned int light;
+};
+
+struct LightBuildContext
+{
+	const std::vector<CompiledLight>* lights;
+	std::vector<LightBuildEntry> entries;
+	std::vector<LightNode>* nodes;
+	std::vector<unsigned int>* trails;
+};
+
+/*
+* Smallest cone around the cones (axisA, thetaA) and (axisB, thetaB), as DirectionCone::Union in pbrt-v4.
+* The lights are two-sided, so axisB is flipped to the side of axisA first.
+*/
+static void UnionCone(const Vector& axisA, float thetaA, Vector axisB, float thetaB, Vector* axis, float* theta)
+{
+	if (Dot(axisA, axisB) < 0.0f)
+	{
+		axisB = Scale(axisB, -1.0f);
+	}
+
+	float thetaD = acosf(std::min(1.0f, std::max(-1.0f, Dot(axisA, axisB))));
+	if (std::min(thetaD + thetaB, (float)M_PI) <= thetaA)
+	{
+		*axis = axisA;
+		*theta = thetaA;
+		return;
+	}
+	if (std::min(thetaD + thetaA, (float)M_PI) <= thetaB)
+	{
+		*axis = axisB;
+		*theta = thetaB;
+		return;
+	}
+
+	float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+	Vector rotationAxis = Cross(axisA, axisB);
+	if (thetaO >= (float)M_PI || Dot(rotationAxis, rotationAxis) == 0.0f)
+	{
+		*axis = axisA;
+		*theta = (float)M_PI;
+		return;
+	}
+
+	// Turn axisA towards axisB by thetaO - thetaA (Rodrigues, the rotation axis is normal to axisA)
+	float thetaR = thetaO - thetaA;
+	Vector k = Normalize(rotationAxis);
+	*axis = Normalize(Add(Scale(axisA, cosf(thetaR)), Scale(Cross(k, axisA), sinf(thetaR))));
+	*theta = thetaO;
+}
+
+static void GrowNode(LightNode* node, const float* boundsMin, const float* boundsMax)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		node->m_boundsMin[a] = std::min(node->m_boundsMin[a], boundsMin[a]);
+		node->m_boundsMax[a] = std::max(node->m_boundsMax[a], boundsMax[a]);
+	}
+}
+
+static int BuildLightNode(LightBuildContext* ctx, unsigned int first, unsigned int count, unsigned int depth,
+	unsigned int trail)
+{
+	std::vector<LightNode>& nodes = *ctx->nodes;
+
+	int nodeIndex = (int)nodes.size();
+	nodes.push_back(LightNode());
+
+	if (count == 1)
+	{
+		const LightBuildEntry& entry = ctx->entries[first];
+		const CompiledLight& light = (*ctx->lights)[entry.light];
+		LightNode& leaf = nodes[nodeIndex];
+		for (int a = 0; a < 3; a++)
+		{
+			leaf.m_boundsMin[a] = entry.boundsMin[a];
+			leaf.m_boundsMax[a] = entry.boundsMax[a];
+		}
+		leaf.m_offset = (int)entry.light;
+		leaf.m_lightCount = 1;
+		leaf.m_axis[0] = light.m_normal.x;
+		leaf.m_axis[1] = light.m_normal.y;
+		leaf.m_axis[2] = light.m_normal.z;
+		leaf.m_cosTheta = 1.0f;
+		leaf.m_energy = std::max(0.0f, LightFlux(light));
+		(*ctx->trails)[entry.light] = trail;
+		return nodeIndex;
+	}
+
+	// Median split along the widest extent of the centroids
+	float centroidMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float centroidMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (unsigned int i = first; i < first + count; i++)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			centroidMin[a] = std::min(centroidMin[a], ctx->entries[i].centroid[a]);
+			centroidMax[a] = std::max(centroidMax[a], ctx->entries[i].centroid[a]);
+		}
+	}
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+	{
+		if (centroidMax[a] - centroidMin[a] > centroidMax[axis] - centroidMin[axis])
+			axis = a;
+	}
+
+	unsigned int half = count / 2;
+	std::nth_element(ctx->entries.begin() + first, ctx->entries.begin() + first + half, ctx->entries.begin() + first + count,
+		[axis](const LightBuildEntry& a, const LightBuildEntry& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+	int left = BuildLightNode(ctx, first, half, depth + 1, trail);
+	int right = BuildLightNode(ctx, first + half, count - half, depth + 1, trail | (1u << depth));
+
+	// nodes may have moved while the children were built
+	LightNode& node = nodes[nodeIndex];
+	const LightNode& a = nodes[left];
+	const LightNode& b = nodes[right];
+	for (int i = 0; i < 3; i++)
+	{
+		node.m_boundsMin[i] = a.m_boundsMin[i];
+		node.m_boundsMax[i] = a.m_boundsMax[i];
+	}
+	GrowNode(&node, b.m_boundsMin, b.m_boundsMax);
+	node.m_offset = right;
+	node.m_lightCount = 0;
+	node.m_energy = a.m_energy + b.m_energy;
+
+	Vector axisA = { a.m_axis[0], a.m_axis[1], a.m_axis[2] };
+	Vector axisB = { b.m_axis[0], b.m_axis[1], b.m_axis[2] };
+	Vector coneAxis;
+	float theta;
+	UnionCone(axisA, acosf(std::min(1.0f, a.m_cosTheta)), axisB, acosf(std::min(1.0f, b.m_cosTheta)), &coneAxis, &theta);
+	node.m_axis[0] = coneAxis.x;
+	node.m_axis[1] = coneAxis.y;
+	node.m_axis[2] = coneAxis.z;
+	node.m_cosTheta = cosf(theta);
+
+	return nodeIndex;
+}
+
+void BuildLightBVH(const std::vector<CompiledLight>& lights, std::vector<LightNode>* nodes,
+	std::vector<unsigned int>* trails)
+{
+	nodes->clear();
+	trails->assign(lights.size(), 0);
+	if (lights.empty())
+		return;
+
+	LightBuildContext ctx;
+	ctx.lights = &lights;
+	ctx.nodes = nodes;
+	ctx.trails = trails;
+	ctx.entries.resize(lights.size());
+
+	for (unsigned int i = 0; i < (unsigned int)lights.size(); i++)
+	{
+		const CompiledLight& light = lights[i];
+		LightBuildEntry& entry = ctx.entries[i];
+		Point corners[4] = { light.m_pos, Add(light.m_pos, light.m_side1), Add(light.m_pos, light.m_side2),
+			Add(Add(light.m_pos, light.m_side1), light.m_side2) };
+		for (int a = 0; a < 3; a++)
+		{
+			entry.boundsMin[a] = FLT_MAX;
+			entry.boundsMax[a] = -FLT_MAX;
+		}
+		for (int c = 0; c < 4; c++)
+		{
+			float p[3] = { corners[c].x, corners[c].y, corners[c].z };
+			for (int a = 0; a < 3; a++)
+			{
+				entry.boundsMin[a] = std::min(entry.boundsMin[a], p[a]);
+				entry.boundsMax[a] = std::max(entry.boundsMax[a], p[a]);
+			}
+		}
+		for (int a = 0; a < 3; a++)
+		{
+			entry.centroid[a] = 0.5f * (entry.boundsMin[a] + entry.boundsMax[a]);
+		}
+		entry.light = i;
+	}
+
+	nodes->reserve(2 * lights.size() - 1);
+	BuildLightNode(&ctx, 0, (unsigned int)lights.size(), 0, 0);
+}
+
+void BuildLightSelection(const std::vector<CompiledLight>& lights, LightSelectMode mode, unsigned int samples,
+	LightSelection* selection)
+{
+	selection->samples = std::max(samples, 1u);
+	BuildLightAlias(lights, &selection->alias);
+
+	selection->nodes.clear();
+	selection->trails.clear();
+	if (mode == LIGHT_SELECT_BVH || (mode == LIGHT_SELECT_AUTO && lights.size() >= LIGHT_BVH_MIN_LIGHTS))
+	{
+		BuildLightBVH(lights, &selection->nodes, &selection->trails);
+	}
+}
+
+/*
+* Importance of a light BVH node for a hit at position with normal: flux over squared distance,
+* scaled by the best cosines the bounds allow at the lights and at the hit (Conty Estevez and
+* Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018; LightBounds::Importance
+* in pbrt-v4). The lights are planar, so they emit up to 90 degrees off their normal.
+* Same as lightNodeImportance in ray_algorithm.cl.
+*/
+static float LightNodeImportance(const LightNode& node, const Point& position, const Vector& normal)
+{
+	Point center = { 0.5f * (node.m_boundsMin[0] + node.m_boundsMax[0]), 0.5f * (node.m_boundsMin[1] + node.m_boundsMax[1]),
+		0.5f * (node.m_boundsMin[2] + node.m_boundsMax[2]) };
+	Vector diagonal = { node.m_boundsMax[0] - node.m_boundsMin[0], node.m_boundsMax[1] - node.m_boundsMin[1],
+		node.m_boundsMax[2] - node.m_boundsMin[2] };
+	float radiusSq = 0.25f * Dot(diagonal, diagonal);
+
+	Vector toCenter = { center.x - position.x, center.y - position.y, center.z - position.z };
+	float distanceSq = Dot(toCenter, toCenter);
+	toCenter = Normalize(toCenter);
+
+	// Half angle of the bounding sphere as seen from the hit; inside it any direction is possible
+	float cosBounds = -1.0f, sinBounds = 0.0f;
+	if (distanceSq > radiusSq)
+	{
+		float sinSq = radiusSq / distanceSq;
+		cosBounds = sqrtf(1.0f - sinSq);
+		sinBounds = sqrtf(sinSq);
+	}
+
+	// Angle between the normal cone and the direction to the hit, less the cone and the bounds
+	Vector axis = { node.m_axis[0], node.m_axis[1], node.m_axis[2] };
+	float cosW = fabsf(Dot(axis, toCenter));
+	float sinW = sqrtf(std::max(0.0f, 1.0f - cosW * cosW));
+	float cosO = node.m_cosTheta;
+	float sinO = sqrtf(std::max(0.0f, 1.0f - cosO * cosO));
+	float cosX = cosW > cosO ? 1.0f : cosW * cosO + sinW * sinO;
+	float sinX = sqrtf(std::max(0.0f, 1.0f - cosX * cosX));
+	float cosLight = cosX > cosBounds ? 1.0f : cosX * cosBounds + sinX * sinBounds;
+	if (cosLight <= 0.0f)
+		return 0.0f;
+
+	// Same at the hit: its surface faces the lights within the bounds
+	float cosI = Dot(normal, toCenter);
+	float sinI = sqrtf(std::max(0.0f, 1.0f - cosI * cosI));
+	float cosSurface = cosI > cosBounds ? 1.0f : cosI * cosBounds + sinI * sinBounds;
+	if (cosSurface <= 0.0f)
+		return 0.0f;
+
+	// Close to or inside the box the distance says little, so it is kept at the box size
+	return node.m_energy * cosLight * cosSurface / std::max(distanceSq, radiusSq);
+}
+
+int SelectLight(const LightSelection& selection, const Point& position, const Vector& normal, float u, float* pmf)
+{
+	unsigned int count = (unsigned int)selection.alias.size();
+	if (count == 0)
+		return -1;
+
+	if (selection.nodes.empty())
+	{
+		float scaled = u * count;
+		unsigned int entry = std::min((unsigned int)scaled, count - 1);
+		int light = (scaled - entry < selection.alias[entry].m_threshold) ? (int)entry : (int)selection.alias[entry].m_alias;
+		*pmf = selection.alias[light].m_pdf;
+		return light;
+	}
+
+	float probability = 1.0f;
+	int nodeIndex = 0;
+	while (!selection.nodes[nodeIndex].m_lightCount)
+	{
+		const LightNode& node = selection.nodes[nodeIndex];
+		float first = LightNodeImportance(selection.nodes[nodeIndex + 1], position, normal);
+		float second = LightNodeImportance(selection.nodes[node.m_offset], position, normal);
+		if (first + second <= 0.0f)
+			return -1;
+
+		// Reuse u for the next level
+		float pFirst = first / (first + second);
+		if (u < pFirst)
+		{
+			u = u / pFirst;
+			probability *= pFirst;
+			nodeIndex = nodeIndex + 1;
+		}
+		else
+		{
+			u = (u - pFirst) / (1.0f - pFirst);
+			probability *= 1.0f - pFirst;
+			nodeIndex = node.m_offset;
+		}
+		u = std::min(u, 0.99999994f);
+	}
+
+	*pmf = probability;
+	return selection.nodes[nodeIndex].m_offset;
+}
+
+float LightSelectPdf(const LightSelection& selection, const Point& position, const Vector& normal,
+	unsigned int light)
+{
+	if (selection.nodes.empty())
+		return selection.alias[light].m_pdf;
+
+	float probability = 1.0f;
+	unsigned int trail = selection.trails[light];
+	int nodeIndex = 0;
+	while (!selection.nodes[nodeIndex].m_lightCount)
+	{
+		const LightNode& node = selection.nodes[nodeIndex];
+		float first = LightNodeImportance(selection.nodes[nodeIndex + 1], position, normal);
+		float second = LightNodeImportance(selection.nodes[node.m_offset], position, normal);
+		if (first + second <= 0.0f)
+			return 0.0f;
+
+		if (trail & 1)
+		{
+			probability *= second / (first + second);
+			nodeIndex = node.m_offset;
+		}
+		else
+		{
+			probability *= first / (first + second);
+			nodeIndex = nodeIndex + 1;
+		}
+		trail >>= 1;
+	}
+
+	return probability;
+}
+
+}
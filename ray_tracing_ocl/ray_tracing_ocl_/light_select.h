@@ -0,0 +1,65 @@
+// Light selection for next-event estimation: alias table and light BVH over the compiled lights
+//
+#ifndef __LIGHT_SELECT_H__
+#define __LIGHT_SELECT_H__
+
+#include <vector>
+
+#include "raytracing.h"
+
+namespace RAYTRACING
+{
+
+// With LIGHT_SELECT_AUTO scenes with at least this many lights use the light BVH
+#define LIGHT_BVH_MIN_LIGHTS	16
+
+enum LightSelectMode
+{
+	LIGHT_SELECT_AUTO,
+	LIGHT_SELECT_ALIAS,     // pick lights by flux, wherever the hit is
+	LIGHT_SELECT_BVH        // walk the light BVH, weighing the children by their importance for the hit
+};
+
+/*
+* What the render paths need to pick lights. Every hit takes samples lights, with replacement.
+* nodes is empty when the alias table is used. trails[i] holds the way from the root to the
+* leaf of light i: bit d is set when the walk goes to the second child at depth d.
+*/
+struct LightSelection
+{
+	std::vector<LightAlias> alias;
+	std::vector<LightNode> nodes;
+	std::vector<unsigned int> trails;
+	unsigned int samples;
+};
+
+// Emitted flux of a light up to a constant factor: luminance of m_emitted times the area
+float LightFlux(const CompiledLight& light);
+
+// Alias table over the lights weighted by LightFlux; uniform if no light emits anything
+void BuildLightAlias(const std::vector<CompiledLight>& lights, std::vector<LightAlias>* alias);
+
+/*
+* Light BVH with one light per leaf, split at the median centroid of the widest axis,
+* so its depth is at most ceil(log2(light count)) and every trail fits into 32 bits
+*/
+void BuildLightBVH(const std::vector<CompiledLight>& lights, std::vector<LightNode>* nodes,
+	std::vector<unsigned int>* trails);
+
+void BuildLightSelection(const std::vector<CompiledLight>& lights, LightSelectMode mode, unsigned int samples,
+	LightSelection* selection);
+
+/*
+* Pick a light for the hit at position with normal from the random number u in [0, 1).
+* Returns the light index and its probability in pmf, or -1 if no light can reach the hit.
+* Same walk as selectLight in ray_algorithm.cl.
+*/
+int SelectLight(const LightSelection& selection, const Point& position, const Vector& normal, float u, float* pmf);
+
+// Probability that SelectLight picks light for the hit at position with normal
+float LightSelectPdf(const LightSelection& selection, const Point& position, const Vector& normal,
+	unsigned int light);
+
+}
+
+#endif
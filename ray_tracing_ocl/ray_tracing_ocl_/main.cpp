@@ -4,17 +4,45 @@
 #include <time.h>
 
 #include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <memory.h>
 #include <vector>
-
-#include <CL\cl.h>
-
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <list>
+
+#include "ocl_common.h"
+#include "portable.h"
 #include "raytracing.h"
 #include "define.h"
-
+#include "cpu_render.h"
+#include "ocl_device.h"
+#include "bvh.h"
+#include "mesh_loader.h"
+#include "primitives.h"
+#include "scene_compile.h"
+#include "adaptive.h"
+#include "wavefront.h"
+#include "light_select.h"
+#include "program_cache.h"
+#include "scene_file.h"
+#include "image_writer.h"
+#include "profiler.h"
+#include "benchmark.h"
+#include "readback.h"
+#include "camera_path.h"
+#include "render_daemon.h"
+
+#ifdef _MSC_VER
 #pragma warning( push )
 #pragma warning( disable : 4996 )
+#endif
 
 using namespace RAYTRACING;
 
@@ -22,7 +50,7 @@ using namespace RAYTRACING;
 #define OPENCL_VERSION_1_2  1.2f
 #define OPENCL_VERSION_2_0  2.0f
 
-// TODO: these should probably be read in as commandline parameters.
+// Defaults of -size and -spp
 const size_t kWidth = WIDTH_SIZE;
 const size_t kHeight = HEIGHT_SIZE;
 const size_t kNumPixelSamples = NUM_SAMPLE;
@@ -172,6 +200,30 @@ struct ocl_args_d_t
 	cl_mem			 cam;
 	cl_mem           Pixels;            // hold destination buffer
 	cl_mem			 Seeds;
+	cl_mem			 Nodes;             // flattened BVH over the bounded primitives
+	cl_uint			 NodeCount;
+	cl_mem			 PrimRefs;          // primitive references of the BVH leaves
+	cl_mem			 Vertices;          // shared vertex list of all triangle meshes
+	cl_mem			 Triangles;
+	cl_mem			 MeshColors;        // one color per mesh, indexed by Triangle::m_mesh
+	cl_mem			 PrimData;          // structure-of-arrays streams of spheres, discs and boxes
+	PrimitiveLayout	 PrimLayout;
+	cl_mem			 Materials;
+	cl_mem			 Accum;             // float4 per pixel: rgb sum and sample count over all passes
+	cl_mem			 AccumSq;           // float per pixel: sum of the squared sample luminance
+	cl_mem			 PixelList;         // pixels rendered by the next pass
+	cl_uint			 PixelCount;
+	std::vector<cl_uint> PixelOrder;    // every pixel, in the order the passes render them
+	cl_mem			 WorkCounter;       // next pixel list entry for the persistent work-groups
+	cl_uint			 Persistent;        // 1: one launch whose work-groups pull batches from WorkCounter
+	cl_uint			 MaxDepth;          // diffuse bounces per path
+	cl_mem			 AliasTable;        // light selection by flux (LightAlias per light)
+	cl_mem			 LightNodes;        // light BVH, used instead of AliasTable if LightNodeCount > 0
+	cl_uint			 LightNodeCount;
+	cl_mem			 LightTrails;       // way from the light BVH root to each light
+	cl_uint			 LightSamples;      // lights sampled per hit
+	cl_mem			 RayCounts;         // closest-hit and shadow rays traced since the last read (RAY_COUNT_*)
+	Profiler*		 profiler;          // times the commands while it is enabled
 };
 
 ocl_args_d_t::ocl_args_d_t() :
@@ -192,8 +244,31 @@ ocl_args_d_t::ocl_args_d_t() :
 		height(0),
 		cam(NULL),
 		Pixels(NULL),
-		Seeds(NULL)
+		Seeds(NULL),
+		Nodes(NULL),
+		NodeCount(0),
+		PrimRefs(NULL),
+		Vertices(NULL),
+		Triangles(NULL),
+		MeshColors(NULL),
+		PrimData(NULL),
+		Materials(NULL),
+		Accum(NULL),
+		AccumSq(NULL),
+		PixelList(NULL),
+		PixelCount(0),
+		WorkCounter(NULL),
+		Persistent(0),
+		MaxDepth(PATH_MAX_DEPTH),
+		AliasTable(NULL),
+		LightNodes(NULL),
+		LightNodeCount(0),
+		LightTrails(NULL),
+		LightSamples(1),
+		RayCounts(NULL),
+		profiler(NULL)
 {
+	memset(&PrimLayout, 0, sizeof(PrimLayout));
 }
 
 /*
@@ -259,152 +334,164 @@ ocl_args_d_t::~ocl_args_d_t()
 			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
 		}
 	}
-	if (commandQueue)
+	if (Seeds)
 	{
-		err = clReleaseCommandQueue(commandQueue);
+		err = clReleaseMemObject(Seeds);
 		if (CL_SUCCESS != err)
 		{
-			printf("Error: clReleaseCommandQueue returned '%s'.\n", TranslateOpenCLError(err));
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
 		}
 	}
-	if (device)
+	if (Nodes)
 	{
-		err = clReleaseDevice(device);
+		err = clReleaseMemObject(Nodes);
 		if (CL_SUCCESS != err)
 		{
-			printf("Error: clReleaseDevice returned '%s'.\n", TranslateOpenCLError(err));
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
 		}
 	}
-	if (context)
+	if (PrimRefs)
 	{
-		err = clReleaseContext(context);
+		err = clReleaseMemObject(PrimRefs);
 		if (CL_SUCCESS != err)
 		{
-			printf("Error: clReleaseContext returned '%s'.\n", TranslateOpenCLError(err));
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
 		}
 	}
-
-	/*
-	* Note there is no procedure to deallocate platform
-	* because it was not created at the startup,
-	* but just queried from OpenCL runtime.
-	*/
-}
-
-/*
-* Check whether an OpenCL platform is the required platform
-* (based on the platform's name)
-*/
-bool CheckPreferredPlatformMatch(cl_platform_id platform, const char* preferredPlatform)
-{
-	size_t stringLength = 0;
-	cl_int err = CL_SUCCESS;
-	bool match = false;
-
-	// In order to read the platform's name, we first read the platform's name string length (param_value is NULL).
-	// The value returned in stringLength
-	err = clGetPlatformInfo(platform, CL_PLATFORM_NAME, 0, NULL, &stringLength);
-	if (CL_SUCCESS != err)
+	if (Vertices)
 	{
-		printf("Error: clGetPlatformInfo() to get CL_PLATFORM_NAME length returned '%s'.\n", TranslateOpenCLError(err));
-		return false;
+		err = clReleaseMemObject(Vertices);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
 	}
-
-	// Now, that we know the platform's name string length, we can allocate enough space before read it
-	std::vector<char> platformName(stringLength);
-
-	// Read the platform's name string
-	// The read value returned in platformName
-	err = clGetPlatformInfo(platform, CL_PLATFORM_NAME, stringLength, &platformName[0], NULL);
-	if (CL_SUCCESS != err)
+	if (Triangles)
 	{
-		printf("Error: clGetplatform_ids() to get CL_PLATFORM_NAME returned %s.\n", TranslateOpenCLError(err));
-		return false;
+		err = clReleaseMemObject(Triangles);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
 	}
-
-	// Now check if the platform's name is the required one
-	if (strstr(&platformName[0], preferredPlatform) != 0)
+	if (MeshColors)
 	{
-		// The checked platform is the one we're looking for
-		match = true;
+		err = clReleaseMemObject(MeshColors);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
 	}
-
-	return match;
-}
-
-/*
-* Find and return the preferred OpenCL platform
-* In case that preferredPlatform is NULL, the ID of the first discovered platform will be returned
-*/
-cl_platform_id FindOpenCLPlatform(const char* preferredPlatform, cl_device_type deviceType)
-{
-	cl_uint numPlatforms = 0;
-	cl_int err = CL_SUCCESS;
-
-	// Get (in numPlatforms) the number of OpenCL platforms available
-	// No platform ID will be return, since platforms is NULL
-	err = clGetPlatformIDs(0, NULL, &numPlatforms);
-	if (CL_SUCCESS != err)
+	if (PrimData)
 	{
-		printf("Error: clGetplatform_ids() to get num platforms returned %s.\n", TranslateOpenCLError(err));
-		return NULL;
+		err = clReleaseMemObject(PrimData);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
 	}
-
-	printf("Number of available platforms: %u\n", numPlatforms);
-
-	if (0 == numPlatforms)
+	if (Materials)
 	{
-		printf("Error: No platforms found!\n");
-		return NULL;
+		err = clReleaseMemObject(Materials);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
 	}
-
-	std::vector<cl_platform_id> platforms(numPlatforms);
-
-	// Now, obtains a list of numPlatforms OpenCL platforms available
-	// The list of platforms available will be returned in platforms
-	err = clGetPlatformIDs(numPlatforms, &platforms[0], NULL);
-	if (CL_SUCCESS != err)
+	if (Accum)
 	{
-		printf("Error: clGetplatform_ids() to get platforms returned %s.\n", TranslateOpenCLError(err));
-		return NULL;
+		err = clReleaseMemObject(Accum);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
 	}
-
-	// Check if one of the available platform matches the preferred requirements
-	for (cl_uint i = 0; i < numPlatforms; i++)
+	if (AccumSq)
 	{
-		bool match = true;
-		cl_uint numDevices = 0;
-
-		// If the preferredPlatform is not NULL then check if platforms[i] is the required one
-		// Otherwise, continue the check with platforms[i]
-		if ((NULL != preferredPlatform) && (strlen(preferredPlatform) > 0))
+		err = clReleaseMemObject(AccumSq);
+		if (CL_SUCCESS != err)
 		{
-			// In case we're looking for a specific platform
-			match = CheckPreferredPlatformMatch(platforms[i], preferredPlatform);
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
 		}
-
-		// match is true if the platform's name is the required one or don't care (NULL)
-		if (match)
+	}
+	if (PixelList)
+	{
+		err = clReleaseMemObject(PixelList);
+		if (CL_SUCCESS != err)
 		{
-			// Obtains the number of deviceType devices available on platform
-			// When the function failed we expect numDevices to be zero.
-			// We ignore the function return value since a non-zero error code
-			// could happen if this platform doesn't support the specified device type.
-			err = clGetDeviceIDs(platforms[i], deviceType, 0, NULL, &numDevices);
-			if (CL_SUCCESS != err)
-			{
-				printf("clGetDeviceIDs() returned %s.\n", TranslateOpenCLError(err));
-			}
-
-			if (0 != numDevices)
-			{
-				// There is at list one device that answer the requirements
-				return platforms[i];
-			}
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (WorkCounter)
+	{
+		err = clReleaseMemObject(WorkCounter);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (AliasTable)
+	{
+		err = clReleaseMemObject(AliasTable);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (LightNodes)
+	{
+		err = clReleaseMemObject(LightNodes);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (LightTrails)
+	{
+		err = clReleaseMemObject(LightTrails);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (RayCounts)
+	{
+		err = clReleaseMemObject(RayCounts);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseMemObject returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (commandQueue)
+	{
+		err = clReleaseCommandQueue(commandQueue);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseCommandQueue returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (device)
+	{
+		err = clReleaseDevice(device);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseDevice returned '%s'.\n", TranslateOpenCLError(err));
+		}
+	}
+	if (context)
+	{
+		err = clReleaseContext(context);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clReleaseContext returned '%s'.\n", TranslateOpenCLError(err));
 		}
 	}
 
-	return NULL;
+	/*
+	* Note there is no procedure to deallocate platform
+	* because it was not created at the startup,
+	* but just queried from OpenCL runtime.
+	*/
 }
 
 /*
@@ -522,10 +609,41 @@ int GetWorkGroupInfo(ocl_args_d_t *ocl, size_t globalSize, size_t* localSize)
 	return err;
 }
 
+/*
+* A simple in-order command queue on the device of ocl that doesn't allow execution of two kernels in
+* parallel on it, with profiling on. The image read back adds a second one next to ocl->commandQueue.
+*/
+cl_command_queue CreateCommandQueue(ocl_args_d_t *ocl, cl_int* err)
+{
+	cl_command_queue queue;
+#ifdef CL_VERSION_2_0
+	if (OPENCL_VERSION_2_0 == ocl->deviceVersion)
+	{
+		const cl_command_queue_properties properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+		queue = clCreateCommandQueueWithProperties(ocl->context, ocl->device, properties, err);
+	}
+	else {
+		// default behavior: OpenCL 1.2
+		cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+		queue = clCreateCommandQueue(ocl->context, ocl->device, properties, err);
+	}
+#else
+	// default behavior: OpenCL 1.2
+	cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+	queue = clCreateCommandQueue(ocl->context, ocl->device, properties, err);
+#endif
+	if (CL_SUCCESS != *err)
+	{
+		printf("Error: clCreateCommandQueue() returned %s.\n", TranslateOpenCLError(*err));
+		return NULL;
+	}
+	return queue;
+}
+
 /*
 * This function picks/creates necessary OpenCL objects which are needed.
 * The objects are:
-* OpenCL platform, device, context, and command queue.
+* OpenCL context and command queue for the platform/device picked by SelectOpenCLDevice.
 *
 * All these steps are needed to be performed once in a regular OpenCL application.
 * This happens before actual compute kernels calls are performed.
@@ -535,37 +653,25 @@ int GetWorkGroupInfo(ocl_args_d_t *ocl, size_t globalSize, size_t* localSize)
 * Please, consider reviewing the fields before going further.
 * The structure definition is right in the beginning of this file.
 */
-int SetupOpenCL(ocl_args_d_t *ocl, cl_device_type deviceType)
+int SetupOpenCL(ocl_args_d_t *ocl, const OpenCLDeviceInfo* deviceInfo)
 {
 	// The following variable stores return codes for all OpenCL calls.
 	cl_int err = CL_SUCCESS;
 
-	// Query for all available OpenCL platforms on the system
-	// Here you enumerate all platforms and pick one which name has preferredPlatform as a sub-string
-	cl_platform_id platformId = FindOpenCLPlatform("Intel", deviceType);
-	if (NULL == platformId)
-	{
-		printf("Error: Failed to find OpenCL platform.\n");
-		return CL_INVALID_VALUE;
-	}
+	// The platform and device were picked by SelectOpenCLDevice from the list of all available devices
+	cl_platform_id platformId = deviceInfo->platform;
+	ocl->device = deviceInfo->device;
 
-	// Create context with device of specified type.
-	// Required device type is passed as function argument deviceType.
-	// So you may use this function to create context for any CPU or GPU OpenCL device.
+	printf("Using device: %s | %s (%s)\n", deviceInfo->platformName.c_str(), deviceInfo->deviceName.c_str(),
+		DeviceTypeName(deviceInfo->type));
+
+	// Create context with the selected device.
 	// The creation is synchronized (pfn_notify is NULL) and NULL user_data
 	cl_context_properties contextProperties[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)platformId, 0 };
-	ocl->context = clCreateContextFromType(contextProperties, deviceType, NULL, NULL, &err);
+	ocl->context = clCreateContext(contextProperties, 1, &ocl->device, NULL, NULL, &err);
 	if ((CL_SUCCESS != err) || (NULL == ocl->context))
 	{
-		printf("Couldn't create a context, clCreateContextFromType() returned '%s'.\n", TranslateOpenCLError(err));
-		return err;
-	}
-
-	// Query for OpenCL device which was used for context creation
-	err = clGetContextInfo(ocl->context, CL_CONTEXT_DEVICES, sizeof(cl_device_id), &ocl->device, NULL);
-	if (CL_SUCCESS != err)
-	{
-		printf("Error: clGetContextInfo() to get list of devices returned %s.\n", TranslateOpenCLError(err));
+		printf("Couldn't create a context, clCreateContext() returned '%s'.\n", TranslateOpenCLError(err));
 		return err;
 	}
 
@@ -575,26 +681,9 @@ int SetupOpenCL(ocl_args_d_t *ocl, cl_device_type deviceType)
 	// Create command queue.
 	// OpenCL kernels are enqueued for execution to a particular device through special objects called command queues.
 	// Command queue guarantees some ordering between calls and other OpenCL commands.
-	// Here you create a simple in-order OpenCL command queue that doesn't allow execution of two kernels in parallel on a target device.
-#ifdef CL_VERSION_2_0
-	if (OPENCL_VERSION_2_0 == ocl->deviceVersion)
-	{
-		const cl_command_queue_properties properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
-		ocl->commandQueue = clCreateCommandQueueWithProperties(ocl->context, ocl->device, properties, &err);
-	}
-	else {
-		// default behavior: OpenCL 1.2
-		cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
-		ocl->commandQueue = clCreateCommandQueue(ocl->context, ocl->device, properties, &err);
-	}
-#else
-	// default behavior: OpenCL 1.2
-	cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
-	ocl->commandQueue = clCreateCommandQueue(ocl->context, ocl->device, properties, &err);
-#endif
+	ocl->commandQueue = CreateCommandQueue(ocl, &err);
 	if (CL_SUCCESS != err)
 	{
-		printf("Error: clCreateCommandQueue() returned %s.\n", TranslateOpenCLError(err));
 		return err;
 	}
 
@@ -602,9 +691,10 @@ int SetupOpenCL(ocl_args_d_t *ocl, cl_device_type deviceType)
 }
 
 /*
-* Create and build OpenCL program from its source code
+* Create and build OpenCL program from its source code with buildOptions, or load it from
+* the program cache in cacheDir (NULL: no cache)
 */
-int CreateAndBuildProgram(ocl_args_d_t *ocl)
+int CreateAndBuildProgram(ocl_args_d_t *ocl, const std::string& buildOptions, const char* cacheDir)
 {
 	cl_int err = CL_SUCCESS;
 
@@ -616,60 +706,113 @@ int CreateAndBuildProgram(ocl_args_d_t *ocl)
 	if (CL_SUCCESS != err)
 	{
 		printf("Error: ReadSourceFromFile returned %s.\n", TranslateOpenCLError(err));
-		goto Finish;
+		return err;
 	}
 
-	// And now after you obtained a regular C string call clCreateProgramWithSource to create OpenCL program object.
-	ocl->program = clCreateProgramWithSource(ocl->context, 1, (const char**)&source, &src_size, &err);
+	std::chrono::steady_clock::time_point buildBegin = std::chrono::steady_clock::now();
+	bool fromCache = false;
+	err = BuildProgramCached(ocl->context, ocl->device, std::string(source, src_size), buildOptions.c_str(), cacheDir,
+		&ocl->program, &fromCache);
+	delete[] source;
 	if (CL_SUCCESS != err)
 	{
-		printf("Error: clCreateProgramWithSource returned %s.\n", TranslateOpenCLError(err));
-		goto Finish;
+		return err;
 	}
 
-	// Build the program
-	// During creation a program is not built. You need to explicitly call build function.
-	// Here you just use create-build sequence,
-	// but there are also other possibilities when program consist of several parts,
-	// some of which are libraries, and you may want to consider using clCompileProgram and clLinkProgram as
-	// alternatives.
-	err = clBuildProgram(ocl->program, 1, &ocl->device, "", NULL, NULL);
-	if (CL_SUCCESS != err)
-	{
-		printf("Error: clBuildProgram() for source program returned %s.\n", TranslateOpenCLError(err));
+	double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildBegin).count();
+	printf("Program: %s in %lfs\n", fromCache ? "loaded from the cache" : (cacheDir ? "built and cached" : "built"), buildTime);
+	return CL_SUCCESS;
+}
 
-		// In case of error print the build log to the standard output
-		// First check the size of the log
-		// Then allocate the memory and obtain the log from the program
-		if (err == CL_BUILD_PROGRAM_FAILURE)
-		{
-			size_t log_size = 0;
-			clGetProgramBuildInfo(ocl->program, ocl->device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+/*
+* buildOptions for info's device. The lights, planes and camera are kernel arguments in constant
+* memory; when they are larger than the device's constant buffer (64 KB is common, about 700
+* lights), the program reads them from global memory instead. That is another cache entry.
+*/
+std::string DeviceBuildOptions(const std::string& buildOptions, const OpenCLDeviceInfo& info, const CompiledScene* compiled)
+{
+	cl_ulong constantSize = sizeof(CompiledLight) * compiled->lights.size() + sizeof(CompiledPlane) * compiled->planes.size() +
+		sizeof(CompiledCamera);
+	if (constantSize <= info.constantBufferSize)
+		return buildOptions;
+	return buildOptions + (buildOptions.empty() ? "" : " ") + "-D OCL_CONSTANT_BUFFER=__global";
+}
 
-			std::vector<char> build_log(log_size);
-			clGetProgramBuildInfo(ocl->program, ocl->device, CL_PROGRAM_BUILD_LOG, log_size, &build_log[0], NULL);
+/*
+* Build the program with each of variants for every OpenCL device that can compile it and store
+* the binaries in cacheDir, so that later runs (or other machines with the same devices and drivers) start warm.
+* The lights and planes of compiled decide whether a device gets them in constant memory.
+*/
+int PrecompilePrograms(const std::vector<std::string>& variants, const CompiledScene* compiled, const char* cacheDir)
+{
+	std::vector<OpenCLDeviceInfo> devices;
+	if (CL_SUCCESS != EnumerateOpenCLDevices(&devices))
+	{
+		return -1;
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < devices.size(); i++)
+	{
+		if (!devices[i].available || !devices[i].compilerAvailable)
+			continue;
 
-			printf("Error happened during the build of OpenCL program.\nBuild log:%s", &build_log[0]);
+		ocl_args_d_t ocl;
+		if (CL_SUCCESS != SetupOpenCL(&ocl, &devices[i]))
+		{
+			failed++;
+			continue;
+		}
+		for (size_t v = 0; v < variants.size(); v++)
+		{
+			if (CL_SUCCESS != CreateAndBuildProgram(&ocl, DeviceBuildOptions(variants[v], devices[i], compiled), cacheDir))
+			{
+				failed++;
+			}
+			else
+			{
+				clReleaseProgram(ocl.program);
+				ocl.program = NULL;
+			}
 		}
 	}
 
-Finish:
-	if (source)
+	return failed == 0 ? 0 : -1;
+}
+
+/*
+* Read-only buffer over count records of recordSize bytes at data. The scene arrays live as long
+* as the render, in vectors or a mapped scene file, so the runtime may use them in place
+* (zero-copy on devices that share host memory). OpenCL doesn't allow empty buffers, so an
+* empty array gets one zeroed record; the counts passed to the kernel keep it from being read.
+*/
+static cl_mem CreateSceneBuffer(ocl_args_d_t *ocl, const void* data, size_t recordSize, size_t count,
+	const char* name, cl_int* err)
+{
+	static const char zeros[256] = { 0 };     // more than any scene record
+	double begin = ProfileNow(ocl->profiler);
+	cl_mem buffer;
+	if (count == 0 || data == NULL)
+		buffer = clCreateBuffer(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, recordSize, (void*)zeros, err);
+	else
+		buffer = clCreateBuffer(ocl->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, recordSize * count, (void*)data, err);
+
+	if (CL_SUCCESS != *err)
 	{
-		delete[] source;
-		source = NULL;
+		printf("Error: clCreateBuffer for %s returned %s\n", name, TranslateOpenCLError(*err));
 	}
 
-	return err;
+	// clCreateBuffer has no event; the host side is all that can be timed
+	AddPhase(ocl->profiler, "create buffer", name, PROFILE_HOST, begin, ProfileNow(ocl->profiler));
+	return buffer;
 }
 
-
 /*
 * Create OpenCL buffers from host memory
 * These buffers will be used later by the OpenCL kernel
 */
-int CreateBufferArguments(ocl_args_d_t *ocl, RectangleLight* Lightlist, int LightCount, Plane* Shapelist, int ShapeCount, cl_uint sampleCount, Camera* cam,
-	cl_uint* output, cl_uint* seeds, cl_uint tmpworkAmount, cl_uint width, cl_uint height)
+int CreateBufferArguments(ocl_args_d_t *ocl, CompiledScene* compiled, SceneBVH* bvh,
+	SphereSet* scene, cl_uint sampleCount, cl_uint* output, cl_uint* seeds, cl_uint tmpworkAmount, cl_uint width, cl_uint height)
 {
 	cl_int err = CL_SUCCESS;
 
@@ -679,27 +822,21 @@ int CreateBufferArguments(ocl_args_d_t *ocl, RectangleLight* Lightlist, int Ligh
 	// to better organize data copying.
 	// You use CL_MEM_COPY_HOST_PTR here, because the buffers should be populated with bytes at inputA and inputB.
 
-	ocl->Lights = clCreateBuffer(ocl->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(RectangleLight) * LightCount, Lightlist, &err);
+	// Lights, planes and the camera go to the device in their compiled form (see CompileScene)
+	ocl->LightCount = (cl_uint)compiled->lights.size();
+	ocl->ShapeCount = (cl_uint)compiled->planes.size();
+	ocl->Lights = CreateSceneBuffer(ocl, compiled->lights.empty() ? NULL : &compiled->lights[0],
+		sizeof(CompiledLight), compiled->lights.size(), "Lights", &err);
 	if (CL_SUCCESS != err)
-	{
-		printf("Error: clCreateBuffer for srcA returned %s\n", TranslateOpenCLError(err));
 		return err;
-	}
-
-	ocl->LightCount = LightCount;
-	
-	ocl->Shapes = clCreateBuffer(ocl->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, sizeof(Plane) * ShapeCount, Shapelist, &err);
+	ocl->Shapes = CreateSceneBuffer(ocl, compiled->planes.empty() ? NULL : &compiled->planes[0],
+		sizeof(CompiledPlane), compiled->planes.size(), "Shapes", &err);
 	if (CL_SUCCESS != err)
-	{
-		printf("Error: clCreateBuffer for srcB returned %s\n", TranslateOpenCLError(err));
 		return err;
-	}
-
-	ocl->ShapeCount = ShapeCount;
 
 	ocl->sampleCount = sampleCount;
 	
-	ocl->cam = clCreateBuffer(ocl->context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, sizeof(Camera), cam, &err);
+	ocl->cam = clCreateBuffer(ocl->context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, sizeof(CompiledCamera), &compiled->camera, &err);
 	if (CL_SUCCESS != err)
 	{
 		printf("Error: clCreateBuffer for dstMem returned %s\n", TranslateOpenCLError(err));
@@ -723,25 +860,120 @@ int CreateBufferArguments(ocl_args_d_t *ocl, RectangleLight* Lightlist, int Ligh
 		return err;
 	}
 
-	return CL_SUCCESS;
-}
-
-
-/*
-* Set kernel arguments
-*/
-cl_uint SetKernelArguments(ocl_args_d_t *ocl)
-{
-	cl_int err = CL_SUCCESS;
-
-	err = clSetKernelArg(ocl->kernel, 0, sizeof(cl_mem), (void *)&ocl->Lights);
+	// The BVH goes next to Shapes; NodeCount = 0 skips the traversal
+	ocl->NodeCount = bvh->nodeCount;
+	ocl->Nodes = CreateSceneBuffer(ocl, bvh->nodeData, sizeof(BVHNode), bvh->nodeCount, "Nodes", &err);
 	if (CL_SUCCESS != err)
-	{
-		printf("error: Failed to set argument Lights, returned %s\n", TranslateOpenCLError(err));
 		return err;
-	}
-
-	err = clSetKernelArg(ocl->kernel, 1, sizeof(cl_uint), (void *)&ocl->LightCount);
+	ocl->PrimRefs = CreateSceneBuffer(ocl, bvh->primRefData, sizeof(cl_uint), bvh->primRefCount, "PrimRefs", &err);
+	if (CL_SUCCESS != err)
+		return err;
+
+	// Triangle meshes; they are only reached through PrimRefs
+	ocl->Vertices = CreateSceneBuffer(ocl, scene->m_vertices, sizeof(Point), scene->VertexCount, "Vertices", &err);
+	if (CL_SUCCESS != err)
+		return err;
+	ocl->Triangles = CreateSceneBuffer(ocl, scene->m_triangle, sizeof(Triangle), scene->TriangleCount, "Triangles", &err);
+	if (CL_SUCCESS != err)
+		return err;
+	ocl->MeshColors = CreateSceneBuffer(ocl, scene->m_meshColor, sizeof(Color), scene->MeshCount, "MeshColors", &err);
+	if (CL_SUCCESS != err)
+		return err;
+
+	// Spheres, discs and boxes: one float buffer, the stream offsets go by value
+	ocl->PrimLayout = scene->m_primLayout;
+	ocl->PrimData = CreateSceneBuffer(ocl, scene->m_primData, sizeof(float), scene->PrimDataSize, "PrimData", &err);
+	if (CL_SUCCESS != err)
+		return err;
+	ocl->Materials = CreateSceneBuffer(ocl, scene->m_material, sizeof(Color), scene->MaterialCount, "Materials", &err);
+	if (CL_SUCCESS != err)
+		return err;
+
+	// Light selection (see BuildLightSelection); LightNodeCount = 0 makes the kernel use the alias table
+	LightSelection& selection = compiled->lightSelection;
+	ocl->LightNodeCount = (cl_uint)selection.nodes.size();
+	ocl->LightSamples = selection.samples;
+	ocl->AliasTable = CreateSceneBuffer(ocl, selection.alias.empty() ? NULL : &selection.alias[0],
+		sizeof(LightAlias), selection.alias.size(), "AliasTable", &err);
+	if (CL_SUCCESS != err)
+		return err;
+	ocl->LightNodes = CreateSceneBuffer(ocl, selection.nodes.empty() ? NULL : &selection.nodes[0],
+		sizeof(LightNode), selection.nodes.size(), "LightNodes", &err);
+	if (CL_SUCCESS != err)
+		return err;
+	ocl->LightTrails = CreateSceneBuffer(ocl, selection.trails.empty() ? NULL : &selection.trails[0],
+		sizeof(cl_uint), selection.trails.size(), "LightTrails", &err);
+	if (CL_SUCCESS != err)
+		return err;
+
+	// The accumulation buffer starts at zero and stays on the device between passes
+	std::vector<cl_float> zeroAccum((size_t)width * height * 4, 0.0f);
+	ocl->Accum = clCreateBuffer(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_float) * zeroAccum.size(), &zeroAccum[0], &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateBuffer for Accum returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	ocl->AccumSq = clCreateBuffer(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_float) * width * height, &zeroAccum[0], &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateBuffer for AccumSq returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	// The first pass renders every pixel
+	std::vector<cl_uint> allPixels;
+	SelectAllPixels(width * height, &allPixels);
+	ocl->PixelCount = width * height;
+	ocl->PixelList = clCreateBuffer(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_uint) * allPixels.size(), &allPixels[0], &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateBuffer for PixelList returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+	ocl->PixelOrder.swap(allPixels);
+
+	cl_uint zeroCounter = 0;
+	ocl->WorkCounter = clCreateBuffer(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_uint), &zeroCounter, &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateBuffer for WorkCounter returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	cl_uint zeroRays[RAY_COUNT_KINDS] = { 0, 0 };
+	ocl->RayCounts = clCreateBuffer(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(zeroRays), zeroRays, &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateBuffer for RayCounts returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	return CL_SUCCESS;
+}
+
+
+/*
+* Set kernel arguments
+*/
+cl_uint SetKernelArguments(ocl_args_d_t *ocl)
+{
+	cl_int err = CL_SUCCESS;
+
+	err = clSetKernelArg(ocl->kernel, 0, sizeof(cl_mem), (void *)&ocl->Lights);
+	if (CL_SUCCESS != err)
+	{
+		printf("error: Failed to set argument Lights, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 1, sizeof(cl_uint), (void *)&ocl->LightCount);
 	if (CL_SUCCESS != err)
 	{
 		printf("Error: Failed to set argument LightCount, returned %s\n", TranslateOpenCLError(err));
@@ -791,7 +1023,7 @@ cl_uint SetKernelArguments(ocl_args_d_t *ocl)
 		return err;
 	}
 
-	err = clSetKernelArg(ocl->kernel, 8, sizeof(cl_uint), (void *)&ocl->Seeds);
+	err = clSetKernelArg(ocl->kernel, 8, sizeof(cl_mem), (void *)&ocl->Seeds);
 	if (CL_SUCCESS != err)
 	{
 		printf("Error: Failed to set argument ShapeCount, returned %s\n", TranslateOpenCLError(err));
@@ -805,31 +1037,187 @@ cl_uint SetKernelArguments(ocl_args_d_t *ocl)
 		return err;
 	}
 
+	// Argument 10 is the stage, set for every launch in ExecuteAddKernel or ExecutePersistentKernel
+	err = clSetKernelArg(ocl->kernel, 11, sizeof(cl_mem), (void *)&ocl->Nodes);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument Nodes, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 12, sizeof(cl_uint), (void *)&ocl->NodeCount);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument NodeCount, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 13, sizeof(cl_mem), (void *)&ocl->PrimRefs);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument PrimRefs, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 14, sizeof(cl_mem), (void *)&ocl->Vertices);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument Vertices, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 15, sizeof(cl_mem), (void *)&ocl->Triangles);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument Triangles, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 16, sizeof(cl_mem), (void *)&ocl->MeshColors);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument MeshColors, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 17, sizeof(cl_mem), (void *)&ocl->PrimData);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument PrimData, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 18, sizeof(PrimitiveLayout), (void *)&ocl->PrimLayout);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument PrimLayout, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 19, sizeof(cl_mem), (void *)&ocl->Materials);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument Materials, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 20, sizeof(cl_mem), (void *)&ocl->Accum);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument Accum, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 21, sizeof(cl_mem), (void *)&ocl->AccumSq);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument AccumSq, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 22, sizeof(cl_mem), (void *)&ocl->PixelList);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument PixelList, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 23, sizeof(cl_uint), (void *)&ocl->PixelCount);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument PixelCount, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 24, sizeof(cl_mem), (void *)&ocl->WorkCounter);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument WorkCounter, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 25, sizeof(cl_uint), (void *)&ocl->Persistent);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument Persistent, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 26, sizeof(cl_uint), (void *)&ocl->MaxDepth);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument MaxDepth, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 27, sizeof(cl_mem), (void *)&ocl->AliasTable);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument AliasTable, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 28, sizeof(cl_mem), (void *)&ocl->LightNodes);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument LightNodes, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 29, sizeof(cl_uint), (void *)&ocl->LightNodeCount);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument LightNodeCount, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 30, sizeof(cl_mem), (void *)&ocl->LightTrails);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument LightTrails, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 31, sizeof(cl_uint), (void *)&ocl->LightSamples);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument LightSamples, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 32, sizeof(cl_mem), (void *)&ocl->RayCounts);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument RayCounts, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
 	return err;
 }
 
 
 /*
-* Execute the kernel
+* Execute the kernel over the entries firstPixel (a multiple of workAmount) .. pixelCount - 1 of the pixel list
 */
-cl_uint ExecuteAddKernel(ocl_args_d_t *ocl, cl_uint* Pixels, cl_uint globalSize, cl_uint localSize, cl_uint width, cl_uint height, int workAmount, int workCount)
+cl_uint ExecuteAddKernel(ocl_args_d_t *ocl, cl_uint* Pixels, cl_uint globalSize, cl_uint localSize, cl_uint firstPixel, cl_uint pixelCount, int workAmount)
 {
 	cl_int err = CL_SUCCESS;
 
-	unsigned int remain_size = width * height;
+	// One stage per workAmount entries of the pixel list
+	int workCount = (int)((pixelCount + workAmount - 1) / workAmount);
+	unsigned int remain_size = pixelCount - firstPixel;
 
-	for (int i = 0; i < workCount; i++)
+	for (int i = (int)(firstPixel / workAmount); i < workCount; i++)
 	{
 		// Define global iteration space for clEnqueueNDRangeKernel.
+		// A short last stage is rounded up to whole work-groups; the kernel skips the extra items.
 		unsigned int tmpGlobalSize;
 		if ((i + 1) == workCount && (remain_size % workAmount != 0))
-			tmpGlobalSize = remain_size;
+			tmpGlobalSize = (remain_size + localSize - 1) / localSize * localSize;
 		else
 			tmpGlobalSize = globalSize;
 
 		remain_size = remain_size - globalSize;
-		if (tmpGlobalSize < localSize)
-			localSize = tmpGlobalSize;
 
 		size_t globalWorkSize[1] = { tmpGlobalSize };
 		size_t localWorkSize[1] = { localSize };
@@ -842,7 +1230,7 @@ cl_uint ExecuteAddKernel(ocl_args_d_t *ocl, cl_uint* Pixels, cl_uint globalSize,
 		}
 
 		// execute kernel
-		err = clEnqueueNDRangeKernel(ocl->commandQueue, ocl->kernel, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL);
+		err = clEnqueueNDRangeKernel(ocl->commandQueue, ocl->kernel, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, ProfileEvent(ocl->profiler, "ray_cal"));
 		if (CL_SUCCESS != err)
 		{
 			printf("Error: Failed to run kernel, return %s\n", TranslateOpenCLError(err));
@@ -856,202 +1244,2515 @@ cl_uint ExecuteAddKernel(ocl_args_d_t *ocl, cl_uint* Pixels, cl_uint globalSize,
 
 
 /*
-* "Read" the result buffer (mapping the buffer to the host memory address)
+* Persistent-threads launch: a single NDRange of globalSize work items renders the pixel list up to
+* the PixelCount argument. The work-groups take batches of localSize entries from WorkCounter,
+* which starts at firstPixel.
 */
-bool ReleaseInfo(ocl_args_d_t *ocl, cl_uint width, cl_uint height)
+cl_uint ExecutePersistentKernel(ocl_args_d_t *ocl, cl_uint globalSize, cl_uint localSize, cl_uint firstPixel)
 {
 	cl_int err = CL_SUCCESS;
-	bool result = true;
-
-	// Enqueue a command to map the buffer object (ocl->dstMem) into the host address space and returns a pointer to it
-	// The map operation is blocking
-	cl_uint *resultPtr = (cl_uint *)clEnqueueMapBuffer(ocl->commandQueue, ocl->Pixels, true, CL_MAP_READ, 0, sizeof(cl_uint) * width * height, 0, NULL, NULL, &err);
 
+	err = clEnqueueWriteBuffer(ocl->commandQueue, ocl->WorkCounter, CL_TRUE, 0, sizeof(cl_uint), &firstPixel, 0, NULL, ProfileEvent(ocl->profiler, "write WorkCounter"));
 	if (CL_SUCCESS != err)
 	{
-		printf("Error: clEnqueueMapBuffer returned %s\n", TranslateOpenCLError(err));
-		return false;
+		printf("Error: clEnqueueWriteBuffer for WorkCounter returned %s\n", TranslateOpenCLError(err));
+		return err;
 	}
 
-	// Call clFinish to guarantee that output region is updated
-	err = clFinish(ocl->commandQueue);
+	// The stage isn't read in this mode, but every argument has to be set
+	cl_uint stage = 0;
+	err = clSetKernelArg(ocl->kernel, 10, sizeof(cl_uint), (void *)&stage);
 	if (CL_SUCCESS != err)
 	{
-		printf("Error: clFinish returned %s\n", TranslateOpenCLError(err));
+		printf("Error: Failed to set argument stage, returned %s\n", TranslateOpenCLError(err));
+		return err;
 	}
 
-	// Unmapped the output buffer before releasing it
-	err = clEnqueueUnmapMemObject(ocl->commandQueue, ocl->Pixels, resultPtr, 0, NULL, NULL);
+	size_t globalWorkSize[1] = { globalSize };
+	size_t localWorkSize[1] = { localSize };
+	err = clEnqueueNDRangeKernel(ocl->commandQueue, ocl->kernel, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, ProfileEvent(ocl->profiler, "ray_cal"));
 	if (CL_SUCCESS != err)
 	{
-		printf("Error: clEnqueueUnmapMemObject returned %s\n", TranslateOpenCLError(err));
+		printf("Error: Failed to run kernel, return %s\n", TranslateOpenCLError(err));
+		return err;
 	}
 
-	std::ostringstream headerStream;
-	headerStream << "P6\n";
-	headerStream << kWidth << ' ' << kHeight << '\n';
-	headerStream << "255\n";
-	std::ofstream fileStream("out.ppm", std::ios::out | std::ios::binary);
+	return CL_SUCCESS;
+}
 
-	fileStream << headerStream.str();
-	for (unsigned int y = 0; y < height; y++)
-	{
-		for (unsigned int x = 0; x < width; x++)
-		{
-			unsigned char r, g, b;
-			unsigned int tmp = resultPtr[y*width + x];
-			r = (unsigned char)((tmp >> 16) & 0xFF);
-			g = (unsigned char)((tmp >> 8) & 0xFF);
-			b = (unsigned char)((tmp)& 0xFF);
-			fileStream << r << g << b;
-		}
-	}
 
-	fileStream.flush();
-	fileStream.close();
+/*
+* Render the pixels tile by tile: tileWidth x tileHeight tiles in Morton order (SelectTiledPixels)
+* become the pixel list of the first pass and the order of the adaptive ones. With a tile of
+* one work-group, consecutive work-groups take neighbouring square tiles.
+*/
+int SetPixelOrder(ocl_args_d_t *ocl, cl_uint width, cl_uint height, cl_uint tileWidth, cl_uint tileHeight)
+{
+	SelectTiledPixels(width, height, tileWidth, tileHeight, &ocl->PixelOrder);
 
-	return result;
+	cl_int err = clEnqueueWriteBuffer(ocl->commandQueue, ocl->PixelList, CL_TRUE, 0, sizeof(cl_uint) * ocl->PixelOrder.size(),
+		&ocl->PixelOrder[0], 0, NULL, ProfileEvent(ocl->profiler, "write PixelList"));
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueWriteBuffer for PixelList returned %s\n", TranslateOpenCLError(err));
+	}
+	return err;
 }
 
-void generateArgument(SphereSet* tmpSphereSet, Camera* tmpCam, cl_uint* tmpSeeds)
+// The most square power-of-two tile of groupSize pixels: 8x8 for 64, 16x8 for 128, 16x16 for 256
+void AutoTileShape(size_t groupSize, cl_uint* tileWidth, cl_uint* tileHeight)
 {
-	tmpSphereSet->m_rectLight = new RectangleLight[2];
-	tmpSphereSet->m_plane = new Plane[1];
-	tmpSphereSet->PlaneCount = 1;
-	Point tmp_p = { 0.0f, -2.0f, 0.0f };
-	Vector tmp_v1 = { 0.0f, 1.0f, 0.0f };
-	Vector tmp_v2 = { 0.0f, 0.0f, 0.0f };
-	Color tmp_c = { 1.0f, 1.0f, 1.0f };
-
-	float tmp_power = 0.0;
-	int i = 0;
-
-	// Plane Set
-	tmpSphereSet->m_plane[0] = { tmp_p, tmp_v1, tmp_c };
-
-	// Rectangle Light Set
-	tmpSphereSet->LightCount = 2;
-	tmp_p = { 2.5f, 2.0f, -2.5f };
-	tmp_v1 = { 5.0f, 0.0f, 0.0f };
-	tmp_v2 = { 0.0f, 0.0f, 5.0f };
-	tmp_c = { 1.0f, 0.5f, 1.0f };
-	tmp_power = 3.0f;
-	tmpSphereSet->m_rectLight[0] = { tmp_p, tmp_v1, tmp_v2, tmp_c, tmp_power };
-	
-	tmp_p = { -2.0f, -1.0f, -2.0f };
-	tmp_v1 = { 4.0f, 0.0f, 0.0f };
-	tmp_v2 = { 0.0f, 0.0f, 4.0f };
-	tmp_c = { 1.0f, 1.0f, 0.5f };
-	tmp_power = 0.75f;
-	tmpSphereSet->m_rectLight[1] = { tmp_p, tmp_v1, tmp_v2, tmp_c, tmp_power };
-	
-	Point tmp_p1 = { 0.0f, 5.0f, 15.0f };
-	Point tmp_p2 = { 0.0f, 0.0f, 0.0f };
-	Point tmp_p3 = { 0.0f, 1.0f, 0.0f };
-
-	*tmpCam = {45.0f, tmp_p1, tmp_p2, tmp_p3};
-
-	srand((unsigned int)time(NULL));
+	cl_uint width = 1;
+	while ((size_t)width * width < groupSize)
+		width *= 2;
+	*tileWidth = width;
+	*tileHeight = std::max((cl_uint)(groupSize / width), (cl_uint)1);
+}
 
-	for (i = 0; i < workAmount; i++)
+/*
+* Add the rays the kernels counted since the last call to rays (RAY_COUNT_KINDS entries) and
+* start the device counters over. They are 32-bit, so this is done after every pass.
+*/
+bool ReadRayCounts(ocl_args_d_t *ocl, unsigned long long* rays)
+{
+	cl_uint counts[RAY_COUNT_KINDS];
+	cl_int err = clEnqueueReadBuffer(ocl->commandQueue, ocl->RayCounts, CL_TRUE, 0, sizeof(counts), counts, 0, NULL,
+		ProfileEvent(ocl->profiler, "read RayCounts"));
+	if (CL_SUCCESS != err)
 	{
-		tmpSeeds[i] = rand();
-		if (tmpSeeds[i] < 2)
-			tmpSeeds[i] = 2;
+		printf("Error: clEnqueueReadBuffer for RayCounts returned %s\n", TranslateOpenCLError(err));
+		return false;
 	}
+	for (int k = 0; k < RAY_COUNT_KINDS; k++)
+		rays[k] += counts[k];
 
+	cl_uint zeroRays[RAY_COUNT_KINDS] = { 0, 0 };
+	err = clEnqueueWriteBuffer(ocl->commandQueue, ocl->RayCounts, CL_TRUE, 0, sizeof(zeroRays), zeroRays, 0, NULL,
+		ProfileEvent(ocl->profiler, "write RayCounts"));
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueWriteBuffer for RayCounts returned %s\n", TranslateOpenCLError(err));
+		return false;
+	}
+	return true;
 }
 
-int main(int argc, char **argv)
+
+/*
+* "Read" the image (mapping the buffer to the host memory address) and queue it on writer:
+* the packed pixels for 8-bit formats, the float4 accumulation buffer for float formats
+*/
+bool ReleaseInfo(ocl_args_d_t *ocl, ImageWriter* writer, cl_uint width, cl_uint height, const char* fileName)
 {
-	cl_int err;
-	ocl_args_d_t ocl;
-	cl_device_type deviceType = CL_DEVICE_TYPE_GPU;
-
-	cl_uint arrayWidth = kWidth;
-	cl_uint arrayHeight = kHeight;
-	cl_uint sampleCount = kNumPixelSamples;
-	cl_uint workCount;
-	cl_uint globalWorkSize = workAmount;
-	cl_uint localWorkSize;
-	if ((arrayWidth * arrayHeight) % workAmount == 0)
-		workCount = (arrayWidth * arrayHeight) / workAmount;
-	else
-		workCount = (arrayWidth * arrayHeight) / workAmount + 1;
+	cl_int err = CL_SUCCESS;
+	ImageFormat format = IMAGE_PPM;
+	ImageFormatFromName(fileName, &format);
+	const bool floatImage = IsFloatFormat(format);
+	cl_mem image = floatImage ? ocl->Accum : ocl->Pixels;
+	size_t imageSize = floatImage ? sizeof(cl_float) * 4 * width * height : sizeof(cl_uint) * width * height;
 
-	ocl.width = kWidth;
-	ocl.height = kHeight;
-	
-	clock_t begin, end;
+	// Enqueue a command to map the buffer object into the host address space and returns a pointer to it
+	// The map operation is blocking
+	void *resultPtr = clEnqueueMapBuffer(ocl->commandQueue, image, true, CL_MAP_READ, 0, imageSize, 0, NULL,
+		ProfileEvent(ocl->profiler, floatImage ? "map Accum" : "map Pixels"), &err);
 
-	SphereSet masterSet;
-	Camera cam;
-	//initialize Open CL objects (context, queue, etc.)
-	if (CL_SUCCESS != SetupOpenCL(&ocl, deviceType))
+	if (CL_SUCCESS != err)
 	{
-		return -1;
+		printf("Error: clEnqueueMapBuffer returned %s\n", TranslateOpenCLError(err));
+		return false;
 	}
 
-	// allocate working buffers. 
-	// the buffer should be aligned with 4K page and size should fit 64-byte cached line
-	cl_uint optimizedSize = ((sizeof(cl_uint) * arrayWidth * arrayHeight - 1) / 64 + 1) * 64;
-	cl_uint Seeds[workAmount * 2];
-	cl_uint* Pixels = (cl_uint*)_aligned_malloc(optimizedSize, 4096);
-
-	generateArgument(&masterSet, &cam, Seeds);
-
-	begin = clock();
-	
-	// Create OpenCL buffers from host memory
-	// These buffers will be used later by the OpenCL kernel
-	if (CL_SUCCESS != CreateBufferArguments(&ocl, masterSet.m_rectLight, masterSet.LightCount, 
-		masterSet.m_plane, masterSet.PlaneCount, sampleCount, &cam, Pixels, Seeds, workAmount, arrayWidth, arrayHeight))
+	// Call clFinish to guarantee that output region is updated
+	err = clFinish(ocl->commandQueue);
+	if (CL_SUCCESS != err)
 	{
-		return -1;
+		printf("Error: clFinish returned %s\n", TranslateOpenCLError(err));
 	}
 
-	// Create and build the OpenCL program
-	if (CL_SUCCESS != CreateAndBuildProgram(&ocl))
+	// The mapped pointer is only valid until the unmap; Write copies the image before it returns
+	// and the writer thread encodes and writes it while the next pass renders
+	if (floatImage)
+		writer->Write(fileName, NULL, (const float*)resultPtr, width, height);
+	else
+		writer->Write(fileName, (const cl_uint*)resultPtr, NULL, width, height);
+
+	// Unmapped the output buffer before releasing it
+	err = clEnqueueUnmapMemObject(ocl->commandQueue, image, resultPtr, 0, NULL, ProfileEvent(ocl->profiler, floatImage ? "unmap Accum" : "unmap Pixels"));
+	if (CL_SUCCESS != err)
 	{
-		return -1;
+		printf("Error: clEnqueueUnmapMemObject returned %s\n", TranslateOpenCLError(err));
 	}
 
+	return true;
+}
+
+// preview plus the extension of the output file, so the preview is in the same format
+std::string PreviewFileName(const char* outputFile)
+{
+	const char* extension = strrchr(outputFile, '.');
+	return std::string("preview") + (extension ? extension : ".ppm");
+}
+
+// Random seeds of the first workAmount work items; later ones are added where they are needed
+void GenerateSeeds(cl_uint* tmpSeeds, unsigned int seed)
+{
+	srand(seed);
+
+	for (size_t i = 0; i < workAmount * 2; i++)
+	{
+		tmpSeeds[i] = rand();
+		if (tmpSeeds[i] < 2)
+			tmpSeeds[i] = 2;
+	}
+}
+
+enum RenderBackend
+{
+	BACKEND_OPENCL,
+	BACKEND_CPU
+};
+
+// How the OpenCL path launches its work
+enum KernelSchedule
+{
+	SCHEDULE_STAGES,        // one ray_cal launch per WORK_AMOUNT pixels
+	SCHEDULE_PERSISTENT,    // one ray_cal launch per pass, work-groups pull pixel batches
+	SCHEDULE_WAVEFRONT      // wf_* kernels over global path queues
+};
+
+/*
+* A mesh file to load, with the placement given before it on the command line
+*/
+struct MeshOption
+{
+	const char*     fileName;
+	float           scale;
+	Vector          offset;
+	Color           color;
+};
+
+/*
+* Options read from the command line
+*/
+struct RenderOptions
+{
+	RenderBackend   backend;      // which path renders the image
+	unsigned int    threadCount;  // worker threads of the CPU path (0 = one per hardware thread)
+	PacketIsa       simd;         // instruction set of the CPU path's ray packets
+	DeviceSelection device;       // which OpenCL device the OpenCL path runs on
+	bool            allDevices;   // render on every usable OpenCL device together
+	std::vector<DeviceSelection> devices; // render on these devices together; empty: on device alone
+	unsigned int    splitDevices; // sub-devices each device is partitioned into (0 = whole devices)
+	bool            listDevices;  // print all OpenCL devices and exit
+	const char*     kernelCache;  // directory of the program cache, NULL to build from source every time
+	bool            precompile;   // fill the program cache for every device and exit
+	const char*     sceneFile;    // text or binary scene file, NULL for the default scene
+	const char*     writeScene;   // write the scene as a binary scene file and exit
+	const char*     cameraPath;   // render an animation along the keys of this camera path, NULL for one image
+	unsigned int    frameCount;   // frames of the animation (0 = one per key)
+	bool            hasCamera;    // camera replaces the one of the scene
+	Camera          camera;
+	bool            specialize;   // bake the image size, samples per pass and small light/plane counts into the program
+	unsigned int    width;        // image size in pixels
+	unsigned int    height;
+	std::vector<MeshOption> meshes;
+	MeshData        builtMeshes;  // meshes made in memory (by the benchmark), added like the mesh files
+	AnalyticPrimitives shapes;    // spheres, discs and boxes from the command line
+	unsigned int    sampleBudget; // samples per pixel in total
+	unsigned int    passSamples;  // samples per pixel added by one pass (progressive rendering)
+	double          timeLimit;    // seconds; no pass is started that would end past it (0 = no limit)
+	const char*     outputFile;   // .ppm, .png, .pfm or .exr, NULL to write no image
+	bool            preview;      // write the image so far to preview.<extension of outputFile> after every pass
+	float           adaptiveError; // later passes only render pixels with a larger PixelError (0 = off)
+	const char*     sampleMap;    // PGM file for the final samples per pixel, or NULL
+	unsigned int    maxDepth;     // diffuse bounces per path (0 = emitted light only)
+	KernelSchedule  schedule;
+	bool            tileAuto;     // tiles of one work-group of the OpenCL path
+	unsigned int    tileWidth;    // pixel order of the OpenCL path: tiles in Morton order, 0 = row by row
+	unsigned int    tileHeight;
+	std::vector<RectangleLight> lights; // rectangle lights from the command line, added to the default ones
+	LightSelectMode lightSelect;
+	unsigned int    lightSamples; // lights sampled per hit
+	const char*     profileFile;  // JSON timing report of the run, or NULL
+	const char*     traceFile;    // the same timing as a Chrome trace, or NULL
+	unsigned int    seed;         // of the random number seeds, 0 to take it from the clock
+	bool            benchmark;    // run the benchmark suite instead of one render
+	unsigned int    benchRepetitions;   // timed renders per case and backend
+	unsigned int    benchWarmup;        // untimed renders before them
+	const char*     benchJSON;    // benchmark results as JSON, or NULL
+	const char*     benchCSV;     // the same as CSV, which -bench-baseline reads back
+	const char*     benchBaseline;
+	const char*     daemonSocket; // serve render jobs on this Unix domain socket instead of rendering
+	double          benchTolerance; // slowdown against the baseline that counts as a regression
+};
+
+void PrintUsage(const char* program)
+{
+	printf("Usage: %s [-backend ocl|cpu] [-threads N] [-simd auto|off|sse|avx2|avx512]\n", program);
+	printf("          [-device auto|fastest|gpu|cpu|N|name] [-devices all|X,Y,...] [-split-devices N] [-list-devices]\n");
+	printf("          [-kernel-cache dir|off] [-precompile]\n");
+	printf("          [-specialize on|off] [-schedule persistent|stages|wavefront] [-tile auto|off|WxH] [-size WxH]\n");
+	printf("          [-scene file] [-write-scene file.rtscene] [-camera x,y,z,tx,ty,tz,ux,uy,uz,fov]\n");
+	printf("          [-camera-path file] [-frames N]\n");
+	printf("          [-mesh-scale s] [-mesh-offset x,y,z] [-mesh-color r,g,b] [-mesh file.obj|file.ply]...\n");
+	printf("          [-shape-color r,g,b] [-sphere x,y,z,r] [-disc x,y,z,nx,ny,nz,r] [-box x0,y0,z0,x1,y1,z1]...\n");
+	printf("          [-spp N] [-pass-spp N] [-time-limit s] [-output file] [-preview] [-adaptive error] [-sample-map file.pgm]\n");
+	printf("          [-max-depth N] [-light-select auto|alias|bvh] [-light-samples N]\n");
+	printf("          [-light-color r,g,b] [-light x,y,z,ux,uy,uz,vx,vy,vz,power]...\n");
+	printf("          [-profile file.json] [-trace file.json]\n");
+	printf("          [-benchmark] [-bench-reps N] [-bench-warmup N] [-bench-json file] [-bench-csv file]\n");
+	printf("          [-bench-baseline file.csv] [-bench-tolerance t] [-daemon socket]\n");
+	printf("  -backend ocl  render with the OpenCL kernel (default)\n");
+	printf("  -backend cpu  render with the native multithreaded CPU path\n");
+	printf("  -threads N    worker threads of the CPU path (default: all hardware threads)\n");
+	printf("  -simd X       trace the CPU path's camera and shadow rays in SIMD packets of 4 (sse), 8 (avx2)\n");
+	printf("                or 16 (avx512) rays; auto takes the widest the CPU has (default), off traces them one by one\n");
+	printf("  -device X     OpenCL device: auto (fastest GPU, else fastest CPU; default), fastest,\n");
+	printf("                gpu, cpu, an index from -list-devices or a platform/device name sub-string\n");
+	printf("  -devices X,Y  render on several OpenCL devices together, each given as for -device, or on all of them;\n");
+	printf("                every pass is cut into chunks of the pixel list that go to whichever device is idle,\n");
+	printf("                sized by the speed it showed so far, and the sums are added up on the host\n");
+	printf("  -split-devices N\n");
+	printf("                partition each device into N sub-devices with a queue of their own\n");
+	printf("  -list-devices print every OpenCL platform/device and exit\n");
+	printf("  -kernel-cache dir\n");
+	printf("                keep built programs in dir and load them from there on later runs (default %s);\n", PROGRAM_CACHE_DIR);
+	printf("                off builds ray_algorithm.cl every time\n");
+	printf("  -precompile   build the program for every OpenCL device into the kernel cache and exit;\n");
+	printf("                with -specialize on, both the generic program and the one for this command line\n");
+	printf("  -specialize on   build the program for this image size, samples per pass and, up to %u each,\n", SPEC_MAX_COUNT);
+	printf("                   light and plane count, so they are constants to the compiler (default)\n");
+	printf("  -specialize off  build the generic program that takes them all as kernel arguments\n");
+	printf("  -schedule persistent  one kernel launch per pass; work-groups pull pixel batches from an atomic counter (default)\n");
+	printf("  -schedule stages      one kernel launch per %u pixels\n", (unsigned int)workAmount);
+	printf("  -schedule wavefront   separate generate/extend/shade/shadow/accumulate kernels over compacted path queues\n");
+	printf("  -tile WxH     work-groups of the OpenCL path render WxH pixel tiles, issued in Morton order\n");
+	printf("  -tile auto    tiles of one work-group, as square as a power of two allows (default)\n");
+	printf("  -tile off     render the pixels row by row\n");
+	printf("  -size WxH     image size in pixels (default %ux%u)\n", (unsigned int)kWidth, (unsigned int)kHeight);
+	printf("  -scene file   render a text scene file, or a binary one written by -write-scene (default: built-in scene)\n");
+	printf("  -write-scene f  write the scene, with its BVH, as a binary scene file and exit; loading that maps it\n");
+	printf("                into memory and hands it to the device without parsing\n");
+	printf("  -camera       look from x,y,z at tx,ty,tz with up direction ux,uy,uz and a field of view in degrees,\n");
+	printf("                instead of the scene's camera\n");
+	printf("  -camera-path f  render an animation along the camera keys in f, one image per frame named like\n");
+	printf("                -output with the frame number (out_0000.ppm, ...). Devices, program and buffers are\n");
+	printf("                set up once; per frame only the camera is uploaded and the sums are cleared\n");
+	printf("  -frames N     frames of the animation, spread evenly from the first key to the last (default: one per key)\n");
+	printf("  -mesh file    add a Wavefront OBJ or binary PLY triangle mesh (repeatable)\n");
+	printf("  -mesh-scale, -mesh-offset, -mesh-color\n");
+	printf("                placement and color of the meshes that follow (default 1, 0,0,0, 0.8,0.8,0.8)\n");
+	printf("  -spp N        samples per pixel in total (default %u)\n", (unsigned int)kNumPixelSamples);
+	printf("  -pass-spp N   render progressively, adding N samples per pixel per pass (default: all in one pass)\n");
+	printf("  -time-limit s stop after the last pass that fits into s seconds, even below -spp\n");
+	printf("  -output file  image file; .ppm and .png get 8-bit color, .pfm and .exr the float mean of the samples\n");
+	printf("                (default out.ppm). Images are written on a background thread\n");
+	printf("  -preview      write the image so far to preview.<extension of -output> after every pass\n");
+	printf("  -adaptive e   after every pass keep sampling only the pixels whose relative error is above e\n");
+	printf("                (passes of %u samples per pixel unless -pass-spp is given)\n", ADAPTIVE_PASS_SAMPLES);
+	printf("  -sample-map f write the samples per pixel as a PGM image\n");
+	printf("  -max-depth N  diffuse bounces per path; 1 is direct light only (default %u)\n", PATH_MAX_DEPTH);
+	printf("  -light-select alias  pick the lights sampled at a hit by their power\n");
+	printf("  -light-select bvh    pick them by their power and how close and well oriented they are, from a light BVH\n");
+	printf("  -light-select auto   bvh for scenes with %u lights or more, otherwise alias (default)\n", LIGHT_BVH_MIN_LIGHTS);
+	printf("  -light-samples N     lights sampled per hit (default 1)\n");
+	printf("  -light        add a rectangle light (corner, two sides, power) in the color of the last\n");
+	printf("                -light-color (default 1,1,1)\n");
+	printf("  -sphere, -disc, -box\n");
+	printf("                add a sphere (center, radius), disc (center, normal, radius) or axis-aligned box\n");
+	printf("                (two corners) in the color of the last -shape-color (default 0.8,0.8,0.8)\n");
+	printf("  -profile f    write the wall time of every phase and the queued/submit/start/end time of every\n");
+	printf("                OpenCL command (from its profiling event) to f as JSON\n");
+	printf("  -trace f      write the same timing as a Chrome trace (chrome://tracing, ui.perfetto.dev)\n");
+	printf("  -benchmark    render the fixed benchmark scenes on the CPU path and the OpenCL device and report\n");
+	printf("                startup time, time per sample and primary, closest-hit and shadow Mrays/s\n");
+	printf("  -bench-reps N, -bench-warmup N\n");
+	printf("                timed and untimed renders per case and backend (default 5 and 1)\n");
+	printf("  -bench-json f, -bench-csv f\n");
+	printf("                write the benchmark results as JSON or CSV\n");
+	printf("  -bench-baseline f  compare to a CSV of an earlier -bench-csv and fail on a regression of more\n");
+	printf("                than -bench-tolerance (default 0.1, i.e. 10%%)\n");
+	printf("  -daemon path  take render jobs on a Unix domain socket at path and keep the devices, programs and\n");
+	printf("                scene buffers of recent jobs set up for the next ones; the other options are the\n");
+	printf("                defaults of every job\n");
+}
+
+// Parse "x,y,z" into three floats
+static bool ParseFloat3(const char* text, float* x, float* y, float* z)
+{
+	return sscanf(text, "%f,%f,%f", x, y, z) == 3;
+}
+
+bool ParseCommandLine(int argc, char **argv, RenderOptions* options)
+{
+	options->backend = BACKEND_OPENCL;
+	options->threadCount = 0;
+	options->simd = PACKET_ISA_AUTO;
+	options->listDevices = false;
+	options->kernelCache = PROGRAM_CACHE_DIR;
+	options->precompile = false;
+	options->specialize = true;
+	options->sceneFile = NULL;
+	options->writeScene = NULL;
+	options->cameraPath = NULL;
+	options->frameCount = 0;
+	options->hasCamera = false;
+	options->width = (unsigned int)kWidth;
+	options->height = (unsigned int)kHeight;
+	options->meshes.clear();
+	options->shapes = AnalyticPrimitives();
+	options->sampleBudget = (unsigned int)kNumPixelSamples;
+	options->passSamples = 0;
+	options->timeLimit = 0.0;
+	options->outputFile = "out.ppm";
+	options->preview = false;
+	options->adaptiveError = 0.0f;
+	options->sampleMap = NULL;
+	options->maxDepth = PATH_MAX_DEPTH;
+	options->schedule = SCHEDULE_PERSISTENT;
+	options->tileAuto = true;
+	options->tileWidth = 0;
+	options->tileHeight = 0;
+	options->lights.clear();
+	options->lightSelect = LIGHT_SELECT_AUTO;
+	options->lightSamples = 1;
+	options->profileFile = NULL;
+	options->traceFile = NULL;
+	options->seed = 0;
+	options->benchmark = false;
+	options->benchRepetitions = 5;
+	options->benchWarmup = 1;
+	options->benchJSON = NULL;
+	options->benchCSV = NULL;
+	options->benchBaseline = NULL;
+	options->benchTolerance = 0.1;
+	options->daemonSocket = NULL;
+	ParseDeviceSelection("auto", &options->device);
+	options->allDevices = false;
+	options->splitDevices = 0;
+
+	// Shapes share one material until the next -shape-color
+	Color shapeColor = { 0.8f, 0.8f, 0.8f };
+	int shapeMaterial = -1;
+	Color lightColor = { 1.0f, 1.0f, 1.0f };
+	float values[10];
+
+	MeshOption mesh;
+	mesh.fileName = NULL;
+	mesh.scale = 1.0f;
+	mesh.offset = { 0.0f, 0.0f, 0.0f };
+	mesh.color = { 0.8f, 0.8f, 0.8f };
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-backend") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "ocl") == 0 || strcmp(argv[i], "opencl") == 0)
+			{
+				options->backend = BACKEND_OPENCL;
+			}
+			else if (strcmp(argv[i], "cpu") == 0)
+			{
+				options->backend = BACKEND_CPU;
+			}
+			else
+			{
+				printf("Error: Unknown backend '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-schedule") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "persistent") == 0)
+			{
+				options->schedule = SCHEDULE_PERSISTENT;
+			}
+			else if (strcmp(argv[i], "stages") == 0)
+			{
+				options->schedule = SCHEDULE_STAGES;
+			}
+			else if (strcmp(argv[i], "wavefront") == 0)
+			{
+				options->schedule = SCHEDULE_WAVEFRONT;
+			}
+			else
+			{
+				printf("Error: Unknown schedule '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+		{
+			options->threadCount = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-simd") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "auto") == 0)
+			{
+				options->simd = PACKET_ISA_AUTO;
+			}
+			else if (strcmp(argv[i], "off") == 0)
+			{
+				options->simd = PACKET_ISA_OFF;
+			}
+			else if (strcmp(argv[i], "sse") == 0)
+			{
+				options->simd = PACKET_ISA_SSE;
+			}
+			else if (strcmp(argv[i], "avx2") == 0)
+			{
+				options->simd = PACKET_ISA_AVX2;
+			}
+			else if (strcmp(argv[i], "avx512") == 0)
+			{
+				options->simd = PACKET_ISA_AVX512;
+			}
+			else
+			{
+				printf("Error: Unknown instruction set '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-device") == 0 && i + 1 < argc)
+		{
+			ParseDeviceSelection(argv[++i], &options->device);
+		}
+		else if (strcmp(argv[i], "-devices") == 0 && i + 1 < argc)
+		{
+			ParseDeviceList(argv[++i], &options->allDevices, &options->devices);
+		}
+		else if (strcmp(argv[i], "-split-devices") == 0 && i + 1 < argc)
+		{
+			options->splitDevices = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-list-devices") == 0)
+		{
+			options->listDevices = true;
+		}
+		else if (strcmp(argv[i], "-kernel-cache") == 0 && i + 1 < argc)
+		{
+			i++;
+			options->kernelCache = (strcmp(argv[i], "off") == 0) ? NULL : argv[i];
+		}
+		else if (strcmp(argv[i], "-precompile") == 0)
+		{
+			options->precompile = true;
+		}
+		else if (strcmp(argv[i], "-scene") == 0 && i + 1 < argc)
+		{
+			options->sceneFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-write-scene") == 0 && i + 1 < argc)
+		{
+			options->writeScene = argv[++i];
+		}
+		else if (strcmp(argv[i], "-specialize") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "on") == 0)
+			{
+				options->specialize = true;
+			}
+			else if (strcmp(argv[i], "off") == 0)
+			{
+				options->specialize = false;
+			}
+			else
+			{
+				printf("Error: -specialize expects on or off, got '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-tile") == 0 && i + 1 < argc)
+		{
+			i++;
+			options->tileAuto = (strcmp(argv[i], "auto") == 0);
+			options->tileWidth = options->tileHeight = 0;
+			if (!options->tileAuto && strcmp(argv[i], "off") != 0 &&
+				(sscanf(argv[i], "%ux%u", &options->tileWidth, &options->tileHeight) != 2 || options->tileWidth == 0 || options->tileHeight == 0))
+			{
+				printf("Error: -tile expects auto, off or WxH, got '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+		{
+			if (sscanf(argv[++i], "%ux%u", &options->width, &options->height) != 2)
+			{
+				printf("Error: -size expects WxH, got '%s'.\n", argv[i]);
+				return false;
+			}
+			// Pixel counts are cl_uint and buffer sizes size_t; neither may wrap
+			unsigned long long values = (unsigned long long)options->width * options->height * PIXEL_MAX_VALUES;
+			if (options->width == 0 || options->height == 0 || values > 0xFFFFFFFFULL || values * sizeof(cl_float) > (size_t)-1)
+			{
+				printf("Error: -size %s is out of range; the image needs 1 to %u pixels.\n", argv[i], (unsigned int)(0xFFFFFFFFULL / PIXEL_MAX_VALUES));
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-camera") == 0 && i + 1 < argc)
+		{
+			if (!ParseSceneValues(argv[++i], values, 10))
+			{
+				printf("Error: -camera expects 10 comma-separated numbers, got '%s'.\n", argv[i]);
+				return false;
+			}
+			Camera camera = { values[9], { values[0], values[1], values[2] }, { values[3], values[4], values[5] },
+				{ values[6], values[7], values[8] }, 1.0f };
+			options->camera = camera;
+			options->hasCamera = true;
+		}
+		else if (strcmp(argv[i], "-camera-path") == 0 && i + 1 < argc)
+		{
+			options->cameraPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+		{
+			options->frameCount = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-spp") == 0 && i + 1 < argc)
+		{
+			options->sampleBudget = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-pass-spp") == 0 && i + 1 < argc)
+		{
+			options->passSamples = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-time-limit") == 0 && i + 1 < argc)
+		{
+			options->timeLimit = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-output") == 0 && i + 1 < argc)
+		{
+			ImageFormat format;
+			options->outputFile = argv[++i];
+			if (!ImageFormatFromName(options->outputFile, &format))
+			{
+				printf("Error: -output expects a .ppm, .png, .pfm or .exr file, got '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-preview") == 0)
+		{
+			options->preview = true;
+		}
+		else if (strcmp(argv[i], "-adaptive") == 0 && i + 1 < argc)
+		{
+			options->adaptiveError = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-sample-map") == 0 && i + 1 < argc)
+		{
+			options->sampleMap = argv[++i];
+		}
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+		{
+			options->profileFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+		{
+			options->traceFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-benchmark") == 0)
+		{
+			options->benchmark = true;
+		}
+		else if (strcmp(argv[i], "-bench-reps") == 0 && i + 1 < argc)
+		{
+			options->benchRepetitions = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-bench-warmup") == 0 && i + 1 < argc)
+		{
+			options->benchWarmup = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-bench-json") == 0 && i + 1 < argc)
+		{
+			options->benchJSON = argv[++i];
+		}
+		else if (strcmp(argv[i], "-bench-csv") == 0 && i + 1 < argc)
+		{
+			options->benchCSV = argv[++i];
+		}
+		else if (strcmp(argv[i], "-bench-baseline") == 0 && i + 1 < argc)
+		{
+			options->benchBaseline = argv[++i];
+		}
+		else if (strcmp(argv[i], "-bench-tolerance") == 0 && i + 1 < argc)
+		{
+			options->benchTolerance = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-daemon") == 0 && i + 1 < argc)
+		{
+			options->daemonSocket = argv[++i];
+		}
+		else if (strcmp(argv[i], "-max-depth") == 0 && i + 1 < argc)
+		{
+			options->maxDepth = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-light-select") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "auto") == 0)
+			{
+				options->lightSelect = LIGHT_SELECT_AUTO;
+			}
+			else if (strcmp(argv[i], "alias") == 0)
+			{
+				options->lightSelect = LIGHT_SELECT_ALIAS;
+			}
+			else if (strcmp(argv[i], "bvh") == 0)
+			{
+				options->lightSelect = LIGHT_SELECT_BVH;
+			}
+			else
+			{
+				printf("Error: Unknown light selection '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-light-samples") == 0 && i + 1 < argc)
+		{
+			options->lightSamples = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-light-color") == 0 && i + 1 < argc)
+		{
+			if (!ParseFloat3(argv[++i], &lightColor.x, &lightColor.y, &lightColor.z))
+			{
+				printf("Error: -light-color expects r,g,b, got '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-light") == 0 && i + 1 < argc)
+		{
+			if (!ParseSceneValues(argv[++i], values, 10))
+			{
+				printf("Error: -light expects 10 comma-separated numbers, got '%s'.\n", argv[i]);
+				return false;
+			}
+			RectangleLight light = { { values[0], values[1], values[2] }, { values[3], values[4], values[5] },
+				{ values[6], values[7], values[8] }, lightColor, values[9] };
+			options->lights.push_back(light);
+		}
+		else if (strcmp(argv[i], "-mesh") == 0 && i + 1 < argc)
+		{
+			mesh.fileName = argv[++i];
+			options->meshes.push_back(mesh);
+		}
+		else if (strcmp(argv[i], "-mesh-scale") == 0 && i + 1 < argc)
+		{
+			mesh.scale = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-mesh-offset") == 0 && i + 1 < argc)
+		{
+			if (!ParseFloat3(argv[++i], &mesh.offset.x, &mesh.offset.y, &mesh.offset.z))
+			{
+				printf("Error: -mesh-offset expects x,y,z, got '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-mesh-color") == 0 && i + 1 < argc)
+		{
+			if (!ParseFloat3(argv[++i], &mesh.color.x, &mesh.color.y, &mesh.color.z))
+			{
+				printf("Error: -mesh-color expects r,g,b, got '%s'.\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(argv[i], "-shape-color") == 0 && i + 1 < argc)
+		{
+			if (!ParseFloat3(argv[++i], &shapeColor.x, &shapeColor.y, &shapeColor.z))
+			{
+				printf("Error: -shape-color expects r,g,b, got '%s'.\n", argv[i]);
+				return false;
+			}
+			shapeMaterial = -1;
+		}
+		else if ((strcmp(argv[i], "-sphere") == 0 || strcmp(argv[i], "-disc") == 0 || strcmp(argv[i], "-box") == 0) && i + 1 < argc)
+		{
+			const char* shape = argv[i++];
+			int count = (shape[1] == 's') ? 4 : (shape[1] == 'd') ? 7 : 6;
+			if (!ParseSceneValues(argv[i], values, count))
+			{
+				printf("Error: %s expects %d comma-separated numbers, got '%s'.\n", shape, count, argv[i]);
+				return false;
+			}
+			if (shapeMaterial < 0)
+			{
+				shapeMaterial = (int)AddMaterial(&options->shapes, shapeColor);
+			}
+
+			Point p0 = { values[0], values[1], values[2] };
+			Point p1 = { values[3], values[4], values[5] };
+			if (count == 4)
+				AddSphere(&options->shapes, p0, values[3], (unsigned int)shapeMaterial);
+			else if (count == 7)
+				AddDisc(&options->shapes, p0, p1, values[6], (unsigned int)shapeMaterial);
+			else
+				AddBox(&options->shapes, p0, p1, (unsigned int)shapeMaterial);
+		}
+		else
+		{
+			printf("Error: Unknown argument '%s'.\n", argv[i]);
+			return false;
+		}
+	}
+
+	if (options->sampleBudget == 0)
+	{
+		printf("Error: -spp must be at least 1.\n");
+		return false;
+	}
+	// Pixel centers map to [0, 1] over width - 1 and height - 1
+	if (options->width < 2 || options->height < 2)
+	{
+		printf("Error: -size must be at least 2x2.\n");
+		return false;
+	}
+	if (options->lightSamples == 0)
+	{
+		printf("Error: -light-samples must be at least 1.\n");
+		return false;
+	}
+	if (options->frameCount > 0 && !options->cameraPath)
+	{
+		printf("Error: -frames needs a -camera-path.\n");
+		return false;
+	}
+	if (options->benchmark && options->benchRepetitions == 0)
+	{
+		printf("Error: -bench-reps must be at least 1.\n");
+		return false;
+	}
+	if (options->passSamples == 0 && options->adaptiveError > 0.0f)
+	{
+		options->passSamples = ADAPTIVE_PASS_SAMPLES;
+	}
+	if (options->passSamples == 0 || options->passSamples > options->sampleBudget)
+	{
+		options->passSamples = options->sampleBudget;
+	}
+
+	return true;
+}
+
+/*
+* Progress of a progressive render: samples per pixel so far and the timing of the passes
+*/
+struct PassSchedule
+{
+	unsigned int samplesDone;
+	unsigned int passCount;
+	std::chrono::steady_clock::time_point start;
+	double elapsedSeconds;        // at the end of the last pass
+	double lastPassSeconds;
+};
+
+void BeginPasses(PassSchedule* schedule)
+{
+	schedule->samplesDone = 0;
+	schedule->passCount = 0;
+	schedule->start = std::chrono::steady_clock::now();
+	schedule->elapsedSeconds = 0.0;
+	schedule->lastPassSeconds = 0.0;
+}
+
+// Samples per pixel of the next pass, 0 once the budget is spent or the next pass would miss the deadline
+unsigned int NextPassSamples(const RenderOptions* options, const PassSchedule* schedule)
+{
+	if (schedule->samplesDone >= options->sampleBudget)
+		return 0;
+
+	if (options->timeLimit > 0.0 && schedule->passCount > 0)
+	{
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - schedule->start).count();
+		if (elapsed + schedule->lastPassSeconds > options->timeLimit)
+		{
+			printf("Time limit: stopping at %u samples per pixel\n", schedule->samplesDone);
+			return 0;
+		}
+	}
+
+	return std::min(options->passSamples, options->sampleBudget - schedule->samplesDone);
+}
+
+void EndPass(const RenderOptions* options, PassSchedule* schedule, unsigned int passSamples)
+{
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - schedule->start).count();
+
+	schedule->samplesDone += passSamples;
+	schedule->passCount++;
+	schedule->lastPassSeconds = elapsed - schedule->elapsedSeconds;
+	schedule->elapsedSeconds = elapsed;
+
+	if (options->passSamples < options->sampleBudget)
+	{
+		printf("Pass %u: %u/%u samples per pixel, %.3lfs\n", schedule->passCount,
+			schedule->samplesDone, options->sampleBudget, elapsed);
+	}
+}
+
+/*
+* Print the mean samples per pixel of an adaptive render and write the sample map if asked for.
+* accum is the Accum buffer or CPUFrame::accum.
+*/
+bool ReportSamples(const RenderOptions* options, const float* accum, cl_uint width, cl_uint height)
+{
+	if (options->adaptiveError > 0.0f)
+	{
+		printf("Adaptive sampling: %.1lf samples per pixel on average\n", AverageSamples(accum, width * height));
+	}
+
+	if (options->sampleMap)
+	{
+		return WriteSampleMap(options->sampleMap, accum, width, height);
+	}
+	return true;
+}
+
+/*
+* Make the first pixelCount entries of active the pixel list of the next pass
+*/
+int SetPixelList(ocl_args_d_t *ocl, const std::vector<cl_uint>& active, cl_uint pixelCount)
+{
+	ocl->PixelCount = pixelCount;
+	if (pixelCount == 0)
+		return CL_SUCCESS;
+
+	cl_int err = clEnqueueWriteBuffer(ocl->commandQueue, ocl->PixelList, true, 0, sizeof(cl_uint) * pixelCount, &active[0], 0, NULL,
+		ProfileEvent(ocl->profiler, "write PixelList"));
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueWriteBuffer for PixelList returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clSetKernelArg(ocl->kernel, 23, sizeof(cl_uint), (void *)&ocl->PixelCount);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument PixelCount, returned %s\n", TranslateOpenCLError(err));
+	}
+
+	return err;
+}
+
+/*
+* Adaptive sampling on the OpenCL path: read the sums back, keep the pixels whose error is
+* still above threshold and make them the pixel list of the next pass
+*/
+int UpdatePixelList(ocl_args_d_t *ocl, cl_uint width, cl_uint height, float threshold)
+{
+	cl_int err = CL_SUCCESS;
+
+	cl_float *accumPtr = (cl_float *)clEnqueueMapBuffer(ocl->commandQueue, ocl->Accum, true, CL_MAP_READ, 0, sizeof(cl_float) * 4 * width * height, 0, NULL,
+		ProfileEvent(ocl->profiler, "map Accum"), &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueMapBuffer returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	cl_float *accumSqPtr = (cl_float *)clEnqueueMapBuffer(ocl->commandQueue, ocl->AccumSq, true, CL_MAP_READ, 0, sizeof(cl_float) * width * height, 0, NULL,
+		ProfileEvent(ocl->profiler, "map AccumSq"), &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueMapBuffer returned %s\n", TranslateOpenCLError(err));
+		clEnqueueUnmapMemObject(ocl->commandQueue, ocl->Accum, accumPtr, 0, NULL, NULL);
+		return err;
+	}
+
+	std::vector<cl_uint> active;
+	ocl->PixelCount = SelectActivePixels(accumPtr, accumSqPtr, width * height, &ocl->PixelOrder[0], threshold, &active);
+
+	err = clEnqueueUnmapMemObject(ocl->commandQueue, ocl->AccumSq, accumSqPtr, 0, NULL, ProfileEvent(ocl->profiler, "unmap AccumSq"));
+	if (CL_SUCCESS == err)
+		err = clEnqueueUnmapMemObject(ocl->commandQueue, ocl->Accum, accumPtr, 0, NULL, ProfileEvent(ocl->profiler, "unmap Accum"));
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueUnmapMemObject returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	printf("Adaptive sampling: %u of %u pixels above the error threshold\n", ocl->PixelCount, width * height);
+	return SetPixelList(ocl, active, ocl->PixelCount);
+}
+
+/*
+* Write the sample statistics of the OpenCL path (see ReportSamples)
+*/
+bool ReportDeviceSamples(ocl_args_d_t *ocl, const RenderOptions* options, cl_uint width, cl_uint height)
+{
+	if (options->adaptiveError <= 0.0f && !options->sampleMap)
+		return true;
+
+	cl_int err = CL_SUCCESS;
+	cl_float *accumPtr = (cl_float *)clEnqueueMapBuffer(ocl->commandQueue, ocl->Accum, true, CL_MAP_READ, 0, sizeof(cl_float) * 4 * width * height, 0, NULL,
+		ProfileEvent(ocl->profiler, "map Accum"), &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueMapBuffer returned %s\n", TranslateOpenCLError(err));
+		return false;
+	}
+
+	bool result = ReportSamples(options, accumPtr, width, height);
+
+	err = clEnqueueUnmapMemObject(ocl->commandQueue, ocl->Accum, accumPtr, 0, NULL, ProfileEvent(ocl->profiler, "unmap Accum"));
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueUnmapMemObject returned %s\n", TranslateOpenCLError(err));
+	}
+
+	return result;
+}
+
+/*
+* Print the rays a render traced and their rate over the passes, and keep them in stats
+* (if not NULL) with the render time and samples per pixel
+*/
+void ReportRays(const unsigned long long* rays, const PassSchedule* schedule, RenderStats* stats)
+{
+	double seconds = std::max(schedule->elapsedSeconds, 1e-9);
+	printf("Rays: %llu closest-hit, %llu shadow, %.2lf Mrays/s\n", rays[RAY_COUNT_CLOSEST], rays[RAY_COUNT_SHADOW],
+		(double)(rays[RAY_COUNT_CLOSEST] + rays[RAY_COUNT_SHADOW]) / seconds * 1e-6);
+
+	if (stats)
+	{
+		stats->renderSeconds = schedule->elapsedSeconds;
+		stats->samplesPerPixel = schedule->samplesDone;
+		for (int k = 0; k < RAY_COUNT_KINDS; k++)
+			stats->rays[k] = rays[k];
+	}
+}
+
+// Write the timing report and trace the command line asked for
+bool WriteProfile(Profiler* profiler, const RenderOptions* options)
+{
+	bool result = true;
+	if (options->profileFile)
+		result = WriteProfileReport(profiler, options->profileFile) && result;
+	if (options->traceFile)
+		result = WriteChromeTrace(profiler, options->traceFile) && result;
+	return result;
+}
+
+// Frames to render: one without a camera path, else -frames or one per key
+unsigned int FrameCount(const RenderOptions* options, const CameraPath* path)
+{
+	if (!path)
+		return 1;
+	return options->frameCount ? options->frameCount : (unsigned int)path->keys.size();
+}
+
+/*
+* Point the camera at a frame of an animation along path. compiled->camera is what the CPU path
+* reads and what the cam buffers of the OpenCL path are created over.
+*/
+void SetFrameCamera(const CameraPath& path, unsigned int frame, unsigned int frameCount, float aspectRatio,
+	CompiledScene* compiled)
+{
+	Camera cam = CameraAt(path, FrameTime(path, frame, frameCount));
+	cam.aspectRatio = aspectRatio;
+	CompileCamera(cam, &compiled->camera);
+}
+
+/*
+* Render the scene with the native CPU path and write the same image as the OpenCL path;
+* with a path, one image per frame of the animation along it
+*/
+int RunCPUBackend(const RenderOptions* options, Profiler* profiler, WorkStealingPool* pool, SphereSet* scene, CompiledScene* compiled,
+	SceneBVH* bvh, const CameraPath* path, cl_uint* seeds, cl_uint* pixels, cl_uint width, cl_uint height, RenderStats* stats)
+{
+	printf("CPU backend: %u threads, %dx%d tiles\n", pool->ThreadCount(), CPU_TILE_SIZE, CPU_TILE_SIZE);
+
+	const PacketKernels* packets = SelectPacketKernels(options->simd);
+	if (!packets && options->simd != PACKET_ISA_OFF && options->simd != PACKET_ISA_AUTO)
+	{
+		printf("Error: This CPU doesn't support the instruction set given by -simd.\n");
+		return -1;
+	}
+	if (packets)
+	{
+		printf("CPU packets: %s, %u rays\n", packets->name, packets->width);
+	}
+	else
+	{
+		printf("CPU packets: off\n");
+	}
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	BeginPhase(profiler, "render");
+
+	ImageWriter writer(profiler);
+	const std::string previewFile = options->preview ? PreviewFileName(options->outputFile) : std::string();
+	CPUFrame frame;
+	InitCPUFrame(&frame, width, height, seeds, (unsigned int)workAmount);
+
+	// An animation renders every frame into the same CPUFrame; the seeds go on where the last frame left them
+	unsigned int frameCount = FrameCount(options, path);
+	for (unsigned int frameIndex = 0; frameIndex < frameCount; frameIndex++)
+	{
+		std::chrono::steady_clock::time_point frameBegin = std::chrono::steady_clock::now();
+		std::string outputFile = options->outputFile ? options->outputFile : "";
+		if (path)
+		{
+			SetFrameCamera(*path, frameIndex, frameCount, (float)width / (float)height, compiled);
+			outputFile = FrameFileName(options->outputFile, frameIndex);
+			frame.accum.assign(frame.accum.size(), 0.0f);
+			frame.accumSq.assign(frame.accumSq.size(), 0.0f);
+		}
+
+		// The first pass renders every pixel, adaptive passes only the pixels in active
+		std::vector<unsigned int> active;
+		const unsigned int* pixelList = NULL;
+		unsigned int pixelCount = width * height;
+		unsigned long long rays[RAY_COUNT_KINDS] = { 0, 0 };
+
+		PassSchedule schedule;
+		BeginPasses(&schedule);
+		for (unsigned int passSamples; (passSamples = NextPassSamples(options, &schedule)) != 0; )
+		{
+			BeginPhase(profiler, "pass");
+			if (0 != RenderCPU(pool, scene, compiled, bvh, passSamples, options->maxDepth, &frame, pixelList, pixelCount,
+				packets, pixels, rays))
+			{
+				printf("Error: RenderCPU failed.\n");
+				return -1;
+			}
+			EndPass(options, &schedule, passSamples);
+			EndPhase(profiler);
+
+			if (options->preview)
+			{
+				writer.Write(previewFile.c_str(), pixels, &frame.accum[0], width, height);
+			}
+
+			if (options->adaptiveError > 0.0f)
+			{
+				pixelCount = SelectActivePixels(&frame.accum[0], &frame.accumSq[0], width * height, NULL, options->adaptiveError, &active);
+				pixelList = pixelCount ? &active[0] : NULL;
+				printf("Adaptive sampling: %u of %u pixels above the error threshold\n", pixelCount, width * height);
+				if (pixelCount == 0)
+					break;
+			}
+		}
+
+		ReportRays(rays, &schedule, stats);
+
+		if (options->outputFile)
+		{
+			writer.Write(outputFile.c_str(), pixels, &frame.accum[0], width, height);
+		}
+		if (path)
+		{
+			printf("Frame %u of %u: %u samples per pixel in %lfs -> %s\n", frameIndex + 1, frameCount, schedule.samplesDone,
+				std::chrono::duration<double>(std::chrono::steady_clock::now() - frameBegin).count(), outputFile.c_str());
+		}
+	}
+	EndPhase(profiler);
+
+	BeginPhase(profiler, "wait for image writer");
+	if (!writer.Finish())
+	{
+		return -1;
+	}
+	EndPhase(profiler);
+	ReportSamples(options, &frame.accum[0], width, height);
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("elapsed time : %lfs\n", elapsed);
+
+	return 0;
+}
+
+/*
+* Assemble the scene to render. A binary scene file is mapped and used as it is; otherwise the
+* text scene file (or the default scene) gets the meshes, lights and shapes of the command line,
+* its BVH is built and it is compiled. scene and bvh point into description or sceneMapping.
+*/
+bool SetupScene(const RenderOptions* options, WorkStealingPool* pool, float aspectRatio,
+	SceneDescription* description, MappedFile* sceneMapping, SphereSet* scene, Camera* cam,
+	CompiledScene* compiled, SceneBVH* bvh)
+{
+	std::chrono::steady_clock::time_point loadBegin = std::chrono::steady_clock::now();
+	if (options->sceneFile && IsBinarySceneFile(options->sceneFile))
+	{
+		if (!options->meshes.empty() || !options->builtMeshes.colors.empty() || !options->lights.empty() || !options->shapes.materials.empty())
+		{
+			printf("Error: Meshes, lights and shapes can't be added to a binary scene; add them to the text scene and convert it again.\n");
+			return false;
+		}
+		if (!LoadSceneFile(options->sceneFile, sceneMapping, scene, cam, compiled, bvh))
+			return false;
+
+		cam->aspectRatio = aspectRatio;
+		CompileCamera(*cam, &compiled->camera);
+	}
+	else
+	{
+		if (!options->sceneFile)
+			DefaultScene(description);
+		else if (!LoadSceneText(options->sceneFile, pool, description))
+			return false;
+
+		for (size_t m = 0; m < options->meshes.size(); m++)
+		{
+			const MeshOption& mesh = options->meshes[m];
+			if (!LoadMeshFile(mesh.fileName, mesh.scale, mesh.offset, mesh.color, pool, &description->meshes))
+				return false;
+		}
+		AppendMeshData(&description->meshes, options->builtMeshes);
+		description->lights.insert(description->lights.end(), options->lights.begin(), options->lights.end());
+		AppendPrimitives(&description->shapes, options->shapes);
+		BuildSceneSet(description, scene);
+
+		// Bounded primitives go into a BVH, the planes stay in their own list
+		BuildSceneBVH(scene, bvh);
+
+		// Bake what doesn't change between samples: light normals and extents, plane distances, camera basis
+		*cam = description->camera;
+		cam->aspectRatio = aspectRatio;
+		CompileScene(scene, cam, compiled);
+	}
+
+	double loadTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - loadBegin).count();
+	printf("Scene: %s in %lfs\n", !options->sceneFile ? "default scene" : sceneMapping->Data() ? "binary scene mapped" : "text scene loaded",
+		loadTime);
+	printf("Scene: %u lights, %u planes, %d meshes (%d vertices, %d triangles), %u spheres, %u discs, %u boxes\n",
+		(unsigned int)compiled->lights.size(), (unsigned int)compiled->planes.size(), scene->MeshCount, scene->VertexCount,
+		scene->TriangleCount, scene->m_primLayout.m_sphereCount, scene->m_primLayout.m_discCount, scene->m_primLayout.m_boxCount);
+	printf("BVH: %u nodes, %u primitives, depth %u\n", bvh->nodeCount, bvh->primRefCount, bvh->depth);
+	return true;
+}
+
+/*
+* Build options of the program variant for this render: -D SPEC_* for the values ray_algorithm.cl
+* can take as constants. The sample count only goes in when every pass adds the same number of
+* samples, light and plane counts only up to SPEC_MAX_COUNT; larger scenes get the loops with
+* run-time bounds. An empty string is the generic program.
+*/
+std::string KernelSpecialization(const RenderOptions* options, cl_uint lightCount, cl_uint planeCount)
+{
+	if (!options->specialize)
+		return std::string();
+
+	char define[64];
+	snprintf(define, sizeof(define), "-D SPEC_WIDTH=%u -D SPEC_HEIGHT=%u", options->width, options->height);
+	std::string buildOptions = define;
+	if (options->sampleBudget % options->passSamples == 0)
+	{
+		snprintf(define, sizeof(define), " -D SPEC_SAMPLE_COUNT=%u", options->passSamples);
+		buildOptions += define;
+	}
+	if (lightCount <= SPEC_MAX_COUNT)
+	{
+		snprintf(define, sizeof(define), " -D SPEC_LIGHT_COUNT=%u", lightCount);
+		buildOptions += define;
+	}
+	if (planeCount <= SPEC_MAX_COUNT)
+	{
+		snprintf(define, sizeof(define), " -D SPEC_PLANE_COUNT=%u", planeCount);
+		buildOptions += define;
+	}
+	return buildOptions;
+}
+
+/*
+* One OpenCL device of the render, with its own context, queue, program, buffers and kernels.
+* The scene arrays are shared. The seeds are its own, so no two devices trace the same random
+* sequences, and so are the sums: a device only has those of the pixels it rendered.
+*/
+struct RenderDevice
+{
+	RenderDevice();
+	~RenderDevice();
+
+	ocl_args_d_t      ocl;
+	WavefrontPipeline wavefront;
+	std::string       name;
+	cl_device_id      subDevice;       // released with it if it was partitioned off (-split-devices)
+	std::vector<cl_uint> seeds;
+	cl_uint*          pixels;          // host memory of ocl.Pixels
+	size_t            localSize;
+	cl_uint           persistentSize;  // work items of a persistent launch
+
+	// The split of the passes over several devices (RunDevicePass)
+	double            throughput;      // pixel samples per second of the finished chunks, 0 before the first
+	cl_event          chunkDone;       // marker behind the chunk in flight, NULL while idle
+	cl_uint           chunkPixels;
+	std::chrono::steady_clock::time_point chunkBegin;
+	unsigned long long pixelSamples;   // rendered over the whole render
+	double            busySeconds;
+};
+
+RenderDevice::RenderDevice() :
+		subDevice(NULL),
+		pixels(NULL),
+		localSize(0),
+		persistentSize(0),
+		throughput(0.0),
+		chunkDone(NULL),
+		chunkPixels(0),
+		pixelSamples(0),
+		busySeconds(0.0)
+{
+}
+
+RenderDevice::~RenderDevice()
+{
+	if (chunkDone)
+	{
+		clReleaseEvent(chunkDone);
+	}
+
+	// ocl.Pixels uses pixels, so it goes first
+	if (ocl.Pixels)
+	{
+		clReleaseMemObject(ocl.Pixels);
+		ocl.Pixels = NULL;
+	}
+	if (pixels)
+	{
+		_aligned_free(pixels);
+	}
+
+#ifdef CL_VERSION_1_2
+	if (subDevice)
+	{
+		clReleaseDevice(subDevice);
+	}
+#endif
+}
+
+/*
+* The devices to render on: those of -devices, else the one of -device, each partitioned into
+* -split-devices sub-devices where the device allows it
+*/
+bool ChooseRenderDevices(const RenderOptions* options, const std::vector<OpenCLDeviceInfo>& devices,
+	std::vector<OpenCLDeviceInfo>* chosen)
+{
+	std::vector<int> indices;
+	if (options->allDevices || !options->devices.empty())
+	{
+		if (!SelectOpenCLDevices(devices, options->allDevices, options->devices, &indices))
+			return false;
+	}
+	else
+	{
+		int index = SelectOpenCLDevice(devices, options->device);
+		if (index < 0)
+			return false;
+		indices.push_back(index);
+	}
+
+	chosen->clear();
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		const OpenCLDeviceInfo& info = devices[indices[i]];
+		std::vector<OpenCLDeviceInfo> parts;
+		if (options->splitDevices > 1 && !PartitionOpenCLDevice(info, options->splitDevices, &parts))
+		{
+			printf("Device %s can't be split into %u sub-devices, using it whole.\n", info.deviceName.c_str(), options->splitDevices);
+		}
+		if (parts.empty())
+			chosen->push_back(info);
+		else
+			chosen->insert(chosen->end(), parts.begin(), parts.end());
+	}
+	return true;
+}
+
+/*
+* Everything a device needs for the passes once SetupOpenCL made its context and queue: seeds,
+* buffers, program, kernels and the pixel order. The first device starts from seeds, the others
+* from fresh ones. All devices render from the same pixel list, so the tile shape the first one
+* picks for -tile auto is used by the others too.
+*/
+int PrepareDevice(RenderDevice* device, const OpenCLDeviceInfo& info, const RenderOptions* options, Profiler* profiler,
+	CompiledScene* compiled, SceneBVH* bvh, SphereSet* scene, const std::string& buildOptions,
+	const std::vector<cl_uint>& seeds, bool firstDevice, cl_uint* tileWidth, cl_uint* tileHeight)
+{
+	cl_int err;
+	ocl_args_d_t* ocl = &device->ocl;
+	cl_uint width = options->width;
+	cl_uint height = options->height;
+	ocl->width = width;
+	ocl->height = height;
+	ocl->profiler = profiler;
+
+	// Seeds are per work item of a stage, per pixel in the persistent mode (where any work item
+	// may take a pixel) and per path in the wavefront mode; the last two can need more than a stage
+	cl_uint seedCount = (cl_uint)workAmount;
+	cl_uint wavefrontPaths = std::min(width * height, (cl_uint)WAVEFRONT_MAX_PATHS);
+	if (options->schedule == SCHEDULE_PERSISTENT)
+	{
+		seedCount = std::max(seedCount, width * height);
+	}
+	else if (options->schedule == SCHEDULE_WAVEFRONT)
+	{
+		seedCount = std::max(seedCount, wavefrontPaths);
+	}
+	if (firstDevice)
+	{
+		device->seeds = seeds;
+	}
+	for (size_t i = device->seeds.size(); i < (size_t)seedCount * 2; i++)
+	{
+		cl_uint seed = rand();
+		device->seeds.push_back(seed < 2 ? 2 : seed);
+	}
+	ocl->Persistent = (options->schedule == SCHEDULE_PERSISTENT) ? 1 : 0;
+	ocl->MaxDepth = options->maxDepth;
+
+	// the buffer should be aligned with 4K page and size should fit 64-byte cached line
+	cl_uint optimizedSize = ((sizeof(cl_uint) * width * height - 1) / 64 + 1) * 64;
+	device->pixels = (cl_uint*)_aligned_malloc(optimizedSize, 4096);
+
+	// Create OpenCL buffers from host memory
+	// These buffers will be used later by the OpenCL kernel
+	BeginPhase(profiler, "create buffers");
+	if (CL_SUCCESS != CreateBufferArguments(ocl, compiled, bvh,
+		scene, options->passSamples, device->pixels, &device->seeds[0], seedCount, width, height))
+	{
+		return -1;
+	}
+	EndPhase(profiler);
+
+	// Create and build the OpenCL program, specialized for this render unless -specialize off
+	if (firstDevice)
+	{
+		printf("Kernel specialization: %s\n", buildOptions.empty() ? "off" : buildOptions.c_str());
+	}
+	std::string programOptions = DeviceBuildOptions(buildOptions, info, compiled);
+	if (programOptions != buildOptions)
+	{
+		printf("Lights and planes: %u KB, over the %u KB constant buffer of %s; read from global memory\n",
+			(unsigned int)((sizeof(CompiledLight) * compiled->lights.size() + sizeof(CompiledPlane) * compiled->planes.size()) >> 10),
+			(unsigned int)(info.constantBufferSize >> 10), info.deviceName.c_str());
+	}
+	BeginPhase(profiler, "build program");
+	if (CL_SUCCESS != CreateAndBuildProgram(ocl, programOptions, options->kernelCache))
+	{
+		return -1;
+	}
+	EndPhase(profiler);
+
 	// Program consists of kernels.
 	// Each kernel can be called (enqueued) from the host part of OpenCL application.
 	// To call the kernel, you need to create it from existing program.
-	ocl.kernel = clCreateKernel(ocl.program, "ray_cal", &err);
+	BeginPhase(profiler, "create kernels");
+	ocl->kernel = clCreateKernel(ocl->program, "ray_cal", &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateKernel returned %s\n", TranslateOpenCLError(err));
+		return -1;
+	}
+
+	// Passing arguments into OpenCL kernel.
+	if (CL_SUCCESS != SetKernelArguments(ocl))
+	{
+		return -1;
+	}
+
+	if (CL_SUCCESS != GetWorkGroupInfo(ocl, workAmount, &device->localSize))
+	{
+		return -1;
+	}
+
+	// Enough work-groups to keep every compute unit busy for the whole launch
+	device->persistentSize = info.computeUnits * (cl_uint)device->localSize * PERSISTENT_GROUPS_PER_UNIT;
+	if (options->schedule == SCHEDULE_PERSISTENT)
+	{
+		printf("Persistent threads: %u work-groups of %u\n", device->persistentSize / (cl_uint)device->localSize, (cl_uint)device->localSize);
+	}
+
+	// The wavefront kernels come from the same program and read the same scene buffers as ray_cal
+	WavefrontPipeline* wavefront = &device->wavefront;
+	wavefront->profiler = profiler;
+	if (options->schedule == SCHEDULE_WAVEFRONT)
+	{
+		if (CL_SUCCESS != CreateWavefront(wavefront, ocl->context, ocl->device, ocl->program, wavefrontPaths, ocl->LightSamples, ocl->MaxDepth))
+		{
+			return -1;
+		}
+
+		std::vector<KernelArgument> sceneArgs = {
+			{ sizeof(cl_mem), &ocl->Lights }, { sizeof(cl_uint), &ocl->LightCount },
+			{ sizeof(cl_mem), &ocl->Shapes }, { sizeof(cl_uint), &ocl->ShapeCount },
+			{ sizeof(cl_mem), &ocl->Nodes }, { sizeof(cl_uint), &ocl->NodeCount },
+			{ sizeof(cl_mem), &ocl->PrimRefs }, { sizeof(cl_mem), &ocl->Vertices },
+			{ sizeof(cl_mem), &ocl->Triangles }, { sizeof(cl_mem), &ocl->MeshColors },
+			{ sizeof(cl_mem), &ocl->PrimData }, { sizeof(PrimitiveLayout), &ocl->PrimLayout },
+			{ sizeof(cl_mem), &ocl->Materials }, { sizeof(cl_mem), &ocl->AliasTable },
+			{ sizeof(cl_mem), &ocl->LightNodes }, { sizeof(cl_uint), &ocl->LightNodeCount },
+			{ sizeof(cl_mem), &ocl->LightTrails }, { sizeof(cl_uint), &ocl->LightSamples } };
+		WavefrontFrame frame = { ocl->cam, width, height, ocl->Seeds, ocl->Pixels, ocl->Accum, ocl->AccumSq, ocl->PixelList, ocl->RayCounts };
+		if (CL_SUCCESS != SetWavefrontArguments(wavefront, sceneArgs, frame))
+		{
+			return -1;
+		}
+		printf("Wavefront: %u paths per wave, work-groups of %u\n", wavefront->pathCount, (cl_uint)wavefront->localSize);
+	}
+
+	// Work-groups take neighbouring tiles of the image instead of strips of rows
+	if (firstDevice && options->tileAuto)
+	{
+		AutoTileShape((options->schedule == SCHEDULE_WAVEFRONT) ? wavefront->localSize : device->localSize, tileWidth, tileHeight);
+	}
+	if (*tileWidth > 0)
+	{
+		if (firstDevice)
+		{
+			printf("Tiles: %ux%u pixels in Morton order\n", *tileWidth, *tileHeight);
+		}
+		if (CL_SUCCESS != SetPixelOrder(ocl, width, height, *tileWidth, *tileHeight))
+		{
+			return -1;
+		}
+	}
+	EndPhase(profiler);
+
+	return 0;
+}
+
+/*
+* Queue the entries firstPixel .. endPixel - 1 of the pixel list on device, with the PixelCount
+* argument at endPixel. firstPixel is a multiple of workAmount, as the stages need it.
+*/
+cl_int EnqueueChunk(RenderDevice* device, const RenderOptions* options, cl_uint passSamples, cl_uint firstPixel, cl_uint endPixel)
+{
+	ocl_args_d_t* ocl = &device->ocl;
+	cl_int err = clSetKernelArg(ocl->kernel, 23, sizeof(cl_uint), (void *)&endPixel);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to set argument PixelCount, returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	if (options->schedule == SCHEDULE_WAVEFRONT)
+		return RunWavefrontPass(&device->wavefront, ocl->commandQueue, passSamples, firstPixel, endPixel);
+	if (options->schedule == SCHEDULE_PERSISTENT)
+		return ExecutePersistentKernel(ocl, device->persistentSize, (cl_uint)device->localSize, firstPixel);
+	return ExecuteAddKernel(ocl, device->pixels, (cl_uint)workAmount, (cl_uint)device->localSize, firstPixel, endPixel, workAmount);
+}
+
+/*
+* Guided self-scheduling: an idle device gets its share of the remaining entries by the speed the
+* devices showed so far (equal shares until each has finished a chunk), halved so the last chunks
+* are small and the devices finish close together. Chunks are whole stages of workAmount entries.
+*/
+cl_uint ChunkSize(const std::deque<RenderDevice>& devices, const RenderDevice& device, cl_uint remaining)
+{
+	double total = 0.0;
+	bool measured = true;
+	for (size_t d = 0; d < devices.size(); d++)
+	{
+		total += devices[d].throughput;
+		measured = measured && devices[d].throughput > 0.0;
+	}
+	double share = measured ? device.throughput / total : 1.0 / devices.size();
+
+	const cl_uint granule = (cl_uint)workAmount;
+	cl_uint count = (cl_uint)(remaining * share * 0.5);
+	count = (count + granule - 1) / granule * granule;
+	return std::min(std::max(count, granule), remaining);
+}
+
+/*
+* Queue a pass over the first pixelCount entries of the pixel list. One device gets them all at
+* once. Several take chunks (ChunkSize) whenever they are idle: each has one chunk in flight with a
+* marker behind it, which this thread polls; the time to the marker gives the device's throughput.
+*/
+cl_int RunDevicePass(std::deque<RenderDevice>* devices, const RenderOptions* options, cl_uint passSamples, cl_uint pixelCount)
+{
+	if (devices->size() == 1)
+		return EnqueueChunk(&devices->front(), options, passSamples, 0, pixelCount);
+
+	cl_int err = CL_SUCCESS;
+	cl_uint next = 0;
+	size_t busy = 0;
+	while (next < pixelCount || busy > 0)
+	{
+		bool progress = false;
+		for (size_t d = 0; d < devices->size(); d++)
+		{
+			RenderDevice& device = (*devices)[d];
+			if (device.chunkDone)
+			{
+				cl_int status = CL_QUEUED;
+				err = clGetEventInfo(device.chunkDone, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+				if (CL_SUCCESS == err && status < 0)
+					err = status;
+				if (CL_SUCCESS != err)
+				{
+					printf("Error: A chunk on %s failed, returned %s\n", device.name.c_str(), TranslateOpenCLError(err));
+					return err;
+				}
+				if (status != CL_COMPLETE)
+					continue;
+
+				double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - device.chunkBegin).count(), 1e-6);
+				double chunkSamples = (double)device.chunkPixels * passSamples;
+				device.throughput = (device.throughput > 0.0) ? 0.5 * (device.throughput + chunkSamples / seconds) : chunkSamples / seconds;
+				device.pixelSamples += (unsigned long long)chunkSamples;
+				device.busySeconds += seconds;
+				clReleaseEvent(device.chunkDone);
+				device.chunkDone = NULL;
+				busy--;
+				progress = true;
+			}
+
+			if (next < pixelCount)
+			{
+				cl_uint count = ChunkSize(*devices, device, pixelCount - next);
+				device.chunkBegin = std::chrono::steady_clock::now();
+				err = EnqueueChunk(&device, options, passSamples, next, next + count);
+				if (CL_SUCCESS != err)
+					return err;
+				err = clEnqueueMarkerWithWaitList(device.ocl.commandQueue, 0, NULL, &device.chunkDone);
+				if (CL_SUCCESS == err)
+					err = clFlush(device.ocl.commandQueue);
+				if (CL_SUCCESS != err)
+				{
+					printf("Error: Failed to queue a chunk on %s, returned %s\n", device.name.c_str(), TranslateOpenCLError(err));
+					return err;
+				}
+				device.chunkPixels = count;
+				next += count;
+				busy++;
+				progress = true;
+			}
+		}
+
+		if (!progress)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	return CL_SUCCESS;
+}
+
+/*
+* The image of a render on several devices: accum and accumSq are the sums of the devices'
+* Accum and AccumSq, pixels (if not NULL) gets the means packed as the kernel's packMean does
+*/
+bool MergeDeviceSums(std::deque<RenderDevice>* devices, cl_uint width, cl_uint height,
+	std::vector<cl_float>* accum, std::vector<cl_float>* accumSq, cl_uint* pixels)
+{
+	const size_t pixelCount = (size_t)width * height;
+	std::vector<cl_float> deviceAccum(pixelCount * 4);
+	std::vector<cl_float> deviceAccumSq(pixelCount);
+	accum->assign(pixelCount * 4, 0.0f);
+	accumSq->assign(pixelCount, 0.0f);
+
+	for (size_t d = 0; d < devices->size(); d++)
+	{
+		ocl_args_d_t* ocl = &(*devices)[d].ocl;
+		cl_int err = clEnqueueReadBuffer(ocl->commandQueue, ocl->Accum, CL_TRUE, 0, sizeof(cl_float) * deviceAccum.size(),
+			&deviceAccum[0], 0, NULL, ProfileEvent(ocl->profiler, "read Accum"));
+		if (CL_SUCCESS == err)
+			err = clEnqueueReadBuffer(ocl->commandQueue, ocl->AccumSq, CL_TRUE, 0, sizeof(cl_float) * deviceAccumSq.size(),
+				&deviceAccumSq[0], 0, NULL, ProfileEvent(ocl->profiler, "read AccumSq"));
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clEnqueueReadBuffer for the sums returned %s\n", TranslateOpenCLError(err));
+			return false;
+		}
+
+		for (size_t i = 0; i < deviceAccum.size(); i++)
+			(*accum)[i] += deviceAccum[i];
+		for (size_t i = 0; i < deviceAccumSq.size(); i++)
+			(*accumSq)[i] += deviceAccumSq[i];
+	}
+
+	if (pixels)
+	{
+		for (size_t p = 0; p < pixelCount; p++)
+		{
+			const cl_float* sum = &(*accum)[4 * p];
+			if (sum[3] <= 0.0f)
+			{
+				pixels[p] = 0;
+				continue;
+			}
+			unsigned char r, g, b;
+			r = (unsigned char)(std::min(std::max(sum[0] / sum[3], 0.0f), 1.0f) * 255.0f);
+			g = (unsigned char)(std::min(std::max(sum[1] / sum[3], 0.0f), 1.0f) * 255.0f);
+			b = (unsigned char)(std::min(std::max(sum[2] / sum[3], 0.0f), 1.0f) * 255.0f);
+			pixels[p] = (r << 16) + (g << 8) + b;
+		}
+	}
+	return true;
+}
+
+/*
+* ReleaseInfo over the render's devices; the image of several is merged (MergeDeviceSums) into pixels
+*/
+bool ReleaseImage(std::deque<RenderDevice>* devices, ImageWriter* writer, cl_uint width, cl_uint height,
+	const char* fileName, cl_uint* pixels)
+{
+	if (devices->size() == 1)
+		return ReleaseInfo(&devices->front().ocl, writer, width, height, fileName);
+
+	std::vector<cl_float> accum, accumSq;
+	if (!MergeDeviceSums(devices, width, height, &accum, &accumSq, pixels))
+		return false;
+	writer->Write(fileName, pixels, &accum[0], width, height);
+	return true;
+}
+
+/*
+* UpdatePixelList over the render's devices: with several, the pixels are picked from the merged
+* sums and every device gets the same list
+*/
+int UpdatePixelLists(std::deque<RenderDevice>* devices, cl_uint width, cl_uint height, float threshold)
+{
+	if (devices->size() == 1)
+		return UpdatePixelList(&devices->front().ocl, width, height, threshold);
+
+	std::vector<cl_float> accum, accumSq;
+	if (!MergeDeviceSums(devices, width, height, &accum, &accumSq, NULL))
+		return CL_INVALID_VALUE;
+
+	std::vector<cl_uint> active;
+	cl_uint pixelCount = SelectActivePixels(&accum[0], &accumSq[0], width * height, &devices->front().ocl.PixelOrder[0], threshold, &active);
+	printf("Adaptive sampling: %u of %u pixels above the error threshold\n", pixelCount, width * height);
+
+	for (size_t d = 0; d < devices->size(); d++)
+	{
+		cl_int err = SetPixelList(&(*devices)[d].ocl, active, pixelCount);
+		if (CL_SUCCESS != err)
+			return err;
+	}
+	return CL_SUCCESS;
+}
+
+/*
+* ReportDeviceSamples over the render's devices
+*/
+bool ReportAllSamples(std::deque<RenderDevice>* devices, const RenderOptions* options, cl_uint width, cl_uint height)
+{
+	if (devices->size() == 1)
+		return ReportDeviceSamples(&devices->front().ocl, options, width, height);
+	if (options->adaptiveError <= 0.0f && !options->sampleMap)
+		return true;
+
+	std::vector<cl_float> accum, accumSq;
+	if (!MergeDeviceSums(devices, width, height, &accum, &accumSq, NULL))
+		return false;
+	return ReportSamples(options, &accum[0], width, height);
+}
+
+/*
+* Print how the passes were split over several devices: share of the pixel samples and throughput
+*/
+void ReportDeviceSplit(const std::deque<RenderDevice>& devices)
+{
+	if (devices.size() < 2)
+		return;
+
+	unsigned long long total = 0;
+	for (size_t d = 0; d < devices.size(); d++)
+		total += devices[d].pixelSamples;
+
+	for (size_t d = 0; d < devices.size(); d++)
+	{
+		const RenderDevice& device = devices[d];
+		printf("Device %s: %.1lf%% of the pixel samples, %.2lf Mpixel-samples/s\n", device.name.c_str(),
+			100.0 * (double)device.pixelSamples / (double)std::max(total, 1ULL),
+			(device.busySeconds > 0.0) ? (double)device.pixelSamples / device.busySeconds * 1e-6 : 0.0);
+	}
+}
+
+/*
+* Start a frame of an animation, or a job of a reused daemon session, on device: upload the camera
+* and clear the sums. With resetPixels the pixel list goes back to every pixel, which adaptive
+* sampling and cancelled renders leave as a subset. Nothing else changes between frames.
+*/
+cl_int BeginDeviceFrame(RenderDevice* device, const CompiledCamera* camera, cl_uint width, cl_uint height, bool resetPixels)
+{
+	ocl_args_d_t* ocl = &device->ocl;
+
+	// camera stays as it is until the passes of this frame are done, so the write needn't block
+	cl_int err = clEnqueueWriteBuffer(ocl->commandQueue, ocl->cam, CL_FALSE, 0, sizeof(CompiledCamera), camera, 0, NULL,
+		ProfileEvent(ocl->profiler, "write cam"));
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueWriteBuffer for cam returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	const cl_float zero = 0.0f;
+	err = clEnqueueFillBuffer(ocl->commandQueue, ocl->Accum, &zero, sizeof(zero), 0, sizeof(cl_float) * 4 * width * height, 0, NULL,
+		ProfileEvent(ocl->profiler, "fill Accum"));
+	if (CL_SUCCESS == err)
+		err = clEnqueueFillBuffer(ocl->commandQueue, ocl->AccumSq, &zero, sizeof(zero), 0, sizeof(cl_float) * width * height, 0, NULL,
+			ProfileEvent(ocl->profiler, "fill AccumSq"));
 	if (CL_SUCCESS != err)
 	{
-		printf("Error: clCreateKernel returned %s\n", TranslateOpenCLError(err));
+		printf("Error: clEnqueueFillBuffer returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	if (resetPixels)
+		return SetPixelList(ocl, ocl->PixelOrder, width * height);
+	return CL_SUCCESS;
+}
+
+/*
+* The passes of one image on the render's devices, on top of the sums and pixel lists they have.
+* Previews go through readback if it is set (one device), else to writer by ReleaseImage.
+* Returns 1 if *cancel was set before a pass, which then isn't started.
+*/
+int RenderPasses(std::deque<RenderDevice>* devices, const RenderOptions* options, Profiler* profiler, ImageWriter* writer,
+	ReadbackPipeline* readback, bool floatImage, cl_uint* Pixels, cl_uint width, cl_uint height, PassSchedule* schedule,
+	unsigned long long* rays, const std::atomic<bool>* cancel)
+{
+	cl_int err = CL_SUCCESS;
+	const std::string previewFile = options->preview ? PreviewFileName(options->outputFile) : std::string();
+	ocl_args_d_t* first = &devices->front().ocl;
+
+	// Execute (enqueue) the kernel, one full image per pass; Accum carries the sums between passes
+	BeginPasses(schedule);
+	for (cl_uint passSamples; (passSamples = NextPassSamples(options, schedule)) != 0; )
+	{
+		if (cancel && cancel->load())
+		{
+			return 1;
+		}
+
+		BeginPhase(profiler, "pass");
+		for (size_t d = 0; d < devices->size(); d++)
+		{
+			ocl_args_d_t* ocl = &(*devices)[d].ocl;
+			ocl->sampleCount = passSamples;
+			err = clSetKernelArg(ocl->kernel, 4, sizeof(cl_uint), (void *)&ocl->sampleCount);
+			if (CL_SUCCESS != err)
+			{
+				printf("Error: Failed to set argument sampleCount, returned %s\n", TranslateOpenCLError(err));
+				return -1;
+			}
+		}
+
+		// Every device has the same pixel list
+		if (CL_SUCCESS != RunDevicePass(devices, options, passSamples, devices->front().ocl.PixelCount))
+		{
+			return -1;
+		}
+
+		for (size_t d = 0; d < devices->size(); d++)
+		{
+			err = clFinish((*devices)[d].ocl.commandQueue);
+			if (CL_SUCCESS != err)
+			{
+				printf("Error: clFinish returned %s\n", TranslateOpenCLError(err));
+				return -1;
+			}
+		}
+		EndPass(options, schedule, passSamples);
+		for (size_t d = 0; d < devices->size(); d++)
+		{
+			if (!ReadRayCounts(&(*devices)[d].ocl, rays))
+			{
+				return -1;
+			}
+		}
+		EndPhase(profiler);
+
+		if (options->preview)
+		{
+			BeginPhase(profiler, "read back");
+			if (readback)
+			{
+				if (CL_SUCCESS != QueueReadback(readback, first->commandQueue, floatImage ? first->Accum : first->Pixels, floatImage, previewFile.c_str()))
+				{
+					return -1;
+				}
+			}
+			else
+			{
+				ReleaseImage(devices, writer, width, height, previewFile.c_str(), Pixels);
+			}
+			EndPhase(profiler);
+		}
+
+		if (options->adaptiveError > 0.0f)
+		{
+			BeginPhase(profiler, "update pixel list");
+			if (CL_SUCCESS != UpdatePixelLists(devices, width, height, options->adaptiveError))
+			{
+				return -1;
+			}
+			EndPhase(profiler);
+			if (devices->front().ocl.PixelCount == 0)
+				break;
+		}
+	}
+	return 0;
+}
+
+/*
+* What a render sets up before its first pass: the scene on the host and the devices with their
+* program, kernels and buffers, which point into the scene. Render sets one up for its image,
+* the daemon keeps them for the jobs after it.
+*/
+struct RenderSession
+{
+	RenderSession();
+	~RenderSession();
+
+	std::string       key;          // SessionKey of the job it was set up for
+	Profiler          profiler;
+	SceneDescription  description;
+	MappedFile        sceneMapping;
+	SphereSet         masterSet;
+	Camera            cam;          // of the scene
+	SceneBVH          bvh;
+	CompiledScene     compiled;
+	std::vector<cl_uint> seeds;
+	cl_uint*          pixels;       // the merged image of several devices
+	bool              used;         // the devices hold the sums of an earlier frame
+	bool              hostError;    // the last job failed on a file only; the devices are still set up
+	ReadbackPipeline* readback;     // of the last job with previews or frames, for the next one of its image size
+
+	// Last, so they are released before the scene their buffers were created over
+	std::deque<RenderDevice> devices;
+};
+
+RenderSession::RenderSession() :
+		pixels(NULL),
+		used(false),
+		hostError(false),
+		readback(NULL)
+{
+}
+
+RenderSession::~RenderSession()
+{
+	// Its queue and buffers are on the first device's context
+	delete readback;
+	devices.clear();
+	if (pixels)
+	{
+		_aligned_free(pixels);
+	}
+}
+
+// The camera of the image: -camera or the scene's, with the image's aspect ratio
+void SetJobCamera(const RenderOptions* options, RenderSession* session)
+{
+	Camera cam = options->hasCamera ? options->camera : session->cam;
+	cam.aspectRatio = (float)options->width / (float)options->height;
+	CompileCamera(cam, &session->compiled.camera);
+}
+
+/*
+* Set up the scene and the devices of session for a render as options ask for. Writing the
+* scene, precompiling and the CPU path end there; *finished tells that their result is in.
+* begin gets the time the render itself starts at.
+*/
+int SetupSession(const RenderOptions* options, const CameraPath* path, RenderSession* session, RenderStats* stats,
+	std::chrono::steady_clock::time_point runBegin, std::chrono::steady_clock::time_point* begin, bool* finished)
+{
+	Profiler& profiler = session->profiler;
+	SphereSet& masterSet = session->masterSet;
+	Camera& cam = session->cam;
+	std::vector<cl_uint>& Seeds = session->seeds;
+	SceneBVH& bvh = session->bvh;
+	CompiledScene& compiled = session->compiled;
+	cl_uint arrayWidth = options->width;
+	cl_uint arrayHeight = options->height;
+	*finished = false;
+
+	// allocate working buffers. 
+	// the buffer should be aligned with 4K page and size should fit 64-byte cached line
+	cl_uint optimizedSize = ((sizeof(cl_uint) * arrayWidth * arrayHeight - 1) / 64 + 1) * 64;
+	Seeds.assign(workAmount * 2, 0);
+	cl_uint* Pixels = session->pixels = (cl_uint*)_aligned_malloc(optimizedSize, 4096);
+
+	GenerateSeeds(&Seeds[0], options->seed ? options->seed : (unsigned int)time(NULL));
+
+	// One pool serves mesh loading and the CPU path
+	WorkStealingPool pool(options->threadCount);
+
+	BeginPhase(&profiler, "setup scene");
+	if (!SetupScene(options, &pool, (float)arrayWidth / (float)arrayHeight, &session->description, &session->sceneMapping,
+		&masterSet, &cam, &compiled, &bvh))
+	{
 		return -1;
 	}
+	SetJobCamera(options, session);
+	EndPhase(&profiler);
 
-	// Passing arguments into OpenCL kernel.
-	if (CL_SUCCESS != SetKernelArguments(&ocl))
+	if (options->writeScene)
+	{
+		bool written = WriteSceneFile(options->writeScene, &masterSet, cam, compiled, bvh);
+		if (written)
+			printf("Scene: written to '%s'\n", options->writeScene);
+		*finished = true;
+		return written ? 0 : -1;
+	}
+
+	// Lights are picked per hit from an alias table or a light BVH over the compiled lights
+	BeginPhase(&profiler, "select lights");
+	BuildLightSelection(compiled.lights, options->lightSelect, options->lightSamples, &compiled.lightSelection);
+	EndPhase(&profiler);
+	printf("Light selection: %s over %u lights, %u per hit\n", compiled.lightSelection.nodes.empty() ? "alias table" : "light BVH",
+		(unsigned int)compiled.lights.size(), compiled.lightSelection.samples);
+
+	std::string buildOptions = KernelSpecialization(options, (cl_uint)compiled.lights.size(), (cl_uint)compiled.planes.size());
+	if (options->precompile)
+	{
+		std::vector<std::string> variants(1);
+		if (!buildOptions.empty())
+			variants.push_back(buildOptions);
+		*finished = true;
+		return PrecompilePrograms(variants, &compiled, options->kernelCache);
+	}
+
+	// The CPU path doesn't need any OpenCL object
+	if (options->backend == BACKEND_CPU)
+	{
+		profiler.deviceName = "CPU";
+		if (stats)
+		{
+			stats->device = "CPU";
+			stats->startupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runBegin).count();
+		}
+		int result = RunCPUBackend(options, &profiler, &pool, &masterSet, &compiled, &bvh, path, &Seeds[0], Pixels, arrayWidth, arrayHeight, stats);
+		if (result == 0 && !WriteProfile(&profiler, options))
+			result = -1;
+		*finished = true;
+		return result;
+	}
+
+	// Pick the devices: by index or name from the command line, otherwise by policy
+	std::vector<OpenCLDeviceInfo> devices;
+	std::vector<OpenCLDeviceInfo> chosen;
+	BeginPhase(&profiler, "setup device");
+	if (CL_SUCCESS != EnumerateOpenCLDevices(&devices) || !ChooseRenderDevices(options, devices, &chosen))
 	{
+		if (!devices.empty())
+			PrintOpenCLDevices(devices);
 		return -1;
 	}
 
-	if (CL_SUCCESS != GetWorkGroupInfo(&ocl, workAmount, &localWorkSize))
+	// Every device gets its own context, queue, buffers and kernels
+	std::deque<RenderDevice>& renderDevices = session->devices;
+	for (size_t d = 0; d < chosen.size(); d++)
+	{
+		renderDevices.emplace_back();
+		renderDevices.back().name = chosen[d].deviceName;
+		renderDevices.back().subDevice = chosen[d].parent ? chosen[d].device : NULL;
+	}
+	for (size_t d = 0; d < chosen.size(); d++)
+	{
+		//initialize Open CL objects (context, queue, etc.)
+		if (CL_SUCCESS != SetupOpenCL(&renderDevices[d].ocl, &chosen[d]))
+		{
+			return -1;
+		}
+		profiler.deviceName += (d > 0) ? " + " + chosen[d].deviceName : chosen[d].deviceName;
+	}
+	EndPhase(&profiler);
+
+	*begin = std::chrono::steady_clock::now();
+
+	cl_uint tileWidth = options->tileWidth;
+	cl_uint tileHeight = options->tileHeight;
+	for (size_t d = 0; d < renderDevices.size(); d++)
+	{
+		if (0 != PrepareDevice(&renderDevices[d], chosen[d], options, &profiler, &compiled, &bvh, &masterSet,
+			buildOptions, Seeds, d == 0, &tileWidth, &tileHeight))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+* One render as the options ask for, in session: set it up unless an earlier render did, render
+* on the chosen backend and write the image. stats, if not NULL, gets the startup and render time
+* and the rays traced. A render stops between two passes once *cancel is set (if cancel isn't
+* NULL) and returns 1 without writing the image.
+*/
+int RenderInSession(const RenderOptions* options, RenderSession* session, RenderStats* stats, const std::atomic<bool>* cancel)
+{
+	cl_int err;
+	Profiler& profiler = session->profiler;
+	std::chrono::steady_clock::time_point runBegin = std::chrono::steady_clock::now();
+
+	if (options->precompile && options->kernelCache == NULL)
 	{
+		printf("Error: -precompile needs a kernel cache.\n");
 		return -1;
 	}
-	//localWorkSize = 1;
-	// Execute (enqueue) the kernel
-	if (CL_SUCCESS != ExecuteAddKernel(&ocl, Pixels, globalWorkSize, localWorkSize, arrayWidth, arrayHeight, workAmount, workCount))
+
+	if (options->precompile && options->writeScene)
 	{
+		printf("Error: -precompile and -write-scene don't go together.\n");
 		return -1;
 	}
 
-	// The last part of this function: getting processed results back.
-	// use map-unmap sequence to update original memory area with output buffer.
-	
-	ReleaseInfo(&ocl, arrayWidth, arrayHeight);
+	cl_uint arrayWidth = options->width;
+	cl_uint arrayHeight = options->height;
+
+	// Wall time from here on; commands only get events with a report to write
+	profiler.enabled = options->profileFile || options->traceFile;
+	std::chrono::steady_clock::time_point begin = runBegin;
+
+	// The camera path is read before any device is set up, so a bad file costs nothing
+	CameraPath cameraPath;
+	const CameraPath* path = NULL;
+	session->hostError = false;
+	if (options->cameraPath)
+	{
+		if (!LoadCameraPath(options->cameraPath, &cameraPath))
+		{
+			session->hostError = true;
+			return -1;
+		}
+		path = &cameraPath;
+		printf("Camera path: %u keys, %s interpolation, %u frames\n", (unsigned int)cameraPath.keys.size(),
+			(cameraPath.interpolation == CAMERA_SMOOTH) ? "smooth" : "linear", FrameCount(options, path));
+	}
+
+	// A session an earlier job has set up only needs the camera of this one
+	if (session->devices.empty())
+	{
+		bool finished = false;
+		int result = SetupSession(options, path, session, stats, runBegin, &begin, &finished);
+		if (result != 0 || finished)
+			return result;
+	}
+	else
+	{
+		SetJobCamera(options, session);
+	}
+
+	std::deque<RenderDevice>& renderDevices = session->devices;
+	CompiledScene& compiled = session->compiled;
+	cl_uint* Pixels = session->pixels;
+	if (stats)
+	{
+		stats->device = profiler.deviceName;
+		stats->startupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runBegin).count();
+	}
+
+	// Images are encoded and written on the writer's thread while the next pass runs
+	ImageWriter writer(&profiler);
+
+	// With previews or frames on one device, each image is read back on a second queue while the next pass renders
+	ReadbackPipeline* readback = NULL;
+	ocl_args_d_t* first = &renderDevices.front().ocl;
+	ImageFormat format = IMAGE_PPM;
+	ImageFormatFromName((options->preview || path) ? options->outputFile : "", &format);
+	const bool floatImage = IsFloatFormat(format);
+	const bool pipelined = (options->preview || path) && renderDevices.size() == 1;
+	if (pipelined)
+	{
+		// The queue and slots of an earlier job in the session take this one's images if they fit
+		size_t imageSize = (floatImage ? sizeof(cl_float) * 4 : sizeof(cl_uint)) * arrayWidth * arrayHeight;
+		readback = session->readback;
+		if (readback && (readback->width != arrayWidth || readback->height != arrayHeight || readback->imageSize < imageSize))
+		{
+			delete readback;
+			readback = session->readback = NULL;
+		}
+		if (readback)
+		{
+			DiscardReadbacks(readback);
+			readback->writer = &writer;
+		}
+		else
+		{
+			cl_command_queue transferQueue = CreateCommandQueue(first, &err);
+			if (CL_SUCCESS != err)
+			{
+				return -1;
+			}
+			readback = session->readback = new ReadbackPipeline;
+			if (CL_SUCCESS != CreateReadback(readback, first->context, transferQueue, imageSize, arrayWidth, arrayHeight, &writer, &profiler))
+			{
+				delete readback;
+				session->readback = NULL;
+				return -1;
+			}
+		}
+	}
+
+	// Every frame reuses the devices as they are; only the camera and the sums change
+	unsigned int frameCount = FrameCount(options, path);
+	for (unsigned int frameIndex = 0; frameIndex < frameCount; frameIndex++)
+	{
+		std::chrono::steady_clock::time_point frameBegin = std::chrono::steady_clock::now();
+		std::string outputFile = options->outputFile ? options->outputFile : "";
+		if (path)
+		{
+			SetFrameCamera(*path, frameIndex, frameCount, (float)arrayWidth / (float)arrayHeight, &compiled);
+			outputFile = FrameFileName(options->outputFile, frameIndex);
+		}
+		if (path || session->used)
+		{
+			// The first frame in a reused session may follow an adaptive or cancelled job
+			bool resetPixels = options->adaptiveError > 0.0f || frameIndex == 0;
+			for (size_t d = 0; d < renderDevices.size(); d++)
+			{
+				if (CL_SUCCESS != BeginDeviceFrame(&renderDevices[d], &compiled.camera, arrayWidth, arrayHeight, resetPixels))
+				{
+					return -1;
+				}
+			}
+		}
+		session->used = true;
+
+		BeginPhase(&profiler, "render");
+		PassSchedule schedule;
+		unsigned long long rays[RAY_COUNT_KINDS] = { 0, 0 };
+		int result = RenderPasses(&renderDevices, options, &profiler, &writer, readback, floatImage,
+			Pixels, arrayWidth, arrayHeight, &schedule, rays, cancel);
+		if (result != 0)
+		{
+			if (result > 0)
+				printf("Render cancelled after %u samples per pixel\n", schedule.samplesDone);
+			return result;
+		}
+		EndPhase(&profiler);
+		ReportRays(rays, &schedule, stats);
+
+		// The last part of this function: getting processed results back.
+		// use map-unmap sequence to update original memory area with output buffer.
+		// Read backs through the pipeline go on while the next frame renders
+		if (options->outputFile)
+		{
+			BeginPhase(&profiler, "read back");
+			if (pipelined)
+			{
+				if (CL_SUCCESS != QueueReadback(readback, first->commandQueue, floatImage ? first->Accum : first->Pixels, floatImage, outputFile.c_str()))
+				{
+					return -1;
+				}
+			}
+			else if (!ReleaseImage(&renderDevices, &writer, arrayWidth, arrayHeight, outputFile.c_str(), Pixels))
+			{
+				return -1;
+			}
+			EndPhase(&profiler);
+		}
+		if (path)
+		{
+			printf("Frame %u of %u: %u samples per pixel in %lfs -> %s\n", frameIndex + 1, frameCount, schedule.samplesDone,
+				std::chrono::duration<double>(std::chrono::steady_clock::now() - frameBegin).count(), outputFile.c_str());
+		}
+	}
+	ReportDeviceSplit(renderDevices);
+
+	if (pipelined)
+	{
+		BeginPhase(&profiler, "read back");
+		if (CL_SUCCESS != CollectReadbacks(readback, true))
+		{
+			return -1;
+		}
+		EndPhase(&profiler);
+	}
+	BeginPhase(&profiler, "wait for image writer");
+	if (!writer.Finish())
+	{
+		session->hostError = true;
+		return -1;
+	}
+	EndPhase(&profiler);
+	ReportAllSamples(&renderDevices, options, arrayWidth, arrayHeight);
 	
-	end = clock();
-	printf("elapsed time : %lfs\n", (double)(end - begin) / CLOCKS_PER_SEC);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("elapsed time : %lfs\n", elapsed);
+
+	if (!WriteProfile(&profiler, options))
+	{
+		return -1;
+	}
 
-	_aligned_free(Pixels);
 	//getchar();
 	return 0;
 }
+
+/*
+* One render as the options ask for: set up the scene, render it on the chosen backend and write
+* the image. stats, if not NULL, gets the startup and render time and the rays traced.
+*/
+int Render(const RenderOptions* options, RenderStats* stats)
+{
+	RenderSession session;
+	return RenderInSession(options, &session, stats, NULL);
+}
+
+/*
+* Render every benchmark case on the CPU path and on the OpenCL device: warm-up renders first
+* (they also fill the kernel cache), then the timed ones. The scenes, sizes and sample counts
+* are fixed, so are the seeds; the other options (device, schedule, threads, ...) still apply.
+*/
+int RunBenchmark(const RenderOptions* options)
+{
+	const RenderBackend backends[] = { BACKEND_CPU, BACKEND_OPENCL };
+	bool skipOpenCL = false;
+	std::vector<BenchmarkResult> results;
+
+	const std::vector<BenchmarkCase>& cases = BenchmarkCases();
+	for (size_t c = 0; c < cases.size(); c++)
+	{
+		const BenchmarkCase& benchmark = cases[c];
+		RenderOptions caseOptions = *options;
+		caseOptions.width = benchmark.width;
+		caseOptions.height = benchmark.height;
+		caseOptions.sampleBudget = benchmark.sampleCount;
+		caseOptions.passSamples = benchmark.sampleCount;
+		caseOptions.timeLimit = 0.0;
+		caseOptions.adaptiveError = 0.0f;
+		caseOptions.outputFile = NULL;
+		caseOptions.preview = false;
+		caseOptions.sampleMap = NULL;
+		caseOptions.cameraPath = NULL;
+		caseOptions.profileFile = NULL;
+		caseOptions.traceFile = NULL;
+		caseOptions.seed = 1;
+		BuildBenchmarkScene(benchmark, &caseOptions.lights, &caseOptions.shapes, &caseOptions.builtMeshes);
+
+		for (int b = 0; b < 2; b++)
+		{
+			if (backends[b] == BACKEND_OPENCL && skipOpenCL)
+				continue;
+			caseOptions.backend = backends[b];
+			const char* backendName = (backends[b] == BACKEND_CPU) ? "cpu" : "ocl";
+			printf("Benchmark %s (%s) on %s: %u warm-up and %u timed renders\n", benchmark.name, benchmark.description,
+				backendName, options->benchWarmup, options->benchRepetitions);
+
+			std::vector<RenderStats> runs;
+			for (unsigned int run = 0; run < options->benchWarmup + options->benchRepetitions; run++)
+			{
+				RenderStats stats;
+				if (0 != Render(&caseOptions, &stats))
+					break;
+				if (run >= options->benchWarmup)
+					runs.push_back(stats);
+			}
+
+			// Without a usable OpenCL device the suite goes on with the CPU path alone
+			if (runs.size() != options->benchRepetitions)
+			{
+				if (backends[b] == BACKEND_CPU)
+					return -1;
+				printf("Benchmark: no OpenCL results, going on with the CPU path only\n");
+				skipOpenCL = true;
+				continue;
+			}
+			results.push_back(SummarizeBenchmark(benchmark, backendName, runs));
+		}
+	}
+
+	printf("\n");
+	for (size_t r = 0; r < results.size(); r++)
+	{
+		PrintBenchmarkResult(results[r]);
+	}
+
+	bool result = true;
+	if (options->benchJSON)
+		result = WriteBenchmarkJSON(options->benchJSON, results) && result;
+	if (options->benchCSV)
+		result = WriteBenchmarkCSV(options->benchCSV, results) && result;
+	if (options->benchBaseline)
+		result = CompareBenchmarkBaseline(options->benchBaseline, results, options->benchTolerance) && result;
+	return result ? 0 : -1;
+}
+
+// Options of a daemon job that don't change what its session sets up, with the values they take
+static const struct { const char* name; int values; } kJobOptions[] = {
+	{ "-camera", 1 }, { "-camera-path", 1 }, { "-frames", 1 }, { "-spp", 1 }, { "-pass-spp", 1 },
+	{ "-time-limit", 1 }, { "-output", 1 }, { "-preview", 0 }, { "-adaptive", 1 }, { "-sample-map", 1 } };
+
+/*
+* What tells sessions apart: the options of a job without those of kJobOptions, and the samples
+* per pass if the program is specialized for them
+*/
+std::string SessionKey(const std::vector<std::string>& args, const RenderOptions* options)
+{
+	std::string key;
+	for (size_t i = 0; i < args.size(); i++)
+	{
+		int skip = -1;
+		for (size_t k = 0; k < sizeof(kJobOptions) / sizeof(kJobOptions[0]); k++)
+		{
+			if (args[i] == kJobOptions[k].name)
+				skip = kJobOptions[k].values;
+		}
+		if (skip >= 0)
+		{
+			i += skip;
+			continue;
+		}
+		key += args[i] + " ";
+	}
+
+	if (options->specialize && options->sampleBudget % options->passSamples == 0)
+	{
+		char samples[32];
+		snprintf(samples, sizeof(samples), "/ %u samples per pass", options->passSamples);
+		key += samples;
+	}
+	return key;
+}
+
+/*
+* Render job in the session set up for one like it, or in a new one. The reply tells where the
+* image went and how long the job waited, set up and rendered.
+*/
+std::string RunDaemonJob(const std::vector<std::string>& daemonArgs, DaemonJob* job, std::list<RenderSession>* sessions)
+{
+	char reply[512];
+	double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - job->queued).count();
+
+	// The job's options go after the daemon's, so they override them
+	std::vector<std::string> args = daemonArgs;
+	args.insert(args.end(), job->args.begin(), job->args.end());
+	std::vector<char*> argv;
+	for (size_t i = 0; i < args.size(); i++)
+		argv.push_back(const_cast<char*>(args[i].c_str()));
+
+	RenderOptions options;
+	if (!ParseCommandLine((int)argv.size(), &argv[0], &options))
+	{
+		snprintf(reply, sizeof(reply), "failed %u: bad options", job->id);
+		return reply;
+	}
+	if (options.backend == BACKEND_CPU || options.benchmark || options.precompile || options.writeScene ||
+		options.listDevices || options.profileFile || options.traceFile || options.daemonSocket)
+	{
+		snprintf(reply, sizeof(reply), "failed %u: a job renders on OpenCL devices and only writes images", job->id);
+		return reply;
+	}
+
+	// The session of the job goes to the front, so the least recently used one is at the back
+	std::string key = SessionKey(args, &options);
+	std::list<RenderSession>::iterator session = sessions->begin();
+	while (session != sessions->end() && session->key != key)
+		++session;
+	bool warm = (session != sessions->end());
+	if (warm)
+	{
+		sessions->splice(sessions->begin(), *sessions, session);
+	}
+	else
+	{
+		sessions->emplace_front();
+		sessions->front().key = key;
+	}
+
+	RenderStats stats;
+	stats.startupSeconds = 0.0;
+	int result = RenderInSession(&options, &sessions->front(), &stats, &job->cancel);
+	if (result < 0 && !sessions->front().hostError)
+	{
+		// After a failed OpenCL call whatever the devices hold can't be trusted for the next job
+		sessions->pop_front();
+	}
+	while (sessions->size() > DAEMON_SESSIONS)
+	{
+		sessions->pop_back();
+	}
+
+	if (result < 0)
+	{
+		snprintf(reply, sizeof(reply), "failed %u: see the daemon's output", job->id);
+		return reply;
+	}
+	if (result > 0)
+	{
+		snprintf(reply, sizeof(reply), "cancelled %u", job->id);
+		return reply;
+	}
+	snprintf(reply, sizeof(reply), "done %u %s session=%s wait=%.6fs setup=%.6fs render=%.6fs spp=%u rays=%llu",
+		job->id, options.outputFile, warm ? "warm" : "new", waited, stats.startupSeconds, stats.renderSeconds,
+		stats.samplesPerPixel, stats.rays[RAY_COUNT_CLOSEST] + stats.rays[RAY_COUNT_SHADOW]);
+	return reply;
+}
+
+/*
+* Take render jobs on a Unix domain socket until a client asks for a shutdown. Every job starts
+* from the daemon's own options; the sessions of the last DAEMON_SESSIONS kinds of job stay set up.
+*/
+int RunDaemon(int argc, char **argv, const RenderOptions* options)
+{
+	std::vector<std::string> daemonArgs;
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-daemon") == 0 && i + 1 < argc)
+			i++;
+		else
+			daemonArgs.push_back(argv[i]);
+	}
+
+	RenderDaemon daemon;
+	if (!daemon.Listen(options->daemonSocket))
+	{
+		return -1;
+	}
+	printf("Daemon: taking jobs on '%s'\n", options->daemonSocket);
+	fflush(stdout);
+
+	std::list<RenderSession> sessions;
+	for (DaemonJob* job; (job = daemon.NextJob()) != NULL; )
+	{
+		printf("Daemon: job %u, priority %d\n", job->id, job->priority);
+		std::string reply = RunDaemonJob(daemonArgs, job, &sessions);
+		printf("Daemon: %s\n", reply.c_str());
+		fflush(stdout);
+		daemon.FinishJob(job, reply);
+	}
+	printf("Daemon: shut down\n");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	RenderOptions options;
+
+	if (!ParseCommandLine(argc, argv, &options))
+	{
+		PrintUsage(argv[0]);
+		return -1;
+	}
+
+	if (options.listDevices)
+	{
+		std::vector<OpenCLDeviceInfo> devices;
+		if (CL_SUCCESS != EnumerateOpenCLDevices(&devices))
+		{
+			return -1;
+		}
+		PrintOpenCLDevices(devices);
+		return 0;
+	}
+
+	if (options.benchmark)
+	{
+		if (options.precompile || options.writeScene)
+		{
+			printf("Error: -benchmark doesn't go with -precompile or -write-scene.\n");
+			return -1;
+		}
+		return RunBenchmark(&options);
+	}
+
+	if (options.daemonSocket)
+	{
+		if (options.precompile || options.writeScene || options.backend == BACKEND_CPU)
+		{
+			printf("Error: -daemon doesn't go with -precompile, -write-scene or -backend cpu.\n");
+			return -1;
+		}
+		return RunDaemon(argc, argv, &options);
+	}
+
+	return Render(&options, NULL);
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace RAYTRACING
+{
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() :
+		m_data(NULL),
+		m_size(0),
+		m_file(INVALID_HANDLE_VALUE),
+		m_mapping(NULL)
+{
+}
+
+bool MappedFile::Open(const char* fileName, bool copyOnWrite)
+{
+	Close();
+
+	m_file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		printf("Error: Couldn't open file '%s'.\n", fileName);
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(m_file, &fileSize))
+	{
+		printf("Error: Couldn't get the size of file '%s'.\n", fileName);
+		Close();
+		return false;
+	}
+
+	m_size = (size_t)fileSize.QuadPart;
+	if (m_size == 0)
+		return true;
+
+	m_mapping = CreateFileMappingA(m_file, NULL, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping == NULL)
+	{
+		printf("Error: CreateFileMapping failed for '%s'.\n", fileName);
+		Close();
+		return false;
+	}
+
+	m_data = (const char*)MapViewOfFile(m_mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+	if (m_data == NULL)
+	{
+		printf("Error: MapViewOfFile failed for '%s'.\n", fileName);
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+
+	m_data = NULL;
+	m_size = 0;
+	m_mapping = NULL;
+	m_file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedFile::MappedFile() :
+		m_data(NULL),
+		m_size(0),
+		m_fd(-1)
+{
+}
+
+bool MappedFile::Open(const char* fileName, bool copyOnWrite)
+{
+	Close();
+
+	m_fd = open(fileName, O_RDONLY);
+	if (m_fd < 0)
+	{
+		printf("Error: Couldn't open file '%s'.\n", fileName);
+		return false;
+	}
+
+	struct stat fileStat;
+	if (fstat(m_fd, &fileStat) != 0)
+	{
+		printf("Error: Couldn't get the size of file '%s'.\n", fileName);
+		Close();
+		return false;
+	}
+
+	m_size = (size_t)fileStat.st_size;
+	if (m_size == 0)
+		return true;
+
+	void* data = mmap(NULL, m_size, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, m_fd, 0);
+	if (data == MAP_FAILED)
+	{
+		printf("Error: mmap failed for '%s'.\n", fileName);
+		Close();
+		return false;
+	}
+
+	// The loaders read the file front to back
+	madvise(data, m_size, MADV_SEQUENTIAL);
+	m_data = (const char*)data;
+
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_data)
+		munmap((void*)m_data, m_size);
+	if (m_fd >= 0)
+		close(m_fd);
+
+	m_data = NULL;
+	m_size = 0;
+	m_fd = -1;
+}
+
+#endif
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+}
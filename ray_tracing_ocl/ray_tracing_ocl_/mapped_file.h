@@ -0,0 +1,45 @@
+// Read-only memory-mapped file
+//
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <stddef.h>
+
+namespace RAYTRACING
+{
+
+/*
+* Maps a whole file read-only into the address space.
+* The mapping lives as long as the object; an empty file maps to size 0 and data NULL.
+* With copyOnWrite the pages are mapped writable but private, for APIs that want a
+* non-const pointer (e.g. CL_MEM_USE_HOST_PTR); the file itself never changes.
+*/
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char* fileName, bool copyOnWrite = false);
+	void Close();
+
+	const char* Data() const { return m_data; }
+	size_t Size() const { return m_size; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const char* m_data;
+	size_t m_size;
+#ifdef _WIN32
+	void* m_file;
+	void* m_mapping;
+#else
+	int m_fd;
+#endif
+};
+
+}
+
+#endif
@@ -0,0 +1,804 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <string>
+
+#include "mesh_loader.h"
+#include "mapped_file.h"
+
+namespace RAYTRACING
+{
+
+// Number of parse chunks per worker thread, so that stealing can even out the line lengths
+#define MESH_CHUNKS_PER_THREAD	4
+
+static inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* SkipSpaces(const char* p, const char* end)
+{
+	while (p < end && IsSpace(*p))
+		p++;
+	return p;
+}
+
+static inline const char* SkipToken(const char* p, const char* end)
+{
+	while (p < end && !IsSpace(*p) && *p != '\n')
+		p++;
+	return p;
+}
+
+static inline const char* LineEnd(const char* p, const char* end)
+{
+	const char* newline = (const char*)memchr(p, '\n', end - p);
+	return newline ? newline : end;
+}
+
+/*
+* Locale independent float parser; much faster than strtod on large files
+*/
+static bool ParseFloat(const char** cursor, const char* end, float* value)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+		1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	const char* p = SkipSpaces(*cursor, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+
+	double mantissa = 0.0;
+	int exponent = 0;
+	bool digits = false;
+
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		mantissa = mantissa * 10.0 + (*p - '0');
+		digits = true;
+		p++;
+	}
+	if (p < end && *p == '.')
+	{
+		p++;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			mantissa = mantissa * 10.0 + (*p - '0');
+			exponent--;
+			digits = true;
+			p++;
+		}
+	}
+	if (!digits)
+		return false;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negativeExponent = false;
+		if (p < end && (*p == '-' || *p == '+'))
+		{
+			negativeExponent = (*p == '-');
+			p++;
+		}
+		int e = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			e = std::min(e * 10 + (*p - '0'), 1000);
+			p++;
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+
+	while (exponent > 22) { mantissa *= 1e22; exponent -= 22; }
+	while (exponent < -22) { mantissa /= 1e22; exponent += 22; }
+	mantissa = exponent >= 0 ? mantissa * powers[exponent] : mantissa / powers[-exponent];
+
+	*value = (float)(negative ? -mantissa : mantissa);
+	*cursor = p;
+	return true;
+}
+
+static bool ParseInt(const char** cursor, const char* end, long long* value)
+{
+	const char* p = *cursor;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+	if (p >= end || *p < '0' || *p > '9')
+		return false;
+
+	long long result = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		result = result * 10 + (*p - '0');
+		p++;
+	}
+
+	*value = negative ? -result : result;
+	*cursor = p;
+	return true;
+}
+
+static inline void TransformVertex(Point* v, float scale, const Vector& offset)
+{
+	v->x = v->x * scale + offset.x;
+	v->y = v->y * scale + offset.y;
+	v->z = v->z * scale + offset.z;
+}
+
+/*
+* ---------------------------------------------------------------------------
+* Wavefront OBJ
+*
+* The file is cut into chunks at line boundaries. A first parallel pass counts the
+* vertices and triangles of every chunk, prefix sums turn the counts into output
+* offsets, and a second parallel pass parses straight into the shared lists.
+* Only 'v' and 'f' records are used.
+* ---------------------------------------------------------------------------
+*/
+struct ObjChunk
+{
+	const char* begin;
+	const char* end;
+	size_t vertexCount;
+	size_t triangleCount;
+	size_t vertexBase;
+	size_t triangleBase;
+	bool failed;
+};
+
+static inline bool IsVertexLine(const char* p, const char* end)
+{
+	return (end - p) >= 2 && p[0] == 'v' && IsSpace(p[1]);
+}
+
+static inline bool IsFaceLine(const char* p, const char* end)
+{
+	return (end - p) >= 2 && p[0] == 'f' && IsSpace(p[1]);
+}
+
+static void CountObjChunk(ObjChunk* chunk)
+{
+	const char* p = chunk->begin;
+	chunk->vertexCount = 0;
+	chunk->triangleCount = 0;
+
+	while (p < chunk->end)
+	{
+		const char* lineEnd = LineEnd(p, chunk->end);
+		const char* q = SkipSpaces(p, lineEnd);
+
+		if (IsVertexLine(q, lineEnd))
+		{
+			chunk->vertexCount++;
+		}
+		else if (IsFaceLine(q, lineEnd))
+		{
+			size_t corners = 0;
+			q = SkipSpaces(q + 1, lineEnd);
+			while (q < lineEnd)
+			{
+				corners++;
+				q = SkipSpaces(SkipToken(q, lineEnd), lineEnd);
+			}
+			if (corners >= 3)
+				chunk->triangleCount += corners - 2;
+		}
+
+		p = lineEnd + 1;
+	}
+}
+
+static void ParseObjChunk(ObjChunk* chunk, size_t fileVertexCount, unsigned int vertexOffset, unsigned int meshIndex,
+	float scale, const Vector& offset, Point* vertices, Triangle* triangles)
+{
+	const char* p = chunk->begin;
+	size_t vertex = chunk->vertexBase;
+	size_t triangle = chunk->triangleBase;
+	chunk->failed = false;
+
+	while (p < chunk->end)
+	{
+		const char* lineEnd = LineEnd(p, chunk->end);
+		const char* q = SkipSpaces(p, lineEnd);
+
+		if (IsVertexLine(q, lineEnd))
+		{
+			Point v;
+			q++;
+			if (!ParseFloat(&q, lineEnd, &v.x) || !ParseFloat(&q, lineEnd, &v.y) || !ParseFloat(&q, lineEnd, &v.z))
+			{
+				chunk->failed = true;
+				return;
+			}
+			TransformVertex(&v, scale, offset);
+			vertices[vertex++] = v;
+		}
+		else if (IsFaceLine(q, lineEnd))
+		{
+			unsigned int first = 0, previous = 0;
+			int corner = 0;
+			q = SkipSpaces(q + 1, lineEnd);
+
+			while (q < lineEnd)
+			{
+				// "v", "v/vt", "v//vn" or "v/vt/vn": only the position index matters
+				long long index;
+				if (!ParseInt(&q, lineEnd, &index))
+				{
+					chunk->failed = true;
+					return;
+				}
+				// Negative indices are relative to the vertices read so far
+				long long absolute = index < 0 ? (long long)vertex + index : index - 1;
+				if (absolute < 0 || absolute >= (long long)fileVertexCount)
+				{
+					chunk->failed = true;
+					return;
+				}
+
+				unsigned int current = vertexOffset + (unsigned int)absolute;
+				if (corner == 0)
+				{
+					first = current;
+				}
+				else if (corner >= 2)
+				{
+					Triangle t = { first, previous, current, meshIndex };
+					triangles[triangle++] = t;
+				}
+				previous = current;
+				corner++;
+
+				q = SkipSpaces(SkipToken(q, lineEnd), lineEnd);
+			}
+		}
+
+		p = lineEnd + 1;
+	}
+}
+
+static bool LoadObj(const MappedFile& file, const char* fileName, float scale, const Vector& offset,
+	unsigned int meshIndex, WorkStealingPool* pool, MeshData* mesh)
+{
+	const char* data = file.Data();
+	size_t size = file.Size();
+
+	// Cut into chunks that start right after a newline
+	size_t chunkCount = std::max<size_t>(1, std::min<size_t>(pool->ThreadCount() * MESH_CHUNKS_PER_THREAD, size / 4096 + 1));
+	std::vector<ObjChunk> chunks(chunkCount);
+	const char* begin = data;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		const char* end = (i + 1 == chunkCount) ? data + size : data + size * (i + 1) / chunkCount;
+		if (end < begin)
+			end = begin;
+		if (end < data + size)
+			end = LineEnd(end, data + size);
+		if (end < data + size)
+			end++;
+
+		chunks[i].begin = begin;
+		chunks[i].end = end;
+		chunks[i].failed = false;
+		begin = end;
+	}
+
+	pool->Run((unsigned int)chunkCount, [&](unsigned int i, unsigned int)
+	{
+		CountObjChunk(&chunks[i]);
+	});
+
+	size_t vertexCount = 0, triangleCount = 0;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		chunks[i].vertexBase = vertexCount;
+		chunks[i].triangleBase = triangleCount;
+		vertexCount += chunks[i].vertexCount;
+		triangleCount += chunks[i].triangleCount;
+	}
+
+	size_t firstVertex = mesh->vertices.size();
+	size_t firstTriangle = mesh->triangles.size();
+	mesh->vertices.resize(firstVertex + vertexCount);
+	mesh->triangles.resize(firstTriangle + triangleCount);
+
+	Point* vertices = vertexCount ? &mesh->vertices[firstVertex] : NULL;
+	Triangle* triangles = triangleCount ? &mesh->triangles[firstTriangle] : NULL;
+
+	pool->Run((unsigned int)chunkCount, [&](unsigned int i, unsigned int)
+	{
+		ParseObjChunk(&chunks[i], vertexCount, (unsigned int)firstVertex, meshIndex, scale, offset, vertices, triangles);
+	});
+
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		if (chunks[i].failed)
+		{
+			printf("Error: Malformed vertex or face record in '%s'.\n", fileName);
+			mesh->vertices.resize(firstVertex);
+			mesh->triangles.resize(firstTriangle);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+* ---------------------------------------------------------------------------
+* Binary PLY
+*
+* Vertex records have a fixed size and are decoded in parallel. Faces are decoded
+* in parallel when every face is a triangle (the common case); otherwise they go
+* through one sequential pass that fan-triangulates the polygons.
+* ---------------------------------------------------------------------------
+*/
+enum PlyType
+{
+	PLY_INVALID, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+};
+
+struct PlyProperty
+{
+	std::string name;
+	PlyType type;
+	bool isList;
+	PlyType countType;
+};
+
+struct PlyElement
+{
+	std::string name;
+	size_t count;
+	std::vector<PlyProperty> properties;
+};
+
+static PlyType ParsePlyType(const std::string& name)
+{
+	if (name == "char" || name == "int8") return PLY_INT8;
+	if (name == "uchar" || name == "uint8") return PLY_UINT8;
+	if (name == "short" || name == "int16") return PLY_INT16;
+	if (name == "ushort" || name == "uint16") return PLY_UINT16;
+	if (name == "int" || name == "int32") return PLY_INT32;
+	if (name == "uint" || name == "uint32") return PLY_UINT32;
+	if (name == "float" || name == "float32") return PLY_FLOAT32;
+	if (name == "double" || name == "float64") return PLY_FLOAT64;
+	return PLY_INVALID;
+}
+
+static size_t PlyTypeSize(PlyType type)
+{
+	switch (type)
+	{
+	case PLY_INT8: case PLY_UINT8: return 1;
+	case PLY_INT16: case PLY_UINT16: return 2;
+	case PLY_INT32: case PLY_UINT32: case PLY_FLOAT32: return 4;
+	case PLY_FLOAT64: return 8;
+	default: return 0;
+	}
+}
+
+static inline void ReadRaw(const char* p, size_t size, bool swap, unsigned char* out)
+{
+	if (swap)
+	{
+		for (size_t i = 0; i < size; i++)
+			out[i] = (unsigned char)p[size - 1 - i];
+	}
+	else
+	{
+		memcpy(out, p, size);
+	}
+}
+
+static inline double ReadPlyScalar(const char* p, PlyType type, bool swap)
+{
+	unsigned char raw[8];
+	ReadRaw(p, PlyTypeSize(type), swap, raw);
+
+	switch (type)
+	{
+	case PLY_INT8: return (double)(signed char)raw[0];
+	case PLY_UINT8: return (double)raw[0];
+	case PLY_INT16: { short v; memcpy(&v, raw, 2); return v; }
+	case PLY_UINT16: { unsigned short v; memcpy(&v, raw, 2); return v; }
+	case PLY_INT32: { int v; memcpy(&v, raw, 4); return v; }
+	case PLY_UINT32: { unsigned int v; memcpy(&v, raw, 4); return v; }
+	case PLY_FLOAT32: { float v; memcpy(&v, raw, 4); return v; }
+	case PLY_FLOAT64: { double v; memcpy(&v, raw, 8); return v; }
+	default: return 0.0;
+	}
+}
+
+static bool IsLittleEndianHost()
+{
+	unsigned int probe = 1;
+	return *(unsigned char*)&probe == 1;
+}
+
+static bool LoadPly(const MappedFile& file, const char* fileName, float scale, const Vector& offset,
+	unsigned int meshIndex, WorkStealingPool* pool, MeshData* mesh)
+{
+	const char* data = file.Data();
+	const char* end = data + file.Size();
+	const char* p = data;
+
+	// Header
+	std::vector<PlyElement> elements;
+	bool binary = false, bigEndian = false, headerDone = false;
+
+	const char* lineEnd = LineEnd(p, end);
+	if (lineEnd - p < 3 || strncmp(p, "ply", 3) != 0)
+	{
+		printf("Error: '%s' is not a PLY file.\n", fileName);
+		return false;
+	}
+	p = lineEnd + 1;
+
+	while (p < end && !headerDone)
+	{
+		lineEnd = LineEnd(p, end);
+		std::string line(p, lineEnd);
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		p = lineEnd + 1;
+
+		char word[64] = { 0 }, arg1[64] = { 0 }, arg2[64] = { 0 }, arg3[64] = { 0 };
+		int fields = sscanf(line.c_str(), "%63s %63s %63s %63s", word, arg1, arg2, arg3);
+		if (fields <= 0)
+			continue;
+
+		if (strcmp(word, "format") == 0)
+		{
+			binary = strcmp(arg1, "binary_little_endian") == 0 || strcmp(arg1, "binary_big_endian") == 0;
+			bigEndian = strcmp(arg1, "binary_big_endian") == 0;
+		}
+		else if (strcmp(word, "element") == 0 && fields >= 3)
+		{
+			PlyElement element;
+			element.name = arg1;
+			element.count = (size_t)strtoull(arg2, NULL, 10);
+			elements.push_back(element);
+		}
+		else if (strcmp(word, "property") == 0 && !elements.empty())
+		{
+			PlyProperty property;
+			if (strcmp(arg1, "list") == 0 && fields >= 4)
+			{
+				char name[64] = { 0 };
+				sscanf(line.c_str(), "%*s %*s %*s %*s %63s", name);
+				property.isList = true;
+				property.countType = ParsePlyType(arg2);
+				property.type = ParsePlyType(arg3);
+				property.name = name;
+			}
+			else
+			{
+				property.isList = false;
+				property.countType = PLY_INVALID;
+				property.type = ParsePlyType(arg1);
+				property.name = arg2;
+			}
+			if (property.type == PLY_INVALID || (property.isList && property.countType == PLY_INVALID))
+			{
+				printf("Error: Unsupported property type in '%s': %s\n", fileName, line.c_str());
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+		else if (strcmp(word, "end_header") == 0)
+		{
+			headerDone = true;
+		}
+	}
+
+	if (!headerDone || !binary)
+	{
+		printf("Error: '%s' must be a binary PLY file.\n", fileName);
+		return false;
+	}
+
+	bool swap = bigEndian == IsLittleEndianHost();
+	size_t firstVertex = mesh->vertices.size();
+	size_t firstTriangle = mesh->triangles.size();
+	size_t vertexCount = 0;
+	bool haveVertices = false;
+
+	for (size_t e = 0; e < elements.size(); e++)
+	{
+		const PlyElement& element = elements[e];
+
+		// Offsets of the fixed-size properties in front of the (only) list property
+		size_t fixedSize = 0, listOffset = 0;
+		int listIndex = -1;
+		int xyz[3] = { -1, -1, -1 };
+		size_t xyzOffset[3] = { 0, 0, 0 };
+
+		for (size_t i = 0; i < element.properties.size(); i++)
+		{
+			const PlyProperty& property = element.properties[i];
+			if (property.isList)
+			{
+				if (listIndex >= 0)
+				{
+					printf("Error: Element '%s' in '%s' has more than one list property.\n", element.name.c_str(), fileName);
+					return false;
+				}
+				listIndex = (int)i;
+				listOffset = fixedSize;
+				continue;
+			}
+			if (property.name == "x") { xyz[0] = (int)i; xyzOffset[0] = fixedSize; }
+			if (property.name == "y") { xyz[1] = (int)i; xyzOffset[1] = fixedSize; }
+			if (property.name == "z") { xyz[2] = (int)i; xyzOffset[2] = fixedSize; }
+			fixedSize += PlyTypeSize(property.type);
+		}
+
+		if (element.name == "vertex")
+		{
+			if (listIndex >= 0 || xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)
+			{
+				printf("Error: Vertex element of '%s' needs scalar x, y and z.\n", fileName);
+				return false;
+			}
+			if ((size_t)(end - p) < fixedSize * element.count)
+			{
+				printf("Error: '%s' is truncated.\n", fileName);
+				return false;
+			}
+
+			vertexCount = element.count;
+			haveVertices = true;
+			mesh->vertices.resize(firstVertex + vertexCount);
+			Point* vertices = vertexCount ? &mesh->vertices[firstVertex] : NULL;
+			const char* records = p;
+			PlyType types[3] = { element.properties[xyz[0]].type, element.properties[xyz[1]].type, element.properties[xyz[2]].type };
+			unsigned int chunkCount = pool->ThreadCount() * MESH_CHUNKS_PER_THREAD;
+
+			pool->Run(chunkCount, [&](unsigned int chunk, unsigned int)
+			{
+				size_t first = vertexCount * chunk / chunkCount;
+				size_t last = vertexCount * (chunk + 1) / chunkCount;
+				for (size_t v = first; v < last; v++)
+				{
+					const char* record = records + v * fixedSize;
+					Point point;
+					point.x = (float)ReadPlyScalar(record + xyzOffset[0], types[0], swap);
+					point.y = (float)ReadPlyScalar(record + xyzOffset[1], types[1], swap);
+					point.z = (float)ReadPlyScalar(record + xyzOffset[2], types[2], swap);
+					TransformVertex(&point, scale, offset);
+					vertices[v] = point;
+				}
+			});
+
+			p += fixedSize * element.count;
+		}
+		else if (element.name == "face" && listIndex >= 0)
+		{
+			if (!haveVertices)
+			{
+				printf("Error: Faces come before vertices in '%s'.\n", fileName);
+				return false;
+			}
+
+			const PlyProperty& list = element.properties[listIndex];
+			size_t countSize = PlyTypeSize(list.countType);
+			size_t indexSize = PlyTypeSize(list.type);
+			size_t triangleRecord = fixedSize + countSize + 3 * indexSize;
+			size_t faceCount = element.count;
+			const char* records = p;
+
+			/*
+			* Fast path: every face is a triangle, so records have a fixed size. A chunk that
+			* starts after a polygon reads at the wrong offset, so its index errors only count
+			* when no chunk found a face other than a triangle.
+			*/
+			bool allTriangles = (size_t)(end - p) >= triangleRecord * faceCount;
+			if (allTriangles)
+			{
+				mesh->triangles.resize(firstTriangle + faceCount);
+				Triangle* triangles = faceCount ? &mesh->triangles[firstTriangle] : NULL;
+				unsigned int chunkCount = pool->ThreadCount() * MESH_CHUNKS_PER_THREAD;
+				std::vector<char> notTriangles(chunkCount, 0);
+				std::vector<char> outOfRange(chunkCount, 0);
+
+				pool->Run(chunkCount, [&](unsigned int chunk, unsigned int)
+				{
+					size_t first = faceCount * chunk / chunkCount;
+					size_t last = faceCount * (chunk + 1) / chunkCount;
+					for (size_t f = first; f < last; f++)
+					{
+						const char* record = records + f * triangleRecord + listOffset;
+						if ((size_t)ReadPlyScalar(record, list.countType, swap) != 3)
+						{
+							notTriangles[chunk] = 1;
+							return;
+						}
+						record += countSize;
+						double i0 = ReadPlyScalar(record, list.type, swap);
+						double i1 = ReadPlyScalar(record + indexSize, list.type, swap);
+						double i2 = ReadPlyScalar(record + 2 * indexSize, list.type, swap);
+						if (i0 < 0 || i1 < 0 || i2 < 0 || i0 >= vertexCount || i1 >= vertexCount || i2 >= vertexCount)
+						{
+							// Go on with the counts, a later polygon sends the file to the sequential pass
+							outOfRange[chunk] = 1;
+							continue;
+						}
+						Triangle t = { (unsigned int)firstVertex + (unsigned int)i0, (unsigned int)firstVertex + (unsigned int)i1,
+							(unsigned int)firstVertex + (unsigned int)i2, meshIndex };
+						triangles[f] = t;
+					}
+				});
+
+				bool badIndex = false;
+				for (unsigned int c = 0; c < chunkCount; c++)
+				{
+					if (notTriangles[c])
+						allTriangles = false;
+					if (outOfRange[c])
+						badIndex = true;
+				}
+				if (allTriangles && badIndex)
+				{
+					printf("Error: Face index out of range in '%s'.\n", fileName);
+					mesh->vertices.resize(firstVertex);
+					mesh->triangles.resize(firstTriangle);
+					return false;
+				}
+
+				if (allTriangles)
+				{
+					p += triangleRecord * faceCount;
+					continue;
+				}
+				mesh->triangles.resize(firstTriangle);
+			}
+
+			// Polygons: one sequential pass
+			for (size_t f = 0; f < faceCount; f++)
+			{
+				if ((size_t)(end - p) < listOffset + countSize)
+				{
+					printf("Error: '%s' is truncated.\n", fileName);
+					return false;
+				}
+				size_t corners = (size_t)ReadPlyScalar(p + listOffset, list.countType, swap);
+				const char* indices = p + listOffset + countSize;
+				size_t recordSize = fixedSize + countSize + corners * indexSize;
+				if ((size_t)(end - p) < recordSize)
+				{
+					printf("Error: '%s' is truncated.\n", fileName);
+					return false;
+				}
+
+				for (size_t c = 2; c < corners; c++)
+				{
+					double i0 = ReadPlyScalar(indices, list.type, swap);
+					double i1 = ReadPlyScalar(indices + (c - 1) * indexSize, list.type, swap);
+					double i2 = ReadPlyScalar(indices + c * indexSize, list.type, swap);
+					if (i0 < 0 || i1 < 0 || i2 < 0 || i0 >= vertexCount || i1 >= vertexCount || i2 >= vertexCount)
+					{
+						printf("Error: Face index out of range in '%s'.\n", fileName);
+						mesh->vertices.resize(firstVertex);
+						mesh->triangles.resize(firstTriangle);
+						return false;
+					}
+					Triangle t = { (unsigned int)firstVertex + (unsigned int)i0, (unsigned int)firstVertex + (unsigned int)i1,
+						(unsigned int)firstVertex + (unsigned int)i2, meshIndex };
+					mesh->triangles.push_back(t);
+				}
+				p += recordSize;
+			}
+		}
+		else
+		{
+			// Other elements are skipped; that only works when their records have a fixed size
+			if (listIndex >= 0)
+			{
+				printf("Error: Can't skip element '%s' with a list property in '%s'.\n", element.name.c_str(), fileName);
+				return false;
+			}
+			p += fixedSize * element.count;
+		}
+	}
+
+	if (!haveVertices)
+	{
+		printf("Error: '%s' has no vertex element.\n", fileName);
+		return false;
+	}
+
+	return true;
+}
+
+static bool HasExtension(const char* fileName, const char* extension)
+{
+	size_t length = strlen(fileName), extensionLength = strlen(extension);
+	if (length < extensionLength)
+		return false;
+
+	for (size_t i = 0; i < extensionLength; i++)
+	{
+		if (tolower((unsigned char)fileName[length - extensionLength + i]) != extension[i])
+			return false;
+	}
+	return true;
+}
+
+bool LoadMeshFile(const char* fileName, float scale, const Vector& offset, const Color& color,
+	WorkStealingPool* pool, MeshData* mesh)
+{
+	MappedFile file;
+	if (!file.Open(fileName))
+		return false;
+
+	if (file.Size() == 0)
+	{
+		printf("Error: '%s' is empty.\n", fileName);
+		return false;
+	}
+
+	unsigned int meshIndex = (unsigned int)mesh->colors.size();
+	bool result;
+
+	if (HasExtension(fileName, ".obj"))
+	{
+		result = LoadObj(file, fileName, scale, offset, meshIndex, pool, mesh);
+	}
+	else if (HasExtension(fileName, ".ply"))
+	{
+		result = LoadPly(file, fileName, scale, offset, meshIndex, pool, mesh);
+	}
+	else
+	{
+		printf("Error: Unknown mesh format '%s' (expected .obj or .ply).\n", fileName);
+		return false;
+	}
+
+	if (result)
+	{
+		mesh->colors.push_back(color);
+	}
+
+	return result;
+}
+
+void AppendMeshData(MeshData* mesh, const MeshData& other)
+{
+	unsigned int vertexBase = (unsigned int)mesh->vertices.size();
+	unsigned int meshBase = (unsigned int)mesh->colors.size();
+	mesh->vertices.insert(mesh->vertices.end(), other.vertices.begin(), other.vertices.end());
+	mesh->colors.insert(mesh->colors.end(), other.colors.begin(), other.colors.end());
+	for (size_t t = 0; t < other.triangles.size(); t++)
+	{
+		Triangle triangle = other.triangles[t];
+		triangle.m_v0 += vertexBase;
+		triangle.m_v1 += vertexBase;
+		triangle.m_v2 += vertexBase;
+		triangle.m_mesh += meshBase;
+		mesh->triangles.push_back(triangle);
+	}
+}
+
+void AttachMeshData(SphereSet* scene, MeshData* mesh)
+{
+	scene->m_vertices = mesh->vertices.empty() ? NULL : &mesh->vertices[0];
+	scene->VertexCount = (int)mesh->vertices.size();
+	scene->m_triangle = mesh->triangles.empty() ? NULL : &mesh->triangles[0];
+	scene->TriangleCount = (int)mesh->triangles.size();
+	scene->m_meshColor = mesh->colors.empty() ? NULL : &mesh->colors[0];
+	scene->MeshCount = (int)mesh->colors.size();
+}
+
+}
@@ -0,0 +1,41 @@
+// Triangle mesh loading (Wavefront OBJ and binary PLY)
+//
+#ifndef __MESH_LOADER_H__
+#define __MESH_LOADER_H__
+
+#include <vector>
+
+#include "raytracing.h"
+#include "thread_pool.h"
+
+namespace RAYTRACING
+{
+
+/*
+* Shared vertex and index lists of every mesh in the scene.
+* Each loaded file becomes one mesh with its own entry in colors.
+*/
+struct MeshData
+{
+	std::vector<Point> vertices;
+	std::vector<Triangle> triangles;
+	std::vector<Color> colors;
+};
+
+/*
+* Memory-map an .obj or binary .ply file (chosen by extension), parse it in parallel on pool
+* and append it to mesh. Vertices are transformed by position * scale + offset,
+* polygons are split into triangle fans.
+*/
+bool LoadMeshFile(const char* fileName, float scale, const Vector& offset, const Color& color,
+	WorkStealingPool* pool, MeshData* mesh);
+
+// Append the meshes of other (e.g. built in memory) to mesh, after the ones it has
+void AppendMeshData(MeshData* mesh, const MeshData& other);
+
+// Point the mesh fields of scene at the lists of mesh
+void AttachMeshData(SphereSet* scene, MeshData* mesh);
+
+}
+
+#endif
@@ -0,0 +1,15 @@
+// Shared OpenCL host declarations
+//
+#ifndef __OCL_COMMON_H__
+#define __OCL_COMMON_H__
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// Returns a string representation for an OpenCL error code (defined in main.cpp)
+const char* TranslateOpenCLError(cl_int errorCode);
+
+#endif
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+#include "ocl_device.h"
+
+static std::string GetPlatformString(cl_platform_id platform, cl_platform_info param)
+{
+	size_t stringLength = 0;
+	if (CL_SUCCESS != clGetPlatformInfo(platform, param, 0, NULL, &stringLength) || stringLength == 0)
+		return std::string();
+
+	std::vector<char> value(stringLength);
+	if (CL_SUCCESS != clGetPlatformInfo(platform, param, stringLength, &value[0], NULL))
+		return std::string();
+
+	return std::string(&value[0]);
+}
+
+std::string GetDeviceString(cl_device_id device, cl_device_info param)
+{
+	size_t stringLength = 0;
+	if (CL_SUCCESS != clGetDeviceInfo(device, param, 0, NULL, &stringLength) || stringLength == 0)
+		return std::string();
+
+	std::vector<char> value(stringLength);
+	if (CL_SUCCESS != clGetDeviceInfo(device, param, stringLength, &value[0], NULL))
+		return std::string();
+
+	return std::string(&value[0]);
+}
+
+template <typename T>
+static T GetDeviceValue(cl_device_id device, cl_device_info param)
+{
+	T value = T();
+	if (CL_SUCCESS != clGetDeviceInfo(device, param, sizeof(T), &value, NULL))
+		return T();
+	return value;
+}
+
+static bool ContainsNoCase(const std::string& text, const std::string& pattern)
+{
+	if (pattern.empty())
+		return true;
+
+	std::string lowerText(text), lowerPattern(pattern);
+	for (size_t i = 0; i < lowerText.size(); i++)
+		lowerText[i] = (char)tolower((unsigned char)lowerText[i]);
+	for (size_t i = 0; i < lowerPattern.size(); i++)
+		lowerPattern[i] = (char)tolower((unsigned char)lowerPattern[i]);
+
+	return lowerText.find(lowerPattern) != std::string::npos;
+}
+
+void ParseDeviceSelection(const char* text, DeviceSelection* selection)
+{
+	selection->policy = DEVICE_SELECT_AUTO;
+	selection->index = 0;
+	selection->name.clear();
+
+	if (text == NULL || strcmp(text, "auto") == 0)
+	{
+		selection->policy = DEVICE_SELECT_AUTO;
+	}
+	else if (strcmp(text, "fastest") == 0)
+	{
+		selection->policy = DEVICE_SELECT_FASTEST;
+	}
+	else if (strcmp(text, "gpu") == 0)
+	{
+		selection->policy = DEVICE_SELECT_GPU;
+	}
+	else if (strcmp(text, "cpu") == 0)
+	{
+		selection->policy = DEVICE_SELECT_CPU;
+	}
+	else
+	{
+		char* end = NULL;
+		unsigned long index = strtoul(text, &end, 10);
+		if (end != text && *end == '\0')
+		{
+			selection->policy = DEVICE_SELECT_INDEX;
+			selection->index = (unsigned int)index;
+		}
+		else
+		{
+			selection->policy = DEVICE_SELECT_NAME;
+			selection->name = text;
+		}
+	}
+}
+
+cl_int EnumerateOpenCLDevices(std::vector<OpenCLDeviceInfo>* devices)
+{
+	cl_uint numPlatforms = 0;
+	cl_int err = CL_SUCCESS;
+
+	devices->clear();
+
+	err = clGetPlatformIDs(0, NULL, &numPlatforms);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clGetplatform_ids() to get num platforms returned %s.\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	if (0 == numPlatforms)
+	{
+		printf("Error: No platforms found!\n");
+		return CL_INVALID_PLATFORM;
+	}
+
+	std::vector<cl_platform_id> platforms(numPlatforms);
+	err = clGetPlatformIDs(numPlatforms, &platforms[0], NULL);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clGetplatform_ids() to get platforms returned %s.\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	for (cl_uint i = 0; i < numPlatforms; i++)
+	{
+		// A platform without devices answers CL_DEVICE_NOT_FOUND, that's not an error here
+		cl_uint numDevices = 0;
+		err = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
+		if (CL_SUCCESS != err || 0 == numDevices)
+			continue;
+
+		std::vector<cl_device_id> ids(numDevices);
+		err = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, numDevices, &ids[0], NULL);
+		if (CL_SUCCESS != err)
+		{
+			printf("clGetDeviceIDs() returned %s.\n", TranslateOpenCLError(err));
+			continue;
+		}
+
+		std::string platformName = GetPlatformString(platforms[i], CL_PLATFORM_NAME);
+
+		for (cl_uint d = 0; d < numDevices; d++)
+		{
+			OpenCLDeviceInfo info;
+			info.platform = platforms[i];
+			info.device = ids[d];
+			info.platformName = platformName;
+			info.deviceName = GetDeviceString(ids[d], CL_DEVICE_NAME);
+			info.vendor = GetDeviceString(ids[d], CL_DEVICE_VENDOR);
+			info.deviceVersion = GetDeviceString(ids[d], CL_DEVICE_VERSION);
+			info.driverVersion = GetDeviceString(ids[d], CL_DRIVER_VERSION);
+			info.type = GetDeviceValue<cl_device_type>(ids[d], CL_DEVICE_TYPE);
+			info.computeUnits = GetDeviceValue<cl_uint>(ids[d], CL_DEVICE_MAX_COMPUTE_UNITS);
+			info.clockMHz = GetDeviceValue<cl_uint>(ids[d], CL_DEVICE_MAX_CLOCK_FREQUENCY);
+			info.preferredFloatWidth = GetDeviceValue<cl_uint>(ids[d], CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT);
+			info.maxWorkGroupSize = GetDeviceValue<size_t>(ids[d], CL_DEVICE_MAX_WORK_GROUP_SIZE);
+			info.globalMemSize = GetDeviceValue<cl_ulong>(ids[d], CL_DEVICE_GLOBAL_MEM_SIZE);
+			info.maxAllocSize = GetDeviceValue<cl_ulong>(ids[d], CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+			info.localMemSize = GetDeviceValue<cl_ulong>(ids[d], CL_DEVICE_LOCAL_MEM_SIZE);
+			info.constantBufferSize = GetDeviceValue<cl_ulong>(ids[d], CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE);
+			info.available = GetDeviceValue<cl_bool>(ids[d], CL_DEVICE_AVAILABLE) != CL_FALSE;
+			info.compilerAvailable = GetDeviceValue<cl_bool>(ids[d], CL_DEVICE_COMPILER_AVAILABLE) != CL_FALSE;
+			info.parent = NULL;
+			devices->push_back(info);
+		}
+	}
+
+	if (devices->empty())
+	{
+		printf("Error: No OpenCL devices found!\n");
+		return CL_DEVICE_NOT_FOUND;
+	}
+
+	return CL_SUCCESS;
+}
+
+const char* DeviceTypeName(cl_device_type type)
+{
+	if (type & CL_DEVICE_TYPE_GPU)
+		return "GPU";
+	if (type & CL_DEVICE_TYPE_CPU)
+		return "CPU";
+	if (type & CL_DEVICE_TYPE_ACCELERATOR)
+		return "ACCELERATOR";
+	return "OTHER";
+}
+
+double EstimateDeviceThroughput(const OpenCLDeviceInfo& info)
+{
+	// Compute units are not comparable across device types:
+	// a CPU core runs one work item per SIMD lane, a GPU compute unit keeps dozens in flight.
+	double lanes;
+	if (info.type & CL_DEVICE_TYPE_GPU)
+		lanes = 32.0;
+	else if (info.type & CL_DEVICE_TYPE_ACCELERATOR)
+		lanes = 16.0;
+	else
+		lanes = info.preferredFloatWidth > 0 ? (double)info.preferredFloatWidth : 1.0;
+
+	double clock = info.clockMHz > 0 ? (double)info.clockMHz : 1000.0;
+	return (double)info.computeUnits * clock * lanes;
+}
+
+void PrintOpenCLDevices(const std::vector<OpenCLDeviceInfo>& devices)
+{
+	printf("OpenCL devices:\n");
+	for (size_t i = 0; i < devices.size(); i++)
+	{
+		const OpenCLDeviceInfo& info = devices[i];
+		printf("  [%u] %s | %s (%s)%s\n", (unsigned int)i, info.platformName.c_str(), info.deviceName.c_str(),
+			DeviceTypeName(info.type), (info.available && info.compilerAvailable) ? "" : " [unusable]");
+		printf("      %s, driver %s\n", info.deviceVersion.c_str(), info.driverVersion.c_str());
+		printf("      compute units %u @ %u MHz, max work-group %u\n",
+			info.computeUnits, info.clockMHz, (unsigned int)info.maxWorkGroupSize);
+		printf("      global mem %llu MB, max alloc %llu MB, local mem %llu KB, constant %llu KB\n",
+			(unsigned long long)(info.globalMemSize >> 20), (unsigned long long)(info.maxAllocSize >> 20),
+			(unsigned long long)(info.localMemSize >> 10), (unsigned long long)(info.constantBufferSize >> 10));
+	}
+}
+
+/*
+* Pick the usable device with the highest throughput estimate among those of typeMask
+*/
+static int FindFastestDevice(const std::vector<OpenCLDeviceInfo>& devices, cl_device_type typeMask)
+{
+	int best = -1;
+	double bestScore = -1.0;
+
+	for (size_t i = 0; i < devices.size(); i++)
+	{
+		const OpenCLDeviceInfo& info = devices[i];
+		if (!info.available || !info.compilerAvailable || !(info.type & typeMask))
+			continue;
+
+		double score = EstimateDeviceThroughput(info);
+		if (score > bestScore)
+		{
+			bestScore = score;
+			best = (int)i;
+		}
+	}
+
+	return best;
+}
+
+int SelectOpenCLDevice(const std::vector<OpenCLDeviceInfo>& devices, const DeviceSelection& selection)
+{
+	int index = -1;
+
+	switch (selection.policy)
+	{
+	case DEVICE_SELECT_INDEX:
+		if (selection.index >= devices.size())
+		{
+			printf("Error: Device index %u is out of range (%u devices).\n", selection.index, (unsigned int)devices.size());
+			return -1;
+		}
+		index = (int)selection.index;
+		break;
+
+	case DEVICE_SELECT_NAME:
+		for (size_t i = 0; i < devices.size(); i++)
+		{
+			if (ContainsNoCase(devices[i].deviceName, selection.name) ||
+				ContainsNoCase(devices[i].platformName, selection.name))
+			{
+				index = (int)i;
+				break;
+			}
+		}
+		if (index < 0)
+		{
+			printf("Error: No device matches '%s'.\n", selection.name.c_str());
+			return -1;
+		}
+		break;
+
+	case DEVICE_SELECT_FASTEST:
+		index = FindFastestDevice(devices, CL_DEVICE_TYPE_ALL);
+		break;
+
+	case DEVICE_SELECT_CPU:
+		index = FindFastestDevice(devices, CL_DEVICE_TYPE_CPU);
+		break;
+
+	case DEVICE_SELECT_AUTO:
+	case DEVICE_SELECT_GPU:
+	default:
+		index = FindFastestDevice(devices, CL_DEVICE_TYPE_GPU);
+		if (index < 0)
+		{
+			if (selection.policy == DEVICE_SELECT_GPU)
+				printf("Warning: No usable GPU device, falling back to a CPU device.\n");
+			index = FindFastestDevice(devices, CL_DEVICE_TYPE_CPU);
+		}
+		if (index < 0)
+			index = FindFastestDevice(devices, CL_DEVICE_TYPE_ALL);
+		break;
+	}
+
+	if (index < 0)
+	{
+		printf("Error: No usable OpenCL device found.\n");
+		return -1;
+	}
+
+	const OpenCLDeviceInfo& chosen = devices[index];
+	if (!chosen.available || !chosen.compilerAvailable)
+	{
+		printf("Error: Device [%d] '%s' is not available or has no compiler.\n", index, chosen.deviceName.c_str());
+		return -1;
+	}
+
+	return index;
+}
+
+void ParseDeviceList(const char* text, bool* all, std::vector<DeviceSelection>* selections)
+{
+	selections->clear();
+	*all = (strcmp(text, "all") == 0);
+	if (*all)
+		return;
+
+	std::string list(text);
+	size_t begin = 0;
+	while (begin <= list.size())
+	{
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos)
+			end = list.size();
+		if (end > begin)
+		{
+			DeviceSelection selection;
+			ParseDeviceSelection(list.substr(begin, end - begin).c_str(), &selection);
+			selections->push_back(selection);
+		}
+		begin = end + 1;
+	}
+}
+
+bool SelectOpenCLDevices(const std::vector<OpenCLDeviceInfo>& devices, bool all,
+	const std::vector<DeviceSelection>& selections, std::vector<int>* indices)
+{
+	indices->clear();
+	if (all)
+	{
+		for (size_t i = 0; i < devices.size(); i++)
+		{
+			if (devices[i].available && devices[i].compilerAvailable)
+				indices->push_back((int)i);
+		}
+		if (indices->empty())
+		{
+			printf("Error: No usable OpenCL device found.\n");
+			return false;
+		}
+		return true;
+	}
+
+	for (size_t s = 0; s < selections.size(); s++)
+	{
+		int index = SelectOpenCLDevice(devices, selections[s]);
+		if (index < 0)
+			return false;
+		if (std::find(indices->begin(), indices->end(), index) == indices->end())
+			indices->push_back(index);
+	}
+	return !indices->empty();
+}
+
+bool PartitionOpenCLDevice(const OpenCLDeviceInfo& info, cl_uint count, std::vector<OpenCLDeviceInfo>* parts)
+{
+	parts->clear();
+#ifdef CL_VERSION_1_2
+	if (count < 2 || info.computeUnits < count)
+		return false;
+
+	// Equal parts of computeUnits / count compute units; a remainder is left unused
+	const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY,
+		(cl_device_partition_property)(info.computeUnits / count), 0 };
+	cl_uint partCount = 0;
+	cl_int err = clCreateSubDevices(info.device, properties, 0, NULL, &partCount);
+	if (CL_SUCCESS != err || partCount == 0)
+		return false;
+
+	std::vector<cl_device_id> ids(partCount);
+	err = clCreateSubDevices(info.device, properties, partCount, &ids[0], NULL);
+	if (CL_SUCCESS != err)
+		return false;
+
+	for (cl_uint i = 0; i < partCount; i++)
+	{
+		OpenCLDeviceInfo part = info;
+		part.device = ids[i];
+		part.parent = info.device;
+		part.deviceName = info.deviceName + " #" + std::to_string(i);
+		part.computeUnits = GetDeviceValue<cl_uint>(ids[i], CL_DEVICE_MAX_COMPUTE_UNITS);
+		parts->push_back(part);
+	}
+	return true;
+#else
+	return false;
+#endif
+}
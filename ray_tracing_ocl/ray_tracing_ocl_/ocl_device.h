@@ -0,0 +1,89 @@
+// OpenCL platform/device discovery and selection
+//
+#ifndef __OCL_DEVICE_H__
+#define __OCL_DEVICE_H__
+
+#include <string>
+#include <vector>
+
+#include "ocl_common.h"
+
+/*
+* Everything we need to know about one device to pick it
+*/
+struct OpenCLDeviceInfo
+{
+	cl_platform_id platform;
+	cl_device_id   device;
+	std::string    platformName;
+	std::string    deviceName;
+	std::string    vendor;
+	std::string    deviceVersion;
+	std::string    driverVersion;
+	cl_device_type type;
+	cl_uint        computeUnits;
+	cl_uint        clockMHz;
+	cl_uint        preferredFloatWidth;
+	size_t         maxWorkGroupSize;
+	cl_ulong       globalMemSize;
+	cl_ulong       maxAllocSize;
+	cl_ulong       localMemSize;
+	cl_ulong       constantBufferSize;
+	bool           available;
+	bool           compilerAvailable;
+	cl_device_id   parent;         // the device this one was partitioned from (PartitionOpenCLDevice), else NULL
+};
+
+enum DeviceSelectPolicy
+{
+	DEVICE_SELECT_AUTO,     // fastest GPU, falling back to the fastest CPU, then anything else
+	DEVICE_SELECT_FASTEST,  // highest estimated throughput regardless of type
+	DEVICE_SELECT_GPU,      // same as AUTO, but warns when it has to fall back
+	DEVICE_SELECT_CPU,      // fastest CPU device
+	DEVICE_SELECT_INDEX,    // index in the list printed by PrintOpenCLDevices
+	DEVICE_SELECT_NAME      // first device whose platform or device name contains a sub-string
+};
+
+struct DeviceSelection
+{
+	DeviceSelectPolicy policy;
+	unsigned int       index;
+	std::string        name;
+};
+
+// Parse a -device argument: auto, fastest, gpu, cpu, a list index or a name sub-string
+void ParseDeviceSelection(const char* text, DeviceSelection* selection);
+
+// Collect every device of every platform; returns CL_SUCCESS when at least one platform answered
+cl_int EnumerateOpenCLDevices(std::vector<OpenCLDeviceInfo>* devices);
+
+void PrintOpenCLDevices(const std::vector<OpenCLDeviceInfo>& devices);
+
+// Rough peak throughput estimate used to rank devices (compute units * clock * SIMD lanes)
+double EstimateDeviceThroughput(const OpenCLDeviceInfo& info);
+
+// Returns the index of the chosen device, or -1 when none is usable
+int SelectOpenCLDevice(const std::vector<OpenCLDeviceInfo>& devices, const DeviceSelection& selection);
+
+// Parse a -devices argument: all, or a comma separated list of -device arguments
+void ParseDeviceList(const char* text, bool* all, std::vector<DeviceSelection>* selections);
+
+/*
+* Indices of the devices to render on together: every usable one for all, else the device of
+* each selection (a device picked twice is used once). Returns false if a selection fails.
+*/
+bool SelectOpenCLDevices(const std::vector<OpenCLDeviceInfo>& devices, bool all,
+	const std::vector<DeviceSelection>& selections, std::vector<int>* indices);
+
+/*
+* Split a device into count sub-devices with equal compute units (clCreateSubDevices). The parts
+* have to be released with clReleaseDevice. Returns false, with parts empty, if the device can't be split.
+*/
+bool PartitionOpenCLDevice(const OpenCLDeviceInfo& info, cl_uint count, std::vector<OpenCLDeviceInfo>* parts);
+
+const char* DeviceTypeName(cl_device_type type);
+
+// A string property of device, empty if the query fails
+std::string GetDeviceString(cl_device_id device, cl_device_info param);
+
+#endif
@@ -0,0 +1,47 @@
+// Small shims for the MSVC CRT functions used by the host code
+//
+#ifndef __PORTABLE_H__
+#define __PORTABLE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline int fopen_s(FILE** fp, const char* fileName, const char* mode)
+{
+	*fp = fopen(fileName, mode);
+	return (*fp == NULL) ? -1 : 0;
+}
+
+static inline void* _aligned_malloc(size_t size, size_t alignment)
+{
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, alignment, size) != 0)
+		return NULL;
+	return ptr;
+}
+
+static inline void _aligned_free(void* ptr)
+{
+	free(ptr);
+}
+
+static inline int _mkdir(const char* path)
+{
+	return mkdir(path, 0777);
+}
+
+static inline int _getpid()
+{
+	return (int)getpid();
+}
+#endif
+
+#endif
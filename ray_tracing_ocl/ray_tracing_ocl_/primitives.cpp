@@ -0,0 +1,126 @@
+#include <math.h>
+
+#include "primitives.h"
+
+namespace RAYTRACING
+{
+
+unsigned int AddMaterial(AnalyticPrimitives* prims, const Color& color)
+{
+	prims->materials.push_back(color);
+	return (unsigned int)prims->materials.size() - 1;
+}
+
+void AddSphere(AnalyticPrimitives* prims, const Point& center, float radius, unsigned int material)
+{
+	prims->sphereCenter.push_back(center);
+	prims->sphereRadius.push_back(fabsf(radius));
+	prims->sphereMaterial.push_back(material);
+}
+
+void AddDisc(AnalyticPrimitives* prims, const Point& center, const Vector& normal, float radius, unsigned int material)
+{
+	float length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+	Vector unit = { 0.0f, 1.0f, 0.0f };
+	if (length > 0.0f)
+	{
+		unit.x = normal.x / length;
+		unit.y = normal.y / length;
+		unit.z = normal.z / length;
+	}
+
+	prims->discCenter.push_back(center);
+	prims->discNormal.push_back(unit);
+	prims->discRadius.push_back(fabsf(radius));
+	prims->discMaterial.push_back(material);
+}
+
+void AddBox(AnalyticPrimitives* prims, const Point& boxMin, const Point& boxMax, unsigned int material)
+{
+	Point lo = { fminf(boxMin.x, boxMax.x), fminf(boxMin.y, boxMax.y), fminf(boxMin.z, boxMax.z) };
+	Point hi = { fmaxf(boxMin.x, boxMax.x), fmaxf(boxMin.y, boxMax.y), fmaxf(boxMin.z, boxMax.z) };
+
+	prims->boxMin.push_back(lo);
+	prims->boxMax.push_back(hi);
+	prims->boxMaterial.push_back(material);
+}
+
+/*
+* Append a vector stream (all x, then all y, then all z) and return its offset
+*/
+static unsigned int PackPoints(std::vector<float>* data, const std::vector<Point>& points)
+{
+	unsigned int offset = (unsigned int)data->size();
+	for (size_t i = 0; i < points.size(); i++)
+		data->push_back(points[i].x);
+	for (size_t i = 0; i < points.size(); i++)
+		data->push_back(points[i].y);
+	for (size_t i = 0; i < points.size(); i++)
+		data->push_back(points[i].z);
+	return offset;
+}
+
+static unsigned int PackFloats(std::vector<float>* data, const std::vector<float>& values)
+{
+	unsigned int offset = (unsigned int)data->size();
+	data->insert(data->end(), values.begin(), values.end());
+	return offset;
+}
+
+static unsigned int PackIndices(std::vector<float>* data, const std::vector<unsigned int>& indices)
+{
+	unsigned int offset = (unsigned int)data->size();
+	for (size_t i = 0; i < indices.size(); i++)
+		data->push_back((float)indices[i]);
+	return offset;
+}
+
+void AppendPrimitives(AnalyticPrimitives* prims, const AnalyticPrimitives& other)
+{
+	unsigned int base = (unsigned int)prims->materials.size();
+	prims->materials.insert(prims->materials.end(), other.materials.begin(), other.materials.end());
+
+	for (size_t i = 0; i < other.sphereCenter.size(); i++)
+	{
+		AddSphere(prims, other.sphereCenter[i], other.sphereRadius[i], base + other.sphereMaterial[i]);
+	}
+	for (size_t i = 0; i < other.discCenter.size(); i++)
+	{
+		AddDisc(prims, other.discCenter[i], other.discNormal[i], other.discRadius[i], base + other.discMaterial[i]);
+	}
+	for (size_t i = 0; i < other.boxMin.size(); i++)
+	{
+		AddBox(prims, other.boxMin[i], other.boxMax[i], base + other.boxMaterial[i]);
+	}
+}
+
+void AttachPrimitives(SphereSet* scene, AnalyticPrimitives* prims)
+{
+	PrimitiveLayout& layout = prims->layout;
+	std::vector<float>& data = prims->data;
+	data.clear();
+
+	layout.m_sphereCount = (unsigned int)prims->sphereCenter.size();
+	layout.m_sphereCenter = PackPoints(&data, prims->sphereCenter);
+	layout.m_sphereRadius = PackFloats(&data, prims->sphereRadius);
+	layout.m_sphereMaterial = PackIndices(&data, prims->sphereMaterial);
+
+	layout.m_discCount = (unsigned int)prims->discCenter.size();
+	layout.m_discCenter = PackPoints(&data, prims->discCenter);
+	layout.m_discNormal = PackPoints(&data, prims->discNormal);
+	layout.m_discRadius = PackFloats(&data, prims->discRadius);
+	layout.m_discMaterial = PackIndices(&data, prims->discMaterial);
+
+	layout.m_boxCount = (unsigned int)prims->boxMin.size();
+	layout.m_boxMin = PackPoints(&data, prims->boxMin);
+	layout.m_boxMax = PackPoints(&data, prims->boxMax);
+	layout.m_boxMaterial = PackIndices(&data, prims->boxMaterial);
+
+	scene->m_primData = data.empty() ? NULL : &data[0];
+	scene->PrimDataSize = (int)data.size();
+	scene->m_primLayout = layout;
+	scene->m_material = prims->materials.empty() ? NULL : &prims->materials[0];
+	scene->MaterialCount = (int)prims->materials.size();
+}
+
+}
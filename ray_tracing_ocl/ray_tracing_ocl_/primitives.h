@@ -0,0 +1,68 @@
+// Analytic primitives (spheres, discs, axis-aligned boxes) in structure-of-arrays form
+//
+#ifndef __PRIMITIVES_H__
+#define __PRIMITIVES_H__
+
+#include <vector>
+
+#include "raytracing.h"
+
+namespace RAYTRACING
+{
+
+/*
+* Host-side lists of the analytic primitives of a scene.
+* AttachPrimitives packs them into data, one stream per field, as described by layout.
+*/
+struct AnalyticPrimitives
+{
+	std::vector<Point> sphereCenter;
+	std::vector<float> sphereRadius;
+	std::vector<unsigned int> sphereMaterial;
+
+	std::vector<Point> discCenter;
+	std::vector<Vector> discNormal;
+	std::vector<float> discRadius;
+	std::vector<unsigned int> discMaterial;
+
+	std::vector<Point> boxMin;
+	std::vector<Point> boxMax;
+	std::vector<unsigned int> boxMaterial;
+
+	std::vector<Color> materials;
+
+	std::vector<float> data;
+	PrimitiveLayout layout;
+};
+
+// Append a diffuse color to the material table and return its index
+unsigned int AddMaterial(AnalyticPrimitives* prims, const Color& color);
+
+void AddSphere(AnalyticPrimitives* prims, const Point& center, float radius, unsigned int material);
+
+// normal doesn't need to be normalized
+void AddDisc(AnalyticPrimitives* prims, const Point& center, const Vector& normal, float radius, unsigned int material);
+
+void AddBox(AnalyticPrimitives* prims, const Point& boxMin, const Point& boxMax, unsigned int material);
+
+// Append the primitives and materials of other, with its material indices moved past the ones of prims
+void AppendPrimitives(AnalyticPrimitives* prims, const AnalyticPrimitives& other);
+
+// Pack the lists into prims->data and point the primitive fields of scene at it
+void AttachPrimitives(SphereSet* scene, AnalyticPrimitives* prims);
+
+// Read element index of a vector stream with count elements per component
+inline Point PrimitivePoint(const float* data, unsigned int stream, unsigned int count, unsigned int index)
+{
+	Point p = { data[stream + index], data[stream + count + index], data[stream + 2 * count + index] };
+	return p;
+}
+
+inline unsigned int PrimitiveMaterial(const float* data, unsigned int stream, unsigned int index)
+{
+	return (unsigned int)data[stream + index];
+}
+
+}
+
+#endif
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+
+#include "profiler.h"
+#include "portable.h"
+
+static const char* const kTrackNames[] = { "host", "image writer", "device" };
+
+Profiler::Profiler() :
+		enabled(false),
+		start(std::chrono::steady_clock::now())
+{
+}
+
+Profiler::~Profiler()
+{
+	for (size_t i = 0; i < commands.size(); i++)
+	{
+		if (commands[i].event)
+			clReleaseEvent(commands[i].event);
+	}
+}
+
+double ProfileNow(const Profiler* profiler)
+{
+	if (!profiler)
+		return 0.0;
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - profiler->start).count();
+}
+
+cl_event* ProfileEvent(Profiler* profiler, const char* name)
+{
+	if (!profiler || !profiler->enabled)
+		return NULL;
+
+	std::lock_guard<std::mutex> guard(profiler->lock);
+	ProfileCommand command;
+	command.name = name;
+	command.phase = profiler->open.empty() ? "" : profiler->phases[profiler->open.back()].name;
+	command.event = NULL;
+	command.enqueued = ProfileNow(profiler);
+	command.queued = command.submit = command.begin = command.end = 0;
+	command.timed = false;
+	profiler->commands.push_back(command);
+	return &profiler->commands.back().event;
+}
+
+void ProfileKeepEvent(Profiler* profiler, const char* name, cl_event event)
+{
+	cl_event* kept = ProfileEvent(profiler, name);
+	if (kept && event && CL_SUCCESS == clRetainEvent(event))
+		*kept = event;
+}
+
+void BeginPhase(Profiler* profiler, const char* name)
+{
+	if (!profiler || !profiler->enabled)
+		return;
+
+	std::lock_guard<std::mutex> guard(profiler->lock);
+	ProfilePhase phase;
+	phase.name = name;
+	phase.track = PROFILE_HOST;
+	phase.begin = ProfileNow(profiler);
+	phase.end = -1.0;
+	profiler->open.push_back(profiler->phases.size());
+	profiler->phases.push_back(phase);
+}
+
+void EndPhase(Profiler* profiler)
+{
+	if (!profiler || !profiler->enabled)
+		return;
+
+	std::lock_guard<std::mutex> guard(profiler->lock);
+	if (profiler->open.empty())
+		return;
+	profiler->phases[profiler->open.back()].end = ProfileNow(profiler);
+	profiler->open.pop_back();
+}
+
+void AddPhase(Profiler* profiler, const char* name, const char* detail, ProfileTrack track, double begin, double end)
+{
+	if (!profiler || !profiler->enabled)
+		return;
+
+	std::lock_guard<std::mutex> guard(profiler->lock);
+	ProfilePhase phase;
+	phase.name = name;
+	phase.detail = detail ? detail : "";
+	phase.track = track;
+	phase.begin = begin;
+	phase.end = end;
+	profiler->phases.push_back(phase);
+}
+
+/*
+* Read the timestamps of every command not read yet and return the offset, in seconds, that
+* moves device time onto the host clock: the smallest one that puts no command's queued time
+* before the moment the host enqueued it
+*/
+static double ReadCommandTimes(Profiler* profiler)
+{
+	bool haveOffset = false;
+	double offset = 0.0;
+	for (size_t i = 0; i < profiler->commands.size(); i++)
+	{
+		ProfileCommand& command = profiler->commands[i];
+		if (!command.timed && command.event && CL_SUCCESS == clWaitForEvents(1, &command.event))
+		{
+			command.timed =
+				CL_SUCCESS == clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &command.queued, NULL) &&
+				CL_SUCCESS == clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &command.submit, NULL) &&
+				CL_SUCCESS == clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &command.begin, NULL) &&
+				CL_SUCCESS == clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &command.end, NULL);
+		}
+		if (command.timed)
+		{
+			double commandOffset = command.enqueued - command.queued * 1e-9;
+			offset = haveOffset ? std::max(offset, commandOffset) : commandOffset;
+			haveOffset = true;
+		}
+	}
+	return offset;
+}
+
+// Names are our own, but details are file names, which may hold backslashes
+static void WriteString(FILE* file, const std::string& text)
+{
+	fputc('"', file);
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		unsigned char c = (unsigned char)text[i];
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+static FILE* OpenReport(const char* fileName)
+{
+	FILE* file = NULL;
+	if (0 != fopen_s(&file, fileName, "w") || file == NULL)
+	{
+		printf("Error: Couldn't open profile file '%s'.\n", fileName);
+		return NULL;
+	}
+	return file;
+}
+
+static bool CloseReport(FILE* file, const char* fileName)
+{
+	bool written = !ferror(file);
+	written = (fclose(file) == 0) && written;
+	if (!written)
+	{
+		printf("Error: Couldn't write profile file '%s'.\n", fileName);
+	}
+	return written;
+}
+
+struct ProfileTotal
+{
+	unsigned int count;
+	double       seconds;           // wall time of phases, run time (start to end) of commands
+	double       deviceSeconds;     // run time of the commands enqueued in a phase
+	double       waitSeconds;       // time commands spent between queued and start
+};
+
+bool WriteProfileReport(Profiler* profiler, const char* fileName)
+{
+	std::lock_guard<std::mutex> guard(profiler->lock);
+	double offset = ReadCommandTimes(profiler);
+	double now = ProfileNow(profiler);
+
+	// Totals by track and phase name, and by command name
+	std::map<std::pair<int, std::string>, ProfileTotal> phaseTotals;
+	std::map<std::string, ProfileTotal> commandTotals;
+	for (size_t i = 0; i < profiler->phases.size(); i++)
+	{
+		const ProfilePhase& phase = profiler->phases[i];
+		if (phase.end < phase.begin)
+			continue;
+		ProfileTotal& total = phaseTotals[std::make_pair((int)phase.track, phase.name)];
+		total.count++;
+		total.seconds += phase.end - phase.begin;
+	}
+	for (size_t i = 0; i < profiler->commands.size(); i++)
+	{
+		const ProfileCommand& command = profiler->commands[i];
+		if (!command.timed)
+			continue;
+		double run = (command.end - command.begin) * 1e-9;
+		ProfileTotal& total = commandTotals[command.name];
+		total.count++;
+		total.seconds += run;
+		total.waitSeconds += (command.begin - command.queued) * 1e-9;
+		std::map<std::pair<int, std::string>, ProfileTotal>::iterator phase = phaseTotals.find(std::make_pair((int)PROFILE_HOST, command.phase));
+		if (phase != phaseTotals.end())
+			phase->second.deviceSeconds += run;
+	}
+
+	FILE* file = OpenReport(fileName);
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n  \"device\": ");
+	WriteString(file, profiler->deviceName);
+	fprintf(file, ",\n  \"wallSeconds\": %.6f,\n  \"phaseTotals\": [", now);
+	const char* separator = "\n";
+	for (std::map<std::pair<int, std::string>, ProfileTotal>::const_iterator it = phaseTotals.begin(); it != phaseTotals.end(); ++it)
+	{
+		fprintf(file, "%s    { \"track\": \"%s\", \"name\": ", separator, kTrackNames[it->first.first]);
+		WriteString(file, it->first.second);
+		fprintf(file, ", \"count\": %u, \"seconds\": %.6f, \"deviceSeconds\": %.6f }",
+			it->second.count, it->second.seconds, it->second.deviceSeconds);
+		separator = ",\n";
+	}
+	fprintf(file, "\n  ],\n  \"commandTotals\": [");
+	separator = "\n";
+	for (std::map<std::string, ProfileTotal>::const_iterator it = commandTotals.begin(); it != commandTotals.end(); ++it)
+	{
+		fprintf(file, "%s    { \"name\": ", separator);
+		WriteString(file, it->first);
+		fprintf(file, ", \"count\": %u, \"runSeconds\": %.6f, \"waitSeconds\": %.6f }",
+			it->second.count, it->second.seconds, it->second.waitSeconds);
+		separator = ",\n";
+	}
+
+	// Every time below is in seconds since the start of the run, on the host clock
+	fprintf(file, "\n  ],\n  \"phases\": [");
+	separator = "\n";
+	for (size_t i = 0; i < profiler->phases.size(); i++)
+	{
+		const ProfilePhase& phase = profiler->phases[i];
+		if (phase.end < phase.begin)
+			continue;
+		fprintf(file, "%s    { \"track\": \"%s\", \"name\": ", separator, kTrackNames[phase.track]);
+		WriteString(file, phase.name);
+		if (!phase.detail.empty())
+		{
+			fprintf(file, ", \"detail\": ");
+			WriteString(file, phase.detail);
+		}
+		fprintf(file, ", \"begin\": %.6f, \"end\": %.6f }", phase.begin, phase.end);
+		separator = ",\n";
+	}
+	fprintf(file, "\n  ],\n  \"commands\": [");
+	separator = "\n";
+	for (size_t i = 0; i < profiler->commands.size(); i++)
+	{
+		const ProfileCommand& command = profiler->commands[i];
+		if (!command.timed)
+			continue;
+		fprintf(file, "%s    { \"name\": ", separator);
+		WriteString(file, command.name);
+		fprintf(file, ", \"phase\": ");
+		WriteString(file, command.phase);
+		fprintf(file, ", \"enqueued\": %.6f, \"queued\": %.6f, \"submit\": %.6f, \"start\": %.6f, \"end\": %.6f }",
+			command.enqueued, command.queued * 1e-9 + offset, command.submit * 1e-9 + offset,
+			command.begin * 1e-9 + offset, command.end * 1e-9 + offset);
+		separator = ",\n";
+	}
+	fprintf(file, "\n  ]\n}\n");
+
+	return CloseReport(file, fileName);
+}
+
+bool WriteChromeTrace(Profiler* profiler, const char* fileName)
+{
+	std::lock_guard<std::mutex> guard(profiler->lock);
+	double offset = ReadCommandTimes(profiler);
+
+	FILE* file = OpenReport(fileName);
+	if (!file)
+		return false;
+
+	// Complete ("X") events in microseconds, one thread row per track
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (int track = 0; track < 3; track++)
+	{
+		fprintf(file, "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}},\n",
+			track, kTrackNames[track]);
+	}
+	for (size_t i = 0; i < profiler->phases.size(); i++)
+	{
+		const ProfilePhase& phase = profiler->phases[i];
+		if (phase.end < phase.begin)
+			continue;
+		fprintf(file, "{\"ph\": \"X\", \"cat\": \"phase\", \"name\": ");
+		WriteString(file, phase.name);
+		fprintf(file, ", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", (int)phase.track,
+			phase.begin * 1e6, (phase.end - phase.begin) * 1e6);
+		if (!phase.detail.empty())
+		{
+			fprintf(file, ", \"args\": {\"detail\": ");
+			WriteString(file, phase.detail);
+			fprintf(file, "}");
+		}
+		fprintf(file, "},\n");
+	}
+	for (size_t i = 0; i < profiler->commands.size(); i++)
+	{
+		const ProfileCommand& command = profiler->commands[i];
+		if (!command.timed)
+			continue;
+		fprintf(file, "{\"ph\": \"X\", \"cat\": \"command\", \"name\": ");
+		WriteString(file, command.name);
+		fprintf(file, ", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"phase\": ",
+			(int)PROFILE_DEVICE, (command.begin * 1e-9 + offset) * 1e6, (command.end - command.begin) * 1e-3);
+		WriteString(file, command.phase);
+		fprintf(file, ", \"queuedToStartUs\": %.3f}},\n", (command.begin - command.queued) * 1e-3);
+	}
+
+	// The trace format allows no trailing comma, so the list ends on a marker of the report time
+	fprintf(file, "{\"ph\": \"i\", \"name\": \"end\", \"s\": \"g\", \"pid\": 1, \"tid\": 0, \"ts\": %.3f}\n]}\n",
+		ProfileNow(profiler) * 1e6);
+
+	return CloseReport(file, fileName);
+}
@@ -0,0 +1,97 @@
+// Run profiling: OpenCL commands timed by their events, host phases by the wall clock
+//
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ocl_common.h"
+
+// Where a phase ran; every track is a row of the Chrome trace
+enum ProfileTrack
+{
+	PROFILE_HOST,               // the main thread
+	PROFILE_WRITER,             // the image writer thread
+	PROFILE_DEVICE              // commands of the OpenCL queue
+};
+
+/*
+* An enqueued command: when the host enqueued it (seconds since Profiler::start) and the
+* device timestamps of its event in nanoseconds, read when the report is written
+*/
+struct ProfileCommand
+{
+	std::string name;
+	std::string phase;          // innermost host phase it was enqueued in
+	cl_event    event;
+	double      enqueued;
+	cl_ulong    queued;         // CL_PROFILING_COMMAND_QUEUED
+	cl_ulong    submit;
+	cl_ulong    begin;          // CL_PROFILING_COMMAND_START
+	cl_ulong    end;
+	bool        timed;          // the event completed with profiling info
+};
+
+struct ProfilePhase
+{
+	std::string  name;
+	std::string  detail;        // e.g. the file an image write went to
+	ProfileTrack track;
+	double       begin;
+	double       end;
+};
+
+/*
+* The timing of one run. A disabled profiler records nothing and hands out no events,
+* so commands are enqueued exactly as without it.
+*/
+struct Profiler
+{
+	Profiler();
+	~Profiler();                // releases the events
+
+	bool         enabled;
+	std::string  deviceName;
+	std::chrono::steady_clock::time_point start;
+	std::deque<ProfileCommand> commands;
+	std::vector<ProfilePhase>  phases;
+	std::vector<size_t>        open;      // phases begun and not ended yet, innermost last
+	std::mutex   lock;          // the image writer adds its phases from its own thread
+};
+
+// Wall seconds since profiler->start (0 for a NULL profiler)
+double ProfileNow(const Profiler* profiler);
+
+/*
+* Event for the clEnqueue* call of a command named name, kept for the report, or NULL when
+* profiler is NULL or disabled. Pass it straight to the call: the next one may move it.
+*/
+cl_event* ProfileEvent(Profiler* profiler, const char* name);
+
+// Keep an event the caller needs itself (e.g. to wait on it) for the report as well; it is retained
+void ProfileKeepEvent(Profiler* profiler, const char* name, cl_event event);
+
+/*
+* Host phases of the main thread nest: commands are counted to the innermost one.
+* A phase left open (by an early return) is dropped from the report.
+*/
+void BeginPhase(Profiler* profiler, const char* name);
+void EndPhase(Profiler* profiler);
+
+// A phase that ran on another thread from begin to end (ProfileNow seconds)
+void AddPhase(Profiler* profiler, const char* name, const char* detail, ProfileTrack track, double begin, double end);
+
+/*
+* JSON report: per-phase wall and device totals, per-command-name totals, and every phase and
+* command with its queued, submit, start and end time. Waits for the commands to complete first.
+*/
+bool WriteProfileReport(Profiler* profiler, const char* fileName);
+
+// The same phases and commands as Chrome trace events (chrome://tracing, Perfetto)
+bool WriteChromeTrace(Profiler* profiler, const char* fileName);
+
+#endif
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "program_cache.h"
+#include "ocl_device.h"
+#include "portable.h"
+
+// Header of a cache file, followed by the binary
+static const char kCacheMagic[8] = { 'R', 'T', 'C', 'L', 'B', 'I', 'N', '1' };
+
+struct CacheFileHeader
+{
+	char               magic[8];
+	unsigned long long check;       // second hash of the key text, against name collisions
+	unsigned long long binarySize;
+};
+
+// 64-bit FNV-1a
+static unsigned long long HashText(const std::string& text, unsigned long long hash)
+{
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool ReadTextFile(const std::string& fileName, std::string* text)
+{
+	std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+
+	std::ostringstream contents;
+	contents << file.rdbuf();
+	*text = contents.str();
+	return true;
+}
+
+/*
+* Append the files source includes with #include "name", and theirs, to keyText.
+* A missing file adds its name only; the compiler will complain about it anyway.
+*/
+static void AppendIncludes(const std::string& source, int depth, std::string* keyText)
+{
+	if (depth > 8)
+		return;
+
+	std::istringstream lines(source);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		size_t at = line.find_first_not_of(" \t");
+		if (at == std::string::npos || line[at] != '#')
+			continue;
+		at = line.find_first_not_of(" \t", at + 1);
+		if (at == std::string::npos || line.compare(at, 7, "include") != 0)
+			continue;
+
+		size_t open = line.find('"', at + 7);
+		size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+		if (close == std::string::npos)
+			continue;
+
+		std::string name = line.substr(open + 1, close - open - 1);
+		std::string text;
+		keyText->append("\n#include ").append(name).append("\n");
+		if (ReadTextFile(name, &text))
+		{
+			keyText->append(text);
+			AppendIncludes(text, depth + 1, keyText);
+		}
+	}
+}
+
+/*
+* Cache key of a program: a hash of the source, the files it includes, the build options and
+* the device name and driver version. check is a second hash of the same, stored in the file.
+*/
+static void ProgramCacheKey(const std::string& source, const char* options, cl_device_id device,
+	std::string* key, unsigned long long* check)
+{
+	std::string keyText = source;
+	AppendIncludes(source, 0, &keyText);
+	keyText.append("\n#options ").append(options);
+	keyText.append("\n#device ").append(GetDeviceString(device, CL_DEVICE_NAME));
+	keyText.append("\n#driver ").append(GetDeviceString(device, CL_DRIVER_VERSION));
+
+	char text[17];
+	snprintf(text, sizeof(text), "%016llx", HashText(keyText, 14695981039346656037ULL));
+	*key = text;
+	*check = HashText(keyText, 0x84222325CBF29CE4ULL);
+}
+
+// Log of a failed build, if the device has one
+static void PrintBuildLog(cl_program program, cl_device_id device)
+{
+	size_t logSize = 0;
+	clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+	if (logSize == 0)
+		return;
+
+	std::vector<char> buildLog(logSize);
+	clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, &buildLog[0], NULL);
+	printf("Error happened during the build of OpenCL program.\nBuild log:%s", &buildLog[0]);
+}
+
+static cl_int BuildFromSource(cl_context context, cl_device_id device, const std::string& source, const char* options,
+	cl_program* program)
+{
+	cl_int err = CL_SUCCESS;
+	const char* text = source.c_str();
+	size_t size = source.size();
+
+	*program = clCreateProgramWithSource(context, 1, &text, &size, &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateProgramWithSource returned %s.\n", TranslateOpenCLError(err));
+		return err;
+	}
+
+	err = clBuildProgram(*program, 1, &device, options, NULL, NULL);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clBuildProgram() for source program returned %s.\n", TranslateOpenCLError(err));
+		if (err == CL_BUILD_PROGRAM_FAILURE)
+		{
+			PrintBuildLog(*program, device);
+		}
+	}
+	return err;
+}
+
+// The cached binary in fileName if it was stored under check; empty if there is none
+static bool ReadCacheFile(const std::string& fileName, unsigned long long check, std::vector<unsigned char>* binary)
+{
+	FILE* file = NULL;
+	if (0 != fopen_s(&file, fileName.c_str(), "rb") || file == NULL)
+		return false;
+
+	CacheFileHeader header;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) == 0 &&
+		header.check == check && header.binarySize > 0 && header.binarySize < (1ULL << 32);
+	if (valid)
+	{
+		binary->resize((size_t)header.binarySize);
+		valid = fread(&(*binary)[0], 1, binary->size(), file) == binary->size();
+	}
+	fclose(file);
+	return valid;
+}
+
+/*
+* Write the binary of program to fileName. It goes to a temporary file first that is renamed
+* at the end, so a concurrent run never reads half a file.
+*/
+static bool WriteCacheFile(const std::string& fileName, unsigned long long check, cl_program program)
+{
+	size_t binarySize = 0;
+	cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binarySize), &binarySize, NULL);
+	if (CL_SUCCESS != err || binarySize == 0)
+	{
+		printf("Warning: The program binary isn't available (%s), nothing is cached.\n", TranslateOpenCLError(err));
+		return false;
+	}
+
+	std::vector<unsigned char> binary(binarySize);
+	unsigned char* binaries[1] = { &binary[0] };
+	err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL);
+	if (CL_SUCCESS != err)
+	{
+		printf("Warning: clGetProgramInfo(CL_PROGRAM_BINARIES) returned %s, nothing is cached.\n", TranslateOpenCLError(err));
+		return false;
+	}
+
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", _getpid());
+	std::string tempName = fileName + suffix;
+
+	FILE* file = NULL;
+	if (0 != fopen_s(&file, tempName.c_str(), "wb") || file == NULL)
+	{
+		printf("Warning: Couldn't write the program cache file '%s'.\n", tempName.c_str());
+		return false;
+	}
+
+	CacheFileHeader header;
+	memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+	header.check = check;
+	header.binarySize = binarySize;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(&binary[0], 1, binarySize, file) == binarySize;
+	written = (fclose(file) == 0) && written;
+
+	// rename doesn't replace an existing file on Windows
+	if (written && rename(tempName.c_str(), fileName.c_str()) != 0)
+	{
+		remove(fileName.c_str());
+		written = rename(tempName.c_str(), fileName.c_str()) == 0;
+	}
+	if (!written)
+	{
+		remove(tempName.c_str());
+		printf("Warning: Couldn't write the program cache file '%s'.\n", fileName.c_str());
+	}
+	return written;
+}
+
+cl_int BuildProgramCached(cl_context context, cl_device_id device, const std::string& source, const char* options,
+	const char* cacheDir, cl_program* program, bool* fromCache)
+{
+	*program = NULL;
+	*fromCache = false;
+	if (options == NULL)
+		options = "";
+
+	if (cacheDir == NULL)
+		return BuildFromSource(context, device, source, options, program);
+
+	std::string key;
+	unsigned long long check;
+	ProgramCacheKey(source, options, device, &key, &check);
+	std::string fileName = std::string(cacheDir) + "/" + key + ".bin";
+
+	std::vector<unsigned char> binary;
+	if (ReadCacheFile(fileName, check, &binary))
+	{
+		// Binaries still need a build call, which is quick; a driver may also refuse an old one
+		const unsigned char* binaries[1] = { &binary[0] };
+		size_t binarySize = binary.size();
+		cl_int binaryStatus = CL_SUCCESS;
+		cl_int err = CL_SUCCESS;
+		*program = clCreateProgramWithBinary(context, 1, &device, &binarySize, binaries, &binaryStatus, &err);
+		if (CL_SUCCESS == err && CL_SUCCESS == binaryStatus)
+		{
+			err = clBuildProgram(*program, 1, &device, options, NULL, NULL);
+		}
+		if (CL_SUCCESS == err && CL_SUCCESS == binaryStatus)
+		{
+			*fromCache = true;
+			return CL_SUCCESS;
+		}
+
+		printf("Warning: The cached program '%s' was refused (%s), rebuilding it.\n", fileName.c_str(),
+			TranslateOpenCLError(CL_SUCCESS != err ? err : binaryStatus));
+		if (*program)
+		{
+			clReleaseProgram(*program);
+			*program = NULL;
+		}
+	}
+
+	cl_int err = BuildFromSource(context, device, source, options, program);
+	if (CL_SUCCESS != err)
+		return err;
+
+	// An existing directory makes _mkdir fail, which is fine
+	_mkdir(cacheDir);
+	WriteCacheFile(fileName, check, *program);
+	return CL_SUCCESS;
+}
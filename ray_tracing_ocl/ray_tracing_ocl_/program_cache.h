@@ -0,0 +1,25 @@
+// On-disk cache of built OpenCL programs
+//
+#ifndef __PROGRAM_CACHE_H__
+#define __PROGRAM_CACHE_H__
+
+#include <string>
+
+#include "ocl_common.h"
+
+// Default directory of the cached program binaries, relative to the working directory
+#define PROGRAM_CACHE_DIR	"kernel_cache"
+
+/*
+* Create a program from source and build it with options for device.
+* With a cacheDir, a binary cached for the same source, options and device is loaded if the
+* device accepts it. Otherwise the program is built from source and its binary is written to
+* cacheDir (created if missing) under a hash of the source, the files it #includes with quotes
+* (looked up in the working directory, as the OpenCL compiler does here), the options and the
+* device name and driver version. A change to any of them misses the cache and rebuilds.
+* cacheDir NULL always builds from source. fromCache tells which of the two happened.
+*/
+cl_int BuildProgramCached(cl_context context, cl_device_id device, const std::string& source, const char* options,
+	const char* cacheDir, cl_program* program, bool* fromCache);
+
+#endif
@@ -1,14 +1,57 @@
 
+// The host passes -D OCL_CONSTANT_BUFFER=__global when the lights and planes don't fit in constant memory
+#ifndef OCL_CONSTANT_BUFFER
 #ifdef __APPLE__
 #define OCL_CONSTANT_BUFFER __global
 #else
 #define OCL_CONSTANT_BUFFER __constant
 #endif
+#endif
 
 #include "define.h"
 
 #define RAYMAX  1.0e30f
 #define EPSILON 0.00001f
+#define INV_PI  0.318309886f
+#define TWO_PI  6.283185307f
+
+// Bounce and shadow rays start this far off the surface, on the side the normal faces
+#define RAY_OFFSET 0.0001f
+
+/*
+* Values the host may bake into a program variant with -D SPEC_*=n: the image size, the
+* samples per pass and small light and plane counts. The kernel arguments stay, so every
+* variant takes the same ones; without the define these fall back to the argument.
+*/
+#ifdef SPEC_WIDTH
+#define IMAGE_WIDTH(n)	(SPEC_WIDTH)
+#else
+#define IMAGE_WIDTH(n)	(n)
+#endif
+
+#ifdef SPEC_HEIGHT
+#define IMAGE_HEIGHT(n)	(SPEC_HEIGHT)
+#else
+#define IMAGE_HEIGHT(n)	(n)
+#endif
+
+#ifdef SPEC_SAMPLE_COUNT
+#define SAMPLE_COUNT(n)	(SPEC_SAMPLE_COUNT)
+#else
+#define SAMPLE_COUNT(n)	(n)
+#endif
+
+#ifdef SPEC_LIGHT_COUNT
+#define LIGHT_COUNT(n)	(SPEC_LIGHT_COUNT)
+#else
+#define LIGHT_COUNT(n)	(n)
+#endif
+
+#ifdef SPEC_PLANE_COUNT
+#define PLANE_COUNT(n)	(SPEC_PLANE_COUNT)
+#else
+#define PLANE_COUNT(n)	(n)
+#endif
 
 #ifndef M_PI
   // For some reason, MSVC doesn't define this when <cmath> is included
@@ -31,25 +74,96 @@ typedef struct Ray{
 	float m_tMax;
 }Ray;
 
-typedef struct RectangleLight{
+// Lights, planes and the camera arrive precompiled (see scene_compile.cpp)
+typedef struct CompiledLight{
 	Point m_pos;
 	Vector m_side1, m_side2;
-	Color m_color;
-	float m_power;
-}RectangleLight;
+	Vector m_normal;
+	Vector m_side1Inv;		// m_side1 / |m_side1|^2
+	Vector m_side2Inv;
+	Color m_emitted;
+	float m_planeDistance;
+	float m_area;
+}CompiledLight;
 
-typedef struct Plane{
-	Point m_pos;
+typedef struct CompiledPlane{
 	Vector m_normal;
-	Color m_color; 
-}Plane;
+	float m_distance;
+	Color m_color;
+}CompiledPlane;
+
+typedef struct BVHNode{
+	float m_boundsMin[3];
+	int m_offset;		// leaf: first entry in primRefs, interior: second child
+	float m_boundsMax[3];
+	int m_primCount;	// 0 for interior nodes
+}BVHNode;
+
+typedef struct Triangle{
+	unsigned int m_v0, m_v1, m_v2;
+	unsigned int m_mesh;
+}Triangle;
 
-typedef struct Camera{
-	float fieldOfViewInDegrees;
-    Point origin;
-    Vector target;
-    Vector targetUpDirection;
-}Camera;
+typedef struct PrimitiveLayout{
+	unsigned int m_sphereCount;
+	unsigned int m_sphereCenter, m_sphereRadius, m_sphereMaterial;
+	unsigned int m_discCount;
+	unsigned int m_discCenter, m_discNormal, m_discRadius, m_discMaterial;
+	unsigned int m_boxCount;
+	unsigned int m_boxMin, m_boxMax, m_boxMaterial;
+}PrimitiveLayout;
+
+// Light selection (see light_select.h)
+typedef struct LightAlias{
+	float m_threshold;
+	unsigned int m_alias;
+	float m_pdf;
+}LightAlias;
+
+typedef struct LightNode{
+	float m_boundsMin[3];
+	int m_offset;		// leaf: light index, interior: second child
+	float m_boundsMax[3];
+	int m_lightCount;	// 1 for leaves, 0 for interior nodes
+	float m_axis[3];
+	float m_cosTheta;
+	float m_energy;
+}LightNode;
+
+typedef struct CompiledCamera{
+	Point m_origin;
+	Vector m_forward;
+	Vector m_right;			// scaled by tan(fov)
+	Vector m_up;			// scaled by tan(fov)
+}CompiledCamera;
+
+// Scene buffers of one work item, bundled so that the intersection routines take one argument
+typedef struct SceneData{
+	OCL_CONSTANT_BUFFER const CompiledLight* lights;
+	unsigned int lightcount;
+	OCL_CONSTANT_BUFFER const CompiledPlane* planes;
+	unsigned int planecount;
+	__global const BVHNode* nodes;
+	unsigned int nodeCount;
+	__global const unsigned int* primRefs;
+	__global const Point* vertices;
+	__global const Triangle* triangles;
+	__global const Color* meshColors;
+	__global const float* primData;		// structure-of-arrays streams of spheres, discs and boxes
+	PrimitiveLayout primLayout;
+	__global const Color* materials;
+	__global const LightAlias* lightAlias;
+	__global const LightNode* lightNodes;	// light BVH, used instead of lightAlias if lightNodeCount > 0
+	unsigned int lightNodeCount;
+	__global const unsigned int* lightTrails;
+	unsigned int lightSamples;				// lights sampled per hit
+}SceneData;
+
+// Per-ray constants of the watertight ray/triangle test
+typedef struct RayShear{
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+}RayShear;
 
 typedef struct Intersection{ 
 	Ray m_ray;
@@ -78,6 +192,8 @@ typedef struct Intersection{
 #define viszero(v) (((v).x == 0.f) && ((v).x == 0.f) && ((v).z == 0.f))
 #define pcal(v, a, b, c) { vsmul(v, a, c); vadd(v, v, b);}
 
+#define vluminance(v) (0.2126f * (v).x + 0.7152f * (v).y + 0.0722f * (v).z)
+
 #define vclamp(v) { vinit(v, clamp((v).x, 0.0f, 1.0f), clamp((v).y, 0.0f, 1.0f), clamp((v).z, 0.0f, 1.0f))}
 
 static float GetRandom(unsigned int *seed0, unsigned int *seed1) {
@@ -89,75 +205,73 @@ static float GetRandom(unsigned int *seed0, unsigned int *seed1) {
 	return ((*seed0 << 16) + *seed1) * 2.328306e-10f;
 }
 
-static Ray makeCameraRay(OCL_CONSTANT_BUFFER const Camera* cam, float xScreenPosTo1, float yScreenPosTo1) {
-	Vector forward, right, up, tmp;
+static Ray makeCameraRay(OCL_CONSTANT_BUFFER const CompiledCamera* cam, float xScreenPosTo1, float yScreenPosTo1) {
+	Vector right, up;
 	Ray ray;
 
-	vsub(tmp, cam->target, cam->origin); vnorm(tmp); vassign(forward, tmp);
-	vxcross(tmp, forward, cam->targetUpDirection); vnorm(tmp); vassign(right, tmp);
-	vxcross(tmp, right, forward); vnorm(tmp); vassign(up, tmp);
-
-	float tanFov = tan(cam->fieldOfViewInDegrees * M_PI / 180.0f);
+	vsmul(right, (xScreenPosTo1 - 0.5f), cam->m_right);
+	vsmul(up, (yScreenPosTo1 - 0.5f), cam->m_up);
 	
-	vsmul(right, ((xScreenPosTo1 - 0.5f) * tanFov), right);
-	vsmul(up, ((yScreenPosTo1 - 0.5f) * tanFov), up);
-	
-	ray.m_origin = cam->origin;
-	vadd(ray.m_direction, forward, right);
+	ray.m_origin = cam->m_origin;
+	vadd(ray.m_direction, cam->m_forward, right);
 	vadd(ray.m_direction, ray.m_direction, up);
 	vnorm(ray.m_direction);
 	ray.m_tMax = RAYMAX;
 	return ray;
 }
 
-static bool RectangleLightIntersect(RectangleLight tmpRectangle, int index,Intersection* tmpIntersection)
+/*
+* The *Distance tests find where ray hits a primitive, if that is in [EPSILON, tMax), and write no
+* hit record; the *Intersect tests on top of them fill the Intersection of closest-hit queries.
+*/
+static bool RectangleLightDistance(OCL_CONSTANT_BUFFER const CompiledLight* light, const Ray* ray, const float tMax, float* tHit)
 {
-	Vector normal;
-	vxcross(normal, tmpRectangle.m_side1, tmpRectangle.m_side2); vnorm(normal);
-	
-	
-	float nDotD = vdot(normal, tmpIntersection->m_ray.m_direction);
+	float nDotD = vdot(light->m_normal, ray->m_direction);
 	if (nDotD == 0.0f)
 	{
 		return false;
 	}
 
-	float t = (vdot(tmpRectangle.m_pos, normal) - vdot(tmpIntersection->m_ray.m_origin, normal)) / 
-		(vdot(tmpIntersection->m_ray.m_direction, normal));
+	float t = (light->m_planeDistance - vdot(ray->m_origin, light->m_normal)) / nDotD;
 	
-	if(t >= tmpIntersection->m_t || t < EPSILON)
+	if(t >= tMax || t < EPSILON)
 	{
 		return false; 
 	}
 	
-	Vector side1Norm = tmpRectangle.m_side1;
-	Vector side2Norm = tmpRectangle.m_side2;
-	float side1Length = sqrt(vdot(side1Norm, side1Norm)); vnorm(side1Norm);
-	float side2Length = sqrt(vdot(side2Norm, side2Norm)); vnorm(side2Norm);
+	Vector worldPoint, worldRelativePoint;
+	pcal(worldPoint, t, ray->m_origin, ray->m_direction);
 	
-	Vector worldPoint, worldRelativePoint, localPoint;
-	pcal(worldPoint, t, tmpIntersection->m_ray.m_origin, tmpIntersection->m_ray.m_direction);
+	vsub(worldRelativePoint, worldPoint, light->m_pos);
 	
-	vsub(worldRelativePoint, worldPoint, tmpRectangle.m_pos);
+	// Position across the light in units of its sides
+	float u = vdot(worldRelativePoint, light->m_side1Inv);
+	float v = vdot(worldRelativePoint, light->m_side2Inv);
 	
-	
-	vinit(localPoint, vdot(worldRelativePoint, side1Norm), 
-		vdot(worldRelativePoint, side2Norm), 0.0f);
-	
-	if((localPoint.x < 0.0f) || (localPoint.x > side1Length) ||
-		(localPoint.y < 0.0f) || (localPoint.y > side2Length))
+	if((u < 0.0f) || (u > 1.0f) || (v < 0.0f) || (v > 1.0f))
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool RectangleLightIntersect(OCL_CONSTANT_BUFFER const CompiledLight* light, int index, Intersection* tmpIntersection)
+{
+	float t;
+	if (!RectangleLightDistance(light, &tmpIntersection->m_ray, tmpIntersection->m_t, &t))
 	{
 		return false;
 	}
-	
 	
 	tmpIntersection->m_t = t;
 	tmpIntersection->lastindex = index;
-	tmpIntersection->m_normal = normal;
+	tmpIntersection->m_normal = light->m_normal;
 	vclr(tmpIntersection->m_color);
-	vsmul(tmpIntersection->m_emitted, tmpRectangle.m_power, tmpRectangle.m_color);
+	tmpIntersection->m_emitted = light->m_emitted;
 	
-	if((vdot(tmpIntersection->m_normal, tmpIntersection->m_ray.m_direction)) > 0.0f)
+	if(vdot(light->m_normal, tmpIntersection->m_ray.m_direction) > 0.0f)
 	{
 		vsmul(tmpIntersection->m_normal, -1.0f, tmpIntersection->m_normal);
 	}
@@ -165,172 +279,937 @@ static bool RectangleLightIntersect(RectangleLight tmpRectangle, int index,Inter
 	return true;
 }
 
-static bool PlaneIntersect(Plane tmpPlane, Intersection* tmpIntersection)
+static bool PlaneDistance(OCL_CONSTANT_BUFFER const CompiledPlane* plane, const Ray* ray, const float tMax, float* tHit)
 {
-	float nDotD = vdot(tmpPlane.m_normal, tmpIntersection->m_ray.m_direction);
-;	if (nDotD >= 0.0f)
+	float nDotD = vdot(plane->m_normal, ray->m_direction);
+	if (nDotD >= 0.0f)
 	{
 		return false;
 	}
 	
 
-	float t = (vdot(tmpPlane.m_pos, tmpPlane.m_normal) - 
-		vdot(tmpIntersection->m_ray.m_origin, tmpPlane.m_normal)) / 
-		(vdot(tmpIntersection->m_ray.m_direction, tmpPlane.m_normal));
+	float t = (plane->m_distance - vdot(ray->m_origin, plane->m_normal)) / nDotD;
 	
-	if(t >= tmpIntersection->m_t || t < EPSILON)
+	if(t >= tMax || t < EPSILON)
 	{
 		return false; 
 	}
-	
+
+	*tHit = t;
+	return true;
+}
+
+static bool PlaneIntersect(OCL_CONSTANT_BUFFER const CompiledPlane* plane, Intersection* tmpIntersection)
+{
+	float t;
+	if (!PlaneDistance(plane, &tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
 
 	tmpIntersection->m_t = t;
-	tmpIntersection->m_normal = tmpPlane.m_normal;
+	tmpIntersection->m_normal = plane->m_normal;
 	vclr(tmpIntersection->m_emitted);
-	tmpIntersection->m_color = tmpPlane.m_color;
+	tmpIntersection->m_color = plane->m_color;
 
 	return true;
 }
 
-static bool intersect(Intersection* tmpIntersection, 
-	OCL_CONSTANT_BUFFER const RectangleLight* lights,
-	const unsigned int lightcount, OCL_CONSTANT_BUFFER const Plane* planes,
-	const unsigned int planecount)
+// Record a hit on a non-emitting surface; the normal is turned to face the ray
+static void SetDiffuseHit(Intersection* tmpIntersection, const float t, Vector normal, const Color color)
 {
-	bool intersectedAny = false;
-	int i;
+	if (vdot(normal, tmpIntersection->m_ray.m_direction) > 0.0f)
+	{
+		vsmul(normal, -1.0f, normal);
+	}
+
+	tmpIntersection->m_t = t;
+	tmpIntersection->lastindex = -1;
+	tmpIntersection->m_normal = normal;
+	tmpIntersection->m_color = color;
+	vclr(tmpIntersection->m_emitted);
+}
+
+// Watertight ray/triangle test (Woop, Benthin, Wald: "Watertight Ray/Triangle Intersection", JCGT 2013)
+static void PrepareRayShear(const Vector direction, RayShear* shear)
+{
+	float dir[3] = { direction.x, direction.y, direction.z };
+	float ax = fabs(dir[0]), ay = fabs(dir[1]), az = fabs(dir[2]);
 
-	for(i = 0; i<planecount; i++)
+	// kz is the dominant axis of the direction; swapping kx/ky keeps the winding
+	shear->kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	shear->kx = (shear->kz + 1) % 3;
+	shear->ky = (shear->kx + 1) % 3;
+	if (dir[shear->kz] < 0.0f)
 	{
-		if(PlaneIntersect(planes[i], tmpIntersection) )
-		{
-			intersectedAny = true;
-			
-			
-		}
+		int tmp = shear->kx; shear->kx = shear->ky; shear->ky = tmp;
 	}
-	
-	for(i = 0; i<lightcount; i++)
+
+	shear->Sx = dir[shear->kx] / dir[shear->kz];
+	shear->Sy = dir[shear->ky] / dir[shear->kz];
+	shear->Sz = 1.0f / dir[shear->kz];
+}
+
+static bool TriangleDistance(const SceneData* scene, const unsigned int index, const RayShear* shear,
+	const Ray* ray, const float tMax, float* tHit)
+{
+	const Triangle triangle = scene->triangles[index];
+	const Point p0 = scene->vertices[triangle.m_v0];
+	const Point p1 = scene->vertices[triangle.m_v1];
+	const Point p2 = scene->vertices[triangle.m_v2];
+	const Point origin = ray->m_origin;
+
+	// Vertices relative to the ray origin, sheared so that the ray runs along +z
+	float A[3] = { p0.x - origin.x, p0.y - origin.y, p0.z - origin.z };
+	float B[3] = { p1.x - origin.x, p1.y - origin.y, p1.z - origin.z };
+	float C[3] = { p2.x - origin.x, p2.y - origin.y, p2.z - origin.z };
+
+	float Ax = A[shear->kx] - shear->Sx * A[shear->kz];
+	float Ay = A[shear->ky] - shear->Sy * A[shear->kz];
+	float Bx = B[shear->kx] - shear->Sx * B[shear->kz];
+	float By = B[shear->ky] - shear->Sy * B[shear->kz];
+	float Cx = C[shear->kx] - shear->Sx * C[shear->kz];
+	float Cy = C[shear->ky] - shear->Sy * C[shear->kz];
+
+	// Scaled barycentrics; edges shared by two triangles give the same value with opposite sign
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+
+	if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+	{
+		return false;
+	}
+
+	float det = U + V + W;
+	if (det == 0.0f)
+	{
+		return false;
+	}
+
+	float T = U * shear->Sz * A[shear->kz] + V * shear->Sz * B[shear->kz] + W * shear->Sz * C[shear->kz];
+	float t = T / det;
+
+	if(t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool TriangleIntersect(const SceneData* scene, const unsigned int index, const RayShear* shear,
+	Intersection* tmpIntersection)
+{
+	float t;
+	if (!TriangleDistance(scene, index, shear, &tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	const Triangle triangle = scene->triangles[index];
+	const Point p0 = scene->vertices[triangle.m_v0];
+	const Point p1 = scene->vertices[triangle.m_v1];
+	const Point p2 = scene->vertices[triangle.m_v2];
+	Vector edge1, edge2, normal;
+	vsub(edge1, p1, p0);
+	vsub(edge2, p2, p0);
+	vxcross(normal, edge1, edge2); vnorm(normal);
+
+	SetDiffuseHit(tmpIntersection, t, normal, scene->meshColors[triangle.m_mesh]);
+	return true;
+}
+
+// Element index of a vector stream: neighbouring primitives are neighbouring words
+static Point PrimitivePoint(__global const float* data, const unsigned int stream, const unsigned int count,
+	const unsigned int index)
+{
+	Point p;
+	vinit(p, data[stream + index], data[stream + count + index], data[stream + 2 * count + index]);
+	return p;
+}
+
+static Color PrimitiveColor(const SceneData* scene, const unsigned int stream, const unsigned int index)
+{
+	return scene->materials[(unsigned int)scene->primData[stream + index]];
+}
+
+static bool SphereDistance(const SceneData* scene, const unsigned int index, const Ray* ray, const float tMax, float* tHit)
+{
+	const Point center = PrimitivePoint(scene->primData, scene->primLayout.m_sphereCenter, scene->primLayout.m_sphereCount, index);
+	const float radius = scene->primData[scene->primLayout.m_sphereRadius + index];
+
+	// |o + t*d - c|^2 = r^2 with |d| = 1
+	Vector oc;
+	vsub(oc, ray->m_origin, center);
+	float b = vdot(oc, ray->m_direction);
+	float c = vdot(oc, oc) - radius * radius;
+	float discriminant = b * b - c;
+	if (discriminant < 0.0f)
+	{
+		return false;
+	}
+
+	float root = sqrt(discriminant);
+	float t = -b - root;
+	if (t < EPSILON)
+	{
+		t = -b + root;
+	}
+	if(t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool SphereIntersect(const SceneData* scene, const unsigned int index, Intersection* tmpIntersection)
+{
+	float t;
+	if (!SphereDistance(scene, index, &tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	const Point center = PrimitivePoint(scene->primData, scene->primLayout.m_sphereCenter, scene->primLayout.m_sphereCount, index);
+	Vector hitPoint, normal;
+	pcal(hitPoint, t, tmpIntersection->m_ray.m_origin, tmpIntersection->m_ray.m_direction);
+	vsub(normal, hitPoint, center); vnorm(normal);
+
+	SetDiffuseHit(tmpIntersection, t, normal, PrimitiveColor(scene, scene->primLayout.m_sphereMaterial, index));
+	return true;
+}
+
+static bool DiscDistance(const SceneData* scene, const unsigned int index, const Ray* ray, const float tMax, float* tHit)
+{
+	const Point center = PrimitivePoint(scene->primData, scene->primLayout.m_discCenter, scene->primLayout.m_discCount, index);
+	const Vector normal = PrimitivePoint(scene->primData, scene->primLayout.m_discNormal, scene->primLayout.m_discCount, index);
+	const float radius = scene->primData[scene->primLayout.m_discRadius + index];
+
+	float nDotD = vdot(normal, ray->m_direction);
+	if (nDotD == 0.0f)
+	{
+		return false;
+	}
+
+	Vector toCenter;
+	vsub(toCenter, center, ray->m_origin);
+	float t = vdot(toCenter, normal) / nDotD;
+	if(t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	Vector hitPoint, offset;
+	pcal(hitPoint, t, ray->m_origin, ray->m_direction);
+	vsub(offset, hitPoint, center);
+	if (vdot(offset, offset) > radius * radius)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	return true;
+}
+
+static bool DiscIntersect(const SceneData* scene, const unsigned int index, Intersection* tmpIntersection)
+{
+	float t;
+	if (!DiscDistance(scene, index, &tmpIntersection->m_ray, tmpIntersection->m_t, &t))
+	{
+		return false;
+	}
+
+	const Vector normal = PrimitivePoint(scene->primData, scene->primLayout.m_discNormal, scene->primLayout.m_discCount, index);
+	SetDiffuseHit(tmpIntersection, t, normal, PrimitiveColor(scene, scene->primLayout.m_discMaterial, index));
+	return true;
+}
+
+// hitAxis receives the axis of the box face that is hit
+static bool AxisBoxDistance(const SceneData* scene, const unsigned int index, const Ray* ray, const float tMax,
+	float* tHit, int* hitAxis)
+{
+	const Point boxMin = PrimitivePoint(scene->primData, scene->primLayout.m_boxMin, scene->primLayout.m_boxCount, index);
+	const Point boxMax = PrimitivePoint(scene->primData, scene->primLayout.m_boxMax, scene->primLayout.m_boxCount, index);
+	const Point origin = ray->m_origin;
+	const Vector direction = ray->m_direction;
+
+	float lo[3] = { boxMin.x, boxMin.y, boxMin.z };
+	float hi[3] = { boxMax.x, boxMax.y, boxMax.z };
+	float o[3] = { origin.x, origin.y, origin.z };
+	float d[3] = { direction.x, direction.y, direction.z };
+
+	// Slab test that remembers which axis bounds the entry and the exit
+	float tNear = -RAYMAX, tFar = RAYMAX;
+	int nearAxis = 0, farAxis = 0;
+	int a;
+	for (a = 0; a < 3; a++)
 	{
-		if (RectangleLightIntersect(lights[i], i, tmpIntersection))
+		if (d[a] == 0.0f)
 		{
-			intersectedAny = true;
+			if (o[a] < lo[a] || o[a] > hi[a])
+				return false;
+			continue;
+		}
+		float t0 = (lo[a] - o[a]) / d[a];
+		float t1 = (hi[a] - o[a]) / d[a];
+		if (t0 > t1)
+		{
+			float tmp = t0; t0 = t1; t1 = tmp;
+		}
+		if (t0 > tNear)
+		{
+			tNear = t0;
+			nearAxis = a;
+		}
+		if (t1 < tFar)
+		{
+			tFar = t1;
+			farAxis = a;
 		}
-		
+	}
+	if (tNear > tFar)
+	{
+		return false;
 	}
 
-	return intersectedAny;
+	// Rays starting inside the box hit its far side
+	float t = tNear;
+	int axis = nearAxis;
+	if (t < EPSILON)
+	{
+		t = tFar;
+		axis = farAxis;
+	}
+	if(t >= tMax || t < EPSILON)
+	{
+		return false;
+	}
+
+	*tHit = t;
+	*hitAxis = axis;
+	return true;
 }
 
-static bool sampleSurface(RectangleLight tmpRectangle, float u1, float u2,
-	const Point* referencePosition, Point* outPosition, Vector* outNormal)
+static bool AxisBoxIntersect(const SceneData* scene, const unsigned int index, Intersection* tmpIntersection)
 {
-	Point tmp;
-	vxcross(tmp, tmpRectangle.m_side1, tmpRectangle.m_side2); vnorm(tmp); vassign(*outNormal, tmp);
+	float t;
+	int axis;
+	if (!AxisBoxDistance(scene, index, &tmpIntersection->m_ray, tmpIntersection->m_t, &t, &axis))
+	{
+		return false;
+	}
 
-	vsmul(tmp, u1, tmpRectangle.m_side1); vadd(*outPosition, tmpRectangle.m_pos, tmp);
+	Vector normal;
+	vinit(normal, axis == 0 ? 1.0f : 0.0f, axis == 1 ? 1.0f : 0.0f, axis == 2 ? 1.0f : 0.0f);
 
-	vsmul(tmp, u2, tmpRectangle.m_side2); vadd(*outPosition, *outPosition, tmp);
+	SetDiffuseHit(tmpIntersection, t, normal, PrimitiveColor(scene, scene->primLayout.m_boxMaterial, index));
+	return true;
+}
 
-	vsub(tmp, *outPosition, *referencePosition);
+static bool intersectPrimitive(const unsigned int ref, Intersection* tmpIntersection,
+	const SceneData* scene, const RayShear* shear)
+{
+	const unsigned int index = ref & PRIM_INDEX_MASK;
 
-	if (vdot(*outNormal, tmp) > 0.0f)
+	switch (ref >> PRIM_TYPE_SHIFT)
 	{
-		vsmul(*outNormal, -1.0f, *outNormal);
+	case PRIM_RECT_LIGHT:
+		return RectangleLightIntersect(&scene->lights[index], index, tmpIntersection);
+	case PRIM_TRIANGLE:
+		return TriangleIntersect(scene, index, shear, tmpIntersection);
+	case PRIM_SPHERE:
+		return SphereIntersect(scene, index, tmpIntersection);
+	case PRIM_DISC:
+		return DiscIntersect(scene, index, tmpIntersection);
+	case PRIM_BOX:
+		return AxisBoxIntersect(scene, index, tmpIntersection);
+	default:
+		return false;
 	}
+}
 
-	return true;
+// Slab test against a node box; tEntry receives the distance where the ray enters the box
+static bool BoxIntersect(__global const BVHNode* node, const Point origin, const Vector invDir,
+	const float tMax, float* tEntry)
+{
+	float t0 = (node->m_boundsMin[0] - origin.x) * invDir.x;
+	float t1 = (node->m_boundsMax[0] - origin.x) * invDir.x;
+	float tNear = fmin(t0, t1), tFar = fmax(t0, t1);
+
+	t0 = (node->m_boundsMin[1] - origin.y) * invDir.y;
+	t1 = (node->m_boundsMax[1] - origin.y) * invDir.y;
+	tNear = fmax(tNear, fmin(t0, t1)); tFar = fmin(tFar, fmax(t0, t1));
+
+	t0 = (node->m_boundsMin[2] - origin.z) * invDir.z;
+	t1 = (node->m_boundsMax[2] - origin.z) * invDir.z;
+	tNear = fmax(tNear, fmin(t0, t1)); tFar = fmin(tFar, fmax(t0, t1));
+
+	*tEntry = tNear;
+	return tNear <= tFar && tFar >= 0.0f && tNear < tMax;
 }
 
-// TODO: Add OpenCL kernel code here.
-__kernel void ray_cal(OCL_CONSTANT_BUFFER const RectangleLight* lights,
-	const unsigned int lightcount, OCL_CONSTANT_BUFFER const Plane* planes,
-	const unsigned int planecount, const unsigned int sampleCount,
-	const unsigned int width, const unsigned int height,
-	OCL_CONSTANT_BUFFER const Camera* cam, __global unsigned int* seeds,
-	__global unsigned int* pixels, const unsigned int stage)
+static float SafeInverse(const float d)
 {
-    const int offset     = get_global_id(0);
-    const int y		= (stage * WORK_AMOUNT + offset) / WIDTH_SIZE;
-	const int x     = (stage * WORK_AMOUNT + offset) % WIDTH_SIZE;
-	unsigned int seed0, seed1;
-	
-	int i, j;
-	
-	seed0 = seeds[2*offset];
-	seed1 = seeds[2*offset + 1];
+	return 1.0f / (fabs(d) > 1.0e-20f ? d : (d < 0.0f ? -1.0e-20f : 1.0e-20f));
+}
 
-	Color pixelColor;
-	vclr(pixelColor);
-	float yu, xu;
-	//pixels[0] = pixels[0] + 1;
-	pixels[y*width+x] = 0;
-	for(i= 0; i< sampleCount; i++)
+// Closest-hit BVH traversal, nearer child first.
+// Primitive tests only accept hits closer than m_t, so the result is the same as testing everything.
+static bool intersectBVH(Intersection* tmpIntersection, const SceneData* scene)
+{
+	if (scene->nodeCount == 0)
 	{
-		yu = 1.0f - ((y + GetRandom(&seed0, &seed1)) / (height - 1));
-		xu = (x + GetRandom(&seed0, &seed1)) / (width - 1);
-		
-		Ray ray = makeCameraRay(cam, xu, yu);
-		Intersection intersection;
-		intersection.m_ray = ray;
-		intersection.m_t = ray.m_tMax;
-		vclr(intersection.m_color);
-		vclr(intersection.m_emitted);
-		vclr(intersection.m_normal);
-		intersection.lastindex = -1;
-		if(intersect(&intersection, lights, lightcount, planes, planecount))
+		return false;
+	}
+
+	__global const BVHNode* nodes = scene->nodes;
+	__global const unsigned int* primRefs = scene->primRefs;
+
+	const Point origin = tmpIntersection->m_ray.m_origin;
+	Vector invDir;
+	vinit(invDir, SafeInverse(tmpIntersection->m_ray.m_direction.x),
+		SafeInverse(tmpIntersection->m_ray.m_direction.y),
+		SafeInverse(tmpIntersection->m_ray.m_direction.z));
+	RayShear shear;
+	PrepareRayShear(tmpIntersection->m_ray.m_direction, &shear);
+
+	int stack[BVH_STACK_SIZE];
+	float stackEntry[BVH_STACK_SIZE];
+	int stackSize = 0;
+	bool intersectedAny = false;
+	int nodeIndex = 0;
+	int k;
+	float tEntry;
+
+	if (!BoxIntersect(&nodes[0], origin, invDir, tmpIntersection->m_t, &tEntry))
+	{
+		return false;
+	}
+
+	for (;;)
+	{
+		__global const BVHNode* node = &nodes[nodeIndex];
+
+		if (node->m_primCount > 0)
+		{
+			for (k = 0; k < node->m_primCount; k++)
+			{
+				if (intersectPrimitive(primRefs[node->m_offset + k], tmpIntersection, scene, &shear))
+				{
+					intersectedAny = true;
+				}
+			}
+		}
+		else
 		{
-			vadd(pixelColor, pixelColor, intersection.m_emitted);
+			int left = nodeIndex + 1;
+			int right = node->m_offset;
+			float tLeft, tRight;
+			bool hitLeft = BoxIntersect(&nodes[left], origin, invDir, tmpIntersection->m_t, &tLeft);
+			bool hitRight = BoxIntersect(&nodes[right], origin, invDir, tmpIntersection->m_t, &tRight);
 
-			Point position;
-			pcal(position, intersection.m_t, intersection.m_ray.m_origin, 
-				intersection.m_ray.m_direction);
-			
-			for(j = 0; j<lightcount; j++)
+			if (hitLeft && hitRight)
 			{
-				Point lightPoint;
-				Vector lightNormal;
-
-				sampleSurface(lights[j], GetRandom(&seed0, &seed1), GetRandom(&seed0, &seed1),
-							&position, &lightPoint, &lightNormal);
-				
-				
-				Vector toLight; vsub(toLight, lightPoint, position);
-				float lightDistance = sqrt(vdot(toLight, toLight)); vnorm(toLight)
-				Ray shadowRay = { position, toLight, lightDistance}; 
-				Intersection shadowIntersection;
-				shadowIntersection.m_ray = shadowRay;
-				shadowIntersection.m_t = shadowRay.m_tMax;
-				vclr(shadowIntersection.m_color);
-				vclr(shadowIntersection.m_emitted);
-				vclr(shadowIntersection.m_normal);
-				shadowIntersection.lastindex = -1;
-				bool intersected = intersect(&shadowIntersection, lights, lightcount, planes, planecount);
-
-				if(!intersected || (shadowIntersection.lastindex == j))
+				if (tRight < tLeft)
 				{
-					float lightAttenuation = max(0.0f, vdot(intersection.m_normal, toLight));
-					Color tmp;
-					vsmul(tmp, lights[j].m_power, lights[j].m_color);
-					vmul(tmp, intersection.m_color, tmp);
-					vsmul(tmp, lightAttenuation, tmp);
-				
-					vadd(pixelColor, pixelColor, tmp);
+					int tmpIndex = left; left = right; right = tmpIndex;
+					float tmpEntry = tLeft; tLeft = tRight; tRight = tmpEntry;
 				}
+				stack[stackSize] = right;
+				stackEntry[stackSize] = tRight;
+				stackSize++;
+				nodeIndex = left;
+				continue;
+			}
+			if (hitLeft || hitRight)
+			{
+				nodeIndex = hitLeft ? left : right;
+				continue;
+			}
+		}
 
+		// Pop the next node that can still hold a closer hit
+		do
+		{
+			if (stackSize == 0)
+			{
+				return intersectedAny;
 			}
-			
-			
+			stackSize--;
+			nodeIndex = stack[stackSize];
+		} while (stackEntry[stackSize] >= tmpIntersection->m_t);
+	}
+}
+
+static bool intersect(Intersection* tmpIntersection, const SceneData* scene)
+{
+	bool intersectedAny = false;
+	int i;
 
+	// Planes are unbounded and stay out of the BVH
+	for(i = 0; i<PLANE_COUNT(scene->planecount); i++)
+	{
+		if(PlaneIntersect(&scene->planes[i], tmpIntersection) )
+		{
+			intersectedAny = true;
 		}
 	}
-
 	
-	seeds[2*offset] = seed0;
-	seeds[2*offset + 1] = seed1;
+	if (intersectBVH(tmpIntersection, scene))
+	{
+		intersectedAny = true;
+	}
 
-	vsdiv(pixelColor, sampleCount, pixelColor);
-	
+	return intersectedAny;
+}
+
+// Any-hit counterpart of intersectPrimitive; light ignoreLight doesn't block the ray
+static bool occludedPrimitive(const unsigned int ref, const Ray* ray, const float tMax, const int ignoreLight,
+	const SceneData* scene, const RayShear* shear)
+{
+	const unsigned int index = ref & PRIM_INDEX_MASK;
+	float t;
+	int axis;
+
+	switch (ref >> PRIM_TYPE_SHIFT)
+	{
+	case PRIM_RECT_LIGHT:
+		return (int)index != ignoreLight && RectangleLightDistance(&scene->lights[index], ray, tMax, &t);
+	case PRIM_TRIANGLE:
+		return TriangleDistance(scene, index, shear, ray, tMax, &t);
+	case PRIM_SPHERE:
+		return SphereDistance(scene, index, ray, tMax, &t);
+	case PRIM_DISC:
+		return DiscDistance(scene, index, ray, tMax, &t);
+	case PRIM_BOX:
+		return AxisBoxDistance(scene, index, ray, tMax, &t, &axis);
+	default:
+		return false;
+	}
+}
+
+// Any-hit BVH traversal: nearer child first, done at the first primitive closer than tMax
+static bool occludedBVH(const SceneData* scene, const Ray* ray, const float tMax, const int ignoreLight)
+{
+	if (scene->nodeCount == 0)
+	{
+		return false;
+	}
+
+	__global const BVHNode* nodes = scene->nodes;
+	__global const unsigned int* primRefs = scene->primRefs;
+
+	const Point origin = ray->m_origin;
+	Vector invDir;
+	vinit(invDir, SafeInverse(ray->m_direction.x), SafeInverse(ray->m_direction.y), SafeInverse(ray->m_direction.z));
+	RayShear shear;
+	PrepareRayShear(ray->m_direction, &shear);
+
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+	int k;
+	float tEntry;
+
+	if (!BoxIntersect(&nodes[0], origin, invDir, tMax, &tEntry))
+	{
+		return false;
+	}
+
+	for (;;)
+	{
+		__global const BVHNode* node = &nodes[nodeIndex];
+
+		if (node->m_primCount > 0)
+		{
+			for (k = 0; k < node->m_primCount; k++)
+			{
+				if (occludedPrimitive(primRefs[node->m_offset + k], ray, tMax, ignoreLight, scene, &shear))
+				{
+					return true;
+				}
+			}
+		}
+		else
+		{
+			int left = nodeIndex + 1;
+			int right = node->m_offset;
+			float tLeft, tRight;
+			bool hitLeft = BoxIntersect(&nodes[left], origin, invDir, tMax, &tLeft);
+			bool hitRight = BoxIntersect(&nodes[right], origin, invDir, tMax, &tRight);
+
+			if (hitLeft && hitRight)
+			{
+				if (tRight < tLeft)
+				{
+					int tmpIndex = left; left = right; right = tmpIndex;
+				}
+				stack[stackSize++] = right;
+				nodeIndex = left;
+				continue;
+			}
+			if (hitLeft || hitRight)
+			{
+				nodeIndex = hitLeft ? left : right;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+		{
+			return false;
+		}
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+/*
+* Any-hit query for shadow rays: whether anything but light ignoreLight (-1 for none) lies on
+* ray closer than tMax. Returns at the first blocker found and fills no Intersection.
+*/
+static bool occluded(const SceneData* scene, const Ray* ray, const float tMax, const int ignoreLight)
+{
+	float t;
+	int i;
+
+	for(i = 0; i<PLANE_COUNT(scene->planecount); i++)
+	{
+		if (PlaneDistance(&scene->planes[i], ray, tMax, &t))
+		{
+			return true;
+		}
+	}
+
+	return occludedBVH(scene, ray, tMax, ignoreLight);
+}
+
+static bool sampleSurface(OCL_CONSTANT_BUFFER const CompiledLight* light, float u1, float u2,
+	const Point* referencePosition, Point* outPosition, Vector* outNormal)
+{
+	Point tmp;
+	*outNormal = light->m_normal;
+
+	vsmul(tmp, u1, light->m_side1); vadd(*outPosition, light->m_pos, tmp);
+
+	vsmul(tmp, u2, light->m_side2); vadd(*outPosition, *outPosition, tmp);
+
+	vsub(tmp, *outPosition, *referencePosition);
+
+	if (vdot(*outNormal, tmp) > 0.0f)
+	{
+		vsmul(*outNormal, -1.0f, *outNormal);
+	}
+
+	return true;
+}
+
+// Orthonormal basis around the unit vector n (Duff et al., "Building an Orthonormal Basis, Revisited", JCGT 2017)
+static void makeBasis(const Vector n, Vector* tangent, Vector* bitangent)
+{
+	float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+	float a = -1.0f / (sign + n.z);
+	float b = n.x * n.y * a;
+	vinit(*tangent, 1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+	vinit(*bitangent, b, sign + n.y * n.y * a, -n.y);
+}
+
+// Cosine-weighted direction around the normal; its density is dot(normal, direction) / pi
+static Vector sampleCosineHemisphere(const Vector normal, float u1, float u2)
+{
+	Vector tangent, bitangent, direction, tmp;
+	makeBasis(normal, &tangent, &bitangent);
+
+	float r = sqrt(u1);
+	float phi = TWO_PI * u2;
+	vsmul(direction, sqrt(max(0.0f, 1.0f - u1)), normal);
+	vsmul(tmp, r * cos(phi), tangent); vadd(direction, direction, tmp);
+	vsmul(tmp, r * sin(phi), bitangent); vadd(direction, direction, tmp);
+	return direction;
+}
+
+// Power heuristic (beta = 2) weight of the strategy with density pdf against the other one
+static float powerHeuristic(const float pdf, const float otherPdf)
+{
+	float a = pdf * pdf;
+	float b = otherPdf * otherPdf;
+	return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+/*
+* Solid angle density of sampling a point on light that is distance away and whose
+* normal makes cosLight with the direction to it; 0 if it can't be sampled
+*/
+static float lightPdf(OCL_CONSTANT_BUFFER const CompiledLight* light, const float distance, const float cosLight)
+{
+	if (cosLight <= 0.0f || light->m_area <= 0.0f)
+	{
+		return 0.0f;
+	}
+	return distance * distance / (cosLight * light->m_area);
+}
+
+/*
+* Importance of a light BVH node for a hit at position with normal: flux over squared distance,
+* scaled by the best cosines the bounds allow at the lights and at the hit (Conty Estevez and
+* Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018).
+* The lights are planar, so they emit up to 90 degrees off their normal.
+*/
+static float lightNodeImportance(__global const LightNode* node, const Point position, const Vector normal)
+{
+	Point center;
+	vinit(center, 0.5f * (node->m_boundsMin[0] + node->m_boundsMax[0]), 0.5f * (node->m_boundsMin[1] + node->m_boundsMax[1]),
+		0.5f * (node->m_boundsMin[2] + node->m_boundsMax[2]));
+	Vector diagonal;
+	vinit(diagonal, node->m_boundsMax[0] - node->m_boundsMin[0], node->m_boundsMax[1] - node->m_boundsMin[1],
+		node->m_boundsMax[2] - node->m_boundsMin[2]);
+	float radiusSq = 0.25f * vdot(diagonal, diagonal);
+
+	Vector toCenter; vsub(toCenter, center, position);
+	float distanceSq = vdot(toCenter, toCenter);
+	if (distanceSq > 0.0f)
+	{
+		vsdiv(toCenter, sqrt(distanceSq), toCenter);
+	}
+
+	// Half angle of the bounding sphere as seen from the hit; inside it any direction is possible
+	float cosBounds = -1.0f, sinBounds = 0.0f;
+	if (distanceSq > radiusSq)
+	{
+		float sinSq = radiusSq / distanceSq;
+		cosBounds = sqrt(1.0f - sinSq);
+		sinBounds = sqrt(sinSq);
+	}
+
+	// Angle between the normal cone and the direction to the hit, less the cone and the bounds
+	Vector axis;
+	vinit(axis, node->m_axis[0], node->m_axis[1], node->m_axis[2]);
+	float cosW = fabs(vdot(axis, toCenter));
+	float sinW = sqrt(max(0.0f, 1.0f - cosW * cosW));
+	float cosO = node->m_cosTheta;
+	float sinO = sqrt(max(0.0f, 1.0f - cosO * cosO));
+	float cosX = cosW > cosO ? 1.0f : cosW * cosO + sinW * sinO;
+	float sinX = sqrt(max(0.0f, 1.0f - cosX * cosX));
+	float cosLight = cosX > cosBounds ? 1.0f : cosX * cosBounds + sinX * sinBounds;
+	if (cosLight <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	// Same at the hit: its surface faces the lights within the bounds
+	float cosI = vdot(normal, toCenter);
+	float sinI = sqrt(max(0.0f, 1.0f - cosI * cosI));
+	float cosSurface = cosI > cosBounds ? 1.0f : cosI * cosBounds + sinI * sinBounds;
+	if (cosSurface <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	// Close to or inside the box the distance says little, so it is kept at the box size
+	return node->m_energy * cosLight * cosSurface / max(distanceSq, radiusSq);
+}
+
+/*
+* Pick a light for the hit at position with normal from u in [0, 1): from the alias table,
+* or down the light BVH choosing children in proportion to their importance.
+* Returns the light and its probability in pmf, or -1 if no light can reach the hit.
+*/
+static int selectLight(const SceneData* scene, const Point position, const Vector normal, float u, float* pmf)
+{
+	const unsigned int lightcount = LIGHT_COUNT(scene->lightcount);
+	if (lightcount == 0)
+	{
+		return -1;
+	}
+
+	if (scene->lightNodeCount == 0)
+	{
+		float scaled = u * lightcount;
+		unsigned int entry = min((unsigned int)scaled, lightcount - 1);
+		int light = (scaled - entry < scene->lightAlias[entry].m_threshold) ? (int)entry : (int)scene->lightAlias[entry].m_alias;
+		*pmf = scene->lightAlias[light].m_pdf;
+		return light;
+	}
+
+	__global const LightNode* nodes = scene->lightNodes;
+	float probability = 1.0f;
+	int nodeIndex = 0;
+	while (!nodes[nodeIndex].m_lightCount)
+	{
+		float first = lightNodeImportance(&nodes[nodeIndex + 1], position, normal);
+		float second = lightNodeImportance(&nodes[nodes[nodeIndex].m_offset], position, normal);
+		if (first + second <= 0.0f)
+		{
+			return -1;
+		}
+
+		// Reuse u for the next level
+		float pFirst = first / (first + second);
+		if (u < pFirst)
+		{
+			u = u / pFirst;
+			probability *= pFirst;
+			nodeIndex = nodeIndex + 1;
+		}
+		else
+		{
+			u = (u - pFirst) / (1.0f - pFirst);
+			probability *= 1.0f - pFirst;
+			nodeIndex = nodes[nodeIndex].m_offset;
+		}
+		u = min(u, 0.99999994f);
+	}
+
+	*pmf = probability;
+	return nodes[nodeIndex].m_offset;
+}
+
+// Probability that selectLight picks light for the hit at position with normal; follows the light's trail
+static float lightSelectPdf(const SceneData* scene, const Point position, const Vector normal, const int light)
+{
+	if (scene->lightNodeCount == 0)
+	{
+		return scene->lightAlias[light].m_pdf;
+	}
+
+	__global const LightNode* nodes = scene->lightNodes;
+	unsigned int trail = scene->lightTrails[light];
+	float probability = 1.0f;
+	int nodeIndex = 0;
+	while (!nodes[nodeIndex].m_lightCount)
+	{
+		float first = lightNodeImportance(&nodes[nodeIndex + 1], position, normal);
+		float second = lightNodeImportance(&nodes[nodes[nodeIndex].m_offset], position, normal);
+		if (first + second <= 0.0f)
+		{
+			return 0.0f;
+		}
+
+		if (trail & 1)
+		{
+			probability *= second / (first + second);
+			nodeIndex = nodes[nodeIndex].m_offset;
+		}
+		else
+		{
+			probability *= first / (first + second);
+			nodeIndex = nodeIndex + 1;
+		}
+		trail >>= 1;
+	}
+
+	return probability;
+}
+
+/*
+* Next-event estimation: sample a point on light as seen from a diffuse hit.
+* selectPdf is the chance of sampling this light, times the light samples per hit.
+* Fills shadowRay and the MIS-weighted contribution (path throughput not applied) that
+* counts if the shadow ray is unoccluded. Returns false if the light can't contribute.
+*/
+static bool sampleLight(OCL_CONSTANT_BUFFER const CompiledLight* light, float u1, float u2, const float selectPdf,
+	const Point position, const Vector normal, const Color albedo, Ray* shadowRay, Color* contribution)
+{
+	Point lightPoint;
+	Vector lightNormal;
+	sampleSurface(light, u1, u2, &position, &lightPoint, &lightNormal);
+
+	Vector toLight; vsub(toLight, lightPoint, position);
+	float lightDistance = sqrt(vdot(toLight, toLight));
+	if (lightDistance <= 0.0f)
+	{
+		return false;
+	}
+	vsdiv(toLight, lightDistance, toLight);
+
+	// A light behind the surface adds nothing, whether it is occluded or not
+	float cosSurface = vdot(normal, toLight);
+	float pdf = selectPdf * lightPdf(light, lightDistance, -vdot(lightNormal, toLight));
+	if (cosSurface <= 0.0f || pdf <= 0.0f)
+	{
+		return false;
+	}
+
+	// Lambert: albedo / pi * emitted * cos / pdf, weighted against cosine sampling of the same direction
+	float weight = powerHeuristic(pdf, cosSurface * INV_PI);
+	vmul(*contribution, albedo, light->m_emitted);
+	vsmul(*contribution, weight * cosSurface * INV_PI / pdf, *contribution);
+
+	shadowRay->m_origin = position;
+	shadowRay->m_direction = toLight;
+	shadowRay->m_tMax = lightDistance;
+	return true;
+}
+
+/*
+* MIS weight of light found at distance t by a cosine-sampled bounce with density bsdfPdf,
+* which left the hit with normal at ray's origin. Camera rays (bsdfPdf 0) have no light
+* sample competing with them and take it all.
+*/
+static float emissionWeight(const SceneData* scene, const int light, const Ray* ray, const float t,
+	const Vector normal, const float bsdfPdf)
+{
+	if (bsdfPdf <= 0.0f)
+	{
+		return 1.0f;
+	}
+	float selectPdf = scene->lightSamples * lightSelectPdf(scene, ray->m_origin, normal, light);
+	return powerHeuristic(bsdfPdf,
+		selectPdf * lightPdf(&scene->lights[light], t, fabs(vdot(scene->lights[light].m_normal, ray->m_direction))));
+}
+
+// Surface point of a hit, moved off the surface along its (ray-facing) normal
+static Point offsetHitPoint(const Intersection* intersection)
+{
+	Point position;
+	pcal(position, intersection->m_t, intersection->m_ray.m_origin, intersection->m_ray.m_direction);
+	Vector offset;
+	vsmul(offset, RAY_OFFSET, intersection->m_normal);
+	vadd(position, position, offset);
+	return position;
+}
+
+static void initRayIntersection(Intersection* intersection, const Ray ray)
+{
+	intersection->m_ray = ray;
+	intersection->m_t = ray.m_tMax;
+	vclr(intersection->m_color);
+	vclr(intersection->m_emitted);
+	vclr(intersection->m_normal);
+	intersection->lastindex = -1;
+}
+
+/*
+* Russian roulette from bounce PATH_RR_DEPTH on: a path survives with the probability of its
+* largest throughput component (at most 0.95) and is scaled up to stay unbiased
+*/
+static bool russianRoulette(const unsigned int depth, Color* throughput, unsigned int* seed0, unsigned int* seed1)
+{
+	if (depth + 1 < PATH_RR_DEPTH)
+	{
+		return true;
+	}
+
+	float survive = min(vfilter(*throughput), 0.95f);
+	if (survive <= 0.0f || GetRandom(seed0, seed1) >= survive)
+	{
+		return false;
+	}
+	vsdiv(*throughput, survive, *throughput);
+	return true;
+}
+
+/*
+* Mean color of an Accum entry, clamped and packed as 0x00RRGGBB
+*/
+static unsigned int packMean(const float4 sum)
+{
+	Color pixelColor;
+	vinit(pixelColor, sum.x / sum.w, sum.y / sum.w, sum.z / sum.w);
+	
 	vclamp(pixelColor);
 	
 	unsigned char r, g, b;
@@ -339,6 +1218,569 @@ __kernel void ray_cal(OCL_CONSTANT_BUFFER const RectangleLight* lights,
 	g = (unsigned char)(pixelColor.y * 255.0f);
 	b = (unsigned char)(pixelColor.z * 255.0f);
 
-	pixels[y*width+x] = (r << 16) + (g << 8) + b;
+	return (r << 16) + (g << 8) + b;
+}
+
+/*
+* One path traced sample of the camera ray: up to maxDepth diffuse bounces, each with
+* next-event estimation toward lightSamples selected lights combined with the
+* cosine-sampled bounce by MIS. The rays traced are added to rayCount (RAY_COUNT_KINDS entries).
+*/
+static Color tracePath(const SceneData* scene, Ray ray, const unsigned int maxDepth,
+	unsigned int* seed0, unsigned int* seed1, unsigned int* rayCount)
+{
+	OCL_CONSTANT_BUFFER const CompiledLight* lights = scene->lights;
+
+	Color radiance, throughput;
+	vclr(radiance);
+	vinit(throughput, 1.0f, 1.0f, 1.0f);
+	float bsdfPdf = 0.0f;		// density of the bounce that made ray, 0 for the camera ray
+	Vector lastNormal;			// normal of the hit that made ray
+	vclr(lastNormal);
+
+	for (unsigned int depth = 0; ; depth++)
+	{
+		Intersection intersection;
+		initRayIntersection(&intersection, ray);
+		rayCount[RAY_COUNT_CLOSEST]++;
+		if (!intersect(&intersection, scene))
+			break;
+
+		// Lights don't reflect, so a path ends on them
+		if (intersection.lastindex >= 0)
+		{
+			Color tmp;
+			vmul(tmp, throughput, intersection.m_emitted);
+			vsmul(tmp, emissionWeight(scene, intersection.lastindex, &ray, intersection.m_t, lastNormal, bsdfPdf), tmp);
+			vadd(radiance, radiance, tmp);
+			break;
+		}
+
+		if (depth >= maxDepth)
+			break;
+
+		Point position = offsetHitPoint(&intersection);
+		for (unsigned int s = 0; s < scene->lightSamples; s++)
+		{
+			Ray shadowRay;
+			Color contribution;
+			float pmf;
+			const int j = selectLight(scene, position, intersection.m_normal, GetRandom(seed0, seed1), &pmf);
+			float u1 = GetRandom(seed0, seed1);
+			float u2 = GetRandom(seed0, seed1);
+			if (j < 0 || !sampleLight(&lights[j], u1, u2, pmf * scene->lightSamples, position, intersection.m_normal,
+				intersection.m_color, &shadowRay, &contribution))
+				continue;
+
+			rayCount[RAY_COUNT_SHADOW]++;
+			if (!occluded(scene, &shadowRay, shadowRay.m_tMax, j))
+			{
+				vmul(contribution, contribution, throughput);
+				vadd(radiance, radiance, contribution);
+			}
+		}
+
+		if (!russianRoulette(depth, &throughput, seed0, seed1))
+			break;
+
+		// Cosine sampling cancels the Lambert cosine / pi, leaving the albedo as the weight
+		float u1 = GetRandom(seed0, seed1);
+		float u2 = GetRandom(seed0, seed1);
+		ray.m_origin = position;
+		ray.m_direction = sampleCosineHemisphere(intersection.m_normal, u1, u2);
+		ray.m_tMax = RAYMAX;
+		bsdfPdf = vdot(intersection.m_normal, ray.m_direction) * INV_PI;
+		lastNormal = intersection.m_normal;
+		vmul(throughput, throughput, intersection.m_color);
+		if (bsdfPdf <= 0.0f)
+			break;
+	}
+
+	return radiance;
+}
+
+/*
+* Add sampleCount samples to one pixel: update its sums and its packed color
+*/
+static void renderPixel(const SceneData* scene, OCL_CONSTANT_BUFFER const CompiledCamera* cam,
+	const unsigned int passSamples, const unsigned int maxDepth, const unsigned int imageWidth, const unsigned int imageHeight,
+	const unsigned int pixel, unsigned int* seed0, unsigned int* seed1,
+	__global unsigned int* pixels, __global float4* accum, __global float* accumSq, unsigned int* rayCount)
+{
+	const unsigned int width = IMAGE_WIDTH(imageWidth);
+	const unsigned int height = IMAGE_HEIGHT(imageHeight);
+	const unsigned int sampleCount = SAMPLE_COUNT(passSamples);
+    const int y		= pixel / width;
+	const int x     = pixel % width;
+	
+	int i;
+
+	Color pixelColor;
+	vclr(pixelColor);
+	float luminanceSq = 0.0f;
+	float yu, xu;
+	//pixels[0] = pixels[0] + 1;
+	pixels[y*width+x] = 0;
+	for(i= 0; i< sampleCount; i++)
+	{
+		yu = 1.0f - ((y + GetRandom(seed0, seed1)) / (height - 1));
+		xu = (x + GetRandom(seed0, seed1)) / (width - 1);
+		
+		Color sampleColor = tracePath(scene, makeCameraRay(cam, xu, yu), maxDepth, seed0, seed1, rayCount);
+
+		// The squared luminance of every sample gives the variance of the pixel
+		vadd(pixelColor, pixelColor, sampleColor);
+		float luminance = vluminance(sampleColor);
+		luminanceSq += luminance * luminance;
+	}
+
+	// Add this pass to the running sums (w counts the samples) and show the mean so far
+	float4 sum = accum[y*width+x];
+	sum.x += pixelColor.x;
+	sum.y += pixelColor.y;
+	sum.z += pixelColor.z;
+	sum.w += sampleCount;
+	accum[y*width+x] = sum;
+	accumSq[y*width+x] += luminanceSq;
+
+	pixels[y*width+x] = packMean(sum);
 	
-}
\ No newline at end of file
+}
+
+// TODO: Add OpenCL kernel code here.
+/*
+* With persistent == 0 every work item renders entry stage * WORK_AMOUNT + offset of pixelList,
+* one launch per stage. Otherwise a single launch sized to fill the device loops: each
+* work-group takes the next get_local_size(0) entries from workCounter until the list is done.
+* Which work item gets a pixel then depends on timing, so the seeds are per pixel, not per work
+* item, and a render with fixed seeds comes out the same every time.
+* Every work item adds the rays it traced to rayCounts once, at its end.
+*/
+__kernel void ray_cal(OCL_CONSTANT_BUFFER const CompiledLight* lights,
+	const unsigned int lightcount, OCL_CONSTANT_BUFFER const CompiledPlane* planes,
+	const unsigned int planecount, const unsigned int sampleCount,
+	const unsigned int width, const unsigned int height,
+	OCL_CONSTANT_BUFFER const CompiledCamera* cam, __global unsigned int* seeds,
+	__global unsigned int* pixels, const unsigned int stage,
+	__global const BVHNode* nodes, const unsigned int nodeCount,
+	__global const unsigned int* primRefs, __global const Point* vertices,
+	__global const Triangle* triangles, __global const Color* meshColors,
+	__global const float* primData, const PrimitiveLayout primLayout, __global const Color* materials,
+	__global float4* accum, __global float* accumSq,
+	__global const unsigned int* pixelList, const unsigned int pixelCount,
+	__global volatile unsigned int* workCounter, const unsigned int persistent, const unsigned int maxDepth,
+	__global const LightAlias* lightAlias, __global const LightNode* lightNodes, const unsigned int lightNodeCount,
+	__global const unsigned int* lightTrails, const unsigned int lightSamples,
+	__global volatile unsigned int* rayCounts)
+{
+    const int offset     = get_global_id(0);
+	unsigned int rayCount[RAY_COUNT_KINDS] = { 0, 0 };
+	__local unsigned int batchStart;
+
+	SceneData scene;
+	scene.lights = lights;
+	scene.lightcount = lightcount;
+	scene.planes = planes;
+	scene.planecount = planecount;
+	scene.nodes = nodes;
+	scene.nodeCount = nodeCount;
+	scene.primRefs = primRefs;
+	scene.vertices = vertices;
+	scene.triangles = triangles;
+	scene.meshColors = meshColors;
+	scene.primData = primData;
+	scene.primLayout = primLayout;
+	scene.materials = materials;
+	scene.lightAlias = lightAlias;
+	scene.lightNodes = lightNodes;
+	scene.lightNodeCount = lightNodeCount;
+	scene.lightTrails = lightTrails;
+	scene.lightSamples = lightSamples;
+
+	if (!persistent)
+	{
+		// The last stage may run past the end of the list
+		const unsigned int index = stage * WORK_AMOUNT + offset;
+		if (index >= pixelCount)
+			return;
+
+		unsigned int seed0 = seeds[2*offset];
+		unsigned int seed1 = seeds[2*offset + 1];
+
+		renderPixel(&scene, cam, sampleCount, maxDepth, width, height, pixelList[index], &seed0, &seed1,
+			pixels, accum, accumSq, rayCount);
+
+		seeds[2*offset] = seed0;
+		seeds[2*offset + 1] = seed1;
+		atomic_add(&rayCounts[RAY_COUNT_CLOSEST], rayCount[RAY_COUNT_CLOSEST]);
+		atomic_add(&rayCounts[RAY_COUNT_SHADOW], rayCount[RAY_COUNT_SHADOW]);
+		return;
+	}
+
+	// The loop condition is the same for the whole work-group, so every item reaches the barriers
+	for (;;)
+	{
+		if (get_local_id(0) == 0)
+			batchStart = atomic_add(workCounter, (unsigned int)get_local_size(0));
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		const unsigned int first = batchStart;
+		const unsigned int index = first + get_local_id(0);
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if (first >= pixelCount)
+			break;
+
+		if (index < pixelCount)
+		{
+			const unsigned int pixel = pixelList[index];
+			unsigned int seed0 = seeds[2*pixel];
+			unsigned int seed1 = seeds[2*pixel + 1];
+
+			renderPixel(&scene, cam, sampleCount, maxDepth, width, height, pixel, &seed0, &seed1,
+				pixels, accum, accumSq, rayCount);
+
+			seeds[2*pixel] = seed0;
+			seeds[2*pixel + 1] = seed1;
+		}
+	}
+
+	atomic_add(&rayCounts[RAY_COUNT_CLOSEST], rayCount[RAY_COUNT_CLOSEST]);
+	atomic_add(&rayCounts[RAY_COUNT_SHADOW], rayCount[RAY_COUNT_SHADOW]);
+}
+
+/*
+* Wavefront pipeline
+*
+* One path per pixel list entry is in flight per wave; its state lives in global
+* structure-of-arrays buffers indexed by path. Every sample of a pass is one wave:
+*   wf_generate    camera rays for pathCount entries of pixelList from first on
+* then for every depth from 0 to maxDepth
+*   wf_extend      closest hit of the paths in the extend queue; light hits end the path,
+*                  surface hits go to the shade queue (below maxDepth)
+*   wf_shade       lightSamples selected lights per hit into the shadow slots, then Russian
+*                  roulette and the cosine-sampled bounce into the extend queue of depth + 1
+*   wf_shadow      occlusion of the shadow slots of the queued paths, visible ones are added
+* and finally
+*   wf_accumulate  add the path colors to Accum/AccumSq
+* Queues are compacted with atomic counters, so a work-group past a queue's count quits at once.
+* wf_extend adds the length of its queue to rayCounts, wf_shadow the slots each item tests.
+* Each depth has its own counters (queueCounts[depth * QUEUE_KINDS + queue]), so none has to
+* be reset while a kernel reads it. Shadow ray slots are path * lightSamples + sample,
+* the w of their direction holds the sampled light.
+*/
+#define QUEUE_EXTEND	0
+#define QUEUE_SHADE		1
+#define QUEUE_SHADOW	2
+#define QUEUE_KINDS		3
+
+static float4 makeFloat4(const float x, const float y, const float z, const float w)
+{
+	float4 v;
+	v.x = x; v.y = y; v.z = z; v.w = w;
+	return v;
+}
+
+static void initSceneData(SceneData* scene, OCL_CONSTANT_BUFFER const CompiledLight* lights,
+	const unsigned int lightcount, OCL_CONSTANT_BUFFER const CompiledPlane* planes,
+	const unsigned int planecount, __global const BVHNode* nodes, const unsigned int nodeCount,
+	__global const unsigned int* primRefs, __global const Point* vertices,
+	__global const Triangle* triangles, __global const Color* meshColors,
+	__global const float* primData, const PrimitiveLayout primLayout, __global const Color* materials,
+	__global const LightAlias* lightAlias, __global const LightNode* lightNodes, const unsigned int lightNodeCount,
+	__global const unsigned int* lightTrails, const unsigned int lightSamples)
+{
+	scene->lights = lights;
+	scene->lightcount = lightcount;
+	scene->planes = planes;
+	scene->planecount = planecount;
+	scene->nodes = nodes;
+	scene->nodeCount = nodeCount;
+	scene->primRefs = primRefs;
+	scene->vertices = vertices;
+	scene->triangles = triangles;
+	scene->meshColors = meshColors;
+	scene->primData = primData;
+	scene->primLayout = primLayout;
+	scene->materials = materials;
+	scene->lightAlias = lightAlias;
+	scene->lightNodes = lightNodes;
+	scene->lightNodeCount = lightNodeCount;
+	scene->lightTrails = lightTrails;
+	scene->lightSamples = lightSamples;
+}
+
+static void initIntersection(Intersection* intersection, const float4 origin, const float4 direction)
+{
+	Ray ray;
+	vinit(ray.m_origin, origin.x, origin.y, origin.z);
+	vinit(ray.m_direction, direction.x, direction.y, direction.z);
+	ray.m_tMax = origin.w;
+	initRayIntersection(intersection, ray);
+}
+
+__kernel void wf_generate(OCL_CONSTANT_BUFFER const CompiledCamera* cam,
+	const unsigned int imageWidth, const unsigned int imageHeight, const unsigned int maxDepth,
+	__global const unsigned int* pixelList, const unsigned int first, const unsigned int pathCount,
+	__global unsigned int* seeds, __global unsigned int* pathPixel,
+	__global float4* rayOrigin, __global float4* rayDirection, __global float4* pathRadiance,
+	__global float4* pathThroughput, __global unsigned int* extendQueue, __global unsigned int* queueCounts)
+{
+	const unsigned int path = get_global_id(0);
+
+	// The kernels of the previous wave are done, so the counters can be reset here
+	if (path == 0)
+	{
+		for (unsigned int i = 0; i < (maxDepth + 1) * QUEUE_KINDS; i++)
+		{
+			queueCounts[i] = 0;
+		}
+		queueCounts[QUEUE_EXTEND] = pathCount;
+	}
+	if (path >= pathCount)
+		return;
+
+	const unsigned int width = IMAGE_WIDTH(imageWidth);
+	const unsigned int height = IMAGE_HEIGHT(imageHeight);
+	const unsigned int pixel = pixelList[first + path];
+	const int y = pixel / width;
+	const int x = pixel % width;
+
+	unsigned int seed0 = seeds[2*path];
+	unsigned int seed1 = seeds[2*path + 1];
+	float yu = 1.0f - ((y + GetRandom(&seed0, &seed1)) / (height - 1));
+	float xu = (x + GetRandom(&seed0, &seed1)) / (width - 1);
+	seeds[2*path] = seed0;
+	seeds[2*path + 1] = seed1;
+
+	Ray ray = makeCameraRay(cam, xu, yu);
+	pathPixel[path] = pixel;
+	rayOrigin[path] = makeFloat4(ray.m_origin.x, ray.m_origin.y, ray.m_origin.z, ray.m_tMax);
+	rayDirection[path] = makeFloat4(ray.m_direction.x, ray.m_direction.y, ray.m_direction.z, 0.0f);
+	pathRadiance[path] = makeFloat4(0.0f, 0.0f, 0.0f, 0.0f);
+	// w is the density of the bounce that made the ray, 0 for camera rays (see emissionWeight)
+	pathThroughput[path] = makeFloat4(1.0f, 1.0f, 1.0f, 0.0f);
+	extendQueue[path] = path;
+}
+
+__kernel void wf_extend(OCL_CONSTANT_BUFFER const CompiledLight* lights,
+	const unsigned int lightcount, OCL_CONSTANT_BUFFER const CompiledPlane* planes,
+	const unsigned int planecount, __global const BVHNode* nodes, const unsigned int nodeCount,
+	__global const unsigned int* primRefs, __global const Point* vertices,
+	__global const Triangle* triangles, __global const Color* meshColors,
+	__global const float* primData, const PrimitiveLayout primLayout, __global const Color* materials,
+	__global const LightAlias* lightAlias, __global const LightNode* lightNodes, const unsigned int lightNodeCount,
+	__global const unsigned int* lightTrails, const unsigned int lightSamples, const unsigned int depth, const unsigned int maxDepth,
+	__global const float4* rayOrigin, __global const float4* rayDirection, __global const float4* pathThroughput,
+	__global const unsigned int* extendQueue, __global float4* pathRadiance,
+	__global float4* hitNormal, __global float4* hitColor,
+	__global unsigned int* shadeQueue, __global unsigned int* queueCounts, __global volatile unsigned int* rayCounts)
+{
+	const unsigned int index = get_global_id(0);
+	if (index >= queueCounts[depth * QUEUE_KINDS + QUEUE_EXTEND])
+		return;
+	if (index == 0)
+		atomic_add(&rayCounts[RAY_COUNT_CLOSEST], queueCounts[depth * QUEUE_KINDS + QUEUE_EXTEND]);
+
+	SceneData scene;
+	initSceneData(&scene, lights, lightcount, planes, planecount, nodes, nodeCount,
+		primRefs, vertices, triangles, meshColors, primData, primLayout, materials,
+		lightAlias, lightNodes, lightNodeCount, lightTrails, lightSamples);
+
+	const unsigned int path = extendQueue[index];
+	Intersection intersection;
+	initIntersection(&intersection, rayOrigin[path], rayDirection[path]);
+	if (!intersect(&intersection, &scene))
+		return;
+
+	// Lights don't reflect, so a path ends on them
+	if (intersection.lastindex >= 0)
+	{
+		// The previous hit's normal is still in hitNormal, its position is the ray origin
+		const float4 throughput = pathThroughput[path];
+		const float4 lastNormal4 = hitNormal[path];
+		Vector lastNormal;
+		vinit(lastNormal, lastNormal4.x, lastNormal4.y, lastNormal4.z);
+		float weight = emissionWeight(&scene, intersection.lastindex, &intersection.m_ray, intersection.m_t,
+			lastNormal, throughput.w);
+		float4 radiance = pathRadiance[path];
+		radiance.x += throughput.x * intersection.m_emitted.x * weight;
+		radiance.y += throughput.y * intersection.m_emitted.y * weight;
+		radiance.z += throughput.z * intersection.m_emitted.z * weight;
+		pathRadiance[path] = radiance;
+		return;
+	}
+
+	if (depth >= maxDepth)
+		return;
+
+	hitNormal[path] = makeFloat4(intersection.m_normal.x, intersection.m_normal.y, intersection.m_normal.z, intersection.m_t);
+	hitColor[path] = makeFloat4(intersection.m_color.x, intersection.m_color.y, intersection.m_color.z, 0.0f);
+	shadeQueue[atomic_inc(&queueCounts[depth * QUEUE_KINDS + QUEUE_SHADE])] = path;
+}
+
+__kernel void wf_shade(OCL_CONSTANT_BUFFER const CompiledLight* lights,
+	const unsigned int lightcount, OCL_CONSTANT_BUFFER const CompiledPlane* planes,
+	const unsigned int planecount, __global const BVHNode* nodes, const unsigned int nodeCount,
+	__global const unsigned int* primRefs, __global const Point* vertices,
+	__global const Triangle* triangles, __global const Color* meshColors,
+	__global const float* primData, const PrimitiveLayout primLayout, __global const Color* materials,
+	__global const LightAlias* lightAlias, __global const LightNode* lightNodes, const unsigned int lightNodeCount,
+	__global const unsigned int* lightTrails, const unsigned int lightSamples,
+	const unsigned int depth, __global unsigned int* seeds, __global float4* rayOrigin, __global float4* rayDirection,
+	__global float4* pathThroughput, __global const float4* hitNormal, __global const float4* hitColor,
+	__global const unsigned int* shadeQueue, __global float4* shadowOrigin, __global float4* shadowDirection,
+	__global float4* shadowContribution, __global unsigned int* shadowQueue,
+	__global unsigned int* extendQueue, __global unsigned int* queueCounts)
+{
+	const unsigned int index = get_global_id(0);
+	if (index >= queueCounts[depth * QUEUE_KINDS + QUEUE_SHADE])
+		return;
+
+	SceneData scene;
+	initSceneData(&scene, lights, lightcount, planes, planecount, nodes, nodeCount,
+		primRefs, vertices, triangles, meshColors, primData, primLayout, materials,
+		lightAlias, lightNodes, lightNodeCount, lightTrails, lightSamples);
+
+	const unsigned int path = shadeQueue[index];
+	const float4 normal4 = hitNormal[path];
+	const float4 color4 = hitColor[path];
+	const float4 throughput4 = pathThroughput[path];
+
+	Intersection intersection;
+	initIntersection(&intersection, rayOrigin[path], rayDirection[path]);
+	intersection.m_t = normal4.w;
+	vinit(intersection.m_normal, normal4.x, normal4.y, normal4.z);
+	vinit(intersection.m_color, color4.x, color4.y, color4.z);
+	Point position = offsetHitPoint(&intersection);
+
+	Color throughput;
+	vinit(throughput, throughput4.x, throughput4.y, throughput4.z);
+
+	unsigned int seed0 = seeds[2*path];
+	unsigned int seed1 = seeds[2*path + 1];
+
+	// Slots of samples that can't contribute keep w = 0, wf_shadow skips them
+	bool anyLight = false;
+	for (unsigned int s = 0; s < lightSamples; s++)
+	{
+		const unsigned int slot = path * lightSamples + s;
+		Ray shadowRay;
+		Color contribution;
+		float pmf;
+		const int j = selectLight(&scene, position, intersection.m_normal, GetRandom(&seed0, &seed1), &pmf);
+		float u1 = GetRandom(&seed0, &seed1);
+		float u2 = GetRandom(&seed0, &seed1);
+		if (j < 0 || !sampleLight(&lights[j], u1, u2, pmf * lightSamples, position, intersection.m_normal,
+			intersection.m_color, &shadowRay, &contribution))
+		{
+			shadowContribution[slot] = makeFloat4(0.0f, 0.0f, 0.0f, 0.0f);
+			continue;
+		}
+
+		vmul(contribution, contribution, throughput);
+		shadowOrigin[slot] = makeFloat4(shadowRay.m_origin.x, shadowRay.m_origin.y, shadowRay.m_origin.z, shadowRay.m_tMax);
+		shadowDirection[slot] = makeFloat4(shadowRay.m_direction.x, shadowRay.m_direction.y, shadowRay.m_direction.z, (float)j);
+		shadowContribution[slot] = makeFloat4(contribution.x, contribution.y, contribution.z, 1.0f);
+		anyLight = true;
+	}
+	if (anyLight)
+	{
+		shadowQueue[atomic_inc(&queueCounts[depth * QUEUE_KINDS + QUEUE_SHADOW])] = path;
+	}
+
+	if (russianRoulette(depth, &throughput, &seed0, &seed1))
+	{
+		float u1 = GetRandom(&seed0, &seed1);
+		float u2 = GetRandom(&seed0, &seed1);
+		Vector direction = sampleCosineHemisphere(intersection.m_normal, u1, u2);
+		float bsdfPdf = vdot(intersection.m_normal, direction) * INV_PI;
+		if (bsdfPdf > 0.0f)
+		{
+			vmul(throughput, throughput, intersection.m_color);
+			rayOrigin[path] = makeFloat4(position.x, position.y, position.z, RAYMAX);
+			rayDirection[path] = makeFloat4(direction.x, direction.y, direction.z, 0.0f);
+			pathThroughput[path] = makeFloat4(throughput.x, throughput.y, throughput.z, bsdfPdf);
+			extendQueue[atomic_inc(&queueCounts[(depth + 1) * QUEUE_KINDS + QUEUE_EXTEND])] = path;
+		}
+	}
+
+	seeds[2*path] = seed0;
+	seeds[2*path + 1] = seed1;
+}
+
+// One work item per queued path tests all of its shadow slots, so only it adds to the path radiance
+__kernel void wf_shadow(OCL_CONSTANT_BUFFER const CompiledLight* lights,
+	const unsigned int lightcount, OCL_CONSTANT_BUFFER const CompiledPlane* planes,
+	const unsigned int planecount, __global const BVHNode* nodes, const unsigned int nodeCount,
+	__global const unsigned int* primRefs, __global const Point* vertices,
+	__global const Triangle* triangles, __global const Color* meshColors,
+	__global const float* primData, const PrimitiveLayout primLayout, __global const Color* materials,
+	__global const LightAlias* lightAlias, __global const LightNode* lightNodes, const unsigned int lightNodeCount,
+	__global const unsigned int* lightTrails, const unsigned int lightSamples, const unsigned int depth, __global const float4* shadowOrigin, __global const float4* shadowDirection,
+	__global const float4* shadowContribution, __global const unsigned int* shadowQueue,
+	__global float4* pathRadiance, __global const unsigned int* queueCounts, __global volatile unsigned int* rayCounts)
+{
+	const unsigned int index = get_global_id(0);
+	if (index >= queueCounts[depth * QUEUE_KINDS + QUEUE_SHADOW])
+		return;
+
+	SceneData scene;
+	initSceneData(&scene, lights, lightcount, planes, planecount, nodes, nodeCount,
+		primRefs, vertices, triangles, meshColors, primData, primLayout, materials,
+		lightAlias, lightNodes, lightNodeCount, lightTrails, lightSamples);
+
+	const unsigned int path = shadowQueue[index];
+	float4 radiance = pathRadiance[path];
+	unsigned int shadowRays = 0;
+	for (unsigned int s = 0; s < lightSamples; s++)
+	{
+		const unsigned int slot = path * lightSamples + s;
+		const float4 contribution = shadowContribution[slot];
+		if (contribution.w == 0.0f)
+			continue;
+		shadowRays++;
+
+		const float4 origin = shadowOrigin[slot];
+		const float4 direction = shadowDirection[slot];
+		Ray shadowRay;
+		vinit(shadowRay.m_origin, origin.x, origin.y, origin.z);
+		vinit(shadowRay.m_direction, direction.x, direction.y, direction.z);
+		shadowRay.m_tMax = origin.w;
+		if (!occluded(&scene, &shadowRay, shadowRay.m_tMax, (int)direction.w))
+		{
+			radiance.x += contribution.x;
+			radiance.y += contribution.y;
+			radiance.z += contribution.z;
+		}
+	}
+	pathRadiance[path] = radiance;
+	atomic_add(&rayCounts[RAY_COUNT_SHADOW], shadowRays);
+}
+
+__kernel void wf_accumulate(const unsigned int pathCount,
+	__global const unsigned int* pathPixel, __global const float4* pathRadiance,
+	__global float4* accum, __global float* accumSq,
+	__global unsigned int* pixels, const unsigned int writePixels)
+{
+	const unsigned int path = get_global_id(0);
+	if (path >= pathCount)
+		return;
+
+	const float4 color = pathRadiance[path];
+
+	// A pixel has at most one path per wave, so no other work item touches its sums
+	const unsigned int pixel = pathPixel[path];
+	float4 sum = accum[pixel];
+	sum.x += color.x;
+	sum.y += color.y;
+	sum.z += color.z;
+	sum.w += 1.0f;
+	accum[pixel] = sum;
+
+	float luminance = vluminance(color);
+	accumSq[pixel] += luminance * luminance;
+
+	if (writePixels)
+		pixels[pixel] = packMean(sum);
+}
@@ -38,20 +38,109 @@ typedef struct Plane{
 	Color m_color;
 }Plane;
 
+// Indexed triangle; m_v0..m_v2 index the shared vertex list, m_mesh the mesh color table
+typedef struct Triangle{
+	unsigned int m_v0, m_v1, m_v2;
+	unsigned int m_mesh;
+}Triangle;
+
+// Offsets (in floats) of the structure-of-arrays streams of the analytic primitives in
+// one packed buffer. Vector streams hold all x, then all y, then all z of their type;
+// material streams hold material table indices stored as floats.
+typedef struct PrimitiveLayout{
+	unsigned int m_sphereCount;
+	unsigned int m_sphereCenter, m_sphereRadius, m_sphereMaterial;
+	unsigned int m_discCount;
+	unsigned int m_discCenter, m_discNormal, m_discRadius, m_discMaterial;
+	unsigned int m_boxCount;
+	unsigned int m_boxMin, m_boxMax, m_boxMaterial;
+}PrimitiveLayout;
+
 typedef struct SphereSet{
 	RectangleLight* m_rectLight;
 	int LightCount;
 	Plane* m_plane;
 	int PlaneCount;
+	Point* m_vertices;
+	int VertexCount;
+	Triangle* m_triangle;
+	int TriangleCount;
+	Color* m_meshColor;
+	int MeshCount;
+	float* m_primData;			// spheres, discs and boxes, see PrimitiveLayout
+	int PrimDataSize;			// in floats
+	PrimitiveLayout m_primLayout;
+	Color* m_material;
+	int MaterialCount;
 }SphereSet;
 
+// Flattened BVH node, stored depth-first: the first child of an interior node
+// directly follows its parent, m_offset points at the second one.
+typedef struct BVHNode{
+	float m_boundsMin[3];
+	int m_offset;		// leaf: first entry in the primitive reference list, interior: second child
+	float m_boundsMax[3];
+	int m_primCount;	// 0 for interior nodes
+}BVHNode;
+
 typedef struct Camera{
 	float fieldOfViewInDegrees;
 	Point origin;
 	Vector target;
 	Vector targetUpDirection;
+	float aspectRatio;          // image width / height
 }Camera;
 
+// Device records written by CompileScene: everything a ray needs that doesn't
+// change between samples is computed once on the host.
+
+typedef struct CompiledLight{
+	Point m_pos;
+	Vector m_side1, m_side2;
+	Vector m_normal;			// unit normal of m_side1 x m_side2
+	Vector m_side1Inv;			// m_side1 / |m_side1|^2, dot with (p - m_pos) gives 0..1 across the light
+	Vector m_side2Inv;
+	Color m_emitted;			// m_power * m_color
+	float m_planeDistance;		// dot(m_normal, m_pos)
+	float m_area;				// |m_side1 x m_side2|, turns the uniform area density into a solid angle one
+}CompiledLight;
+
+typedef struct CompiledPlane{
+	Vector m_normal;
+	float m_distance;			// dot(m_normal, m_pos)
+	Color m_color;
+}CompiledPlane;
+
+// Walker alias table entry of the light selection: entry i picks light i with
+// probability m_threshold and light m_alias otherwise
+typedef struct LightAlias{
+	float m_threshold;
+	unsigned int m_alias;
+	float m_pdf;				// probability that light i is picked at all
+}LightAlias;
+
+// Node of the light BVH, flattened depth-first like BVHNode. The box bounds the light
+// corners, the cone (m_axis, m_cosTheta) the light normals of the subtree; lights are
+// two-sided, so the cone holds for the negated normals as well.
+typedef struct LightNode{
+	float m_boundsMin[3];
+	int m_offset;				// leaf: light index, interior: second child
+	float m_boundsMax[3];
+	int m_lightCount;			// 1 for leaves, 0 for interior nodes
+	float m_axis[3];
+	float m_cosTheta;			// cosine of the half angle of the normal cone
+	float m_energy;				// summed flux of the lights below
+}LightNode;
+
+// A camera ray through screen position (x, y) in 0..1 is
+// m_forward + (x - 0.5) * m_right + (y - 0.5) * m_up, normalized
+typedef struct CompiledCamera{
+	Point m_origin;
+	Vector m_forward;
+	Vector m_right;				// scaled by tan(fieldOfViewInDegrees)
+	Vector m_up;				// scaled by tan(fieldOfViewInDegrees)
+}CompiledCamera;
+
 }
 
 #endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+
+#include "readback.h"
+
+ReadbackPipeline::ReadbackPipeline() :
+	transferQueue(NULL),
+	imageSize(0),
+	width(0),
+	height(0),
+	writer(NULL),
+	profiler(NULL),
+	next(0)
+{
+	for (unsigned int i = 0; i < READBACK_SLOTS; i++)
+	{
+		slots[i].staging = NULL;
+		slots[i].pinned = NULL;
+		slots[i].host = NULL;
+		slots[i].ready = NULL;
+		slots[i].floatImage = false;
+	}
+}
+
+ReadbackPipeline::~ReadbackPipeline()
+{
+	// The reads in flight write to the pinned memory, so they have to end before it goes
+	if (transferQueue)
+	{
+		clFinish(transferQueue);
+	}
+
+	for (unsigned int i = 0; i < READBACK_SLOTS; i++)
+	{
+		ReadbackSlot& slot = slots[i];
+		if (slot.ready)
+		{
+			clReleaseEvent(slot.ready);
+		}
+		if (slot.host)
+		{
+			clEnqueueUnmapMemObject(transferQueue, slot.pinned, slot.host, 0, NULL, NULL);
+		}
+	}
+	if (transferQueue)
+	{
+		clFinish(transferQueue);
+	}
+
+	for (unsigned int i = 0; i < READBACK_SLOTS; i++)
+	{
+		cl_mem buffers[] = { slots[i].staging, slots[i].pinned };
+		for (size_t b = 0; b < sizeof(buffers) / sizeof(buffers[0]); b++)
+		{
+			if (buffers[b] && CL_SUCCESS != clReleaseMemObject(buffers[b]))
+			{
+				printf("Error: clReleaseMemObject failed for a read back buffer.\n");
+			}
+		}
+	}
+
+	if (transferQueue && CL_SUCCESS != clReleaseCommandQueue(transferQueue))
+	{
+		printf("Error: clReleaseCommandQueue failed for the transfer queue.\n");
+	}
+}
+
+cl_int CreateReadback(ReadbackPipeline* rb, cl_context context, cl_command_queue transferQueue, size_t imageSize,
+	cl_uint width, cl_uint height, RAYTRACING::ImageWriter* writer, Profiler* profiler)
+{
+	cl_int err = CL_SUCCESS;
+
+	rb->transferQueue = transferQueue;
+	rb->imageSize = imageSize;
+	rb->width = width;
+	rb->height = height;
+	rb->writer = writer;
+	rb->profiler = profiler;
+
+	for (unsigned int i = 0; i < READBACK_SLOTS; i++)
+	{
+		ReadbackSlot& slot = rb->slots[i];
+		slot.staging = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, imageSize, NULL, &err);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clCreateBuffer for a staging buffer returned %s\n", TranslateOpenCLError(err));
+			return err;
+		}
+
+		// Memory the runtime allocates for the host can be pinned, so the read is a straight DMA
+		slot.pinned = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, imageSize, NULL, &err);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clCreateBuffer for a pinned buffer returned %s\n", TranslateOpenCLError(err));
+			return err;
+		}
+
+		slot.host = clEnqueueMapBuffer(transferQueue, slot.pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, imageSize, 0, NULL, NULL, &err);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: clEnqueueMapBuffer for a pinned buffer returned %s\n", TranslateOpenCLError(err));
+			slot.host = NULL;
+			return err;
+		}
+	}
+
+	return CL_SUCCESS;
+}
+
+// Wait for the read of slot if asked to, hand the image to the writer and free the slot
+static cl_int FinishSlot(ReadbackPipeline* rb, ReadbackSlot* slot, bool wait, bool* done)
+{
+	cl_int err = CL_SUCCESS;
+	*done = false;
+
+	if (wait)
+	{
+		err = clWaitForEvents(1, &slot->ready);
+	}
+	else
+	{
+		cl_int status = CL_QUEUED;
+		err = clGetEventInfo(slot->ready, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+		if (CL_SUCCESS == err && status < 0)
+			err = status;
+		if (CL_SUCCESS == err && status != CL_COMPLETE)
+			return CL_SUCCESS;
+	}
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: The read back of %s failed, returned %s\n", slot->fileName.c_str(), TranslateOpenCLError(err));
+		return err;
+	}
+
+	// Write copies the image, so the slot can take the next one right away
+	if (slot->floatImage)
+		rb->writer->Write(slot->fileName.c_str(), NULL, (const float*)slot->host, rb->width, rb->height);
+	else
+		rb->writer->Write(slot->fileName.c_str(), (const unsigned int*)slot->host, NULL, rb->width, rb->height);
+
+	clReleaseEvent(slot->ready);
+	slot->ready = NULL;
+	*done = true;
+	return CL_SUCCESS;
+}
+
+cl_int CollectReadbacks(ReadbackPipeline* rb, bool wait)
+{
+	// From the oldest image to the newest, so the files are written in order
+	for (unsigned int i = 0; i < READBACK_SLOTS; i++)
+	{
+		ReadbackSlot* slot = &rb->slots[(rb->next + i) % READBACK_SLOTS];
+		if (!slot->ready)
+			continue;
+
+		bool done = false;
+		cl_int err = FinishSlot(rb, slot, wait, &done);
+		if (CL_SUCCESS != err)
+			return err;
+		if (!done)
+			break;
+	}
+	return CL_SUCCESS;
+}
+
+void DiscardReadbacks(ReadbackPipeline* rb)
+{
+	if (rb->transferQueue)
+	{
+		clFinish(rb->transferQueue);
+	}
+	for (unsigned int i = 0; i < READBACK_SLOTS; i++)
+	{
+		ReadbackSlot& slot = rb->slots[i];
+		if (slot.ready)
+		{
+			clReleaseEvent(slot.ready);
+			slot.ready = NULL;
+		}
+	}
+	rb->next = 0;
+}
+
+cl_int QueueReadback(ReadbackPipeline* rb, cl_command_queue computeQueue, cl_mem image, bool floatImage,
+	const char* fileName)
+{
+	cl_int err = CL_SUCCESS;
+	size_t size = floatImage ? sizeof(cl_float) * 4 * rb->width * rb->height : sizeof(cl_uint) * rb->width * rb->height;
+	if (size > rb->imageSize)
+	{
+		printf("Error: An image of %u bytes doesn't fit the read back slots.\n", (unsigned int)size);
+		return CL_INVALID_BUFFER_SIZE;
+	}
+
+	// Previews that are done go to the writer now rather than when their slot comes round again
+	if (CL_SUCCESS != (err = CollectReadbacks(rb, false)))
+		return err;
+
+	ReadbackSlot* slot = &rb->slots[rb->next];
+	if (slot->ready)
+	{
+		bool done = false;
+		if (CL_SUCCESS != (err = FinishSlot(rb, slot, true, &done)))
+			return err;
+	}
+
+	// The device copy sits in the compute queue between this pass and the next
+	cl_event copied = NULL;
+	err = clEnqueueCopyBuffer(computeQueue, image, slot->staging, 0, 0, size, 0, NULL, &copied);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueCopyBuffer to a staging buffer returned %s\n", TranslateOpenCLError(err));
+		return err;
+	}
+	ProfileKeepEvent(rb->profiler, floatImage ? "copy Accum" : "copy Pixels", copied);
+	clFlush(computeQueue);
+
+	err = clEnqueueReadBuffer(rb->transferQueue, slot->staging, CL_FALSE, 0, size, slot->host, 1, &copied, &slot->ready);
+	clReleaseEvent(copied);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clEnqueueReadBuffer from a staging buffer returned %s\n", TranslateOpenCLError(err));
+		slot->ready = NULL;
+		return err;
+	}
+	ProfileKeepEvent(rb->profiler, floatImage ? "read Accum" : "read Pixels", slot->ready);
+	clFlush(rb->transferQueue);
+
+	slot->fileName = fileName;
+	slot->floatImage = floatImage;
+	rb->next = (rb->next + 1) % READBACK_SLOTS;
+	return CL_SUCCESS;
+}
@@ -0,0 +1,71 @@
+// Double-buffered image read back: pass N goes to the host while pass N+1 renders
+//
+#ifndef __READBACK_H__
+#define __READBACK_H__
+
+#include <string>
+
+#include "ocl_common.h"
+#include "profiler.h"
+#include "image_writer.h"
+
+#define READBACK_SLOTS	2
+
+/*
+* One image on its way to the host: a device-side copy of it and the pinned host memory
+* the copy is read into
+*/
+struct ReadbackSlot
+{
+	cl_mem       staging;        // device buffer the image is copied to on the compute queue
+	cl_mem       pinned;         // CL_MEM_ALLOC_HOST_PTR buffer, mapped for as long as the pipeline lives
+	void*        host;           // its mapped pointer, which the transfer queue reads staging into
+	cl_event     ready;          // the read into host; NULL while the slot is free
+	std::string  fileName;
+	bool         floatImage;     // host holds float4 sums, else packed pixels
+};
+
+/*
+* Reads images back without holding up the compute queue. The image is copied on the device
+* right behind the commands that wrote it (the queue is in order, so the next pass can't touch
+* it before), then a second queue reads the copy into pinned memory while the compute queue goes
+* on. Finished reads go to the ImageWriter, which encodes and writes them on its own thread.
+* The slots take turns, so two images can be on their way at a time.
+*/
+struct ReadbackPipeline
+{
+	ReadbackPipeline();
+	~ReadbackPipeline();            // waits for the reads in flight, then releases everything
+
+	cl_command_queue transferQueue;
+	size_t           imageSize;     // bytes of the largest image the slots take
+	cl_uint          width;
+	cl_uint          height;
+	RAYTRACING::ImageWriter* writer;
+	Profiler*        profiler;      // times the copies and reads if set and enabled
+	ReadbackSlot     slots[READBACK_SLOTS];
+	unsigned int     next;          // slot of the next image; also the oldest one in flight
+};
+
+/*
+* Set up the slots for images of up to imageSize bytes. transferQueue is a second queue on the
+* compute queue's device; the pipeline releases it.
+*/
+cl_int CreateReadback(ReadbackPipeline* rb, cl_context context, cl_command_queue transferQueue, size_t imageSize,
+	cl_uint width, cl_uint height, RAYTRACING::ImageWriter* writer, Profiler* profiler);
+
+/*
+* Queue image (packed pixels, or float4 sums for floatImage), as the commands queued on
+* computeQueue so far leave it, to be written to fileName. Only waits if both slots are
+* still busy, for the older one.
+*/
+cl_int QueueReadback(ReadbackPipeline* rb, cl_command_queue computeQueue, cl_mem image, bool floatImage,
+	const char* fileName);
+
+// Hand the images whose read is complete to the writer, oldest first; with wait, all of them
+cl_int CollectReadbacks(ReadbackPipeline* rb, bool wait);
+
+// Drop the images still on their way, e.g. of a job that was cancelled, so the slots can be reused
+void DiscardReadbacks(ReadbackPipeline* rb);
+
+#endif
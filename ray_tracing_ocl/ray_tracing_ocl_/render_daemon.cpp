@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+
+#include "render_daemon.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#define CloseSocket	closesocket
+#else
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define INVALID_SOCKET	(-1)
+#define CloseSocket	close
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+namespace RAYTRACING
+{
+
+// A client that has gone away only loses its reply; the daemon mustn't die of SIGPIPE
+static void SendLine(DaemonSocket client, const std::string& line)
+{
+	std::string text = line + "\n";
+	size_t sent = 0;
+	while (sent < text.size())
+	{
+		int count = (int)send(client, text.c_str() + sent, (int)(text.size() - sent), MSG_NOSIGNAL);
+		if (count <= 0)
+			return;
+		sent += (size_t)count;
+	}
+}
+
+// 1 if path is a socket file, 0 if nothing is there, -1 if it is anything else
+static int SocketFileState(const char* path)
+{
+#ifdef _WIN32
+	// AF_UNIX socket files are reparse points on Windows
+	DWORD attributes = GetFileAttributesA(path);
+	if (attributes == INVALID_FILE_ATTRIBUTES)
+		return 0;
+	return (attributes & FILE_ATTRIBUTE_REPARSE_POINT) ? 1 : -1;
+#else
+	struct stat status;
+	if (lstat(path, &status) != 0)
+		return 0;
+	return S_ISSOCK(status.st_mode) ? 1 : -1;
+#endif
+}
+
+// A connection whose request line hasn't come in completely yet
+struct PendingClient
+{
+	DaemonSocket socket;
+	std::string  text;
+	std::chrono::steady_clock::time_point since;
+};
+
+// A reply that goes out once m_lock is released; close ends the connection after it
+struct DaemonReply
+{
+	DaemonSocket socket;
+	std::string  line;
+	bool         close;
+};
+
+static void SendReplies(const std::vector<DaemonReply>& replies)
+{
+	for (size_t r = 0; r < replies.size(); r++)
+	{
+		SendLine(replies[r].socket, replies[r].line);
+		if (replies[r].close)
+			CloseSocket(replies[r].socket);
+	}
+}
+
+RenderDaemon::RenderDaemon() :
+		m_listener(INVALID_SOCKET),
+		m_running(NULL),
+		m_nextId(1),
+		m_ownsSocketFile(false),
+		m_shutdown(false),
+		m_stop(false)
+{
+}
+
+RenderDaemon::~RenderDaemon()
+{
+	m_stop = true;
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+	if (m_listener != INVALID_SOCKET)
+	{
+		CloseSocket(m_listener);
+	}
+	if (m_ownsSocketFile && SocketFileState(m_socketPath.c_str()) == 1)
+	{
+		remove(m_socketPath.c_str());
+	}
+
+	for (size_t j = 0; j < m_queue.size(); j++)
+	{
+		char reply[64];
+		snprintf(reply, sizeof(reply), "cancelled %u", m_queue[j]->id);
+		SendLine(m_queue[j]->client, reply);
+		CloseSocket(m_queue[j]->client);
+		delete m_queue[j];
+	}
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+bool RenderDaemon::Listen(const char* socketPath)
+{
+#ifdef _WIN32
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+	{
+		printf("Error: WSAStartup failed.\n");
+		return false;
+	}
+#endif
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path))
+	{
+		printf("Error: The socket path '%s' is too long.\n", socketPath);
+		return false;
+	}
+	memcpy(address.sun_path, socketPath, strlen(socketPath) + 1);
+
+	m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_listener == INVALID_SOCKET)
+	{
+		printf("Error: Couldn't create a Unix domain socket.\n");
+		return false;
+	}
+
+	// The socket file of a daemon that didn't shut down cleanly is in the way of bind; anything else stays
+	int state = SocketFileState(socketPath);
+	if (state < 0)
+	{
+		printf("Error: '%s' exists and is not a socket.\n", socketPath);
+		CloseSocket(m_listener);
+		m_listener = INVALID_SOCKET;
+		return false;
+	}
+	if (state > 0)
+		remove(socketPath);
+	bool bound = bind(m_listener, (const sockaddr*)&address, sizeof(address)) == 0;
+	if (!bound || listen(m_listener, SOMAXCONN) != 0)
+	{
+		printf("Error: Couldn't listen on '%s'.\n", socketPath);
+		CloseSocket(m_listener);
+		m_listener = INVALID_SOCKET;
+		if (bound)
+			remove(socketPath);
+		return false;
+	}
+	m_socketPath = socketPath;
+	m_ownsSocketFile = true;
+
+	m_thread = std::thread(&RenderDaemon::ListenLoop, this);
+	return true;
+}
+
+/*
+* One select over the listener and every connection that is still sending its request, so a slow
+* or idle client holds up nobody. Whatever has arrived is read into the connection's buffer; the
+* request is handled once its newline is in.
+*/
+void RenderDaemon::ListenLoop()
+{
+	std::vector<PendingClient> pending;
+	while (!m_stop)
+	{
+		// Look up every 100 ms, so the destructor doesn't wait on select
+		fd_set ready;
+		FD_ZERO(&ready);
+		FD_SET(m_listener, &ready);
+		DaemonSocket highest = m_listener;
+		for (size_t c = 0; c < pending.size(); c++)
+		{
+			FD_SET(pending[c].socket, &ready);
+			highest = std::max(highest, pending[c].socket);
+		}
+		timeval timeout = { 0, 100000 };
+		int count = select((int)highest + 1, &ready, NULL, NULL, &timeout);
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for (size_t c = pending.size(); c-- > 0; )
+		{
+			PendingClient& client = pending[c];
+			bool drop = now - client.since > std::chrono::seconds(DAEMON_REQUEST_SECONDS);
+			if (count > 0 && FD_ISSET(client.socket, &ready))
+			{
+				char data[512];
+				int received = (int)recv(client.socket, data, sizeof(data), 0);
+				if (received > 0)
+					client.text.append(data, (size_t)received);
+				size_t newline = client.text.find('\n');
+				if (newline != std::string::npos)
+				{
+					std::string line = client.text.substr(0, newline);
+					line.erase(line.find_last_not_of("\r") + 1);
+					DaemonSocket socket = client.socket;
+					pending.erase(pending.begin() + c);
+					HandleRequest(socket, line);
+					continue;
+				}
+				drop = drop || received <= 0 || client.text.size() >= DAEMON_MAX_LINE;
+			}
+			if (drop)
+			{
+				CloseSocket(client.socket);
+				pending.erase(pending.begin() + c);
+			}
+		}
+
+		// The fd_set of select has room for FD_SETSIZE sockets, the listener among them
+		if (count > 0 && FD_ISSET(m_listener, &ready))
+		{
+			DaemonSocket socket = accept(m_listener, NULL, NULL);
+			bool full = pending.size() + 1 >= FD_SETSIZE;
+#ifndef _WIN32
+			full = full || socket >= FD_SETSIZE;   // a POSIX fd_set is indexed by the descriptor
+#endif
+			if (socket != INVALID_SOCKET && full)
+			{
+				SendLine(socket, "error: busy");
+				CloseSocket(socket);
+			}
+			else if (socket != INVALID_SOCKET)
+			{
+				// Replies are short, but a client that never reads mustn't block a send for good
+#ifdef _WIN32
+				DWORD sendTimeout = DAEMON_REQUEST_SECONDS * 1000;
+#else
+				timeval sendTimeout = { DAEMON_REQUEST_SECONDS, 0 };
+#endif
+				setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&sendTimeout, sizeof(sendTimeout));
+				PendingClient client = { socket, std::string(), now };
+				pending.push_back(client);
+			}
+		}
+	}
+
+	for (size_t c = 0; c < pending.size(); c++)
+	{
+		CloseSocket(pending[c].socket);
+	}
+}
+
+void RenderDaemon::HandleRequest(DaemonSocket client, const std::string& line)
+{
+	std::istringstream fields(line);
+	std::string request;
+	fields >> request;
+	std::vector<std::string> args;
+	for (std::string arg; fields >> arg; )
+	{
+		args.push_back(arg);
+	}
+
+	// Only this thread adds jobs and sets m_shutdown, so they can be read here without the lock
+	char reply[128];
+	if (request == "render" && !m_shutdown)
+	{
+		// -priority is for the queue, the rest for the render
+		DaemonJob* job = new DaemonJob;
+		job->id = m_nextId++;
+		job->priority = 0;
+		for (size_t i = 0; i < args.size(); i++)
+		{
+			if (args[i] == "-priority" && i + 1 < args.size())
+				job->priority = atoi(args[++i].c_str());
+			else
+				job->args.push_back(args[i]);
+		}
+		job->client = client;
+		job->cancel = false;
+		job->queued = std::chrono::steady_clock::now();
+
+		// The client keeps the connection open for the result, which can't come before this
+		snprintf(reply, sizeof(reply), "queued %u", job->id);
+		SendLine(client, reply);
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_queue.push_back(job);
+		m_wake.notify_one();
+		return;
+	}
+
+	std::vector<DaemonReply> replies;
+	std::unique_lock<std::mutex> lock(m_lock);
+	std::string answer;
+	if (request == "render")
+	{
+		answer = "error: shutting down";
+	}
+	else if (request == "cancel" && args.size() == 1)
+	{
+		unsigned int id = (unsigned int)strtoul(args[0].c_str(), NULL, 10);
+		snprintf(reply, sizeof(reply), "error: no job %u", id);
+		answer = reply;
+		if (m_running && m_running->id == id)
+		{
+			m_running->cancel = true;
+			answer = "ok";
+		}
+		for (size_t j = 0; j < m_queue.size(); j++)
+		{
+			if (m_queue[j]->id != id)
+				continue;
+			snprintf(reply, sizeof(reply), "cancelled %u", id);
+			DaemonReply cancelled = { m_queue[j]->client, reply, true };
+			replies.push_back(cancelled);
+			delete m_queue[j];
+			m_queue.erase(m_queue.begin() + j);
+			answer = "ok";
+			break;
+		}
+	}
+	else if (request == "status" && args.empty())
+	{
+		// One line per job, the running one first; the connection closes after the last
+		if (m_running)
+		{
+			snprintf(reply, sizeof(reply), "running %u priority %d\n", m_running->id, m_running->priority);
+			answer += reply;
+		}
+		for (size_t j = 0; j < m_queue.size(); j++)
+		{
+			snprintf(reply, sizeof(reply), "queued %u priority %d\n", m_queue[j]->id, m_queue[j]->priority);
+			answer += reply;
+		}
+		answer += "end";
+	}
+	else if (request == "shutdown" && args.empty())
+	{
+		// The running job finishes, the queued ones are turned away
+		m_shutdown = true;
+		for (size_t j = 0; j < m_queue.size(); j++)
+		{
+			snprintf(reply, sizeof(reply), "cancelled %u", m_queue[j]->id);
+			DaemonReply cancelled = { m_queue[j]->client, reply, true };
+			replies.push_back(cancelled);
+			delete m_queue[j];
+		}
+		m_queue.clear();
+		m_wake.notify_all();
+		answer = "ok";
+	}
+	else
+	{
+		answer = "error: unknown request '" + line + "'";
+	}
+	lock.unlock();
+
+	DaemonReply last = { client, answer, true };
+	replies.push_back(last);
+	SendReplies(replies);
+}
+
+DaemonJob* RenderDaemon::NextJob()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	m_wake.wait(lock, [this] { return m_shutdown || !m_queue.empty(); });
+	if (m_queue.empty())
+		return NULL;
+
+	// The queue is in the order the jobs came in, so the first of the highest priority is the oldest
+	size_t best = 0;
+	for (size_t j = 1; j < m_queue.size(); j++)
+	{
+		if (m_queue[j]->priority > m_queue[best]->priority)
+			best = j;
+	}
+	m_running = m_queue[best];
+	m_queue.erase(m_queue.begin() + best);
+	return m_running;
+}
+
+void RenderDaemon::FinishJob(DaemonJob* job, const std::string& reply)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_running == job)
+			m_running = NULL;
+	}
+	SendLine(job->client, reply);
+	CloseSocket(job->client);
+	delete job;
+}
+
+}
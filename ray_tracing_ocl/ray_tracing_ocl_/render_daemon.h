@@ -0,0 +1,91 @@
+// Render daemon: render jobs that come in over a local (Unix domain) socket, by priority
+//
+#ifndef __RENDER_DAEMON_H__
+#define __RENDER_DAEMON_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A SOCKET on Windows, kept off winsock2.h here so it doesn't clash with what includes this
+#ifdef _WIN32
+#include <stdint.h>
+typedef uintptr_t DaemonSocket;
+#else
+typedef int DaemonSocket;
+#endif
+
+namespace RAYTRACING
+{
+
+// Longest request line a client may send
+#define DAEMON_MAX_LINE	4096
+
+// Time a client has to send its request line before it is dropped
+#define DAEMON_REQUEST_SECONDS	2
+
+// Set-up renders the daemon keeps for later jobs, the most recently used ones
+#define DAEMON_SESSIONS	4
+
+/*
+* A render job: the command line options of the image, minus -priority. The client that sent it
+* waits on its socket for the one reply line.
+*/
+struct DaemonJob
+{
+	unsigned int      id;
+	int               priority;     // higher runs first, equal ones in the order they came in
+	std::vector<std::string> args;
+	DaemonSocket      client;
+	std::atomic<bool> cancel;       // set by a cancel request; the render checks it between passes
+	std::chrono::steady_clock::time_point queued;
+};
+
+/*
+* Takes requests on a socket on its own thread (see README.md for the protocol) and hands the
+* render jobs to the thread that calls NextJob, one at a time. Queued jobs are cancelled
+* on the listener thread; the running one is flagged and stops after its current pass.
+* Replies are sent after m_lock is released, so a client that doesn't read holds up nobody.
+*/
+class RenderDaemon
+{
+public:
+	RenderDaemon();
+	~RenderDaemon();            // stops listening and turns the jobs still queued away
+
+	// Listen on a socket file at socketPath, replacing a stale one
+	bool Listen(const char* socketPath);
+
+	// The next job by priority; waits for one. NULL once a client asked for a shutdown.
+	DaemonJob* NextJob();
+
+	// Send reply (one line) to the client of job, which NextJob returned, and drop the job
+	void FinishJob(DaemonJob* job, const std::string& reply);
+
+private:
+	RenderDaemon(const RenderDaemon&);
+	RenderDaemon& operator=(const RenderDaemon&);
+
+	void ListenLoop();
+	void HandleRequest(DaemonSocket client, const std::string& line);
+
+	std::string m_socketPath;
+	DaemonSocket m_listener;
+	std::thread m_thread;
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	std::vector<DaemonJob*> m_queue;
+	DaemonJob* m_running;
+	unsigned int m_nextId;
+	bool m_ownsSocketFile;      // bind made the file at m_socketPath, so it goes at the end
+	bool m_shutdown;
+	std::atomic<bool> m_stop;   // ends the listener thread
+};
+
+}
+
+#endif
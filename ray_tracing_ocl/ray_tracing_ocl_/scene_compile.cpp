@@ -0,0 +1,98 @@
+#include <math.h>
+
+#include "scene_compile.h"
+
+#ifndef M_PI
+  #define M_PI 3.14159265358979
+#endif
+
+namespace RAYTRACING
+{
+
+static inline float Dot(const Vector& a, const Vector& b)
+{
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline Vector Cross(const Vector& a, const Vector& b)
+{
+	Vector v = { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+	return v;
+}
+
+static inline Vector Scale(const Vector& a, float k)
+{
+	Vector v = { a.x * k, a.y * k, a.z * k };
+	return v;
+}
+
+static inline Vector Normalize(const Vector& a)
+{
+	float length = sqrtf(Dot(a, a));
+	return length > 0.0f ? Scale(a, 1.0f / length) : a;
+}
+
+// Scale a by 1 / |a|^2; degenerate vectors give a zero vector
+static inline Vector InverseLength2(const Vector& a)
+{
+	float length2 = Dot(a, a);
+	Vector zero = { 0.0f, 0.0f, 0.0f };
+	return length2 > 0.0f ? Scale(a, 1.0f / length2) : zero;
+}
+
+void CompileLight(const RectangleLight& light, CompiledLight* compiled)
+{
+	compiled->m_pos = light.m_pos;
+	compiled->m_side1 = light.m_side1;
+	compiled->m_side2 = light.m_side2;
+	Vector cross = Cross(light.m_side1, light.m_side2);
+	compiled->m_normal = Normalize(cross);
+	compiled->m_side1Inv = InverseLength2(light.m_side1);
+	compiled->m_side2Inv = InverseLength2(light.m_side2);
+	compiled->m_emitted.x = light.m_power * light.m_color.x;
+	compiled->m_emitted.y = light.m_power * light.m_color.y;
+	compiled->m_emitted.z = light.m_power * light.m_color.z;
+	compiled->m_planeDistance = Dot(compiled->m_normal, light.m_pos);
+	compiled->m_area = sqrtf(Dot(cross, cross));
+}
+
+void CompilePlane(const Plane& plane, CompiledPlane* compiled)
+{
+	compiled->m_normal = plane.m_normal;
+	compiled->m_distance = Dot(plane.m_normal, plane.m_pos);
+	compiled->m_color = plane.m_color;
+}
+
+void CompileCamera(const Camera& cam, CompiledCamera* compiled)
+{
+	Vector toTarget = { cam.target.x - cam.origin.x, cam.target.y - cam.origin.y, cam.target.z - cam.origin.z };
+	Vector forward = Normalize(toTarget);
+	Vector right = Normalize(Cross(forward, cam.targetUpDirection));
+	Vector up = Normalize(Cross(right, forward));
+
+	float tanFov = tanf(cam.fieldOfViewInDegrees * (float)M_PI / 180.0f);
+
+	compiled->m_origin = cam.origin;
+	compiled->m_forward = forward;
+	compiled->m_right = Scale(right, tanFov * cam.aspectRatio);
+	compiled->m_up = Scale(up, tanFov);
+}
+
+void CompileScene(const SphereSet* scene, const Camera* cam, CompiledScene* compiled)
+{
+	compiled->lights.resize(scene->LightCount);
+	for (int i = 0; i < scene->LightCount; i++)
+	{
+		CompileLight(scene->m_rectLight[i], &compiled->lights[i]);
+	}
+
+	compiled->planes.resize(scene->PlaneCount);
+	for (int i = 0; i < scene->PlaneCount; i++)
+	{
+		CompilePlane(scene->m_plane[i], &compiled->planes[i]);
+	}
+
+	CompileCamera(*cam, &compiled->camera);
+}
+
+}
@@ -0,0 +1,36 @@
+// Scene compilation: bake per-primitive and camera invariants into device records
+//
+#ifndef __SCENE_COMPILE_H__
+#define __SCENE_COMPILE_H__
+
+#include <vector>
+
+#include "raytracing.h"
+#include "light_select.h"
+
+namespace RAYTRACING
+{
+
+/*
+* The scene as both render paths read it. Lights and planes keep the order
+* of the SphereSet they were compiled from, so BVH references stay valid.
+* lightSelection is filled in by BuildLightSelection.
+*/
+struct CompiledScene
+{
+	std::vector<CompiledLight> lights;
+	std::vector<CompiledPlane> planes;
+	CompiledCamera camera;
+	LightSelection lightSelection;
+};
+
+void CompileLight(const RectangleLight& light, CompiledLight* compiled);
+void CompilePlane(const Plane& plane, CompiledPlane* compiled);
+void CompileCamera(const Camera& cam, CompiledCamera* compiled);
+
+// Compile every light and plane of scene and the camera
+void CompileScene(const SphereSet* scene, const Camera* cam, CompiledScene* compiled);
+
+}
+
+#endif
@@ -0,0 +1,562 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "scene_file.h"
+#include "portable.h"
+
+namespace RAYTRACING
+{
+
+/*
+* Binary layout: SceneFileHeader, one SceneFileSection per SceneSection in that order, then
+* the section data, each at a multiple of SCENE_FILE_ALIGNMENT. Records are stored exactly as
+* the host and the kernel lay them out, so they go to the device without any conversion;
+* recordSize guards against a struct that has changed since the file was written.
+*/
+static const char kSceneMagic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 'B' };
+
+enum SceneSection
+{
+	SECTION_CAMERA,         // Camera, one record
+	SECTION_LIGHTS,         // CompiledLight
+	SECTION_PLANES,         // CompiledPlane
+	SECTION_VERTICES,       // Point
+	SECTION_TRIANGLES,      // Triangle
+	SECTION_MESH_COLORS,    // Color
+	SECTION_PRIM_LAYOUT,    // PrimitiveLayout, one record
+	SECTION_PRIM_DATA,      // float
+	SECTION_MATERIALS,      // Color
+	SECTION_BVH_NODES,      // BVHNode
+	SECTION_PRIM_REFS,      // unsigned int
+	SECTION_COUNT
+};
+
+static const char* const kSectionName[SECTION_COUNT] = {
+	"camera", "lights", "planes", "vertices", "triangles", "mesh colors",
+	"primitive layout", "primitive data", "materials", "BVH nodes", "primitive references" };
+
+static const unsigned int kRecordSize[SECTION_COUNT] = {
+	sizeof(Camera), sizeof(CompiledLight), sizeof(CompiledPlane), sizeof(Point), sizeof(Triangle), sizeof(Color),
+	sizeof(PrimitiveLayout), sizeof(float), sizeof(Color), sizeof(BVHNode), sizeof(unsigned int) };
+
+struct SceneFileHeader
+{
+	char               magic[8];
+	unsigned int       version;
+	unsigned int       sectionCount;
+	unsigned int       bvhDepth;
+	unsigned int       reserved;
+	unsigned long long tableChecksum;   // of the section table that follows
+};
+
+struct SceneFileSection
+{
+	unsigned int       type;
+	unsigned int       recordSize;
+	unsigned long long count;
+	unsigned long long offset;          // from the start of the file
+	unsigned long long checksum;        // of the count * recordSize bytes at offset
+};
+
+/*
+* Four interleaved multiply-xor lanes over 8-byte words (FNV-1a constants), so that checking
+* a large scene keeps up with reading it; the tail goes byte by byte
+*/
+static unsigned long long Checksum(const char* data, size_t size)
+{
+	const unsigned long long prime = 1099511628211ULL;
+	unsigned long long lanes[4] = { 14695981039346656037ULL, 14695981039346656037ULL ^ 1,
+		14695981039346656037ULL ^ 2, 14695981039346656037ULL ^ 3 };
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		for (int l = 0; l < 4; l++)
+		{
+			unsigned long long word;
+			memcpy(&word, data + i + 8 * l, 8);
+			lanes[l] = (lanes[l] ^ word) * prime;
+			lanes[l] ^= lanes[l] >> 32;
+		}
+	}
+
+	unsigned long long hash = size;
+	for (int l = 0; l < 4; l++)
+	{
+		hash = (hash ^ lanes[l]) * prime;
+	}
+	for (; i < size; i++)
+	{
+		hash = (hash ^ (unsigned char)data[i]) * prime;
+	}
+	return hash;
+}
+
+static Camera MakeCamera(const Point& origin, const Point& target, const Vector& up, float fieldOfView)
+{
+	Camera cam = { fieldOfView, origin, target, up, 1.0f };
+	return cam;
+}
+
+void DefaultScene(SceneDescription* scene)
+{
+	*scene = SceneDescription();
+
+	Plane floor = { { 0.0f, -2.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 1.0f, 1.0f, 1.0f } };
+	scene->planes.push_back(floor);
+
+	RectangleLight top = { { 2.5f, 2.0f, -2.5f }, { 5.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 5.0f }, { 1.0f, 0.5f, 1.0f }, 3.0f };
+	RectangleLight low = { { -2.0f, -1.0f, -2.0f }, { 4.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 4.0f }, { 1.0f, 1.0f, 0.5f }, 0.75f };
+	scene->lights.push_back(top);
+	scene->lights.push_back(low);
+
+	Point origin = { 0.0f, 5.0f, 15.0f };
+	Point target = { 0.0f, 0.0f, 0.0f };
+	Vector up = { 0.0f, 1.0f, 0.0f };
+	scene->camera = MakeCamera(origin, target, up, 45.0f);
+}
+
+bool ParseSceneValues(const std::string& text, float* values, int count)
+{
+	const char* at = text.c_str();
+	for (int i = 0; i < count; i++)
+	{
+		char* end;
+		values[i] = (float)strtod(at, &end);
+		if (end == at || (i + 1 < count && *end != ','))
+			return false;
+		at = end + 1;
+	}
+	return true;
+}
+
+// Mesh paths in a scene file are relative to the file, unless they are absolute
+static std::string ScenePath(const std::string& sceneFile, const std::string& path)
+{
+	bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+	size_t slash = sceneFile.find_last_of("/\\");
+	if (absolute || slash == std::string::npos)
+		return path;
+	return sceneFile.substr(0, slash + 1) + path;
+}
+
+bool LoadSceneText(const char* fileName, WorkStealingPool* pool, SceneDescription* scene)
+{
+	std::ifstream file(fileName);
+	if (!file)
+	{
+		printf("Error: Couldn't open scene file '%s'.\n", fileName);
+		return false;
+	}
+
+	// Without a camera line the scene is seen from where the default scene is
+	DefaultScene(scene);
+	scene->lights.clear();
+	scene->planes.clear();
+
+	// Colors and mesh placement apply to what follows them, as on the command line
+	Color lightColor = { 1.0f, 1.0f, 1.0f };
+	Color shapeColor = { 0.8f, 0.8f, 0.8f };
+	int shapeMaterial = -1;
+	float meshScale = 1.0f;
+	Vector meshOffset = { 0.0f, 0.0f, 0.0f };
+	Color meshColor = { 0.8f, 0.8f, 0.8f };
+	float v[10] = { 0.0f };
+
+	std::string line;
+	for (int lineNumber = 1; std::getline(file, line); lineNumber++)
+	{
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword) || keyword[0] == '#')
+			continue;
+
+		// The rest of the line is the value; file names may have spaces in them
+		std::string value;
+		std::getline(fields >> std::ws, value);
+		value.erase(value.find_last_not_of(" \t\r") + 1);
+
+		// Expected value count of the keyword, 0 for the ones that don't take numbers
+		int count = (keyword == "camera" || keyword == "light") ? 10 : (keyword == "plane") ? 9 :
+			(keyword == "disc") ? 7 : (keyword == "box") ? 6 : (keyword == "sphere") ? 4 :
+			(keyword == "light-color" || keyword == "shape-color" || keyword == "mesh-color" || keyword == "mesh-offset") ? 3 :
+			(keyword == "mesh-scale") ? 1 : 0;
+		if (count == 0 && keyword != "mesh")
+		{
+			printf("Error: %s, line %d: Unknown keyword '%s'.\n", fileName, lineNumber, keyword.c_str());
+			return false;
+		}
+		if (count > 0 && !ParseSceneValues(value, v, count))
+		{
+			printf("Error: %s, line %d: %s expects %d comma-separated numbers, got '%s'.\n",
+				fileName, lineNumber, keyword.c_str(), count, value.c_str());
+			return false;
+		}
+
+		Point p0 = { v[0], v[1], v[2] };
+		Point p1 = { v[3], v[4], v[5] };
+		Vector p2 = { v[6], v[7], v[8] };
+		Color c0 = { v[0], v[1], v[2] };
+		if (keyword == "camera")
+		{
+			scene->camera = MakeCamera(p0, p1, p2, v[9]);
+		}
+		else if (keyword == "plane")
+		{
+			float length = sqrtf(p1.x * p1.x + p1.y * p1.y + p1.z * p1.z);
+			if (length <= 0.0f)
+			{
+				printf("Error: %s, line %d: The plane normal is zero.\n", fileName, lineNumber);
+				return false;
+			}
+			Vector normal = { p1.x / length, p1.y / length, p1.z / length };
+			Plane plane = { p0, normal, { v[6], v[7], v[8] } };
+			scene->planes.push_back(plane);
+		}
+		else if (keyword == "light")
+		{
+			RectangleLight light = { p0, p1, p2, lightColor, v[9] };
+			scene->lights.push_back(light);
+		}
+		else if (keyword == "light-color")
+		{
+			lightColor = c0;
+		}
+		else if (keyword == "shape-color")
+		{
+			shapeColor = c0;
+			shapeMaterial = -1;
+		}
+		else if (keyword == "mesh-color")
+		{
+			meshColor = c0;
+		}
+		else if (keyword == "mesh-offset")
+		{
+			meshOffset = p0;
+		}
+		else if (keyword == "mesh-scale")
+		{
+			meshScale = v[0];
+		}
+		else if (keyword == "mesh")
+		{
+			std::string path = ScenePath(fileName, value);
+			if (!LoadMeshFile(path.c_str(), meshScale, meshOffset, meshColor, pool, &scene->meshes))
+				return false;
+		}
+		else
+		{
+			// Shapes share one material until the next shape-color
+			if (shapeMaterial < 0)
+			{
+				shapeMaterial = (int)AddMaterial(&scene->shapes, shapeColor);
+			}
+
+			if (keyword == "sphere")
+				AddSphere(&scene->shapes, p0, v[3], (unsigned int)shapeMaterial);
+			else if (keyword == "disc")
+				AddDisc(&scene->shapes, p0, p1, v[6], (unsigned int)shapeMaterial);
+			else
+				AddBox(&scene->shapes, p0, p1, (unsigned int)shapeMaterial);
+		}
+	}
+
+	return true;
+}
+
+void BuildSceneSet(SceneDescription* description, SphereSet* scene)
+{
+	scene->m_rectLight = description->lights.empty() ? NULL : &description->lights[0];
+	scene->LightCount = (int)description->lights.size();
+	scene->m_plane = description->planes.empty() ? NULL : &description->planes[0];
+	scene->PlaneCount = (int)description->planes.size();
+	AttachMeshData(scene, &description->meshes);
+	AttachPrimitives(scene, &description->shapes);
+}
+
+bool IsBinarySceneFile(const char* fileName)
+{
+	FILE* file = NULL;
+	if (0 != fopen_s(&file, fileName, "rb") || file == NULL)
+		return false;
+
+	char magic[sizeof(kSceneMagic)];
+	bool binary = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, kSceneMagic, sizeof(magic)) == 0;
+	fclose(file);
+	return binary;
+}
+
+bool WriteSceneFile(const char* fileName, const SphereSet* scene, const Camera& camera,
+	const CompiledScene& compiled, const SceneBVH& bvh)
+{
+	const void* data[SECTION_COUNT] = {
+		&camera, compiled.lights.empty() ? NULL : &compiled.lights[0], compiled.planes.empty() ? NULL : &compiled.planes[0],
+		scene->m_vertices, scene->m_triangle, scene->m_meshColor,
+		&scene->m_primLayout, scene->m_primData, scene->m_material, bvh.nodeData, bvh.primRefData };
+	const size_t count[SECTION_COUNT] = {
+		1, compiled.lights.size(), compiled.planes.size(),
+		(size_t)scene->VertexCount, (size_t)scene->TriangleCount, (size_t)scene->MeshCount,
+		1, (size_t)scene->PrimDataSize, (size_t)scene->MaterialCount, bvh.nodeCount, bvh.primRefCount };
+
+	SceneFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kSceneMagic, sizeof(kSceneMagic));
+	header.version = SCENE_FILE_VERSION;
+	header.sectionCount = SECTION_COUNT;
+	header.bvhDepth = bvh.depth;
+
+	SceneFileSection sections[SECTION_COUNT];
+	unsigned long long offset = sizeof(header) + sizeof(sections);
+	for (int s = 0; s < SECTION_COUNT; s++)
+	{
+		offset = (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+		size_t size = count[s] * kRecordSize[s];
+		sections[s].type = (unsigned int)s;
+		sections[s].recordSize = kRecordSize[s];
+		sections[s].count = count[s];
+		sections[s].offset = offset;
+		sections[s].checksum = Checksum((const char*)data[s], size);
+		offset += size;
+	}
+	header.tableChecksum = Checksum((const char*)sections, sizeof(sections));
+
+	FILE* file = NULL;
+	if (0 != fopen_s(&file, fileName, "wb") || file == NULL)
+	{
+		printf("Error: Couldn't create scene file '%s'.\n", fileName);
+		return false;
+	}
+
+	static const char padding[SCENE_FILE_ALIGNMENT] = { 0 };
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(sections, sizeof(sections), 1, file) == 1;
+	unsigned long long position = sizeof(header) + sizeof(sections);
+	for (int s = 0; s < SECTION_COUNT && written; s++)
+	{
+		size_t size = (size_t)(sections[s].count * kRecordSize[s]);
+		written = fwrite(padding, 1, (size_t)(sections[s].offset - position), file) == sections[s].offset - position &&
+			(size == 0 || fwrite(data[s], size, 1, file) == 1);
+		position = sections[s].offset + size;
+	}
+	written = (fclose(file) == 0) && written;
+
+	if (!written)
+	{
+		printf("Error: Couldn't write scene file '%s'.\n", fileName);
+		remove(fileName);
+	}
+	return written;
+}
+
+// A stream of count values (width floats each) at offset that has to end inside the primitive data
+static bool StreamFits(unsigned int offset, unsigned int count, unsigned int width, unsigned long long dataSize)
+{
+	return (unsigned long long)offset + (unsigned long long)count * width <= dataSize;
+}
+
+// Material indices of a stream, stored as floats, that have to pick an entry of the material table
+static bool MaterialsFit(const float* data, unsigned int stream, unsigned int count, unsigned long long materialCount)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		float material = data[stream + i];
+		if (!(material >= 0.0f && material < (float)materialCount))
+			return false;
+	}
+	return true;
+}
+
+/*
+* The checksums only catch damage. Every index the tracers follow without a check is checked
+* here, once, against the section it points into: triangle vertices and meshes, the primitive
+* streams and their materials, BVH children and primitive ranges and the primitive references.
+* Returns the section with a bad index, or -1 if all are in range. Children come after their
+* parent, so the depth of the tree, which sizes the traversal stack, comes out of the same pass.
+*/
+static int CheckSceneIndices(const char* const section[SECTION_COUNT], const SceneFileSection sections[SECTION_COUNT],
+	unsigned int* depth)
+{
+	const unsigned long long vertexCount = sections[SECTION_VERTICES].count;
+	const unsigned long long meshCount = sections[SECTION_MESH_COLORS].count;
+	const Triangle* triangles = (const Triangle*)section[SECTION_TRIANGLES];
+	for (unsigned long long t = 0; t < sections[SECTION_TRIANGLES].count; t++)
+	{
+		if (triangles[t].m_v0 >= vertexCount || triangles[t].m_v1 >= vertexCount || triangles[t].m_v2 >= vertexCount ||
+			triangles[t].m_mesh >= meshCount)
+			return SECTION_TRIANGLES;
+	}
+
+	PrimitiveLayout layout;
+	memcpy(&layout, section[SECTION_PRIM_LAYOUT], sizeof(layout));
+	const unsigned long long dataSize = sections[SECTION_PRIM_DATA].count;
+	if (!StreamFits(layout.m_sphereCenter, layout.m_sphereCount, 3, dataSize) || !StreamFits(layout.m_sphereRadius, layout.m_sphereCount, 1, dataSize) ||
+		!StreamFits(layout.m_sphereMaterial, layout.m_sphereCount, 1, dataSize) ||
+		!StreamFits(layout.m_discCenter, layout.m_discCount, 3, dataSize) || !StreamFits(layout.m_discNormal, layout.m_discCount, 3, dataSize) ||
+		!StreamFits(layout.m_discRadius, layout.m_discCount, 1, dataSize) || !StreamFits(layout.m_discMaterial, layout.m_discCount, 1, dataSize) ||
+		!StreamFits(layout.m_boxMin, layout.m_boxCount, 3, dataSize) || !StreamFits(layout.m_boxMax, layout.m_boxCount, 3, dataSize) ||
+		!StreamFits(layout.m_boxMaterial, layout.m_boxCount, 1, dataSize))
+		return SECTION_PRIM_LAYOUT;
+
+	const float* primData = (const float*)section[SECTION_PRIM_DATA];
+	const unsigned long long materialCount = sections[SECTION_MATERIALS].count;
+	if (!MaterialsFit(primData, layout.m_sphereMaterial, layout.m_sphereCount, materialCount) ||
+		!MaterialsFit(primData, layout.m_discMaterial, layout.m_discCount, materialCount) ||
+		!MaterialsFit(primData, layout.m_boxMaterial, layout.m_boxCount, materialCount))
+		return SECTION_PRIM_DATA;
+
+	const unsigned long long counts[PRIM_BOX + 1] = { sections[SECTION_LIGHTS].count, sections[SECTION_TRIANGLES].count,
+		layout.m_sphereCount, layout.m_discCount, layout.m_boxCount };
+	const unsigned int* primRefs = (const unsigned int*)section[SECTION_PRIM_REFS];
+	for (unsigned long long r = 0; r < sections[SECTION_PRIM_REFS].count; r++)
+	{
+		unsigned int type = primRefs[r] >> PRIM_TYPE_SHIFT;
+		if (type > PRIM_BOX || (primRefs[r] & PRIM_INDEX_MASK) >= counts[type])
+			return SECTION_PRIM_REFS;
+	}
+
+	// The first child of an interior node is the next node, the second one m_offset
+	const long long nodeCount = (long long)sections[SECTION_BVH_NODES].count;
+	const long long primRefCount = (long long)sections[SECTION_PRIM_REFS].count;
+	const BVHNode* nodes = (const BVHNode*)section[SECTION_BVH_NODES];
+	std::vector<unsigned int> nodeDepth((size_t)nodeCount, 1);
+	*depth = 0;
+	for (long long n = 0; n < nodeCount; n++)
+	{
+		const BVHNode& node = nodes[n];
+		*depth = std::max(*depth, nodeDepth[(size_t)n]);
+		if (node.m_primCount > 0)
+		{
+			if (node.m_offset < 0 || (long long)node.m_offset + node.m_primCount > primRefCount)
+				return SECTION_BVH_NODES;
+			continue;
+		}
+		if (node.m_primCount < 0 || n + 1 >= nodeCount || node.m_offset <= n + 1 || node.m_offset >= nodeCount)
+			return SECTION_BVH_NODES;
+		nodeDepth[(size_t)n + 1] = std::max(nodeDepth[(size_t)n + 1], nodeDepth[(size_t)n] + 1);
+		nodeDepth[(size_t)node.m_offset] = std::max(nodeDepth[(size_t)node.m_offset], nodeDepth[(size_t)n] + 1);
+	}
+	return -1;
+}
+
+bool LoadSceneFile(const char* fileName, MappedFile* file, SphereSet* scene, Camera* camera,
+	CompiledScene* compiled, SceneBVH* bvh)
+{
+	// Private writable pages: OpenCL takes the host pointers of CL_MEM_USE_HOST_PTR buffers as void*
+	if (!file->Open(fileName, true))
+		return false;
+
+	const char* data = file->Data();
+	const size_t size = file->Size();
+	SceneFileHeader header;
+	SceneFileSection sections[SECTION_COUNT];
+	if (size < sizeof(header) + sizeof(sections))
+	{
+		printf("Error: '%s' is too short for a scene file.\n", fileName);
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	memcpy(sections, data + sizeof(header), sizeof(sections));
+	if (memcmp(header.magic, kSceneMagic, sizeof(kSceneMagic)) != 0)
+	{
+		printf("Error: '%s' is not a binary scene file.\n", fileName);
+		return false;
+	}
+	if (header.version != SCENE_FILE_VERSION || header.sectionCount != SECTION_COUNT)
+	{
+		printf("Error: '%s' is a version %u scene file, this build reads version %u; convert it again.\n",
+			fileName, header.version, SCENE_FILE_VERSION);
+		return false;
+	}
+	if (header.tableChecksum != Checksum((const char*)sections, sizeof(sections)))
+	{
+		printf("Error: The section table of '%s' is damaged.\n", fileName);
+		return false;
+	}
+	if (header.bvhDepth > BVH_MAX_DEPTH)
+	{
+		printf("Error: The BVH of '%s' is deeper than the traversal stack allows.\n", fileName);
+		return false;
+	}
+
+	const char* section[SECTION_COUNT];
+	for (int s = 0; s < SECTION_COUNT; s++)
+	{
+		const SceneFileSection& entry = sections[s];
+		if (entry.type != (unsigned int)s || entry.recordSize != kRecordSize[s])
+		{
+			printf("Error: The %s of '%s' don't match this build; convert the scene again.\n", kSectionName[s], fileName);
+			return false;
+		}
+		if (entry.offset % SCENE_FILE_ALIGNMENT != 0 || entry.offset > size ||
+			entry.count > (size - entry.offset) / entry.recordSize || entry.count > PRIM_INDEX_MASK ||
+			((s == SECTION_CAMERA || s == SECTION_PRIM_LAYOUT) && entry.count != 1))
+		{
+			printf("Error: The %s of '%s' are out of bounds; the file is truncated or damaged.\n", kSectionName[s], fileName);
+			return false;
+		}
+
+		section[s] = entry.count ? data + entry.offset : NULL;
+		if (entry.checksum != Checksum(section[s], (size_t)(entry.count * entry.recordSize)))
+		{
+			printf("Error: Checksum mismatch in the %s of '%s'.\n", kSectionName[s], fileName);
+			return false;
+		}
+	}
+
+	unsigned int depth;
+	int badSection = CheckSceneIndices(section, sections, &depth);
+	if (badSection >= 0)
+	{
+		printf("Error: An index in the %s of '%s' is out of range; the file is damaged.\n", kSectionName[badSection], fileName);
+		return false;
+	}
+	if (depth > header.bvhDepth)
+	{
+		printf("Error: The BVH of '%s' is deeper than its header says.\n", fileName);
+		return false;
+	}
+
+	memcpy(camera, section[SECTION_CAMERA], sizeof(Camera));
+
+	// Only these few records are copied; their vectors also feed the light selection
+	const CompiledLight* lights = (const CompiledLight*)section[SECTION_LIGHTS];
+	const CompiledPlane* planes = (const CompiledPlane*)section[SECTION_PLANES];
+	compiled->lights.assign(lights, lights + sections[SECTION_LIGHTS].count);
+	compiled->planes.assign(planes, planes + sections[SECTION_PLANES].count);
+
+	scene->m_rectLight = NULL;
+	scene->LightCount = 0;
+	scene->m_plane = NULL;
+	scene->PlaneCount = 0;
+	scene->m_vertices = (Point*)section[SECTION_VERTICES];
+	scene->VertexCount = (int)sections[SECTION_VERTICES].count;
+	scene->m_triangle = (Triangle*)section[SECTION_TRIANGLES];
+	scene->TriangleCount = (int)sections[SECTION_TRIANGLES].count;
+	scene->m_meshColor = (Color*)section[SECTION_MESH_COLORS];
+	scene->MeshCount = (int)sections[SECTION_MESH_COLORS].count;
+	memcpy(&scene->m_primLayout, section[SECTION_PRIM_LAYOUT], sizeof(PrimitiveLayout));
+	scene->m_primData = (float*)section[SECTION_PRIM_DATA];
+	scene->PrimDataSize = (int)sections[SECTION_PRIM_DATA].count;
+	scene->m_material = (Color*)section[SECTION_MATERIALS];
+	scene->MaterialCount = (int)sections[SECTION_MATERIALS].count;
+
+	bvh->nodes.clear();
+	bvh->primRefs.clear();
+	bvh->depth = header.bvhDepth;
+	bvh->nodeData = (const BVHNode*)section[SECTION_BVH_NODES];
+	bvh->nodeCount = (unsigned int)sections[SECTION_BVH_NODES].count;
+	bvh->primRefData = (const unsigned int*)section[SECTION_PRIM_REFS];
+	bvh->primRefCount = (unsigned int)sections[SECTION_PRIM_REFS].count;
+
+	return true;
+}
+
+}
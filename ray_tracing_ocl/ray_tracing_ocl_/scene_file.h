@@ -0,0 +1,74 @@
+// Scene files: a line-based text description and the binary container it converts to
+//
+#ifndef __SCENE_FILE_H__
+#define __SCENE_FILE_H__
+
+#include <string>
+#include <vector>
+
+#include "raytracing.h"
+#include "bvh.h"
+#include "mapped_file.h"
+#include "mesh_loader.h"
+#include "primitives.h"
+#include "scene_compile.h"
+#include "thread_pool.h"
+
+namespace RAYTRACING
+{
+
+#define SCENE_FILE_VERSION	1
+
+// Sections of a binary scene start on page boundaries, so a mapped section can back a buffer in place
+#define SCENE_FILE_ALIGNMENT	4096
+
+/*
+* A scene as the text format describes it. BuildSceneSet points a SphereSet at these
+* lists, so the description has to outlive it.
+*/
+struct SceneDescription
+{
+	Camera camera;
+	std::vector<RectangleLight> lights;
+	std::vector<Plane> planes;
+	MeshData meshes;
+	AnalyticPrimitives shapes;
+};
+
+// Parse count comma-separated floats, as the command line and the scene files take them
+bool ParseSceneValues(const std::string& text, float* values, int count);
+
+// The scene rendered when none is given: a floor plane under two lights
+void DefaultScene(SceneDescription* scene);
+
+/*
+* Parse a text scene (see README.md) into scene. Mesh files are loaded on pool, relative
+* paths are taken from the directory of fileName.
+*/
+bool LoadSceneText(const char* fileName, WorkStealingPool* pool, SceneDescription* scene);
+
+// Point every field of scene at the lists of description
+void BuildSceneSet(SceneDescription* description, SphereSet* scene);
+
+// True if fileName starts like a binary scene, false for text scenes and unreadable files
+bool IsBinarySceneFile(const char* fileName);
+
+/*
+* Write the compiled scene in the binary format: lights and planes in their compiled form,
+* the meshes, analytic primitives and materials as the SphereSet holds them, and the BVH
+*/
+bool WriteSceneFile(const char* fileName, const SphereSet* scene, const Camera& camera,
+	const CompiledScene& compiled, const SceneBVH& bvh);
+
+/*
+* Map a binary scene, verify its header and checksums, and point scene and bvh straight at
+* its sections. Only the lights and planes are copied (into compiled); the caller compiles the
+* camera once it knows the aspect ratio. file has to stay open as long as scene and bvh are used.
+* A binary scene only holds compiled lights and planes, so scene gets none of its own.
+*/
+bool LoadSceneFile(const char* fileName, MappedFile* file, SphereSet* scene, Camera* camera,
+	CompiledScene* compiled, SceneBVH* bvh);
+
+}
+
+#endif
@@ -0,0 +1,167 @@
+#include "thread_pool.h"
+
+namespace RAYTRACING
+{
+
+WorkStealingPool::WorkStealingPool(unsigned int threadCount) :
+		m_task(NULL),
+		m_remaining(0),
+		m_generation(0),
+		m_active(0),
+		m_quit(false)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::thread::hardware_concurrency();
+		if (threadCount == 0)
+			threadCount = 1;
+	}
+
+	for (unsigned int i = 0; i < threadCount; i++)
+	{
+		m_queues.push_back(new WorkerQueue);
+	}
+
+	// Worker 0 is the thread calling Run()
+	for (unsigned int i = 1; i < threadCount; i++)
+	{
+		m_threads.push_back(std::thread(&WorkStealingPool::WorkerLoop, this, i));
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_quit = true;
+	}
+	m_wake.notify_all();
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		m_threads[i].join();
+	}
+
+	for (size_t i = 0; i < m_queues.size(); i++)
+	{
+		delete m_queues[i];
+	}
+}
+
+void WorkStealingPool::Run(unsigned int itemCount, const Task& task)
+{
+	if (itemCount == 0)
+		return;
+
+	unsigned int queueCount = (unsigned int)m_queues.size();
+
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_task = &task;
+		m_remaining = itemCount;
+
+		// Contiguous blocks keep adjacent tiles on one worker until stealing kicks in
+		for (unsigned int q = 0; q < queueCount; q++)
+		{
+			unsigned int first = (unsigned int)((unsigned long long)itemCount * q / queueCount);
+			unsigned int last = (unsigned int)((unsigned long long)itemCount * (q + 1) / queueCount);
+
+			std::lock_guard<std::mutex> queueGuard(m_queues[q]->lock);
+			for (unsigned int i = first; i < last; i++)
+			{
+				m_queues[q]->items.push_back(i);
+			}
+		}
+
+		m_generation++;
+	}
+	m_wake.notify_all();
+
+	Drain(0);
+
+	std::unique_lock<std::mutex> lock(m_lock);
+	while (m_remaining != 0 || m_active != 0)
+	{
+		m_done.wait(lock);
+	}
+	m_task = NULL;
+}
+
+void WorkStealingPool::WorkerLoop(unsigned int worker)
+{
+	unsigned int seen = 0;
+
+	for (;;)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		while (!m_quit && m_generation == seen)
+		{
+			m_wake.wait(lock);
+		}
+		if (m_quit)
+			return;
+
+		seen = m_generation;
+		m_active++;
+		lock.unlock();
+
+		Drain(worker);
+
+		lock.lock();
+		m_active--;
+		if (m_active == 0)
+			m_done.notify_all();
+	}
+}
+
+void WorkStealingPool::Drain(unsigned int worker)
+{
+	unsigned int item;
+
+	while (PopLocal(worker, &item) || Steal(worker, &item))
+	{
+		(*m_task)(item, worker);
+
+		if (--m_remaining == 0)
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_done.notify_all();
+		}
+	}
+}
+
+bool WorkStealingPool::PopLocal(unsigned int worker, unsigned int* item)
+{
+	WorkerQueue* queue = m_queues[worker];
+	std::lock_guard<std::mutex> guard(queue->lock);
+
+	if (queue->items.empty())
+		return false;
+
+	*item = queue->items.front();
+	queue->items.pop_front();
+	return true;
+}
+
+bool WorkStealingPool::Steal(unsigned int thief, unsigned int* item)
+{
+	unsigned int queueCount = (unsigned int)m_queues.size();
+
+	// Start with the neighbour so that thieves spread over the victims
+	for (unsigned int i = 1; i < queueCount; i++)
+	{
+		WorkerQueue* victim = m_queues[(thief + i) % queueCount];
+		std::lock_guard<std::mutex> guard(victim->lock);
+
+		if (!victim->items.empty())
+		{
+			*item = victim->items.back();
+			victim->items.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+}
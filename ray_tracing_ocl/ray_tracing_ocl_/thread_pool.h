@@ -0,0 +1,69 @@
+// Work-stealing thread pool used by the native CPU render path
+//
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace RAYTRACING
+{
+
+/*
+* Fixed set of worker threads that process a batch of independent work items.
+*
+* Every call to Run() splits the items [0, itemCount) into contiguous blocks,
+* one block per worker queue, so that neighbouring tiles stay on the same thread.
+* A worker pops items from the front of its own queue and, once it runs dry,
+* steals from the back of the other queues. The calling thread takes part as worker 0,
+* so a pool of one thread runs everything inline.
+*/
+class WorkStealingPool
+{
+public:
+	typedef std::function<void(unsigned int item, unsigned int worker)> Task;
+
+	explicit WorkStealingPool(unsigned int threadCount = 0);
+	~WorkStealingPool();
+
+	unsigned int ThreadCount() const { return (unsigned int)m_queues.size(); }
+
+	// Execute task(item, worker) for all items and block until every item is done
+	void Run(unsigned int itemCount, const Task& task);
+
+private:
+	WorkStealingPool(const WorkStealingPool&);
+	WorkStealingPool& operator=(const WorkStealingPool&);
+
+	struct WorkerQueue
+	{
+		std::mutex lock;
+		std::deque<unsigned int> items;
+	};
+
+	void WorkerLoop(unsigned int worker);
+	void Drain(unsigned int worker);
+	bool PopLocal(unsigned int worker, unsigned int* item);
+	bool Steal(unsigned int thief, unsigned int* item);
+
+	std::vector<WorkerQueue*> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	const Task* m_task;
+	std::atomic<unsigned int> m_remaining;
+	unsigned int m_generation;
+	unsigned int m_active;
+	bool m_quit;
+};
+
+}
+
+#endif
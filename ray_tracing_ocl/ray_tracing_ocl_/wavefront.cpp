@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <algorithm>
+
+#include "wavefront.h"
+#include "define.h"
+
+// Path state is float4 on the device
+struct Float4
+{
+	cl_float x, y, z, w;
+};
+
+WavefrontPipeline::WavefrontPipeline() :
+	pathCount(0),
+	lightSamples(0),
+	maxDepth(0),
+	localSize(1),
+	depthArg(0),
+	profiler(NULL),
+	generate(NULL),
+	extend(NULL),
+	shade(NULL),
+	shadow(NULL),
+	accumulate(NULL),
+	pathPixel(NULL),
+	rayOrigin(NULL),
+	rayDirection(NULL),
+	pathRadiance(NULL),
+	pathThroughput(NULL),
+	hitNormal(NULL),
+	hitColor(NULL),
+	shadowOrigin(NULL),
+	shadowDirection(NULL),
+	shadowContribution(NULL),
+	extendQueue(NULL),
+	shadeQueue(NULL),
+	shadowQueue(NULL),
+	queueCounts(NULL)
+{
+}
+
+WavefrontPipeline::~WavefrontPipeline()
+{
+	cl_kernel kernels[] = { generate, extend, shade, shadow, accumulate };
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if (kernels[i] && CL_SUCCESS != clReleaseKernel(kernels[i]))
+		{
+			printf("Error: clReleaseKernel failed for a wavefront kernel.\n");
+		}
+	}
+
+	cl_mem buffers[] = { pathPixel, rayOrigin, rayDirection, pathRadiance, pathThroughput, hitNormal, hitColor,
+		shadowOrigin, shadowDirection, shadowContribution, extendQueue, shadeQueue, shadowQueue, queueCounts };
+	for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++)
+	{
+		if (buffers[i] && CL_SUCCESS != clReleaseMemObject(buffers[i]))
+		{
+			printf("Error: clReleaseMemObject failed for a wavefront buffer.\n");
+		}
+	}
+}
+
+static cl_int CreateKernel(cl_program program, const char* name, cl_device_id device, cl_kernel* kernel, size_t* localSize)
+{
+	cl_int err = CL_SUCCESS;
+	*kernel = clCreateKernel(program, name, &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateKernel for %s returned %s\n", name, TranslateOpenCLError(err));
+		return err;
+	}
+
+	size_t maxSize = 1;
+	err = clGetKernelWorkGroupInfo(*kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxSize, NULL);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clGetKernelWorkGroupInfo for %s returned %s\n", name, TranslateOpenCLError(err));
+		return err;
+	}
+
+	// All kernels share the smallest work-group size any of them allows
+	*localSize = std::min(*localSize, maxSize);
+	return CL_SUCCESS;
+}
+
+static cl_int CreateBuffer(cl_context context, size_t size, cl_mem* buffer, const char* name)
+{
+	cl_int err = CL_SUCCESS;
+	*buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clCreateBuffer for %s returned %s\n", name, TranslateOpenCLError(err));
+	}
+	return err;
+}
+
+cl_int CreateWavefront(WavefrontPipeline* wf, cl_context context, cl_device_id device, cl_program program,
+	cl_uint pathCount, cl_uint lightSamples, cl_uint maxDepth)
+{
+	cl_int err = CL_SUCCESS;
+
+	wf->pathCount = pathCount;
+	wf->lightSamples = lightSamples;
+	wf->maxDepth = maxDepth;
+	wf->localSize = WAVEFRONT_GROUP_SIZE;
+
+	if (CL_SUCCESS != (err = CreateKernel(program, "wf_generate", device, &wf->generate, &wf->localSize)) ||
+		CL_SUCCESS != (err = CreateKernel(program, "wf_extend", device, &wf->extend, &wf->localSize)) ||
+		CL_SUCCESS != (err = CreateKernel(program, "wf_shade", device, &wf->shade, &wf->localSize)) ||
+		CL_SUCCESS != (err = CreateKernel(program, "wf_shadow", device, &wf->shadow, &wf->localSize)) ||
+		CL_SUCCESS != (err = CreateKernel(program, "wf_accumulate", device, &wf->accumulate, &wf->localSize)))
+	{
+		return err;
+	}
+
+	// Shadow slots exist even without light samples, so that every buffer has a size
+	size_t slotCount = (size_t)pathCount * std::max(lightSamples, 1u);
+
+	// queueCounts has extend, shade and shadow counters for every depth (QUEUE_KINDS in the kernels)
+	if (CL_SUCCESS != (err = CreateBuffer(context, sizeof(cl_uint) * pathCount, &wf->pathPixel, "pathPixel")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * pathCount, &wf->rayOrigin, "rayOrigin")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * pathCount, &wf->rayDirection, "rayDirection")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * pathCount, &wf->pathRadiance, "pathRadiance")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * pathCount, &wf->pathThroughput, "pathThroughput")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * pathCount, &wf->hitNormal, "hitNormal")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * pathCount, &wf->hitColor, "hitColor")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * slotCount, &wf->shadowOrigin, "shadowOrigin")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * slotCount, &wf->shadowDirection, "shadowDirection")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(Float4) * slotCount, &wf->shadowContribution, "shadowContribution")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(cl_uint) * pathCount, &wf->extendQueue, "extendQueue")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(cl_uint) * pathCount, &wf->shadeQueue, "shadeQueue")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(cl_uint) * pathCount, &wf->shadowQueue, "shadowQueue")) ||
+		CL_SUCCESS != (err = CreateBuffer(context, sizeof(cl_uint) * 3 * (maxDepth + 1), &wf->queueCounts, "queueCounts")))
+	{
+		return err;
+	}
+
+	return CL_SUCCESS;
+}
+
+/*
+* Set arguments first, first + 1, ... of kernel
+*/
+static cl_int SetArguments(cl_kernel kernel, const char* name, cl_uint first, const std::vector<KernelArgument>& args)
+{
+	for (size_t i = 0; i < args.size(); i++)
+	{
+		cl_int err = clSetKernelArg(kernel, first + (cl_uint)i, args[i].size, args[i].value);
+		if (CL_SUCCESS != err)
+		{
+			printf("Error: Failed to set argument %u of %s, returned %s\n", first + (cl_uint)i, name, TranslateOpenCLError(err));
+			return err;
+		}
+	}
+	return CL_SUCCESS;
+}
+
+// The host and the program have to agree on the arguments, or every index after a missing one is off
+static cl_int CheckArgumentCount(cl_kernel kernel, const char* name, size_t count)
+{
+	cl_uint kernelArgs = 0;
+	cl_int err = clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(kernelArgs), &kernelArgs, NULL);
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: clGetKernelInfo for %s returned %s\n", name, TranslateOpenCLError(err));
+		return err;
+	}
+	if (kernelArgs != count)
+	{
+		printf("Error: %s takes %u arguments, the host sets %u\n", name, kernelArgs, (cl_uint)count);
+		return CL_INVALID_KERNEL_ARGS;
+	}
+	return CL_SUCCESS;
+}
+
+#define MEM_ARG(buffer) { sizeof(cl_mem), &(buffer) }
+#define UINT_ARG(value) { sizeof(cl_uint), &(value) }
+
+cl_int SetWavefrontArguments(WavefrontPipeline* wf, const std::vector<KernelArgument>& sceneArgs,
+	const WavefrontFrame& frame)
+{
+	cl_int err = CL_SUCCESS;
+
+	// wf_generate: first (5) and pathCount (6) change with every wave
+	cl_uint first = 0;
+	std::vector<KernelArgument> generateArgs = {
+		MEM_ARG(frame.camera), UINT_ARG(frame.width), UINT_ARG(frame.height), UINT_ARG(wf->maxDepth),
+		MEM_ARG(frame.pixelList), UINT_ARG(first), UINT_ARG(wf->pathCount), MEM_ARG(frame.seeds),
+		MEM_ARG(wf->pathPixel), MEM_ARG(wf->rayOrigin), MEM_ARG(wf->rayDirection), MEM_ARG(wf->pathRadiance),
+		MEM_ARG(wf->pathThroughput), MEM_ARG(wf->extendQueue), MEM_ARG(wf->queueCounts) };
+	if (CL_SUCCESS != (err = SetArguments(wf->generate, "wf_generate", 0, generateArgs)))
+		return err;
+
+	// The depth argument of wf_extend, wf_shade and wf_shadow changes with every launch
+	cl_uint depth = 0;
+	std::vector<KernelArgument> extendArgs = {
+		UINT_ARG(depth), UINT_ARG(wf->maxDepth), MEM_ARG(wf->rayOrigin), MEM_ARG(wf->rayDirection),
+		MEM_ARG(wf->pathThroughput), MEM_ARG(wf->extendQueue), MEM_ARG(wf->pathRadiance),
+		MEM_ARG(wf->hitNormal), MEM_ARG(wf->hitColor), MEM_ARG(wf->shadeQueue), MEM_ARG(wf->queueCounts),
+		MEM_ARG(frame.rayCounts) };
+	wf->depthArg = (cl_uint)sceneArgs.size();
+	if (CL_SUCCESS != (err = CheckArgumentCount(wf->extend, "wf_extend", sceneArgs.size() + extendArgs.size())) ||
+		CL_SUCCESS != (err = SetArguments(wf->extend, "wf_extend", 0, sceneArgs)) ||
+		CL_SUCCESS != (err = SetArguments(wf->extend, "wf_extend", (cl_uint)sceneArgs.size(), extendArgs)))
+		return err;
+
+	std::vector<KernelArgument> shadeArgs = {
+		UINT_ARG(depth), MEM_ARG(frame.seeds), MEM_ARG(wf->rayOrigin), MEM_ARG(wf->rayDirection),
+		MEM_ARG(wf->pathThroughput), MEM_ARG(wf->hitNormal), MEM_ARG(wf->hitColor), MEM_ARG(wf->shadeQueue),
+		MEM_ARG(wf->shadowOrigin), MEM_ARG(wf->shadowDirection), MEM_ARG(wf->shadowContribution),
+		MEM_ARG(wf->shadowQueue), MEM_ARG(wf->extendQueue), MEM_ARG(wf->queueCounts) };
+	if (CL_SUCCESS != (err = CheckArgumentCount(wf->shade, "wf_shade", sceneArgs.size() + shadeArgs.size())) ||
+		CL_SUCCESS != (err = SetArguments(wf->shade, "wf_shade", 0, sceneArgs)) ||
+		CL_SUCCESS != (err = SetArguments(wf->shade, "wf_shade", (cl_uint)sceneArgs.size(), shadeArgs)))
+		return err;
+
+	std::vector<KernelArgument> shadowArgs = {
+		UINT_ARG(depth), MEM_ARG(wf->shadowOrigin), MEM_ARG(wf->shadowDirection), MEM_ARG(wf->shadowContribution),
+		MEM_ARG(wf->shadowQueue), MEM_ARG(wf->pathRadiance), MEM_ARG(wf->queueCounts), MEM_ARG(frame.rayCounts) };
+	if (CL_SUCCESS != (err = CheckArgumentCount(wf->shadow, "wf_shadow", sceneArgs.size() + shadowArgs.size())) ||
+		CL_SUCCESS != (err = SetArguments(wf->shadow, "wf_shadow", 0, sceneArgs)) ||
+		CL_SUCCESS != (err = SetArguments(wf->shadow, "wf_shadow", (cl_uint)sceneArgs.size(), shadowArgs)))
+		return err;
+
+	// wf_accumulate: pathCount (0) and writePixels (6) change with every wave
+	cl_uint writePixels = 0;
+	std::vector<KernelArgument> accumulateArgs = {
+		UINT_ARG(wf->pathCount), MEM_ARG(wf->pathPixel), MEM_ARG(wf->pathRadiance),
+		MEM_ARG(frame.accum), MEM_ARG(frame.accumSq), MEM_ARG(frame.pixels), UINT_ARG(writePixels) };
+	return SetArguments(wf->accumulate, "wf_accumulate", 0, accumulateArgs);
+}
+
+static cl_int Enqueue(WavefrontPipeline* wf, cl_command_queue queue, cl_kernel kernel, const char* name, size_t itemCount)
+{
+	const size_t localSize = wf->localSize;
+	if (itemCount == 0)
+		return CL_SUCCESS;
+
+	// Whole work-groups only; the kernels skip the items past their count
+	size_t globalWorkSize[1] = { (itemCount + localSize - 1) / localSize * localSize };
+	size_t localWorkSize[1] = { localSize };
+	cl_int err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, ProfileEvent(wf->profiler, name));
+	if (CL_SUCCESS != err)
+	{
+		printf("Error: Failed to run %s, return %s\n", name, TranslateOpenCLError(err));
+	}
+	return err;
+}
+
+/*
+* Trace the paths of one wave from the camera to their last bounce. Queues can't be longer
+* than the wave; the kernels read their real length from queueCounts.
+*/
+static cl_int RunWave(WavefrontPipeline* wf, cl_command_queue queue, cl_uint waveSize)
+{
+	cl_int err = CL_SUCCESS;
+
+	if (CL_SUCCESS != (err = Enqueue(wf, queue, wf->generate, "wf_generate", waveSize)))
+		return err;
+
+	for (cl_uint depth = 0; depth <= wf->maxDepth; depth++)
+	{
+		if (CL_SUCCESS != (err = clSetKernelArg(wf->extend, wf->depthArg, sizeof(cl_uint), &depth)) ||
+			CL_SUCCESS != (err = clSetKernelArg(wf->shade, wf->depthArg, sizeof(cl_uint), &depth)) ||
+			CL_SUCCESS != (err = clSetKernelArg(wf->shadow, wf->depthArg, sizeof(cl_uint), &depth)))
+		{
+			printf("Error: Failed to set the path depth, returned %s\n", TranslateOpenCLError(err));
+			return err;
+		}
+
+		if (CL_SUCCESS != (err = Enqueue(wf, queue, wf->extend, "wf_extend", waveSize)))
+			return err;
+
+		// Hits at maxDepth only collect emitted light
+		if (depth == wf->maxDepth)
+			break;
+
+		if (CL_SUCCESS != (err = Enqueue(wf, queue, wf->shade, "wf_shade", waveSize)) ||
+			CL_SUCCESS != (err = Enqueue(wf, queue, wf->shadow, "wf_shadow", waveSize)))
+			return err;
+	}
+
+	return Enqueue(wf, queue, wf->accumulate, "wf_accumulate", waveSize);
+}
+
+cl_int RunWavefrontPass(WavefrontPipeline* wf, cl_command_queue queue, cl_uint sampleCount, cl_uint firstPixel, cl_uint pixelCount)
+{
+	cl_int err = CL_SUCCESS;
+
+	for (cl_uint first = firstPixel; first < pixelCount; first += wf->pathCount)
+	{
+		cl_uint waveSize = std::min(wf->pathCount, pixelCount - first);
+		if (CL_SUCCESS != (err = clSetKernelArg(wf->generate, 5, sizeof(cl_uint), &first)) ||
+			CL_SUCCESS != (err = clSetKernelArg(wf->generate, 6, sizeof(cl_uint), &waveSize)) ||
+			CL_SUCCESS != (err = clSetKernelArg(wf->accumulate, 0, sizeof(cl_uint), &waveSize)))
+		{
+			printf("Error: Failed to set the wave size, returned %s\n", TranslateOpenCLError(err));
+			return err;
+		}
+
+		for (cl_uint sample = 0; sample < sampleCount; sample++)
+		{
+			// Only the last wave of the pass updates the packed pixels
+			cl_uint writePixels = (sample + 1 == sampleCount) ? 1 : 0;
+			err = clSetKernelArg(wf->accumulate, 6, sizeof(cl_uint), &writePixels);
+			if (CL_SUCCESS != err)
+			{
+				printf("Error: Failed to set argument writePixels, returned %s\n", TranslateOpenCLError(err));
+				return err;
+			}
+
+			if (CL_SUCCESS != (err = RunWave(wf, queue, waveSize)))
+				return err;
+		}
+	}
+
+	return CL_SUCCESS;
+}
@@ -0,0 +1,94 @@
+// Wavefront path-tracing pipeline: the wf_* kernels of ray_algorithm.cl and their path state
+//
+#ifndef __WAVEFRONT_H__
+#define __WAVEFRONT_H__
+
+#include <vector>
+
+#include "ocl_common.h"
+#include "profiler.h"
+
+/*
+* One kernel argument as handed to clSetKernelArg
+*/
+struct KernelArgument
+{
+	size_t      size;
+	const void* value;
+};
+
+/*
+* Buffers of the frame the pipeline renders into; they belong to the caller
+*/
+struct WavefrontFrame
+{
+	cl_mem   camera;        // CompiledCamera
+	cl_uint  width;
+	cl_uint  height;
+	cl_mem   seeds;         // 2 per path
+	cl_mem   pixels;
+	cl_mem   accum;
+	cl_mem   accumSq;
+	cl_mem   pixelList;
+	cl_mem   rayCounts;     // RAY_COUNT_KINDS uints, added to by wf_extend and wf_shadow
+};
+
+/*
+* Kernels and global structure-of-arrays path state of the wavefront mode.
+* A wave has up to pathCount paths in flight, one per pixel list entry, each
+* bouncing up to maxDepth times.
+*/
+struct WavefrontPipeline
+{
+	WavefrontPipeline();
+	~WavefrontPipeline();
+
+	cl_uint          pathCount;
+	cl_uint          lightSamples;
+	cl_uint          maxDepth;
+	size_t           localSize;
+	cl_uint          depthArg;           // of wf_extend, wf_shade and wf_shadow, right after the scene arguments
+	Profiler*        profiler;           // times the launches if set and enabled
+
+	cl_kernel        generate;
+	cl_kernel        extend;
+	cl_kernel        shade;
+	cl_kernel        shadow;
+	cl_kernel        accumulate;
+
+	cl_mem           pathPixel;          // uint per path
+	cl_mem           rayOrigin;          // float4 per path: origin and tMax
+	cl_mem           rayDirection;       // float4 per path
+	cl_mem           pathRadiance;       // float4 per path: light found so far
+	cl_mem           pathThroughput;     // float4 per path: throughput and density of the last bounce
+	cl_mem           hitNormal;          // float4 per path: normal and t of the closest hit
+	cl_mem           hitColor;           // float4 per path
+	cl_mem           shadowOrigin;       // float4 per shadow slot (path * lightSamples + sample): origin and distance
+	cl_mem           shadowDirection;    // float4 per shadow slot: direction and sampled light
+	cl_mem           shadowContribution; // float4 per shadow slot: added if the light is visible, w = 0 for unused slots
+	cl_mem           extendQueue;
+	cl_mem           shadeQueue;
+	cl_mem           shadowQueue;        // paths with shadow rays to test
+	cl_mem           queueCounts;        // extend, shade and shadow queue lengths of every depth
+};
+
+/*
+* Create the kernels from program and the path state for pathCount paths, lightSamples
+* light samples per hit and maxDepth bounces
+*/
+cl_int CreateWavefront(WavefrontPipeline* wf, cl_context context, cl_device_id device, cl_program program,
+	cl_uint pathCount, cl_uint lightSamples, cl_uint maxDepth);
+
+/*
+* Set the arguments that don't change between waves.
+* sceneArgs are the scene arguments of ray_cal, in kernel order: lights to materials without
+* the ray_cal-only ones in between (sampleCount .. stage), then lightAlias to lightSamples.
+* Their count places the arguments after them and is checked against the kernels' own.
+*/
+cl_int SetWavefrontArguments(WavefrontPipeline* wf, const std::vector<KernelArgument>& sceneArgs,
+	const WavefrontFrame& frame);
+
+// Add sampleCount samples to each of the entries firstPixel .. pixelCount - 1 of the frame's pixel list
+cl_int RunWavefrontPass(WavefrontPipeline* wf, cl_command_queue queue, cl_uint sampleCount, cl_uint firstPixel, cl_uint pixelCount);
+
+#endif